@@ -50,6 +50,7 @@
 #include "translate-all.h"
 #include "qemu/bitmap.h"
 #include "qemu/error-report.h"
+#include "qemu/interval-tree.h"
 #include "qemu/qemu-print.h"
 #include "qemu/timer.h"
 #include "qemu/main-loop.h"
@@ -2386,91 +2387,114 @@ void cpu_interrupt(CPUState *cpu, int mask)
 }
 
 /*
- * Walks guest process memory "regions" one by one
- * and calls callback function 'fn' for each region.
+ * Besides the PageDesc of each page, which track translated code and
+ * the current protection, keep an interval tree of the guest mappings:
+ * maximal ranges of pages with the same flags, as last set by
+ * page_set_flags.  It lets us find free ranges and walk the mappings in
+ * time proportional to the number of mappings, instead of the size of
+ * the address space.  The tree is protected by the mmap_lock.
  */
-struct walk_memory_regions_data {
-    walk_memory_regions_fn fn;
-    void *priv;
-    target_ulong start;
-    int prot;
-};
+typedef struct PageFlagsNode {
+    IntervalTreeNode itree;
+    int flags;
+} PageFlagsNode;
+
+static IntervalTreeRoot pageflags_root;
 
-static int walk_memory_regions_end(struct walk_memory_regions_data *data,
-                                   target_ulong end, int new_prot)
+static PageFlagsNode *pageflags_find(target_ulong start, target_ulong last)
 {
-    if (data->start != -1u) {
-        int rc = data->fn(data->priv, data->start, end, data->prot);
-        if (rc != 0) {
-            return rc;
-        }
-    }
+    IntervalTreeNode *n;
+
+    n = interval_tree_iter_first(&pageflags_root, start, last);
+    return n ? container_of(n, PageFlagsNode, itree) : NULL;
+}
 
-    data->start = (new_prot ? end : -1u);
-    data->prot = new_prot;
+static PageFlagsNode *pageflags_next(PageFlagsNode *p, target_ulong start,
+                                     target_ulong last)
+{
+    IntervalTreeNode *n;
 
-    return 0;
+    n = interval_tree_iter_next(&p->itree, start, last);
+    return n ? container_of(n, PageFlagsNode, itree) : NULL;
 }
 
-static int walk_memory_regions_1(struct walk_memory_regions_data *data,
-                                 target_ulong base, int level, void **lp)
+static void pageflags_create(target_ulong start, target_ulong last, int flags)
 {
-    target_ulong pa;
-    int i, rc;
+    PageFlagsNode *p = g_new(PageFlagsNode, 1);
 
-    if (*lp == NULL) {
-        return walk_memory_regions_end(data, base, 0);
-    }
+    p->itree.start = start;
+    p->itree.last = last;
+    p->flags = flags;
+    interval_tree_insert(&p->itree, &pageflags_root);
+}
 
-    if (level == 0) {
-        PageDesc *pd = *lp;
+static void pageflags_delete(PageFlagsNode *p)
+{
+    interval_tree_remove(&p->itree, &pageflags_root);
+    g_free(p);
+}
 
-        for (i = 0; i < V_L2_SIZE; ++i) {
-            int prot = pd[i].flags;
+/* Record that [start, last] is now mapped with @flags, or unmapped if 0 */
+static void pageflags_set(target_ulong start, target_ulong last, int flags)
+{
+    PageFlagsNode *p;
 
-            pa = base | (i << TARGET_PAGE_BITS);
-            if (prot != data->prot) {
-                rc = walk_memory_regions_end(data, pa, prot);
-                if (rc != 0) {
-                    return rc;
-                }
-            }
-        }
-    } else {
-        void **pp = *lp;
+    /* Cut the range out of the mappings it overlaps */
+    while ((p = pageflags_find(start, last)) != NULL) {
+        target_ulong p_start = p->itree.start;
+        target_ulong p_last = p->itree.last;
+        int p_flags = p->flags;
 
-        for (i = 0; i < V_L2_SIZE; ++i) {
-            pa = base | ((target_ulong)i <<
-                (TARGET_PAGE_BITS + V_L2_BITS * level));
-            rc = walk_memory_regions_1(data, pa, level - 1, pp + i);
-            if (rc != 0) {
-                return rc;
-            }
+        pageflags_delete(p);
+        if (p_start < start) {
+            pageflags_create(p_start, start - 1, p_flags);
+        }
+        if (p_last > last) {
+            pageflags_create(last + 1, p_last, p_flags);
         }
     }
 
-    return 0;
+    if (!flags) {
+        return;
+    }
+
+    /* Merge with neighbours that have the same flags */
+    if (start != 0) {
+        p = pageflags_find(start - 1, start - 1);
+        if (p && p->flags == flags) {
+            start = p->itree.start;
+            pageflags_delete(p);
+        }
+    }
+    if (last != (target_ulong)-1) {
+        p = pageflags_find(last + 1, last + 1);
+        if (p && p->flags == flags) {
+            last = p->itree.last;
+            pageflags_delete(p);
+        }
+    }
+    pageflags_create(start, last, flags);
 }
 
+/*
+ * Walks guest process memory "regions" one by one
+ * and calls callback function 'fn' for each region.
+ */
 int walk_memory_regions(void *priv, walk_memory_regions_fn fn)
 {
-    struct walk_memory_regions_data data;
-    uintptr_t i, l1_sz = v_l1_size;
+    PageFlagsNode *p;
+    int rc = 0;
 
-    data.fn = fn;
-    data.priv = priv;
-    data.start = -1u;
-    data.prot = 0;
-
-    for (i = 0; i < l1_sz; i++) {
-        target_ulong base = i << (v_l1_shift + TARGET_PAGE_BITS);
-        int rc = walk_memory_regions_1(&data, base, v_l2_levels, l1_map + i);
+    mmap_lock();
+    for (p = pageflags_find(0, -1); p; p = pageflags_next(p, 0, -1)) {
+        rc = fn(priv, p->itree.start, p->itree.last + 1, p->flags);
         if (rc != 0) {
-            return rc;
+            break;
         }
     }
+    mmap_unlock();
 
-    return walk_memory_regions_end(&data, 0, 0);
+    return rc;
 }
 
 static int dump_region(void *priv, target_ulong start,
@@ -2545,6 +2569,45 @@ void page_set_flags(target_ulong start, target_ulong end, int flags)
         }
         p->flags = flags;
     }
+
+    pageflags_set(start, end - 1, flags);
+}
+
+/* Return the lowest mapped address in [start, last], or -1 if it is all
+   free.  The mmap_lock should already be held.  */
+target_ulong page_find_mapped(target_ulong start, target_ulong last)
+{
+    PageFlagsNode *p;
+
+    assert_memory_lock();
+    p = pageflags_find(start, last);
+    if (!p) {
+        return -1;
+    }
+    return MAX(p->itree.start, start);
+}
+
+/* Return true if every page in [start, last] is mapped with all of
+   @flags.  Unlike page_check_range, PAGE_WRITE refers to the protection
+   of the mapping rather than to the current state of pages containing
+   translated code.  The mmap_lock should already be held.  */
+bool page_range_has_flags(target_ulong start, target_ulong last, int flags)
+{
+    PageFlagsNode *p;
+    target_ulong addr = start;
+
+    assert_memory_lock();
+    for (p = pageflags_find(start, last); p;
+         p = pageflags_next(p, start, last)) {
+        if (p->itree.start > addr || (p->flags & flags) != flags) {
+            return false;
+        }
+        if (p->itree.last >= last) {
+            return true;
+        }
+        addr = p->itree.last + 1;
+    }
+    return false;
 }
 
 int page_check_range(target_ulong start, target_ulong len, int flags)
@@ -893,6 +893,30 @@ int bdrv_parse_cache_mode(const char *mode, int *flags, bool *writethrough)
     return 0;
 }
 
+/**
+ * Set open flags for a given AIO mode
+ *
+ * Return 0 on success, -1 if the AIO mode was invalid.
+ */
+int bdrv_parse_aio(const char *mode, int *flags)
+{
+    *flags &= ~(BDRV_O_NATIVE_AIO | BDRV_O_IO_URING);
+
+    if (!strcmp(mode, "threads")) {
+        /* this is the default */
+    } else if (!strcmp(mode, "native")) {
+        *flags |= BDRV_O_NATIVE_AIO;
+#ifdef CONFIG_LINUX_IO_URING
+    } else if (!strcmp(mode, "io_uring")) {
+        *flags |= BDRV_O_IO_URING;
+#endif
+    } else {
+        return -1;
+    }
+
+    return 0;
+}
+
 static char *bdrv_child_get_parent_desc(BdrvChild *c)
 {
     BlockDriverState *parent = c->opaque;
@@ -5690,6 +5714,37 @@ AioContext *bdrv_get_aio_context(BlockDriverState *bs)
     return bs ? bs->aio_context : qemu_get_aio_context();
 }
 
+AioContext *bdrv_get_request_aio_context(BlockDriverState *bs)
+{
+    AioContext *ctx = qemu_get_current_aio_context();
+
+    /*
+     * An iothread only ever runs requests for nodes in its own AioContext,
+     * unless a multiqueue BlockBackend sent them there.  The main loop
+     * thread instead may run requests for any node while holding the
+     * node's AioContext lock.
+     */
+    if (ctx != qemu_get_aio_context()) {
+        return ctx;
+    }
+    return bdrv_get_aio_context(bs);
+}
+
+bool bdrv_supports_multiqueue(BlockDriverState *bs)
+{
+    BdrvChild *child;
+
+    if (!bs->drv || !bs->drv->supports_multiqueue) {
+        return false;
+    }
+    QLIST_FOREACH(child, &bs->children, next) {
+        if (!bdrv_supports_multiqueue(child->bs)) {
+            return false;
+        }
+    }
+    return true;
+}
+
 void bdrv_coroutine_enter(BlockDriverState *bs, Coroutine *co)
 {
     aio_co_enter(bdrv_get_aio_context(bs), co);
@@ -68,8 +68,12 @@ void block_acct_add_interval(BlockAcctStats *stats, unsigned interval_length)
     QSLIST_INSERT_HEAD(&stats->intervals, s, entries);
 
     for (i = 0; i < BLOCK_MAX_IOTYPE; i++) {
-        timed_average_init(&s->latency[i], clock_type,
-                           (uint64_t) interval_length * NANOSECONDS_PER_SECOND);
+        int64_t period = (int64_t) interval_length * NANOSECONDS_PER_SECOND;
+        int64_t now = qemu_clock_get_ns(clock_type);
+
+        timed_average_init(&s->latency[i], clock_type, period);
+        s->latency_log[i][0].expiration = now + period / 2;
+        s->latency_log[i][1].expiration = now + period;
     }
     qemu_mutex_unlock(&stats->lock);
 }
@@ -138,6 +142,120 @@ static void block_latency_histogram_account(BlockLatencyHistogram *hist,
     hist->bins[pos - hist->boundaries + 1]++;
 }
 
+static int block_latency_log_bucket(uint64_t latency_ns)
+{
+    int shift;
+
+    if (latency_ns < BLOCK_LATENCY_LOG_SUB_BUCKETS) {
+        return latency_ns;
+    }
+
+    shift = 63 - clz64(latency_ns) - BLOCK_LATENCY_LOG_SUB_BITS;
+    if (shift + BLOCK_LATENCY_LOG_SUB_BITS >= BLOCK_LATENCY_LOG_MAX_BITS) {
+        return BLOCK_LATENCY_LOG_BUCKETS - 1;
+    }
+
+    /* latency_ns >> shift is in [SUB_BUCKETS, 2 * SUB_BUCKETS) */
+    return (shift * BLOCK_LATENCY_LOG_SUB_BUCKETS) + (latency_ns >> shift);
+}
+
+/* Largest latency that is counted in bucket @idx */
+static uint64_t block_latency_log_bucket_max(int idx)
+{
+    int shift;
+
+    if (idx < BLOCK_LATENCY_LOG_SUB_BUCKETS) {
+        return idx;
+    }
+
+    shift = idx / BLOCK_LATENCY_LOG_SUB_BUCKETS - 1;
+    return ((uint64_t) (idx - shift * BLOCK_LATENCY_LOG_SUB_BUCKETS + 1)
+            << shift) - 1;
+}
+
+static void block_latency_log_account(BlockLatencyLog *log, int idx)
+{
+    stat64_add(&log->buckets[idx], 1);
+}
+
+static void block_latency_log_reset(BlockLatencyLog *log)
+{
+    int i;
+
+    for (i = 0; i < BLOCK_LATENCY_LOG_BUCKETS; i++) {
+        stat64_init(&log->buckets[i], 0);
+    }
+}
+
+/* Clear @w if it expired, and compute the next expiration like TimedAverage */
+static void block_latency_log_window_check(BlockLatencyLogWindow *w,
+                                           int64_t now, int64_t period)
+{
+    if (now >= w->expiration) {
+        block_latency_log_reset(&w->log);
+        w->expiration = now + period - (now - w->expiration) % period;
+    }
+}
+
+/*
+ * Compute percentiles from a snapshot of @log.  Concurrent updates may
+ * be missed, but every bucket is read only once.
+ */
+static void block_latency_log_percentiles(const BlockLatencyLog *log,
+                                          BlockAcctPercentiles *p)
+{
+    static const unsigned permille[] = { 500, 900, 990, 999 };
+    uint64_t *results[] = { &p->p50, &p->p90, &p->p99, &p->p999 };
+    uint64_t buckets[BLOCK_LATENCY_LOG_BUCKETS];
+    uint64_t seen = 0;
+    int i, j = 0;
+
+    memset(p, 0, sizeof(*p));
+    for (i = 0; i < BLOCK_LATENCY_LOG_BUCKETS; i++) {
+        buckets[i] = stat64_get(&log->buckets[i]);
+        p->samples += buckets[i];
+    }
+
+    for (i = 0; i < BLOCK_LATENCY_LOG_BUCKETS && j < ARRAY_SIZE(permille);
+         i++)
+    {
+        seen += buckets[i];
+        while (j < ARRAY_SIZE(permille) &&
+               seen * 1000 >= p->samples * permille[j] && seen > 0) {
+            *results[j++] = block_latency_log_bucket_max(i);
+        }
+    }
+}
+
+void block_acct_latency_percentiles(BlockAcctStats *stats,
+                                    enum BlockAcctType type,
+                                    BlockAcctPercentiles *p)
+{
+    assert(type < BLOCK_MAX_IOTYPE);
+    block_latency_log_percentiles(&stats->latency_log[type], p);
+}
+
+void block_acct_timed_latency_percentiles(BlockAcctTimedStats *stats,
+                                          enum BlockAcctType type,
+                                          BlockAcctPercentiles *p)
+{
+    BlockLatencyLogWindow *w = stats->latency_log[type];
+    int64_t period = (int64_t) stats->interval_length *
+                     NANOSECONDS_PER_SECOND;
+    int64_t now = qemu_clock_get_ns(clock_type);
+
+    assert(type < BLOCK_MAX_IOTYPE);
+
+    qemu_mutex_lock(&stats->stats->lock);
+    block_latency_log_window_check(&w[0], now, period);
+    block_latency_log_window_check(&w[1], now, period);
+
+    /* Report the window that holds the older data */
+    block_latency_log_percentiles(w[0].expiration < w[1].expiration ?
+                                  &w[0].log : &w[1].log, p);
+    qemu_mutex_unlock(&stats->stats->lock);
+}
+
 int block_latency_histogram_set(BlockAcctStats *stats, enum BlockAcctType type,
                                 uint64List *boundaries)
 {
@@ -188,6 +306,7 @@ static void block_account_one_io(BlockAcctStats *stats, BlockAcctCookie *cookie,
     BlockAcctTimedStats *s;
     int64_t time_ns = qemu_clock_get_ns(clock_type);
     int64_t latency_ns = time_ns - cookie->start_time_ns;
+    int log_idx;
 
     if (qtest_enabled()) {
         latency_ns = qtest_latency_ns;
@@ -195,6 +314,11 @@ static void block_account_one_io(BlockAcctStats *stats, BlockAcctCookie *cookie,
 
     assert(cookie->type < BLOCK_MAX_IOTYPE);
 
+    log_idx = block_latency_log_bucket(latency_ns);
+    if (!failed || stats->account_failed) {
+        block_latency_log_account(&stats->latency_log[cookie->type], log_idx);
+    }
+
     qemu_mutex_lock(&stats->lock);
 
     if (failed) {
@@ -212,7 +336,16 @@ static void block_account_one_io(BlockAcctStats *stats, BlockAcctCookie *cookie,
         stats->last_access_time_ns = time_ns;
 
         QSLIST_FOREACH(s, &stats->intervals, entries) {
+            BlockLatencyLogWindow *w = s->latency_log[cookie->type];
+            int64_t period = (int64_t) s->interval_length *
+                             NANOSECONDS_PER_SECOND;
+
             timed_average_account(&s->latency[cookie->type], latency_ns);
+
+            block_latency_log_window_check(&w[0], time_ns, period);
+            block_latency_log_window_check(&w[1], time_ns, period);
+            block_latency_log_account(&w[0].log, log_idx);
+            block_latency_log_account(&w[1].log, log_idx);
         }
     }
 
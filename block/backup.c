@@ -18,6 +18,7 @@
 #include "block/block_int.h"
 #include "block/blockjob_int.h"
 #include "block/block_backup.h"
+#include "block/block-copy.h"
 #include "qapi/error.h"
 #include "qapi/qmp/qerror.h"
 #include "qemu/ratelimit.h"
@@ -28,13 +29,6 @@
 
 #define BACKUP_CLUSTER_SIZE_DEFAULT (1 << 16)
 
-typedef struct CowRequest {
-    int64_t start_byte;
-    int64_t end_byte;
-    QLIST_ENTRY(CowRequest) list;
-    CoQueue wait_queue; /* coroutines blocked on this request */
-} CowRequest;
-
 typedef struct BackupBlockJob {
     BlockJob common;
     BlockBackend *target;
@@ -47,138 +41,22 @@ typedef struct BackupBlockJob {
     uint64_t len;
     uint64_t bytes_read;
     int64_t cluster_size;
-    bool compress;
     NotifierWithReturn before_write;
-    QLIST_HEAD(, CowRequest) inflight_reqs;
-
-    HBitmap *copy_bitmap;
-    bool use_copy_range;
-    int64_t copy_range_size;
 
-    bool serialize_target_writes;
+    BlockCopyState *bcs;
 } BackupBlockJob;
 
 static const BlockJobDriver backup_job_driver;
 
-/* See if in-flight requests overlap and wait for them to complete */
-static void coroutine_fn wait_for_overlapping_requests(BackupBlockJob *job,
-                                                       int64_t start,
-                                                       int64_t end)
-{
-    CowRequest *req;
-    bool retry;
-
-    do {
-        retry = false;
-        QLIST_FOREACH(req, &job->inflight_reqs, list) {
-            if (end > req->start_byte && start < req->end_byte) {
-                qemu_co_queue_wait(&req->wait_queue, NULL);
-                retry = true;
-                break;
-            }
-        }
-    } while (retry);
-}
-
-/* Keep track of an in-flight request */
-static void cow_request_begin(CowRequest *req, BackupBlockJob *job,
-                              int64_t start, int64_t end)
-{
-    req->start_byte = start;
-    req->end_byte = end;
-    qemu_co_queue_init(&req->wait_queue);
-    QLIST_INSERT_HEAD(&job->inflight_reqs, req, list);
-}
-
-/* Forget about a completed request */
-static void cow_request_end(CowRequest *req)
-{
-    QLIST_REMOVE(req, list);
-    qemu_co_queue_restart_all(&req->wait_queue);
-}
-
-/* Copy range to target with a bounce buffer and return the bytes copied. If
- * error occurred, return a negative error number */
-static int coroutine_fn backup_cow_with_bounce_buffer(BackupBlockJob *job,
-                                                      int64_t start,
-                                                      int64_t end,
-                                                      bool is_write_notifier,
-                                                      bool *error_is_read,
-                                                      void **bounce_buffer)
-{
-    int ret;
-    BlockBackend *blk = job->common.blk;
-    int nbytes;
-    int read_flags = is_write_notifier ? BDRV_REQ_NO_SERIALISING : 0;
-    int write_flags = job->serialize_target_writes ? BDRV_REQ_SERIALISING : 0;
-
-    hbitmap_reset(job->copy_bitmap, start / job->cluster_size, 1);
-    nbytes = MIN(job->cluster_size, job->len - start);
-    if (!*bounce_buffer) {
-        *bounce_buffer = blk_blockalign(blk, job->cluster_size);
-    }
-
-    ret = blk_co_pread(blk, start, nbytes, *bounce_buffer, read_flags);
-    if (ret < 0) {
-        trace_backup_do_cow_read_fail(job, start, ret);
-        if (error_is_read) {
-            *error_is_read = true;
-        }
-        goto fail;
-    }
-
-    if (buffer_is_zero(*bounce_buffer, nbytes)) {
-        ret = blk_co_pwrite_zeroes(job->target, start,
-                                   nbytes, write_flags | BDRV_REQ_MAY_UNMAP);
-    } else {
-        ret = blk_co_pwrite(job->target, start,
-                            nbytes, *bounce_buffer, write_flags |
-                            (job->compress ? BDRV_REQ_WRITE_COMPRESSED : 0));
-    }
-    if (ret < 0) {
-        trace_backup_do_cow_write_fail(job, start, ret);
-        if (error_is_read) {
-            *error_is_read = false;
-        }
-        goto fail;
-    }
-
-    return nbytes;
-fail:
-    hbitmap_set(job->copy_bitmap, start / job->cluster_size, 1);
-    return ret;
-
-}
-
-/* Copy range to target and return the bytes copied. If error occurred, return a
- * negative error number. */
-static int coroutine_fn backup_cow_with_offload(BackupBlockJob *job,
-                                                int64_t start,
-                                                int64_t end,
-                                                bool is_write_notifier)
+static void backup_progress_bytes_callback(int64_t bytes, void *opaque)
 {
-    int ret;
-    int nr_clusters;
-    BlockBackend *blk = job->common.blk;
-    int nbytes;
-    int read_flags = is_write_notifier ? BDRV_REQ_NO_SERIALISING : 0;
-    int write_flags = job->serialize_target_writes ? BDRV_REQ_SERIALISING : 0;
-
-    assert(QEMU_IS_ALIGNED(job->copy_range_size, job->cluster_size));
-    nbytes = MIN(job->copy_range_size, end - start);
-    nr_clusters = DIV_ROUND_UP(nbytes, job->cluster_size);
-    hbitmap_reset(job->copy_bitmap, start / job->cluster_size,
-                  nr_clusters);
-    ret = blk_co_copy_range(blk, start, job->target, start, nbytes,
-                            read_flags, write_flags);
-    if (ret < 0) {
-        trace_backup_do_cow_copy_range_fail(job, start, ret);
-        hbitmap_set(job->copy_bitmap, start / job->cluster_size,
-                    nr_clusters);
-        return ret;
-    }
+    BackupBlockJob *s = opaque;
 
-    return nbytes;
+    /* Publish progress, guest I/O counts as progress too.  Note that the
+     * offset field is an opaque progress value, it is not a disk offset.
+     */
+    s->bytes_read += bytes;
+    job_progress_update(&s->common.job, bytes);
 }
 
 static int coroutine_fn backup_do_cow(BackupBlockJob *job,
@@ -186,58 +64,15 @@ static int coroutine_fn backup_do_cow(BackupBlockJob *job,
                                       bool *error_is_read,
                                       bool is_write_notifier)
 {
-    CowRequest cow_request;
-    int ret = 0;
-    int64_t start, end; /* bytes */
-    void *bounce_buffer = NULL;
+    int ret;
 
     qemu_co_rwlock_rdlock(&job->flush_rwlock);
 
-    start = QEMU_ALIGN_DOWN(offset, job->cluster_size);
-    end = QEMU_ALIGN_UP(bytes + offset, job->cluster_size);
-
-    trace_backup_do_cow_enter(job, start, offset, bytes);
-
-    wait_for_overlapping_requests(job, start, end);
-    cow_request_begin(&cow_request, job, start, end);
-
-    while (start < end) {
-        if (!hbitmap_get(job->copy_bitmap, start / job->cluster_size)) {
-            trace_backup_do_cow_skip(job, start);
-            start += job->cluster_size;
-            continue; /* already copied */
-        }
+    trace_backup_do_cow_enter(job, QEMU_ALIGN_DOWN(offset, job->cluster_size),
+                              offset, bytes);
 
-        trace_backup_do_cow_process(job, start);
-
-        if (job->use_copy_range) {
-            ret = backup_cow_with_offload(job, start, end, is_write_notifier);
-            if (ret < 0) {
-                job->use_copy_range = false;
-            }
-        }
-        if (!job->use_copy_range) {
-            ret = backup_cow_with_bounce_buffer(job, start, end, is_write_notifier,
-                                                error_is_read, &bounce_buffer);
-        }
-        if (ret < 0) {
-            break;
-        }
-
-        /* Publish progress, guest I/O counts as progress too.  Note that the
-         * offset field is an opaque progress value, it is not a disk offset.
-         */
-        start += ret;
-        job->bytes_read += ret;
-        job_progress_update(&job->common.job, ret);
-        ret = 0;
-    }
-
-    if (bounce_buffer) {
-        qemu_vfree(bounce_buffer);
-    }
-
-    cow_request_end(&cow_request);
+    ret = block_copy(job->bcs, offset, bytes, error_is_read,
+                     is_write_notifier);
 
     trace_backup_do_cow_return(job, offset, bytes, ret);
 
@@ -295,6 +130,8 @@ static void backup_abort(Job *job)
 static void backup_clean(Job *job)
 {
     BackupBlockJob *s = container_of(job, BackupBlockJob, common.job);
+    block_copy_state_free(s->bcs);
+    s->bcs = NULL;
     assert(s->target);
     blk_unref(s->target);
     s->target = NULL;
@@ -314,7 +151,7 @@ void backup_do_checkpoint(BlockJob *job, Error **errp)
     }
 
     len = DIV_ROUND_UP(backup_job->len, backup_job->cluster_size);
-    hbitmap_set(backup_job->copy_bitmap, 0, len);
+    hbitmap_set(backup_job->bcs->copy_bitmap, 0, len);
 }
 
 static void backup_drain(BlockJob *job)
@@ -365,92 +202,170 @@ static bool coroutine_fn yield_and_check(BackupBlockJob *job)
     return false;
 }
 
+/*
+ * Number of bytes handed to block_copy() at a time by the job itself: enough
+ * to keep all workers busy, small enough for cancellation to stay responsive.
+ * Rate limited jobs keep going one cluster at a time, so that throttling
+ * remains as smooth as it has always been.
+ */
+static int64_t backup_step_bytes(BackupBlockJob *job)
+{
+    BlockCopyState *bcs = job->bcs;
+    int64_t chunk = bcs->chunk_size;
+
+    if (job->common.speed) {
+        return job->cluster_size;
+    }
+
+    if (bcs->use_copy_range) {
+        chunk = MAX(chunk, bcs->copy_range_size);
+    }
+    return chunk * bcs->max_workers;
+}
+
 static int coroutine_fn backup_run_incremental(BackupBlockJob *job)
 {
     int ret;
     bool error_is_read;
-    int64_t cluster;
-    HBitmapIter hbi;
+    uint64_t nb_clusters = DIV_ROUND_UP(job->len, job->cluster_size);
+    uint64_t cluster = 0;
+    uint64_t count;
+
+    for (;;) {
+        count = nb_clusters - cluster;
+        if (!hbitmap_next_dirty_area(job->bcs->copy_bitmap, &cluster,
+                                     &count)) {
+            break;
+        }
+        count = MIN(count, backup_step_bytes(job) / job->cluster_size);
 
-    hbitmap_iter_init(&hbi, job->copy_bitmap, 0);
-    while ((cluster = hbitmap_iter_next(&hbi)) != -1) {
         do {
             if (yield_and_check(job)) {
                 return 0;
             }
             ret = backup_do_cow(job, cluster * job->cluster_size,
-                                job->cluster_size, &error_is_read, false);
+                                count * job->cluster_size, &error_is_read,
+                                false);
             if (ret < 0 && backup_error_action(job, error_is_read, -ret) ==
                            BLOCK_ERROR_ACTION_REPORT)
             {
                 return ret;
             }
         } while (ret < 0);
+
+        cluster += count;
     }
 
     return 0;
 }
 
-/* init copy_bitmap from sync_bitmap */
-static void backup_incremental_init_copy_bitmap(BackupBlockJob *job)
+/*
+ * sync=top: copy the clusters of [@offset, @offset + @bytes) that are at
+ * least partially allocated in the topmost image.
+ */
+static int coroutine_fn backup_copy_top(BackupBlockJob *job, int64_t offset,
+                                        int64_t bytes, bool *error_is_read)
 {
-    BdrvDirtyBitmapIter *dbi;
-    int64_t offset;
-    int64_t end = DIV_ROUND_UP(bdrv_dirty_bitmap_size(job->sync_bitmap),
-                               job->cluster_size);
+    BlockDriverState *bs = blk_bs(job->common.blk);
+    int64_t end = offset + bytes;
+    int64_t run_start = -1;
+    int ret;
 
-    dbi = bdrv_dirty_iter_new(job->sync_bitmap);
-    while ((offset = bdrv_dirty_iter_next(dbi)) != -1) {
-        int64_t cluster = offset / job->cluster_size;
-        int64_t next_cluster;
+    for (; offset < end; offset += job->cluster_size) {
+        int alloced = 0;
+        int i;
+        int64_t n;
+
+        /* Check to see if these blocks are already in the
+         * backing file. */
+
+        for (i = 0; i < job->cluster_size;) {
+            /* bdrv_is_allocated() only returns true/false based
+             * on the first set of sectors it comes across that
+             * are are all in the same state.
+             * For that reason we must verify each sector in the
+             * backup cluster length.  We end up copying more than
+             * needed but at some point that is always the case. */
+            alloced =
+                bdrv_is_allocated(bs, offset + i,
+                                  job->cluster_size - i, &n);
+            i += n;
+
+            if (alloced || n == 0) {
+                break;
+            }
+        }
 
-        offset += bdrv_dirty_bitmap_granularity(job->sync_bitmap);
-        if (offset >= bdrv_dirty_bitmap_size(job->sync_bitmap)) {
-            hbitmap_set(job->copy_bitmap, cluster, end - cluster);
-            break;
+        if (alloced < 0) {
+            *error_is_read = true;
+            return alloced;
         }
 
-        offset = bdrv_dirty_bitmap_next_zero(job->sync_bitmap, offset,
-                                             UINT64_MAX);
-        if (offset == -1) {
-            hbitmap_set(job->copy_bitmap, cluster, end - cluster);
-            break;
+        /* Copy runs of clusters that are in the topmost image */
+        if (alloced && run_start < 0) {
+            run_start = offset;
+        } else if (!alloced && run_start >= 0) {
+            ret = backup_do_cow(job, run_start, offset - run_start,
+                                error_is_read, false);
+            if (ret < 0) {
+                return ret;
+            }
+            run_start = -1;
         }
+    }
+
+    if (run_start >= 0) {
+        return backup_do_cow(job, run_start, end - run_start,
+                             error_is_read, false);
+    }
+
+    return 0;
+}
+
+/* init copy_bitmap from sync_bitmap */
+static void backup_incremental_init_copy_bitmap(BackupBlockJob *job)
+{
+    uint64_t offset = 0;
+    uint64_t bytes = job->len;
+
+    while (bdrv_dirty_bitmap_next_dirty_area(job->sync_bitmap,
+                                             &offset, &bytes))
+    {
+        int64_t cluster = offset / job->cluster_size;
+        int64_t next_cluster = DIV_ROUND_UP(offset + bytes, job->cluster_size);
+
+        hbitmap_set(job->bcs->copy_bitmap, cluster, next_cluster - cluster);
 
-        next_cluster = DIV_ROUND_UP(offset, job->cluster_size);
-        hbitmap_set(job->copy_bitmap, cluster, next_cluster - cluster);
-        if (next_cluster >= end) {
+        offset = next_cluster * job->cluster_size;
+        if (offset >= job->len) {
             break;
         }
-
-        bdrv_set_dirty_iter(dbi, next_cluster * job->cluster_size);
+        bytes = job->len - offset;
     }
 
     /* TODO job_progress_set_remaining() would make more sense */
     job_progress_update(&job->common.job,
-        job->len - hbitmap_count(job->copy_bitmap) * job->cluster_size);
-
-    bdrv_dirty_iter_free(dbi);
+        job->len - hbitmap_count(job->bcs->copy_bitmap) * job->cluster_size);
 }
 
 static int coroutine_fn backup_run(Job *job, Error **errp)
 {
     BackupBlockJob *s = container_of(job, BackupBlockJob, common.job);
     BlockDriverState *bs = blk_bs(s->common.blk);
-    int64_t offset, nb_clusters;
+    BlockCopyStats *stats = &s->bcs->stats;
+    int64_t offset, nb_clusters, bytes = 0;
     int ret = 0;
 
-    QLIST_INIT(&s->inflight_reqs);
     qemu_co_rwlock_init(&s->flush_rwlock);
+    stats->start_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
 
     nb_clusters = DIV_ROUND_UP(s->len, s->cluster_size);
     job_progress_set_remaining(job, s->len);
 
-    s->copy_bitmap = hbitmap_alloc(nb_clusters, 0);
     if (s->sync_mode == MIRROR_SYNC_MODE_INCREMENTAL) {
         backup_incremental_init_copy_bitmap(s);
     } else {
-        hbitmap_set(s->copy_bitmap, 0, nb_clusters);
+        hbitmap_set(s->bcs->copy_bitmap, 0, nb_clusters);
     }
 
 
@@ -469,60 +384,29 @@ static int coroutine_fn backup_run(Job *job, Error **errp)
         ret = backup_run_incremental(s);
     } else {
         /* Both FULL and TOP SYNC_MODE's require copying.. */
-        for (offset = 0; offset < s->len;
-             offset += s->cluster_size) {
+        for (offset = 0; offset < s->len; offset += bytes) {
             bool error_is_read;
-            int alloced = 0;
 
             if (yield_and_check(s)) {
                 break;
             }
 
-            if (s->sync_mode == MIRROR_SYNC_MODE_TOP) {
-                int i;
-                int64_t n;
-
-                /* Check to see if these blocks are already in the
-                 * backing file. */
-
-                for (i = 0; i < s->cluster_size;) {
-                    /* bdrv_is_allocated() only returns true/false based
-                     * on the first set of sectors it comes across that
-                     * are are all in the same state.
-                     * For that reason we must verify each sector in the
-                     * backup cluster length.  We end up copying more than
-                     * needed but at some point that is always the case. */
-                    alloced =
-                        bdrv_is_allocated(bs, offset + i,
-                                          s->cluster_size - i, &n);
-                    i += n;
-
-                    if (alloced || n == 0) {
-                        break;
-                    }
-                }
+            bytes = MIN(backup_step_bytes(s), s->len - offset);
 
-                /* If the above loop never found any sectors that are in
-                 * the topmost image, skip this backup. */
-                if (alloced == 0) {
-                    continue;
-                }
-            }
-            /* FULL sync mode we copy the whole drive. */
-            if (alloced < 0) {
-                ret = alloced;
+            if (s->sync_mode == MIRROR_SYNC_MODE_TOP) {
+                ret = backup_copy_top(s, offset, bytes, &error_is_read);
             } else {
-                ret = backup_do_cow(s, offset, s->cluster_size,
-                                    &error_is_read, false);
+                /* FULL sync mode we copy the whole drive. */
+                ret = backup_do_cow(s, offset, bytes, &error_is_read, false);
             }
             if (ret < 0) {
-                /* Depending on error action, fail now or retry cluster */
+                /* Depending on error action, fail now or retry the step */
                 BlockErrorAction action =
                     backup_error_action(s, error_is_read, -ret);
                 if (action == BLOCK_ERROR_ACTION_REPORT) {
                     break;
                 } else {
-                    offset -= s->cluster_size;
+                    offset -= bytes;
                     continue;
                 }
             }
@@ -534,11 +418,38 @@ static int coroutine_fn backup_run(Job *job, Error **errp)
     /* wait until pending backup_do_cow() calls have completed */
     qemu_co_rwlock_wrlock(&s->flush_rwlock);
     qemu_co_rwlock_unlock(&s->flush_rwlock);
-    hbitmap_free(s->copy_bitmap);
+
+    trace_backup_run_done(s, stats->bytes_copied, stats->bytes_offloaded,
+                          stats->bytes_zeroed, stats->requests,
+                          qemu_clock_get_ns(QEMU_CLOCK_REALTIME) -
+                          stats->start_ns);
 
     return ret;
 }
 
+static void backup_query(BlockJob *job, BlockJobInfo *info)
+{
+    BackupBlockJob *s = container_of(job, BackupBlockJob, common);
+    BlockCopyStats *stats;
+
+    /* The copy state goes away when the job is cleaned up */
+    if (!s->bcs) {
+        return;
+    }
+    stats = &s->bcs->stats;
+
+    info->has_copy_stats = true;
+    info->copy_stats = g_new(BlockJobCopyStats, 1);
+    *info->copy_stats = (BlockJobCopyStats) {
+        .copied     = stats->bytes_copied,
+        .offloaded  = stats->bytes_offloaded,
+        .zeroed     = stats->bytes_zeroed,
+        .requests   = stats->requests,
+        .elapsed_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME) -
+                      stats->start_ns,
+    };
+}
+
 static const BlockJobDriver backup_job_driver = {
     .job_driver = {
         .instance_size          = sizeof(BackupBlockJob),
@@ -552,12 +463,13 @@ static const BlockJobDriver backup_job_driver = {
         .clean                  = backup_clean,
     },
     .drain                  = backup_drain,
+    .query                  = backup_query,
 };
 
 BlockJob *backup_job_create(const char *job_id, BlockDriverState *bs,
                   BlockDriverState *target, int64_t speed,
                   MirrorSyncMode sync_mode, BdrvDirtyBitmap *sync_bitmap,
-                  bool compress,
+                  bool compress, const BackupPerf *perf,
                   BlockdevOnError on_source_error,
                   BlockdevOnError on_target_error,
                   int creation_flags,
@@ -567,6 +479,7 @@ BlockJob *backup_job_create(const char *job_id, BlockDriverState *bs,
     int64_t len;
     BlockDriverInfo bdi;
     BackupBlockJob *job = NULL;
+    BdrvRequestFlags write_flags = 0;
     int ret;
 
     assert(bs);
@@ -595,6 +508,22 @@ BlockJob *backup_job_create(const char *job_id, BlockDriverState *bs,
         return NULL;
     }
 
+    if (perf && perf->has_max_workers &&
+        (perf->max_workers < 1 || perf->max_workers > BLOCK_COPY_MAX_WORKERS))
+    {
+        error_setg(errp, "max-workers must be between 1 and %d",
+                   BLOCK_COPY_MAX_WORKERS);
+        return NULL;
+    }
+
+    if (perf && perf->has_max_chunk &&
+        (perf->max_chunk < 0 || perf->max_chunk > BDRV_REQUEST_MAX_BYTES))
+    {
+        error_setg(errp, "max-chunk must be between 0 and %" PRId64,
+                   (int64_t) BDRV_REQUEST_MAX_BYTES);
+        return NULL;
+    }
+
     if (bdrv_op_is_blocked(bs, BLOCK_OP_TYPE_BACKUP_SOURCE, errp)) {
         return NULL;
     }
@@ -653,10 +582,14 @@ BlockJob *backup_job_create(const char *job_id, BlockDriverState *bs,
     job->sync_mode = sync_mode;
     job->sync_bitmap = sync_mode == MIRROR_SYNC_MODE_INCREMENTAL ?
                        sync_bitmap : NULL;
-    job->compress = compress;
 
     /* Detect image-fleecing (and similar) schemes */
-    job->serialize_target_writes = bdrv_chain_contains(target, bs);
+    if (bdrv_chain_contains(target, bs)) {
+        write_flags |= BDRV_REQ_SERIALISING;
+    }
+    if (compress) {
+        write_flags |= BDRV_REQ_WRITE_COMPRESSED;
+    }
 
     /* If there is no backing file on the target, we cannot rely on COW if our
      * backup cluster size is smaller than the target cluster size. Even for
@@ -684,12 +617,20 @@ BlockJob *backup_job_create(const char *job_id, BlockDriverState *bs,
     } else {
         job->cluster_size = MAX(BACKUP_CLUSTER_SIZE_DEFAULT, bdi.cluster_size);
     }
-    job->use_copy_range = true;
-    job->copy_range_size = MIN_NON_ZERO(blk_get_max_transfer(job->common.blk),
-                                        blk_get_max_transfer(job->target));
-    job->copy_range_size = MAX(job->cluster_size,
-                               QEMU_ALIGN_UP(job->copy_range_size,
-                                             job->cluster_size));
+
+    job->bcs = block_copy_state_new(job->common.blk, job->target,
+                                    job->cluster_size,
+                                    perf && perf->has_max_chunk ?
+                                    perf->max_chunk : 0,
+                                    perf && perf->has_max_workers ?
+                                    perf->max_workers : 0,
+                                    perf && perf->has_use_copy_range ?
+                                    perf->use_copy_range : true,
+                                    write_flags, errp);
+    if (!job->bcs) {
+        goto error;
+    }
+    block_copy_set_callbacks(job->bcs, backup_progress_bytes_callback, job);
 
     /* Required permissions are already taken with target's blk_new() */
     block_job_add_bdrv(&job->common, "target", target, 0, BLK_PERM_ALL,
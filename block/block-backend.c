@@ -74,10 +74,29 @@ struct BlockBackend {
     bool allow_aio_context_change;
     bool allow_write_beyond_eof;
 
+    /*
+     * Set if AIO requests may be submitted from any iothread, not just the
+     * one that runs blk_get_aio_context(blk).  Such requests run in the
+     * submitter's AioContext and complete there.  Cleared if a node that
+     * does not support it is later inserted in the graph.  Accessed with
+     * atomic ops.
+     */
+    bool multiqueue;
+
     NotifierList remove_bs_notifiers, insert_bs_notifiers;
     QLIST_HEAD(, BlockBackendAioNotifier) aio_notifiers;
 
+    /* Accessed with atomic ops, multiqueue submitters read it */
     int quiesce_counter;
+
+    /*
+     * Multiqueue requests that arrived while the BlockBackend is drained;
+     * the device cannot stop other iothreads from submitting, so they wait
+     * here until the drained section ends.
+     */
+    QemuMutex queued_requests_lock;
+    CoQueue queued_requests;
+
     VMChangeStateEntry *vmsh;
     bool force_allow_inactivate;
 
@@ -341,6 +360,9 @@ BlockBackend *blk_new(uint64_t perm, uint64_t shared_perm)
     notifier_list_init(&blk->insert_bs_notifiers);
     QLIST_INIT(&blk->aio_notifiers);
 
+    qemu_mutex_init(&blk->queued_requests_lock);
+    qemu_co_queue_init(&blk->queued_requests);
+
     QTAILQ_INSERT_TAIL(&block_backends, blk, link);
     return blk;
 }
@@ -421,6 +443,7 @@ static void blk_delete(BlockBackend *blk)
     QTAILQ_REMOVE(&block_backends, blk, link);
     drive_info_del(blk->legacy_dinfo);
     block_acct_cleanup(&blk->stats);
+    qemu_mutex_destroy(&blk->queued_requests_lock);
     g_free(blk);
 }
 
@@ -807,6 +830,10 @@ int blk_insert_bs(BlockBackend *blk, BlockDriverState *bs, Error **errp)
     }
     bdrv_ref(bs);
 
+    if (blk->multiqueue && !bdrv_supports_multiqueue(bs)) {
+        atomic_set(&blk->multiqueue, false);
+    }
+
     notifier_list_notify(&blk->insert_bs_notifiers, blk);
     if (tgm->throttle_state) {
         throttle_group_detach_aio_context(tgm);
@@ -1098,6 +1125,81 @@ void blk_set_allow_aio_context_change(BlockBackend *blk, bool allow)
     blk->allow_aio_context_change = allow;
 }
 
+/*
+ * Allow AIO requests on @blk from iothreads other than the one running
+ * blk_get_aio_context(blk).  All nodes below @blk must support it; the
+ * device is responsible for submitting only from the main loop thread
+ * (with the AioContext lock held, as usual) or from iothreads.
+ */
+int blk_set_multiqueue(BlockBackend *blk, bool enable, Error **errp)
+{
+    BlockDriverState *bs = blk_bs(blk);
+
+    if (enable) {
+        if (!bs) {
+            error_setg(errp, "Multiqueue requires a medium");
+            return -ENOMEDIUM;
+        }
+        if (!bdrv_supports_multiqueue(bs)) {
+            error_setg(errp, "Node '%s' does not support multiqueue",
+                       bdrv_get_node_name(bs));
+            return -ENOTSUP;
+        }
+        if (blk->public.throttle_group_member.throttle_state) {
+            error_setg(errp, "Multiqueue cannot be used with I/O throttling");
+            return -ENOTSUP;
+        }
+    }
+
+    atomic_set(&blk->multiqueue, enable);
+    return 0;
+}
+
+bool blk_get_multiqueue(BlockBackend *blk)
+{
+    return atomic_read(&blk->multiqueue);
+}
+
+/* The AioContext in which AIO requests from the current thread run */
+static AioContext *blk_get_request_aio_context(BlockBackend *blk)
+{
+    if (atomic_read(&blk->multiqueue)) {
+        return bdrv_get_request_aio_context(blk_bs(blk));
+    }
+    return blk_get_aio_context(blk);
+}
+
+/*
+ * Requests from other iothreads are not stopped by the device's
+ * drained_begin callback nor by the AioContext lock, so hold them back
+ * here.  The caller has already counted the request in blk->in_flight;
+ * drop it while waiting so that the drain can finish.
+ */
+static void coroutine_fn blk_wait_while_drained(BlockBackend *blk)
+{
+    if (qemu_get_current_aio_context() == blk_get_aio_context(blk)) {
+        return;
+    }
+
+    qemu_mutex_lock(&blk->queued_requests_lock);
+    /* atomic_inc() in blk_inc_in_flight() orders this read */
+    while (atomic_read(&blk->quiesce_counter)) {
+        blk_dec_in_flight(blk);
+        qemu_co_queue_wait(&blk->queued_requests, &blk->queued_requests_lock);
+        blk_inc_in_flight(blk);
+    }
+    qemu_mutex_unlock(&blk->queued_requests_lock);
+
+    /*
+     * If the graph changed while we were waiting and the new nodes cannot
+     * take multiqueue requests, complete the request in the home context.
+     */
+    if (!atomic_read(&blk->multiqueue)) {
+        aio_co_schedule(blk_get_aio_context(blk), qemu_coroutine_self());
+        qemu_coroutine_yield();
+    }
+}
+
 static int blk_check_byte_request(BlockBackend *blk, int64_t offset,
                                   size_t size)
 {
@@ -1298,13 +1400,15 @@ BlockAIOCB *blk_abort_aio_request(BlockBackend *blk,
     acb->blk = blk;
     acb->ret = ret;
 
-    aio_bh_schedule_oneshot(blk_get_aio_context(blk), error_callback_bh, acb);
+    aio_bh_schedule_oneshot(blk_get_request_aio_context(blk),
+                            error_callback_bh, acb);
     return &acb->common;
 }
 
 typedef struct BlkAioEmAIOCB {
     BlockAIOCB common;
     BlkRwCo rwco;
+    AioContext *ctx;
     int bytes;
     bool has_returned;
 } BlkAioEmAIOCB;
@@ -1346,16 +1450,16 @@ static BlockAIOCB *blk_aio_prwv(BlockBackend *blk, int64_t offset, int bytes,
         .flags  = flags,
         .ret    = NOT_DONE,
     };
+    acb->ctx = blk_get_request_aio_context(blk);
     acb->bytes = bytes;
     acb->has_returned = false;
 
     co = qemu_coroutine_create(co_entry, acb);
-    bdrv_coroutine_enter(blk_bs(blk), co);
+    aio_co_enter(acb->ctx, co);
 
     acb->has_returned = true;
     if (acb->rwco.ret != NOT_DONE) {
-        aio_bh_schedule_oneshot(blk_get_aio_context(blk),
-                                blk_aio_complete_bh, acb);
+        aio_bh_schedule_oneshot(acb->ctx, blk_aio_complete_bh, acb);
     }
 
     return &acb->common;
@@ -1368,6 +1472,7 @@ static void blk_aio_read_entry(void *opaque)
     QEMUIOVector *qiov = rwco->iobuf;
 
     assert(qiov->size == acb->bytes);
+    blk_wait_while_drained(rwco->blk);
     rwco->ret = blk_co_preadv(rwco->blk, rwco->offset, acb->bytes,
                               qiov, rwco->flags);
     blk_aio_complete(acb);
@@ -1380,6 +1485,7 @@ static void blk_aio_write_entry(void *opaque)
     QEMUIOVector *qiov = rwco->iobuf;
 
     assert(!qiov || qiov->size == acb->bytes);
+    blk_wait_while_drained(rwco->blk);
     rwco->ret = blk_co_pwritev(rwco->blk, rwco->offset, acb->bytes,
                                qiov, rwco->flags);
     blk_aio_complete(acb);
@@ -1461,6 +1567,7 @@ static void blk_aio_flush_entry(void *opaque)
     BlkAioEmAIOCB *acb = opaque;
     BlkRwCo *rwco = &acb->rwco;
 
+    blk_wait_while_drained(rwco->blk);
     rwco->ret = blk_co_flush(rwco->blk);
     blk_aio_complete(acb);
 }
@@ -1476,6 +1583,7 @@ static void blk_aio_pdiscard_entry(void *opaque)
     BlkAioEmAIOCB *acb = opaque;
     BlkRwCo *rwco = &acb->rwco;
 
+    blk_wait_while_drained(rwco->blk);
     rwco->ret = blk_co_pdiscard(rwco->blk, rwco->offset, acb->bytes);
     blk_aio_complete(acb);
 }
@@ -1527,6 +1635,7 @@ static void blk_aio_ioctl_entry(void *opaque)
     BlkAioEmAIOCB *acb = opaque;
     BlkRwCo *rwco = &acb->rwco;
 
+    blk_wait_while_drained(rwco->blk);
     rwco->ret = blk_co_ioctl(rwco->blk, rwco->offset, rwco->iobuf);
 
     blk_aio_complete(acb);
@@ -2203,7 +2312,7 @@ static void blk_root_drained_begin(BdrvChild *child)
 {
     BlockBackend *blk = child->opaque;
 
-    if (++blk->quiesce_counter == 1) {
+    if (atomic_fetch_inc(&blk->quiesce_counter) == 0) {
         if (blk->dev_ops && blk->dev_ops->drained_begin) {
             blk->dev_ops->drained_begin(blk->dev_opaque);
         }
@@ -2232,10 +2341,25 @@ static void blk_root_drained_end(BdrvChild *child)
     assert(blk->public.throttle_group_member.io_limits_disabled);
     atomic_dec(&blk->public.throttle_group_member.io_limits_disabled);
 
-    if (--blk->quiesce_counter == 0) {
+    if (atomic_fetch_dec(&blk->quiesce_counter) == 1) {
+        /*
+         * Graph changes happen in drained sections, so this is the place
+         * to notice that a node without multiqueue support was inserted.
+         */
+        if (blk->multiqueue && !bdrv_supports_multiqueue(child->bs)) {
+            atomic_set(&blk->multiqueue, false);
+        }
+
         if (blk->dev_ops && blk->dev_ops->drained_end) {
             blk->dev_ops->drained_end(blk->dev_opaque);
         }
+
+        qemu_mutex_lock(&blk->queued_requests_lock);
+        while (qemu_co_enter_next(&blk->queued_requests,
+                                  &blk->queued_requests_lock)) {
+            /* Resume all queued requests */
+        }
+        qemu_mutex_unlock(&blk->queued_requests_lock);
     }
 }
 
@@ -2268,6 +2392,75 @@ int coroutine_fn blk_co_copy_range(BlockBackend *blk_in, int64_t off_in,
                               bytes, read_flags, write_flags);
 }
 
+/*
+ * Send @hdr and the data in [offset, offset + bytes) to the socket @fd, see
+ * bdrv_co_send_to_fd().  When the socket buffer is full, the coroutine waits
+ * for @ioc, the channel that @fd belongs to, to become writable.
+ *
+ * Returns 0 on success and -ENOTSUP if nothing has been sent because the
+ * node doesn't support it.  After other errors, the state of the connection
+ * is unknown.
+ */
+int coroutine_fn blk_co_send_to_fd(BlockBackend *blk, int64_t offset,
+                                   unsigned int bytes, QIOChannel *ioc, int fd,
+                                   const void *hdr, size_t hdr_len)
+{
+    BlockDriverState *bs = blk_bs(blk);
+    BlockAcctCookie acct;
+    const uint8_t *p = hdr;
+    bool sent_any = false;
+    int ret;
+
+    ret = blk_check_byte_request(blk, offset, bytes);
+    if (ret < 0) {
+        return ret;
+    }
+
+    /* throttling disk I/O */
+    if (blk->public.throttle_group_member.throttle_state) {
+        bdrv_inc_in_flight(bs);
+        throttle_group_co_io_limits_intercept(&blk->public.throttle_group_member,
+                bytes, false);
+        bdrv_dec_in_flight(bs);
+    }
+
+    block_acct_start(blk_get_stats(blk), &acct, bytes, BLOCK_ACCT_READ);
+
+    while (hdr_len || bytes) {
+        size_t sent_hdr;
+
+        /* Don't hold up drain while waiting for the peer */
+        bdrv_inc_in_flight(bs);
+        ret = bdrv_co_send_to_fd(blk->root, offset, bytes, fd, p, hdr_len);
+        bdrv_dec_in_flight(bs);
+        if (ret < 0) {
+            break;
+        }
+
+        sent_hdr = MIN((size_t)ret, hdr_len);
+        p += sent_hdr;
+        hdr_len -= sent_hdr;
+        offset += ret - sent_hdr;
+        bytes -= ret - sent_hdr;
+        sent_any |= ret > 0;
+
+        if (hdr_len || bytes) {
+            qio_channel_yield(ioc, G_IO_OUT);
+        }
+    }
+
+    if (ret == -ENOTSUP && !sent_any) {
+        /* Nothing was sent, the caller falls back to a bounce buffer */
+        return ret;
+    } else if (ret < 0) {
+        block_acct_failed(blk_get_stats(blk), &acct);
+        return ret == -ENOTSUP ? -EIO : ret;
+    }
+
+    block_acct_done(blk_get_stats(blk), &acct);
+    return 0;
+}
+
 const BdrvChild *blk_root(BlockBackend *blk)
 {
     return blk->root;
@@ -0,0 +1,420 @@
+/*
+ * block_copy API
+ *
+ * Copyright (C) 2013 Proxmox Server Solutions
+ *
+ * Authors:
+ *  Dietmar Maurer (dietmar@proxmox.com)
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+
+#include "trace.h"
+#include "qapi/error.h"
+#include "block/block-copy.h"
+#include "sysemu/block-backend.h"
+#include "qemu/cutils.h"
+#include "qemu/timer.h"
+#include "qemu/units.h"
+
+/* Upper bound for the bounce buffer of a single worker */
+#define BLOCK_COPY_MAX_BUFFER (1 * MiB)
+
+/*
+ * The state of one block_copy() call: its worker coroutines and the first
+ * error any of them reported.
+ */
+typedef struct BlockCopyCall {
+    BlockCopyState *s;
+    bool is_write_notifier;
+
+    Coroutine *waiter;
+    int in_flight;
+    int ret;
+    bool error_is_read;
+} BlockCopyCall;
+
+typedef struct BlockCopyTask {
+    BlockCopyCall *call;
+    BlockCopyInFlightReq req;
+    int64_t offset;
+    int64_t bytes;
+    bool zeroes;
+} BlockCopyTask;
+
+/*
+ * Wait for one in-flight request that overlaps [@start, @end) to complete.
+ * Return false if there was none.
+ */
+static bool coroutine_fn block_copy_wait_one_request(BlockCopyState *s,
+                                                     int64_t start,
+                                                     int64_t end)
+{
+    BlockCopyInFlightReq *req;
+
+    QLIST_FOREACH(req, &s->inflight_reqs, list) {
+        if (end > req->start_byte && start < req->end_byte) {
+            qemu_co_queue_wait(&req->wait_queue, NULL);
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/* Keep track of an in-flight request */
+static void block_copy_inflight_req_begin(BlockCopyState *s,
+                                          BlockCopyInFlightReq *req,
+                                          int64_t start, int64_t end)
+{
+    req->start_byte = start;
+    req->end_byte = end;
+    qemu_co_queue_init(&req->wait_queue);
+    QLIST_INSERT_HEAD(&s->inflight_reqs, req, list);
+}
+
+/* Forget about a completed request */
+static void block_copy_inflight_req_end(BlockCopyInFlightReq *req)
+{
+    QLIST_REMOVE(req, list);
+    qemu_co_queue_restart_all(&req->wait_queue);
+}
+
+BlockCopyState *block_copy_state_new(BlockBackend *source,
+                                     BlockBackend *target,
+                                     int64_t cluster_size, int64_t max_chunk,
+                                     int max_workers, bool use_copy_range,
+                                     BdrvRequestFlags write_flags,
+                                     Error **errp)
+{
+    BlockCopyState *s;
+    int64_t len;
+    uint32_t max_transfer;
+
+    assert(max_workers >= 0 && max_workers <= BLOCK_COPY_MAX_WORKERS);
+    assert(max_chunk >= 0 && max_chunk <= BDRV_REQUEST_MAX_BYTES);
+
+    len = blk_getlength(source);
+    if (len < 0) {
+        error_setg_errno(errp, -len, "unable to get length of the source");
+        return NULL;
+    }
+
+    s = g_new(BlockCopyState, 1);
+    *s = (BlockCopyState) {
+        .source = source,
+        .target = target,
+        .copy_bitmap = hbitmap_alloc(DIV_ROUND_UP(len, cluster_size), 0),
+        .cluster_size = cluster_size,
+        .len = len,
+        .max_workers = max_workers ?: BLOCK_COPY_MAX_WORKERS_DEFAULT,
+        .write_flags = write_flags,
+        .stats.start_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME),
+    };
+    QLIST_INIT(&s->inflight_reqs);
+
+    max_transfer = MIN_NON_ZERO(blk_get_max_transfer(source),
+                                blk_get_max_transfer(target));
+
+    if (write_flags & BDRV_REQ_WRITE_COMPRESSED) {
+        /* Compressed writes must cover exactly one cluster */
+        s->chunk_size = cluster_size;
+        s->use_copy_range = false;
+        s->copy_range_size = 0;
+    } else {
+        s->chunk_size = MIN_NON_ZERO(max_chunk, BLOCK_COPY_MAX_BUFFER);
+        s->chunk_size = MIN_NON_ZERO(max_transfer, s->chunk_size);
+        s->chunk_size = MAX(cluster_size,
+                            QEMU_ALIGN_DOWN(s->chunk_size, cluster_size));
+
+        s->use_copy_range = use_copy_range;
+        s->copy_range_size = MIN_NON_ZERO(max_chunk, max_transfer);
+        s->copy_range_size = MAX(cluster_size,
+                                 QEMU_ALIGN_UP(s->copy_range_size,
+                                               cluster_size));
+    }
+
+    return s;
+}
+
+void block_copy_state_free(BlockCopyState *s)
+{
+    if (!s) {
+        return;
+    }
+
+    assert(QLIST_EMPTY(&s->inflight_reqs));
+    hbitmap_free(s->copy_bitmap);
+    g_free(s);
+}
+
+void block_copy_set_callbacks(BlockCopyState *s,
+                              ProgressBytesCallbackFunc progress_bytes_callback,
+                              void *progress_opaque)
+{
+    s->progress_bytes_callback = progress_bytes_callback;
+    s->progress_opaque = progress_opaque;
+}
+
+/*
+ * Copy [@offset, @offset + @bytes), trying copy_range first and falling
+ * back to a bounce buffer of at most chunk_size bytes.
+ */
+static int coroutine_fn block_copy_do_copy(BlockCopyState *s,
+                                           int64_t offset, int64_t bytes,
+                                           bool zeroes, bool is_write_notifier,
+                                           bool *error_is_read)
+{
+    BdrvRequestFlags read_flags =
+        is_write_notifier ? BDRV_REQ_NO_SERIALISING : 0;
+    BdrvRequestFlags zero_flags =
+        (s->write_flags & ~BDRV_REQ_WRITE_COMPRESSED) | BDRV_REQ_MAY_UNMAP;
+    void *bounce_buffer;
+    int64_t pos;
+    int ret = 0;
+
+    if (zeroes) {
+        ret = blk_co_pwrite_zeroes(s->target, offset, bytes, zero_flags);
+        if (ret < 0) {
+            trace_block_copy_write_zeroes_fail(s, offset, ret);
+            *error_is_read = false;
+            return ret;
+        }
+        s->stats.bytes_zeroed += bytes;
+        return 0;
+    }
+
+    if (s->use_copy_range) {
+        ret = blk_co_copy_range(s->source, offset, s->target, offset, bytes,
+                                read_flags, s->write_flags);
+        if (ret >= 0) {
+            s->stats.bytes_offloaded += bytes;
+            return 0;
+        }
+
+        /* Don't try again, the bounce buffer path always works */
+        trace_block_copy_copy_range_fail(s, offset, ret);
+        s->use_copy_range = false;
+    }
+
+    bounce_buffer = blk_blockalign(s->source, MIN(bytes, s->chunk_size));
+
+    for (pos = offset; pos < offset + bytes; pos += s->chunk_size) {
+        int nbytes = MIN(s->chunk_size, offset + bytes - pos);
+
+        ret = blk_co_pread(s->source, pos, nbytes, bounce_buffer, read_flags);
+        if (ret < 0) {
+            trace_block_copy_read_fail(s, pos, ret);
+            *error_is_read = true;
+            break;
+        }
+
+        if (buffer_is_zero(bounce_buffer, nbytes)) {
+            ret = blk_co_pwrite_zeroes(s->target, pos, nbytes, zero_flags);
+            if (ret >= 0) {
+                s->stats.bytes_zeroed += nbytes;
+            }
+        } else {
+            ret = blk_co_pwrite(s->target, pos, nbytes, bounce_buffer,
+                                s->write_flags);
+            if (ret >= 0) {
+                s->stats.bytes_copied += nbytes;
+            }
+        }
+        if (ret < 0) {
+            trace_block_copy_write_fail(s, pos, ret);
+            *error_is_read = false;
+            break;
+        }
+    }
+
+    qemu_vfree(bounce_buffer);
+
+    return ret < 0 ? ret : 0;
+}
+
+static void coroutine_fn block_copy_task_entry(void *opaque)
+{
+    BlockCopyTask *task = opaque;
+    BlockCopyCall *call = task->call;
+    BlockCopyState *s = call->s;
+    Coroutine *waiter;
+    bool error_is_read = false;
+    int ret;
+
+    ret = block_copy_do_copy(s, task->offset, task->bytes, task->zeroes,
+                             call->is_write_notifier, &error_is_read);
+    if (ret < 0) {
+        hbitmap_set(s->copy_bitmap, task->offset / s->cluster_size,
+                    DIV_ROUND_UP(task->bytes, s->cluster_size));
+    }
+    block_copy_inflight_req_end(&task->req);
+
+    if (ret >= 0 && s->progress_bytes_callback) {
+        s->progress_bytes_callback(task->bytes, s->progress_opaque);
+    }
+
+    if (ret < 0 && call->ret == 0) {
+        call->ret = ret;
+        call->error_is_read = error_is_read;
+    }
+    g_free(task);
+
+    assert(call->in_flight > 0);
+    call->in_flight--;
+    waiter = call->waiter;
+    if (waiter) {
+        /* The waiter only runs once this coroutine has terminated */
+        call->waiter = NULL;
+        aio_co_wake(waiter);
+    }
+}
+
+static void coroutine_fn block_copy_call_yield(BlockCopyCall *call)
+{
+    assert(!call->waiter);
+    call->waiter = qemu_coroutine_self();
+    qemu_coroutine_yield();
+    assert(!call->waiter);
+}
+
+/*
+ * Return the length of the request that starts at @offset and covers at
+ * most @bytes, and whether the source reads as zeroes there.  Zero runs are
+ * written in one go; data requests stop at the next allocation boundary so
+ * that a zero run following them is detected as well.
+ */
+static int64_t block_copy_chunk_bytes(BlockCopyState *s, int64_t offset,
+                                      int64_t bytes, bool *zeroes)
+{
+    int64_t max_data = s->use_copy_range ? s->copy_range_size : s->chunk_size;
+    int64_t max_zeroes = QEMU_ALIGN_DOWN(BDRV_REQUEST_MAX_BYTES,
+                                         s->cluster_size);
+    int64_t pnum;
+    int ret;
+
+    *zeroes = false;
+
+    ret = bdrv_block_status_above(blk_bs(s->source), NULL, offset,
+                                  MIN(offset + bytes, s->len) - offset,
+                                  &pnum, NULL, NULL);
+    if (ret < 0 || pnum == 0) {
+        return MIN(bytes, max_data);
+    }
+
+    if (ret & BDRV_BLOCK_ZERO) {
+        if (offset + pnum == s->len) {
+            /* The partial cluster at the end of the image is included */
+            *zeroes = true;
+            return MIN(bytes, max_zeroes);
+        } else if (pnum >= s->cluster_size) {
+            *zeroes = true;
+            return MIN(QEMU_ALIGN_DOWN(pnum, s->cluster_size), max_zeroes);
+        }
+    }
+
+    return MIN(MIN(bytes, max_data), QEMU_ALIGN_UP(pnum, s->cluster_size));
+}
+
+/*
+ * Copy the dirty clusters of [@start, @end), which must be cluster aligned.
+ * Each request is claimed by clearing its bits in copy_bitmap and putting
+ * it on inflight_reqs before the worker coroutine for it starts.
+ */
+static int coroutine_fn block_copy_dirty_clusters(BlockCopyState *s,
+                                                  int64_t start, int64_t end,
+                                                  bool *error_is_read,
+                                                  bool is_write_notifier)
+{
+    BlockCopyCall call = {
+        .s = s,
+        .is_write_notifier = is_write_notifier,
+    };
+
+    while (start < end) {
+        BlockCopyTask *task;
+        int64_t next_zero, bytes;
+        bool zeroes;
+
+        while (call.in_flight >= s->max_workers) {
+            block_copy_call_yield(&call);
+        }
+        if (call.ret < 0) {
+            break;
+        }
+
+        if (!hbitmap_get(s->copy_bitmap, start / s->cluster_size)) {
+            trace_block_copy_skip(s, start);
+            start += s->cluster_size;
+            continue; /* already copied or being copied */
+        }
+
+        next_zero = hbitmap_next_zero(s->copy_bitmap, start / s->cluster_size,
+                                      (end - start) / s->cluster_size);
+        bytes = (next_zero < 0 ? end : next_zero * s->cluster_size) - start;
+        bytes = block_copy_chunk_bytes(s, start, bytes, &zeroes);
+
+        trace_block_copy_process(s, start, bytes, zeroes);
+
+        task = g_new(BlockCopyTask, 1);
+        *task = (BlockCopyTask) {
+            .call = &call,
+            .offset = start,
+            .bytes = MIN(start + bytes, s->len) - start,
+            .zeroes = zeroes,
+        };
+        hbitmap_reset(s->copy_bitmap, start / s->cluster_size,
+                      bytes / s->cluster_size);
+        block_copy_inflight_req_begin(s, &task->req, start, start + bytes);
+        s->stats.requests++;
+        start += bytes;
+
+        call.in_flight++;
+        if (start >= end && call.in_flight == 1) {
+            /* Nothing to parallelize, avoid creating a coroutine */
+            block_copy_task_entry(task);
+        } else {
+            qemu_coroutine_enter(qemu_coroutine_create(block_copy_task_entry,
+                                                       task));
+        }
+    }
+
+    while (call.in_flight > 0) {
+        block_copy_call_yield(&call);
+    }
+
+    if (call.ret < 0 && error_is_read) {
+        *error_is_read = call.error_is_read;
+    }
+
+    return call.ret;
+}
+
+int coroutine_fn block_copy(BlockCopyState *s, int64_t start, uint64_t bytes,
+                            bool *error_is_read, bool is_write_notifier)
+{
+    int64_t end = QEMU_ALIGN_UP(start + bytes, s->cluster_size);
+    int ret;
+
+    start = QEMU_ALIGN_DOWN(start, s->cluster_size);
+    assert(end <= QEMU_ALIGN_UP(s->len, s->cluster_size));
+
+    trace_block_copy(s, start, end - start);
+
+    /*
+     * Clusters claimed by other callers are not dirty any more, but their
+     * data is only safe once those requests have completed.  If one of them
+     * fails its clusters become dirty again, so go for another round.
+     */
+    do {
+        ret = block_copy_dirty_clusters(s, start, end, error_is_read,
+                                        is_write_notifier);
+    } while (ret == 0 && block_copy_wait_one_request(s, start, end));
+
+    trace_block_copy_return(s, start, end - start, ret);
+
+    return ret;
+}
@@ -102,6 +102,11 @@
 #include <xfs/xfs.h>
 #endif
 
+#ifdef CONFIG_SENDFILE
+#include <poll.h>
+#include <sys/sendfile.h>
+#endif
+
 #include "trace.h"
 
 /* OS X does not have O_DSYNC */
@@ -154,9 +159,15 @@ typedef struct BDRVRawState {
     bool has_write_zeroes:1;
     bool discard_zeroes:1;
     bool use_linux_aio:1;
+    bool use_linux_io_uring:1;
+    bool io_uring_sqpoll:1;
+    bool io_uring_fixed_buffers:1;
     bool page_cache_inconsistent:1;
     bool has_fallocate;
     bool needs_alignment;
+    /* Engine setup failed in an iothread, see raw_get_linux_aio() */
+    bool linux_aio_failed;
+    bool linux_io_uring_failed;
     bool drop_cache;
     bool check_cache_dropped;
 
@@ -194,6 +205,12 @@ typedef struct RawPosixAIOData {
             int aio_fd2;
             off_t aio_offset2;
         } copy_range;
+        struct {
+            int out_fd;
+            const void *hdr;
+            size_t hdr_len;
+            size_t sent;
+        } send_to_fd;
         struct {
             PreallocMode prealloc;
             Error **errp;
@@ -423,8 +440,21 @@ static QemuOptsList raw_runtime_opts = {
         {
             .name = "aio",
             .type = QEMU_OPT_STRING,
-            .help = "host AIO implementation (threads, native)",
+            .help = "host AIO implementation (threads, native, io_uring)",
         },
+#ifdef CONFIG_LINUX_IO_URING
+        {
+            .name = "io-uring-sqpoll",
+            .type = QEMU_OPT_BOOL,
+            .help = "poll the io_uring submission ring from a kernel thread "
+                    "(default: off)",
+        },
+        {
+            .name = "io-uring-fixed-buffers",
+            .type = QEMU_OPT_BOOL,
+            .help = "register guest RAM with io_uring (default: off)",
+        },
+#endif
         {
             .name = "locking",
             .type = QEMU_OPT_STRING,
@@ -482,9 +512,15 @@ static int raw_open_common(BlockDriverState *bs, QDict *options,
         goto fail;
     }
 
-    aio_default = (bdrv_flags & BDRV_O_NATIVE_AIO)
-                  ? BLOCKDEV_AIO_OPTIONS_NATIVE
-                  : BLOCKDEV_AIO_OPTIONS_THREADS;
+    if (bdrv_flags & BDRV_O_NATIVE_AIO) {
+        aio_default = BLOCKDEV_AIO_OPTIONS_NATIVE;
+#ifdef CONFIG_LINUX_IO_URING
+    } else if (bdrv_flags & BDRV_O_IO_URING) {
+        aio_default = BLOCKDEV_AIO_OPTIONS_IO_URING;
+#endif
+    } else {
+        aio_default = BLOCKDEV_AIO_OPTIONS_THREADS;
+    }
     aio = qapi_enum_parse(&BlockdevAioOptions_lookup,
                           qemu_opt_get(opts, "aio"),
                           aio_default, &local_err);
@@ -494,6 +530,13 @@ static int raw_open_common(BlockDriverState *bs, QDict *options,
         goto fail;
     }
     s->use_linux_aio = (aio == BLOCKDEV_AIO_OPTIONS_NATIVE);
+#ifdef CONFIG_LINUX_IO_URING
+    s->use_linux_io_uring = (aio == BLOCKDEV_AIO_OPTIONS_IO_URING);
+    s->io_uring_sqpoll = qemu_opt_get_bool(opts, "io-uring-sqpoll", false);
+    s->io_uring_fixed_buffers = qemu_opt_get_bool(opts,
+                                                  "io-uring-fixed-buffers",
+                                                  false);
+#endif
 
     locking = qapi_enum_parse(&OnOffAuto_lookup,
                               qemu_opt_get(opts, "locking"),
@@ -579,6 +622,23 @@ static int raw_open_common(BlockDriverState *bs, QDict *options,
     }
 #endif /* !defined(CONFIG_LINUX_AIO) */
 
+#ifdef CONFIG_LINUX_IO_URING
+    if (s->use_linux_io_uring) {
+        LuringState *aio;
+
+        aio = aio_setup_linux_io_uring(bdrv_get_aio_context(bs),
+                                       s->io_uring_sqpoll, errp);
+        if (!aio) {
+            error_prepend(errp, "Unable to use io_uring: ");
+            ret = -EINVAL;
+            goto fail;
+        }
+        if (s->io_uring_fixed_buffers) {
+            luring_enable_fixed_buffers(aio);
+        }
+    }
+#endif
+
     s->has_discard = true;
     s->has_write_zeroes = true;
     if ((bs->open_flags & BDRV_O_NOCACHE) != 0) {
@@ -1856,10 +1916,74 @@ static int coroutine_fn raw_thread_pool_submit(BlockDriverState *bs,
                                                ThreadPoolFunc func, void *arg)
 {
     /* @bs can be NULL, bdrv_get_aio_context() returns the main context then */
-    ThreadPool *pool = aio_get_thread_pool(bdrv_get_aio_context(bs));
+    ThreadPool *pool = aio_get_thread_pool(bdrv_get_request_aio_context(bs));
     return thread_pool_submit_co(pool, func, arg);
 }
 
+/*
+ * Requests from a multiqueue BlockBackend run in the submitting iothread,
+ * so the AIO engines are set up lazily for AioContexts other than the
+ * node's own.  NULL means the engine is unavailable there and the thread
+ * pool should be used instead.
+ *
+ * Setup is not retried for every request after it failed once: the
+ * failure is reported, and from then on requests from iothreads other
+ * than the node's own quietly use the thread pool.
+ */
+#ifdef CONFIG_LINUX_AIO
+static LinuxAioState *raw_get_linux_aio(BlockDriverState *bs)
+{
+    BDRVRawState *s = bs->opaque;
+    AioContext *ctx = bdrv_get_request_aio_context(bs);
+    LinuxAioState *aio;
+    Error *local_err = NULL;
+
+    if (ctx != bdrv_get_aio_context(bs) && atomic_read(&s->linux_aio_failed)) {
+        return NULL;
+    }
+
+    aio = aio_setup_linux_aio(ctx, &local_err);
+    if (!aio) {
+        if (!atomic_xchg(&s->linux_aio_failed, true)) {
+            error_reportf_err(local_err, "Unable to use native AIO in an "
+                                         "iothread, using thread pool: ");
+        } else {
+            error_free(local_err);
+        }
+    }
+    return aio;
+}
+#endif
+
+#ifdef CONFIG_LINUX_IO_URING
+static LuringState *raw_get_linux_io_uring(BlockDriverState *bs)
+{
+    BDRVRawState *s = bs->opaque;
+    AioContext *ctx = bdrv_get_request_aio_context(bs);
+    LuringState *aio;
+    Error *local_err = NULL;
+
+    if (ctx != bdrv_get_aio_context(bs) &&
+        atomic_read(&s->linux_io_uring_failed))
+    {
+        return NULL;
+    }
+
+    aio = aio_setup_linux_io_uring(ctx, s->io_uring_sqpoll, &local_err);
+    if (!aio) {
+        if (!atomic_xchg(&s->linux_io_uring_failed, true)) {
+            error_reportf_err(local_err, "Unable to use io_uring in an "
+                                         "iothread, using thread pool: ");
+        } else {
+            error_free(local_err);
+        }
+    } else if (s->io_uring_fixed_buffers) {
+        luring_enable_fixed_buffers(aio);
+    }
+    return aio;
+}
+#endif
+
 static int coroutine_fn raw_co_prw(BlockDriverState *bs, uint64_t offset,
                                    uint64_t bytes, QEMUIOVector *qiov, int type)
 {
@@ -1875,16 +1999,25 @@ static int coroutine_fn raw_co_prw(BlockDriverState *bs, uint64_t offset,
      * If this is the case tell the low-level driver that it needs
      * to copy the buffer.
      */
-    if (s->needs_alignment) {
-        if (!bdrv_qiov_is_aligned(bs, qiov)) {
-            type |= QEMU_AIO_MISALIGNED;
+    if (s->needs_alignment && !bdrv_qiov_is_aligned(bs, qiov)) {
+        type |= QEMU_AIO_MISALIGNED;
+#ifdef CONFIG_LINUX_IO_URING
+    } else if (s->use_linux_io_uring) {
+        /* Unlike linux-aio, io_uring works without O_DIRECT too */
+        LuringState *aio = raw_get_linux_io_uring(bs);
+        if (aio) {
+            assert(qiov->size == bytes);
+            return luring_co_submit(bs, aio, s->fd, offset, qiov, type);
+        }
+#endif
 #ifdef CONFIG_LINUX_AIO
-        } else if (s->use_linux_aio) {
-            LinuxAioState *aio = aio_get_linux_aio(bdrv_get_aio_context(bs));
+    } else if (s->needs_alignment && s->use_linux_aio) {
+        LinuxAioState *aio = raw_get_linux_aio(bs);
+        if (aio) {
             assert(qiov->size == bytes);
             return laio_co_submit(bs, aio, s->fd, offset, qiov, type);
-#endif
         }
+#endif
     }
 
     acb = (RawPosixAIOData) {
@@ -1920,22 +2053,42 @@ static int coroutine_fn raw_co_pwritev(BlockDriverState *bs, uint64_t offset,
 
 static void raw_aio_plug(BlockDriverState *bs)
 {
+    BDRVRawState __attribute__((unused)) *s = bs->opaque;
 #ifdef CONFIG_LINUX_AIO
-    BDRVRawState *s = bs->opaque;
     if (s->use_linux_aio) {
-        LinuxAioState *aio = aio_get_linux_aio(bdrv_get_aio_context(bs));
-        laio_io_plug(bs, aio);
+        LinuxAioState *aio = raw_get_linux_aio(bs);
+        if (aio) {
+            laio_io_plug(bs, aio);
+        }
+    }
+#endif
+#ifdef CONFIG_LINUX_IO_URING
+    if (s->use_linux_io_uring) {
+        LuringState *aio = raw_get_linux_io_uring(bs);
+        if (aio) {
+            luring_io_plug(bs, aio);
+        }
     }
 #endif
 }
 
 static void raw_aio_unplug(BlockDriverState *bs)
 {
+    BDRVRawState __attribute__((unused)) *s = bs->opaque;
 #ifdef CONFIG_LINUX_AIO
-    BDRVRawState *s = bs->opaque;
     if (s->use_linux_aio) {
-        LinuxAioState *aio = aio_get_linux_aio(bdrv_get_aio_context(bs));
-        laio_io_unplug(bs, aio);
+        LinuxAioState *aio = raw_get_linux_aio(bs);
+        if (aio) {
+            laio_io_unplug(bs, aio);
+        }
+    }
+#endif
+#ifdef CONFIG_LINUX_IO_URING
+    if (s->use_linux_io_uring) {
+        LuringState *aio = raw_get_linux_io_uring(bs);
+        if (aio) {
+            luring_io_unplug(bs, aio);
+        }
     }
 #endif
 }
@@ -1951,6 +2104,15 @@ static int raw_co_flush_to_disk(BlockDriverState *bs)
         return ret;
     }
 
+#ifdef CONFIG_LINUX_IO_URING
+    if (s->use_linux_io_uring) {
+        LuringState *aio = raw_get_linux_io_uring(bs);
+        if (aio) {
+            return luring_co_submit(bs, aio, s->fd, 0, NULL, QEMU_AIO_FLUSH);
+        }
+    }
+#endif
+
     acb = (RawPosixAIOData) {
         .bs             = bs,
         .aio_fildes     = s->fd,
@@ -1963,8 +2125,8 @@ static int raw_co_flush_to_disk(BlockDriverState *bs)
 static void raw_aio_attach_aio_context(BlockDriverState *bs,
                                        AioContext *new_context)
 {
+    BDRVRawState __attribute__((unused)) *s = bs->opaque;
 #ifdef CONFIG_LINUX_AIO
-    BDRVRawState *s = bs->opaque;
     if (s->use_linux_aio) {
         Error *local_err;
         if (!aio_setup_linux_aio(new_context, &local_err)) {
@@ -1974,6 +2136,22 @@ static void raw_aio_attach_aio_context(BlockDriverState *bs,
         }
     }
 #endif
+#ifdef CONFIG_LINUX_IO_URING
+    if (s->use_linux_io_uring) {
+        Error *local_err = NULL;
+        LuringState *aio;
+
+        aio = aio_setup_linux_io_uring(new_context, s->io_uring_sqpoll,
+                                       &local_err);
+        if (!aio) {
+            error_reportf_err(local_err, "Unable to use io_uring, "
+                                         "falling back to thread pool: ");
+            s->use_linux_io_uring = false;
+        } else if (s->io_uring_fixed_buffers) {
+            luring_enable_fixed_buffers(aio);
+        }
+    }
+#endif
 }
 
 static void raw_close(BlockDriverState *bs)
@@ -2898,11 +3076,121 @@ static int coroutine_fn raw_co_copy_range_to(BlockDriverState *bs,
     return raw_thread_pool_submit(bs, handle_aiocb_copy_range, &acb);
 }
 
+#ifdef CONFIG_SENDFILE
+/*
+ * The worker must not wait for the socket to become writable: a client that
+ * stops reading replies would pin it forever.  It sends what fits into the
+ * socket buffer and reports how much that was; the caller waits in its
+ * coroutine and calls again for the rest.
+ */
+static int handle_aiocb_send_to_fd(void *opaque)
+{
+    RawPosixAIOData *aiocb = opaque;
+    int out_fd = aiocb->send_to_fd.out_fd;
+    const uint8_t *hdr = aiocb->send_to_fd.hdr;
+    size_t hdr_len = aiocb->send_to_fd.hdr_len;
+    uint64_t bytes = aiocb->aio_nbytes;
+    off_t offset = aiocb->aio_offset;
+    ssize_t ret;
+
+    aiocb->send_to_fd.sent = 0;
+
+    while (hdr_len) {
+        ret = send(out_fd, hdr, hdr_len, MSG_MORE | MSG_DONTWAIT);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            } else if (errno == EAGAIN) {
+                return 0;
+            }
+            return -errno;
+        }
+        hdr += ret;
+        hdr_len -= ret;
+        aiocb->send_to_fd.sent += ret;
+    }
+
+    while (bytes) {
+        ret = sendfile(out_fd, aiocb->aio_fildes, &offset,
+                       MIN(bytes, INT_MAX));
+        trace_file_sendfile(aiocb->bs, aiocb->aio_fildes, out_fd, offset,
+                            bytes, ret);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            } else if (errno == EAGAIN) {
+                return 0;
+            }
+            return -errno;
+        }
+        if (ret == 0) {
+            /* The file was truncated after raw_co_send_to_fd() checked its
+             * length; the header has been sent already, so we cannot fall
+             * back to zero padding any more */
+            return -EIO;
+        }
+        bytes -= ret;
+        aiocb->send_to_fd.sent += ret;
+    }
+
+    return 0;
+}
+
+static int coroutine_fn raw_co_send_to_fd(BlockDriverState *bs,
+                                          uint64_t offset, uint64_t bytes,
+                                          int fd, const void *hdr,
+                                          size_t hdr_len)
+{
+    BDRVRawState *s = bs->opaque;
+    RawPosixAIOData acb;
+    int64_t length;
+    int ret;
+
+    /* sendfile() goes through the page cache */
+    if (s->open_flags & O_DIRECT) {
+        return -ENOTSUP;
+    }
+    if (fd_open(bs) < 0) {
+        return -EIO;
+    }
+
+    /*
+     * The length of the node is rounded up to a multiple of the sector size,
+     * and reads of the tail are padded with zeroes.  sendfile() can't do
+     * that, so let the caller fall back to a buffered read.
+     */
+    length = raw_getlength(bs);
+    if (length < 0) {
+        return length;
+    }
+    if (offset + bytes > length) {
+        return -ENOTSUP;
+    }
+
+    acb = (RawPosixAIOData) {
+        .bs             = bs,
+        .aio_type       = QEMU_AIO_SEND_TO_FD,
+        .aio_fildes     = s->fd,
+        .aio_offset     = offset,
+        .aio_nbytes     = bytes,
+        .send_to_fd     = {
+            .out_fd         = fd,
+            .hdr            = hdr,
+            .hdr_len        = hdr_len,
+        },
+    };
+
+    ret = raw_thread_pool_submit(bs, handle_aiocb_send_to_fd, &acb);
+    return ret < 0 ? ret : acb.send_to_fd.sent;
+}
+#endif
+
 BlockDriver bdrv_file = {
     .format_name = "file",
     .protocol_name = "file",
     .instance_size = sizeof(BDRVRawState),
     .bdrv_needs_filename = true,
+    .supports_multiqueue = true,
     .bdrv_probe = NULL, /* no probe for protocols */
     .bdrv_parse_filename = raw_parse_filename,
     .bdrv_file_open = raw_open,
@@ -2923,6 +3211,9 @@ BlockDriver bdrv_file = {
     .bdrv_co_pdiscard       = raw_co_pdiscard,
     .bdrv_co_copy_range_from = raw_co_copy_range_from,
     .bdrv_co_copy_range_to  = raw_co_copy_range_to,
+#ifdef CONFIG_SENDFILE
+    .bdrv_co_send_to_fd     = raw_co_send_to_fd,
+#endif
     .bdrv_refresh_limits = raw_refresh_limits,
     .bdrv_io_plug = raw_aio_plug,
     .bdrv_io_unplug = raw_aio_unplug,
@@ -3380,6 +3671,7 @@ static BlockDriver bdrv_host_device = {
     .protocol_name        = "host_device",
     .instance_size      = sizeof(BDRVRawState),
     .bdrv_needs_filename = true,
+    .supports_multiqueue = true,
     .bdrv_probe_device  = hdev_probe_device,
     .bdrv_parse_filename = hdev_parse_filename,
     .bdrv_file_open     = hdev_open,
@@ -3399,6 +3691,9 @@ static BlockDriver bdrv_host_device = {
     .bdrv_co_pdiscard       = hdev_co_pdiscard,
     .bdrv_co_copy_range_from = raw_co_copy_range_from,
     .bdrv_co_copy_range_to  = raw_co_copy_range_to,
+#ifdef CONFIG_SENDFILE
+    .bdrv_co_send_to_fd     = raw_co_send_to_fd,
+#endif
     .bdrv_refresh_limits = raw_refresh_limits,
     .bdrv_io_plug = raw_aio_plug,
     .bdrv_io_unplug = raw_aio_unplug,
@@ -38,6 +38,42 @@
 /* Maximum bounce buffer for copy-on-read and write zeroes, in bytes */
 #define MAX_BOUNCE_BUFFER (32768 << BDRV_SECTOR_BITS)
 
+int coroutine_fn bdrv_co_send_to_fd(BdrvChild *child, uint64_t offset,
+                                    uint64_t bytes, int fd,
+                                    const void *hdr, size_t hdr_len)
+{
+    BlockDriverState *bs = child ? child->bs : NULL;
+    BdrvTrackedRequest req;
+    int ret;
+
+    trace_bdrv_co_send_to_fd(bs, offset, bytes, fd, hdr_len);
+
+    if (!bs || !bs->drv) {
+        return -ENOMEDIUM;
+    }
+    ret = bdrv_check_byte_request(bs, offset, bytes);
+    if (ret) {
+        return ret;
+    }
+
+    /* The data must be sent exactly as it is stored */
+    if (!bs->drv->bdrv_co_send_to_fd || bs->encrypted ||
+        atomic_read(&bs->copy_on_read)) {
+        return -ENOTSUP;
+    }
+
+    bdrv_inc_in_flight(bs);
+    tracked_request_begin(&req, bs, offset, bytes, BDRV_TRACKED_READ);
+    wait_serialising_requests(&req);
+
+    ret = bs->drv->bdrv_co_send_to_fd(bs, offset, bytes, fd, hdr, hdr_len);
+
+    tracked_request_end(&req);
+    bdrv_dec_in_flight(bs);
+
+    return ret;
+}
+
 static void bdrv_parent_cb_resize(BlockDriverState *bs);
 static int coroutine_fn bdrv_co_do_pwrite_zeroes(BlockDriverState *bs,
     int64_t offset, int bytes, BdrvRequestFlags flags);
@@ -1627,6 +1663,7 @@ static int coroutine_fn bdrv_aligned_pwritev(BdrvChild *child,
 {
     BlockDriverState *bs = child->bs;
     BlockDriver *drv = bs->drv;
+    bool detected_zeroes = false;
     int ret;
 
     uint64_t bytes_remaining = bytes;
@@ -1656,6 +1693,7 @@ static int coroutine_fn bdrv_aligned_pwritev(BdrvChild *child,
         if (bs->detect_zeroes == BLOCKDEV_DETECT_ZEROES_OPTIONS_UNMAP) {
             flags |= BDRV_REQ_MAY_UNMAP;
         }
+        detected_zeroes = true;
     }
 
     if (ret < 0) {
@@ -1663,6 +1701,9 @@ static int coroutine_fn bdrv_aligned_pwritev(BdrvChild *child,
     } else if (flags & BDRV_REQ_ZERO_WRITE) {
         bdrv_debug_event(bs, BLKDBG_PWRITEV_ZERO);
         ret = bdrv_co_do_pwrite_zeroes(bs, offset, bytes, flags);
+        if (ret >= 0 && detected_zeroes) {
+            stat64_add(&bs->detected_zero_bytes, bytes);
+        }
     } else if (flags & BDRV_REQ_WRITE_COMPRESSED) {
         ret = bdrv_driver_pwritev_compressed(bs, offset, bytes, qiov);
     } else if (bytes <= max_transfer) {
@@ -2868,7 +2909,12 @@ void bdrv_io_plug(BlockDriverState *bs)
         bdrv_io_plug(child->bs);
     }
 
-    if (atomic_fetch_inc(&bs->io_plugged) == 0) {
+    /*
+     * Multiqueue drivers keep one plug count per AioContext, so a plug
+     * from one iothread must not be hidden by another iothread's.
+     */
+    if (atomic_fetch_inc(&bs->io_plugged) == 0 ||
+        (bs->drv && bs->drv->supports_multiqueue)) {
         BlockDriver *drv = bs->drv;
         if (drv && drv->bdrv_io_plug) {
             drv->bdrv_io_plug(bs);
@@ -2881,7 +2927,8 @@ void bdrv_io_unplug(BlockDriverState *bs)
     BdrvChild *child;
 
     assert(bs->io_plugged);
-    if (atomic_fetch_dec(&bs->io_plugged) == 1) {
+    if (atomic_fetch_dec(&bs->io_plugged) == 1 ||
+        (bs->drv && bs->drv->supports_multiqueue)) {
         BlockDriver *drv = bs->drv;
         if (drv && drv->bdrv_io_unplug) {
             drv->bdrv_io_unplug(bs);
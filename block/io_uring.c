@@ -0,0 +1,655 @@
+/*
+ * Linux io_uring support.
+ *
+ * The structure follows linux-aio.c: requests are queued per AioContext,
+ * submitted in batches when the queue is unplugged, and completions are
+ * signalled through an EventNotifier registered with the ring.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#include "qemu/osdep.h"
+#include <liburing.h>
+#include "qemu-common.h"
+#include "block/aio.h"
+#include "qemu/queue.h"
+#include "block/block.h"
+#include "block/raw-aio.h"
+#include "qemu/error-report.h"
+#include "qemu/event_notifier.h"
+#include "qemu/coroutine.h"
+#include "qemu/thread.h"
+#include "qemu/units.h"
+#include "exec/cpu-common.h"
+#include "exec/ramlist.h"
+#include "qapi/error.h"
+
+/* Ring size, per AioContext.  Requests beyond this wait in io_q. */
+#define MAX_ENTRIES 128
+
+/* How long the SQPOLL kernel thread spins before going to sleep */
+#define SQPOLL_IDLE_MS 1000
+
+/* Kernel limits on registered buffers: size of each, and count */
+#define FIXED_BUF_MAX_SIZE  (1 * GiB)
+#define FIXED_BUF_MAX_COUNT 1024
+
+typedef struct LuringAIOCB {
+    Coroutine *co;
+    int fd;
+    int type;
+    uint64_t offset;
+    QEMUIOVector *qiov;
+    ssize_t ret;
+
+    /* Bytes already transferred, when a short read is resubmitted */
+    size_t done;
+    QEMUIOVector resubmit_qiov;
+
+    QSIMPLEQ_ENTRY(LuringAIOCB) next;
+} LuringAIOCB;
+
+typedef struct LuringQueue {
+    int plugged;
+    unsigned int in_queue;      /* waiting in @pending */
+    unsigned int in_ring;       /* in the submission ring, not yet consumed */
+    unsigned int in_flight;     /* consumed by the kernel */
+    bool blocked;
+    QSIMPLEQ_HEAD(, LuringAIOCB) pending;
+} LuringQueue;
+
+struct LuringState {
+    AioContext *aio_context;
+
+    struct io_uring ring;
+    EventNotifier e;
+
+    /* io queue for submit at batch.  Protected by AioContext lock. */
+    LuringQueue io_q;
+
+    /* I/O completion processing.  Only runs in I/O thread.  */
+    QEMUBH *completion_bh;
+
+    /*
+     * Guest RAM registered with the ring, sorted by address.  Only
+     * changed while nothing is in flight, since the sqes refer to it by
+     * index.
+     */
+    bool use_fixed_buffers;
+    unsigned int fixed_generation;
+    unsigned int nr_fixed;
+    struct iovec *fixed;
+};
+
+/*
+ * Guest RAM blocks, split to the kernel's size limit for registered
+ * buffers.  Filled by a RAMBlockNotifier in the main thread and picked
+ * up by each ring from its own thread.
+ */
+static struct {
+    QemuMutex lock;
+    GArray *bufs;               /* struct iovec, sorted by address */
+    unsigned int generation;
+    RAMBlockNotifier notifier;
+} luring_ram;
+
+static void ioq_submit(LuringState *s);
+
+static void luring_ram_block_added(RAMBlockNotifier *n, void *host,
+                                   size_t size)
+{
+    uint8_t *p = host;
+    guint i;
+
+    qemu_mutex_lock(&luring_ram.lock);
+    for (i = 0; i < luring_ram.bufs->len; i++) {
+        if (g_array_index(luring_ram.bufs, struct iovec, i).iov_base >
+            host) {
+            break;
+        }
+    }
+    while (size) {
+        struct iovec iov = {
+            .iov_base = p,
+            .iov_len = MIN(size, FIXED_BUF_MAX_SIZE),
+        };
+
+        g_array_insert_val(luring_ram.bufs, i++, iov);
+        p += iov.iov_len;
+        size -= iov.iov_len;
+    }
+    atomic_inc(&luring_ram.generation);
+    qemu_mutex_unlock(&luring_ram.lock);
+}
+
+static void luring_ram_block_removed(RAMBlockNotifier *n, void *host,
+                                     size_t size)
+{
+    uint8_t *start = host;
+    guint i;
+
+    qemu_mutex_lock(&luring_ram.lock);
+    for (i = 0; i < luring_ram.bufs->len; ) {
+        uint8_t *base = g_array_index(luring_ram.bufs, struct iovec,
+                                      i).iov_base;
+
+        if (base >= start && base < start + size) {
+            g_array_remove_index(luring_ram.bufs, i);
+        } else {
+            i++;
+        }
+    }
+    atomic_inc(&luring_ram.generation);
+    qemu_mutex_unlock(&luring_ram.lock);
+}
+
+static int luring_ram_init_block(RAMBlock *rb, void *opaque)
+{
+    void *host = qemu_ram_get_host_addr(rb);
+
+    if (host) {
+        luring_ram_block_added(NULL, host, qemu_ram_get_used_length(rb));
+    }
+    return 0;
+}
+
+/* Start tracking guest RAM.  Called with the BQL held.  */
+static void luring_ram_init(void)
+{
+    if (luring_ram.bufs) {
+        return;
+    }
+    qemu_mutex_init(&luring_ram.lock);
+    luring_ram.bufs = g_array_new(false, false, sizeof(struct iovec));
+    luring_ram.notifier.ram_block_added = luring_ram_block_added;
+    luring_ram.notifier.ram_block_removed = luring_ram_block_removed;
+    ram_block_notifier_add(&luring_ram.notifier);
+    qemu_ram_foreach_block(luring_ram_init_block, NULL);
+}
+
+/*
+ * Bring the ring's registered buffers up to date with guest RAM.  The
+ * kernel pins registered memory, so failures (typically RLIMIT_MEMLOCK)
+ * just fall back to regular readv/writev.
+ */
+static void luring_update_fixed_buffers(LuringState *s)
+{
+    unsigned int generation = atomic_read(&luring_ram.generation);
+    struct iovec *bufs;
+    unsigned int n;
+    int ret;
+
+    if (!s->use_fixed_buffers || s->fixed_generation == generation ||
+        s->io_q.in_flight || s->io_q.in_ring) {
+        return;
+    }
+
+    qemu_mutex_lock(&luring_ram.lock);
+    generation = luring_ram.generation;
+    n = MIN(luring_ram.bufs->len, FIXED_BUF_MAX_COUNT);
+    bufs = g_memdup(luring_ram.bufs->data, n * sizeof(struct iovec));
+    qemu_mutex_unlock(&luring_ram.lock);
+
+    if (s->nr_fixed) {
+        io_uring_unregister_buffers(&s->ring);
+        g_free(s->fixed);
+        s->fixed = NULL;
+        s->nr_fixed = 0;
+    }
+    s->fixed_generation = generation;
+
+    if (n) {
+        ret = io_uring_register_buffers(&s->ring, bufs, n);
+        if (ret < 0) {
+            warn_report("io_uring: cannot register guest RAM as fixed "
+                        "buffers, using regular I/O: %s", strerror(-ret));
+            s->use_fixed_buffers = false;
+            g_free(bufs);
+            return;
+        }
+    }
+    s->fixed = bufs;
+    s->nr_fixed = n;
+}
+
+/* Return the index of the registered buffer holding [base, base + len) */
+static int luring_find_fixed_buffer(LuringState *s, void *base, size_t len)
+{
+    uint8_t *p = base;
+    unsigned int lo = 0, hi = s->nr_fixed;
+
+    while (lo < hi) {
+        unsigned int mid = lo + (hi - lo) / 2;
+
+        if ((uint8_t *)s->fixed[mid].iov_base <= p) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    if (lo == 0) {
+        return -1;
+    }
+    lo--;
+    if (p + len > (uint8_t *)s->fixed[lo].iov_base + s->fixed[lo].iov_len) {
+        return -1;
+    }
+    return lo;
+}
+
+static void luring_prep_sqe(LuringState *s, LuringAIOCB *luringcb,
+                            struct io_uring_sqe *sqe)
+{
+    QEMUIOVector *qiov = luringcb->done ? &luringcb->resubmit_qiov
+                                        : luringcb->qiov;
+    uint64_t offset = luringcb->offset + luringcb->done;
+    int idx = -1;
+
+    if (luringcb->type == QEMU_AIO_FLUSH) {
+        io_uring_prep_fsync(sqe, luringcb->fd, IORING_FSYNC_DATASYNC);
+        io_uring_sqe_set_data(sqe, luringcb);
+        return;
+    }
+
+    if (qiov->niov == 1 && s->nr_fixed) {
+        idx = luring_find_fixed_buffer(s, qiov->iov[0].iov_base,
+                                       qiov->iov[0].iov_len);
+    }
+
+    if (luringcb->type == QEMU_AIO_READ) {
+        if (idx >= 0) {
+            io_uring_prep_read_fixed(sqe, luringcb->fd, qiov->iov[0].iov_base,
+                                     qiov->iov[0].iov_len, offset, idx);
+        } else {
+            io_uring_prep_readv(sqe, luringcb->fd, qiov->iov, qiov->niov,
+                                offset);
+        }
+    } else {
+        if (idx >= 0) {
+            io_uring_prep_write_fixed(sqe, luringcb->fd, qiov->iov[0].iov_base,
+                                      qiov->iov[0].iov_len, offset, idx);
+        } else {
+            io_uring_prep_writev(sqe, luringcb->fd, qiov->iov, qiov->niov,
+                                 offset);
+        }
+    }
+    io_uring_sqe_set_data(sqe, luringcb);
+}
+
+/* Queue the rest of a short read for submission */
+static void luring_resubmit_short_read(LuringState *s, LuringAIOCB *luringcb,
+                                       int nread)
+{
+    QEMUIOVector *resubmit_qiov = &luringcb->resubmit_qiov;
+
+    luringcb->done += nread;
+    if (!resubmit_qiov->iov) {
+        qemu_iovec_init(resubmit_qiov, luringcb->qiov->niov);
+    } else {
+        qemu_iovec_reset(resubmit_qiov);
+    }
+    qemu_iovec_concat(resubmit_qiov, luringcb->qiov, luringcb->done,
+                      luringcb->qiov->size - luringcb->done);
+
+    QSIMPLEQ_INSERT_TAIL(&s->io_q.pending, luringcb, next);
+    s->io_q.in_queue++;
+}
+
+/*
+ * Completes an AIO request.
+ */
+static void luring_process_completion(LuringState *s, LuringAIOCB *luringcb,
+                                      int ret)
+{
+    if (luringcb->type != QEMU_AIO_FLUSH && ret >= 0) {
+        size_t total = luringcb->done + ret;
+
+        if (total == luringcb->qiov->size) {
+            ret = 0;
+        } else if (luringcb->type == QEMU_AIO_READ) {
+            if (ret > 0) {
+                /* Buffered reads can be short before EOF: go on */
+                luring_resubmit_short_read(s, luringcb, ret);
+                return;
+            }
+            /* Short reads mean EOF, pad with zeros. */
+            qemu_iovec_memset(luringcb->qiov, total, 0,
+                              luringcb->qiov->size - total);
+            ret = 0;
+        } else {
+            ret = -ENOSPC;
+        }
+    }
+
+    luringcb->ret = ret;
+    qemu_iovec_destroy(&luringcb->resubmit_qiov);
+
+    /* If the coroutine is already entered it must be in ioq_submit() and
+     * will notice luringcb->ret has been filled in when it eventually runs
+     * later.  Coroutines cannot be entered recursively so avoid doing
+     * that!
+     */
+    if (!qemu_coroutine_entered(luringcb->co)) {
+        aio_co_wake(luringcb->co);
+    }
+}
+
+/**
+ * luring_process_completions:
+ * @s: AIO state
+ *
+ * Fetches completed I/O requests and invokes their callbacks.
+ *
+ * Like qemu_laio_process_completions(), this supports nested event
+ * loops: the completion BH stays scheduled while callbacks run, so that
+ * a nested aio_poll() picks up the remaining completions.
+ */
+static void luring_process_completions(LuringState *s)
+{
+    struct io_uring_cqe *cqe;
+
+    /* Reschedule so nested event loops see currently pending completions */
+    qemu_bh_schedule(s->completion_bh);
+
+    while (io_uring_peek_cqe(&s->ring, &cqe) == 0 && cqe) {
+        LuringAIOCB *luringcb = io_uring_cqe_get_data(cqe);
+        int ret = cqe->res;
+
+        io_uring_cqe_seen(&s->ring, cqe);
+
+        /* Change counters one-by-one because we can be nested. */
+        s->io_q.in_flight--;
+        luring_process_completion(s, luringcb, ret);
+    }
+
+    /*
+     * Resubmitted short reads must not wait for an unrelated completion;
+     * leave the BH scheduled to submit them if nothing else is in flight.
+     */
+    if (s->io_q.in_flight || s->io_q.plugged ||
+        (QSIMPLEQ_EMPTY(&s->io_q.pending) && !s->io_q.in_ring)) {
+        qemu_bh_cancel(s->completion_bh);
+    }
+}
+
+static void luring_process_completions_and_submit(LuringState *s)
+{
+    aio_context_acquire(s->aio_context);
+    luring_process_completions(s);
+
+    if (!s->io_q.plugged &&
+        (s->io_q.in_ring || !QSIMPLEQ_EMPTY(&s->io_q.pending))) {
+        ioq_submit(s);
+    }
+    aio_context_release(s->aio_context);
+}
+
+static void luring_completion_bh(void *opaque)
+{
+    LuringState *s = opaque;
+
+    luring_process_completions_and_submit(s);
+}
+
+static void luring_completion_cb(EventNotifier *e)
+{
+    LuringState *s = container_of(e, LuringState, e);
+
+    if (event_notifier_test_and_clear(&s->e)) {
+        luring_process_completions_and_submit(s);
+    }
+}
+
+static bool luring_poll_cb(void *opaque)
+{
+    EventNotifier *e = opaque;
+    LuringState *s = container_of(e, LuringState, e);
+    struct io_uring_cqe *cqe;
+
+    if (io_uring_peek_cqe(&s->ring, &cqe) != 0 || !cqe) {
+        return false;
+    }
+
+    luring_process_completions_and_submit(s);
+    return true;
+}
+
+static void ioq_init(LuringQueue *io_q)
+{
+    QSIMPLEQ_INIT(&io_q->pending);
+    io_q->plugged = 0;
+    io_q->in_queue = 0;
+    io_q->in_ring = 0;
+    io_q->in_flight = 0;
+    io_q->blocked = false;
+}
+
+static void ioq_submit(LuringState *s)
+{
+    LuringAIOCB *luringcb;
+    int ret;
+
+    luring_update_fixed_buffers(s);
+
+    do {
+        /* Move as many queued requests as fit into the submission ring */
+        while (s->io_q.in_flight + s->io_q.in_ring < MAX_ENTRIES &&
+               (luringcb = QSIMPLEQ_FIRST(&s->io_q.pending))) {
+            struct io_uring_sqe *sqe = io_uring_get_sqe(&s->ring);
+
+            if (!sqe) {
+                break;
+            }
+            luring_prep_sqe(s, luringcb, sqe);
+            QSIMPLEQ_REMOVE_HEAD(&s->io_q.pending, next);
+            s->io_q.in_queue--;
+            s->io_q.in_ring++;
+        }
+        if (!s->io_q.in_ring) {
+            break;
+        }
+
+        ret = io_uring_submit(&s->ring);
+        if (ret == -EINTR) {
+            continue;
+        }
+        if (ret == 0 || ret == -EAGAIN || ret == -EBUSY) {
+            /*
+             * The kernel is short of resources or has too many completions
+             * pending.  The sqes stay in the ring and go out with the next
+             * submission.
+             */
+            break;
+        }
+        if (ret < 0) {
+            /*
+             * The sqes in the ring cannot be taken back and are retried,
+             * but fail the requests that did not make it there yet.
+             */
+            while ((luringcb = QSIMPLEQ_FIRST(&s->io_q.pending))) {
+                QSIMPLEQ_REMOVE_HEAD(&s->io_q.pending, next);
+                s->io_q.in_queue--;
+                luring_process_completion(s, luringcb, ret);
+            }
+            break;
+        }
+        s->io_q.in_flight += ret;
+        s->io_q.in_ring -= ret;
+    } while (!s->io_q.in_ring && !QSIMPLEQ_EMPTY(&s->io_q.pending) &&
+             s->io_q.in_flight < MAX_ENTRIES);
+
+    /* Only completions submit again, so never block with nothing in flight */
+    s->io_q.blocked = s->io_q.in_flight > 0 &&
+                      (s->io_q.in_ring > 0 || s->io_q.in_queue > 0);
+
+    if (s->io_q.in_flight) {
+        /* We can try to complete something just right away if there are
+         * still requests in-flight. */
+        luring_process_completions(s);
+    } else if (s->io_q.in_ring || s->io_q.in_queue) {
+        /* Nothing will complete, so retry from the completion BH */
+        qemu_bh_schedule(s->completion_bh);
+    }
+}
+
+void luring_io_plug(BlockDriverState *bs, LuringState *s)
+{
+    s->io_q.plugged++;
+}
+
+void luring_io_unplug(BlockDriverState *bs, LuringState *s)
+{
+    assert(s->io_q.plugged);
+    if (--s->io_q.plugged == 0 && !s->io_q.blocked &&
+        (s->io_q.in_ring || !QSIMPLEQ_EMPTY(&s->io_q.pending))) {
+        ioq_submit(s);
+    }
+}
+
+int coroutine_fn luring_co_submit(BlockDriverState *bs, LuringState *s, int fd,
+                                  uint64_t offset, QEMUIOVector *qiov,
+                                  int type)
+{
+    LuringAIOCB luringcb = {
+        .co         = qemu_coroutine_self(),
+        .fd         = fd,
+        .type       = type,
+        .offset     = offset,
+        .qiov       = qiov,
+        .ret        = -EINPROGRESS,
+    };
+
+    switch (type) {
+    case QEMU_AIO_READ:
+    case QEMU_AIO_WRITE:
+        assert(qiov);
+        break;
+    case QEMU_AIO_FLUSH:
+        break;
+    default:
+        fprintf(stderr, "%s: invalid AIO request type 0x%x.\n",
+                        __func__, type);
+        return -EIO;
+    }
+
+    QSIMPLEQ_INSERT_TAIL(&s->io_q.pending, &luringcb, next);
+    s->io_q.in_queue++;
+    if (!s->io_q.blocked &&
+        (!s->io_q.plugged ||
+         s->io_q.in_flight + s->io_q.in_queue >= MAX_ENTRIES)) {
+        ioq_submit(s);
+    }
+
+    if (luringcb.ret == -EINPROGRESS) {
+        qemu_coroutine_yield();
+    }
+    return luringcb.ret;
+}
+
+void luring_enable_fixed_buffers(LuringState *s)
+{
+    if (!s->use_fixed_buffers) {
+        luring_ram_init();
+        s->use_fixed_buffers = true;
+        s->fixed_generation = atomic_read(&luring_ram.generation) - 1;
+    }
+}
+
+void luring_detach_aio_context(LuringState *s, AioContext *old_context)
+{
+    aio_set_event_notifier(old_context, &s->e, false, NULL, NULL);
+    qemu_bh_delete(s->completion_bh);
+    s->aio_context = NULL;
+}
+
+void luring_attach_aio_context(LuringState *s, AioContext *new_context)
+{
+    s->aio_context = new_context;
+    s->completion_bh = aio_bh_new(new_context, luring_completion_bh, s);
+    aio_set_event_notifier(new_context, &s->e, false,
+                           luring_completion_cb,
+                           luring_poll_cb);
+}
+
+/* Set up an SQPOLL ring, or return a negative errno if unavailable */
+static int luring_init_sqpoll(struct io_uring *ring)
+{
+#ifdef IORING_FEAT_SQPOLL_NONFIXED
+    struct io_uring_params p = {
+        .flags = IORING_SETUP_SQPOLL,
+        .sq_thread_idle = SQPOLL_IDLE_MS,
+    };
+    int rc;
+
+    rc = io_uring_queue_init_params(MAX_ENTRIES, ring, &p);
+    if (rc < 0) {
+        return rc;
+    }
+    /* Before Linux 5.11 the poll thread only serves registered files */
+    if (!(p.features & IORING_FEAT_SQPOLL_NONFIXED)) {
+        io_uring_queue_exit(ring);
+        return -EOPNOTSUPP;
+    }
+    return 0;
+#else
+    return -ENOSYS;
+#endif
+}
+
+LuringState *luring_init(bool sqpoll, Error **errp)
+{
+    int rc;
+    LuringState *s;
+
+    s = g_malloc0(sizeof(*s));
+    rc = event_notifier_init(&s->e, false);
+    if (rc < 0) {
+        error_setg_errno(errp, -rc, "failed to to initialize event notifier");
+        goto out_free_state;
+    }
+
+    rc = -1;
+    if (sqpoll) {
+        rc = luring_init_sqpoll(&s->ring);
+        if (rc < 0) {
+            warn_report("io_uring: kernel submission polling is not "
+                        "available, using a regular ring: %s",
+                        strerror(-rc));
+        }
+    }
+    if (rc < 0) {
+        rc = io_uring_queue_init(MAX_ENTRIES, &s->ring, 0);
+        if (rc < 0) {
+            error_setg_errno(errp, -rc, "failed to create linux io_uring "
+                             "ring");
+            goto out_close_efd;
+        }
+    }
+
+    rc = io_uring_register_eventfd(&s->ring, event_notifier_get_fd(&s->e));
+    if (rc < 0) {
+        error_setg_errno(errp, -rc, "failed to register io_uring eventfd");
+        goto out_queue_exit;
+    }
+
+    ioq_init(&s->io_q);
+
+    return s;
+
+out_queue_exit:
+    io_uring_queue_exit(&s->ring);
+out_close_efd:
+    event_notifier_cleanup(&s->e);
+out_free_state:
+    g_free(s);
+    return NULL;
+}
+
+void luring_cleanup(LuringState *s)
+{
+    event_notifier_cleanup(&s->e);
+    /* This also drops the registered buffers */
+    io_uring_queue_exit(&s->ring);
+    g_free(s->fixed);
+    g_free(s);
+}
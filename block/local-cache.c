@@ -0,0 +1,950 @@
+/*
+ * Persistent local cache filter block driver
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 or
+ * (at your option) version 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * The "file" child is the (slow, usually remote) node that holds the data,
+ * the "cache" child is a local image that keeps copies of recently read
+ * clusters across restarts.
+ *
+ * Layout of the cache image:
+ *
+ *   0             LocalCacheHeader
+ *   table_offset  one little endian uint64_t per slot: 0 if the slot is
+ *                 empty, otherwise the index of the cached cluster plus one
+ *   data_offset   nb_slots clusters of cached data
+ *
+ * The table never points at data that is not on disk:
+ *  - a slot is filled by clearing its table entry, flushing, writing the
+ *    data, flushing and only then writing the new table entry;
+ *  - before a guest write reaches the file child, the table entries of the
+ *    clusters it touches are cleared and flushed;
+ *  - a cluster stays in the in-memory map until its cleared entry is
+ *    durable, so that a failed table update is retried by the next
+ *    invalidation instead of leaving a stale entry behind.
+ * After a crash, the cache may lack some entries but never returns stale
+ * data.  The cache is dropped if the file child changes size or the
+ * geometry options change; it must not be shared between different images.
+ *
+ * Reads that hit only cached clusters are served from the cache image.
+ * On a miss the data is read from the file child and the clusters are
+ * copied into the cache in the background.  Slots are reused in CLOCK
+ * order.
+ */
+
+#include "qemu/osdep.h"
+#include "block/block_int.h"
+#include "qapi/error.h"
+#include "qapi/qmp/qdict.h"
+#include "qapi/qapi-visit-block-core.h"
+#include "qemu/bswap.h"
+#include "qemu/cutils.h"
+#include "qemu/option.h"
+
+#define LOCAL_CACHE_MAGIC   0x45484341434c4551ULL /* "QELCACHE" */
+#define LOCAL_CACHE_VERSION 1
+
+#define LOCAL_CACHE_OPT_SIZE          "size"
+#define LOCAL_CACHE_OPT_CLUSTER_SIZE  "cluster-size"
+
+#define LOCAL_CACHE_DEFAULT_SIZE          (1 * GiB)
+#define LOCAL_CACHE_DEFAULT_CLUSTER_SIZE  (64 * KiB)
+#define LOCAL_CACHE_MIN_CLUSTER_SIZE      (4 * KiB)
+#define LOCAL_CACHE_MAX_CLUSTER_SIZE      (2 * MiB)
+#define LOCAL_CACHE_TABLE_OFFSET          (4 * KiB)
+
+/* Limit on the background copies of missed data, and so on their memory */
+#define LOCAL_CACHE_MAX_POPULATE 8
+
+typedef struct QEMU_PACKED LocalCacheHeader {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t cluster_size;
+    uint64_t nb_slots;
+    uint64_t file_length;
+    uint64_t table_offset;
+    uint64_t data_offset;
+} LocalCacheHeader;
+
+typedef struct LocalCacheSlot {
+    int64_t index;      /* cached cluster, or -1; hash table key */
+    bool referenced;    /* for CLOCK eviction */
+    int pinned;         /* in use by requests, must not be reused */
+} LocalCacheSlot;
+
+typedef struct BDRVLocalCacheState {
+    BdrvChild *cache;
+
+    int64_t cluster_size;
+    int64_t nb_slots;
+    int64_t table_offset;
+    int64_t data_offset;
+
+    CoMutex lock;       /* protects everything below and the table on disk */
+    LocalCacheSlot *slots;
+    GHashTable *map;    /* cluster index -> LocalCacheSlot */
+    int64_t clock_hand;
+    int64_t nb_used;
+
+    /* See mem-cache.c: a miss only populates the cache if no write to the
+     * file child overlapped the time its data was read */
+    int writes_in_flight;
+    uint64_t write_seq;
+    int populating;
+
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    uint64_t invalidations;
+} BDRVLocalCacheState;
+
+typedef struct LocalCachePopulate {
+    BlockDriverState *bs;
+    int64_t start;
+    int64_t bytes;
+    uint8_t *buf;
+    uint64_t write_seq;
+} LocalCachePopulate;
+
+static QemuOptsList local_cache_opts = {
+    .name = "local-cache",
+    .head = QTAILQ_HEAD_INITIALIZER(local_cache_opts.head),
+    .desc = {
+        {
+            .name = LOCAL_CACHE_OPT_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "Amount of data kept in the cache image",
+        },
+        {
+            .name = LOCAL_CACHE_OPT_CLUSTER_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "Size of a cache entry",
+        },
+        { /* end of list */ }
+    },
+};
+
+static int64_t local_cache_slot_offset(BDRVLocalCacheState *s, int64_t slot)
+{
+    return s->data_offset + slot * s->cluster_size;
+}
+
+static int64_t local_cache_slot_number(BDRVLocalCacheState *s,
+                                       LocalCacheSlot *slot)
+{
+    return slot - s->slots;
+}
+
+/* Write the header and an empty table, dropping all cached data */
+static int local_cache_format(BlockDriverState *bs, int64_t file_length,
+                              Error **errp)
+{
+    BDRVLocalCacheState *s = bs->opaque;
+    LocalCacheHeader header = {
+        .magic          = cpu_to_le64(LOCAL_CACHE_MAGIC),
+        .version        = cpu_to_le32(LOCAL_CACHE_VERSION),
+        .cluster_size   = cpu_to_le32(s->cluster_size),
+        .nb_slots       = cpu_to_le64(s->nb_slots),
+        .file_length    = cpu_to_le64(file_length),
+        .table_offset   = cpu_to_le64(s->table_offset),
+        .data_offset    = cpu_to_le64(s->data_offset),
+    };
+    int ret;
+
+    /* Invalidate the old header first so that a crash in the middle leaves
+     * a cache that is formatted again on the next start */
+    ret = bdrv_pwrite_zeroes(s->cache, 0, sizeof(header), 0);
+    if (ret < 0) {
+        goto fail;
+    }
+    ret = bdrv_flush(s->cache->bs);
+    if (ret < 0) {
+        goto fail;
+    }
+
+    ret = bdrv_truncate(s->cache, local_cache_slot_offset(s, s->nb_slots),
+                        PREALLOC_MODE_OFF, errp);
+    if (ret < 0) {
+        return ret;
+    }
+    ret = bdrv_pwrite_zeroes(s->cache, s->table_offset,
+                             s->nb_slots * sizeof(uint64_t), 0);
+    if (ret < 0) {
+        goto fail;
+    }
+    ret = bdrv_flush(s->cache->bs);
+    if (ret < 0) {
+        goto fail;
+    }
+
+    ret = bdrv_pwrite(s->cache, 0, &header, sizeof(header));
+    if (ret < 0) {
+        goto fail;
+    }
+    ret = bdrv_flush(s->cache->bs);
+    if (ret < 0) {
+        goto fail;
+    }
+
+    return 0;
+
+fail:
+    error_setg_errno(errp, -ret, "Could not format the cache image");
+    return ret;
+}
+
+/*
+ * Load the table of a cache image that matches the current geometry.
+ * Returns 1 if the table was loaded, 0 if the image must be formatted, or
+ * a negative errno.
+ */
+static int local_cache_load(BlockDriverState *bs, int64_t file_length,
+                            Error **errp)
+{
+    BDRVLocalCacheState *s = bs->opaque;
+    LocalCacheHeader header;
+    uint64_t *table;
+    int64_t i, nb_clusters;
+    int ret;
+
+    if (bdrv_getlength(s->cache->bs) < local_cache_slot_offset(s, 0)) {
+        return 0;
+    }
+
+    ret = bdrv_pread(s->cache, 0, &header, sizeof(header));
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not read the cache header");
+        return ret;
+    }
+
+    if (le64_to_cpu(header.magic) != LOCAL_CACHE_MAGIC ||
+        le32_to_cpu(header.version) != LOCAL_CACHE_VERSION ||
+        le32_to_cpu(header.cluster_size) != s->cluster_size ||
+        le64_to_cpu(header.nb_slots) != s->nb_slots ||
+        le64_to_cpu(header.file_length) != file_length ||
+        le64_to_cpu(header.table_offset) != s->table_offset ||
+        le64_to_cpu(header.data_offset) != s->data_offset)
+    {
+        return 0;
+    }
+
+    table = g_try_new(uint64_t, s->nb_slots);
+    if (!table) {
+        error_setg(errp, "Could not allocate the cache table");
+        return -ENOMEM;
+    }
+
+    ret = bdrv_pread(s->cache, s->table_offset, table,
+                     s->nb_slots * sizeof(uint64_t));
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not read the cache table");
+        g_free(table);
+        return ret;
+    }
+
+    nb_clusters = DIV_ROUND_UP(file_length, s->cluster_size);
+    for (i = 0; i < s->nb_slots; i++) {
+        uint64_t entry = le64_to_cpu(table[i]);
+        LocalCacheSlot *slot = &s->slots[i];
+
+        /* Ignore anything that does not make sense, it is only a cache */
+        if (entry == 0 || entry > nb_clusters) {
+            continue;
+        }
+        slot->index = entry - 1;
+        if (g_hash_table_contains(s->map, &slot->index)) {
+            slot->index = -1;
+            continue;
+        }
+        g_hash_table_insert(s->map, &slot->index, slot);
+        s->nb_used++;
+    }
+
+    g_free(table);
+    return 1;
+}
+
+#define PERM_CACHE (BLK_PERM_CONSISTENT_READ | BLK_PERM_WRITE | \
+                    BLK_PERM_RESIZE)
+
+static void local_cache_child_perm(BlockDriverState *bs, BdrvChild *c,
+                                   const BdrvChildRole *role,
+                                   BlockReopenQueue *ro_q,
+                                   uint64_t perm, uint64_t shrd,
+                                   uint64_t *nperm, uint64_t *nshrd)
+{
+    if (c && !strcmp(c->name, "cache")) {
+        /* The cache image is private to this node and always written */
+        *nperm = PERM_CACHE;
+        *nshrd = BLK_PERM_WRITE_UNCHANGED;
+        return;
+    }
+
+    bdrv_filter_default_perms(bs, c, role, ro_q, perm, shrd, nperm, nshrd);
+}
+
+static int local_cache_open(BlockDriverState *bs, QDict *options, int flags,
+                            Error **errp)
+{
+    BDRVLocalCacheState *s = bs->opaque;
+    QemuOpts *opts;
+    Error *local_err = NULL;
+    uint64_t size;
+    int64_t file_length, i;
+    int ret;
+
+    opts = qemu_opts_create(&local_cache_opts, NULL, 0, &error_abort);
+    qemu_opts_absorb_qdict(opts, options, &local_err);
+    if (local_err) {
+        ret = -EINVAL;
+        error_propagate(errp, local_err);
+        goto fail;
+    }
+
+    size = qemu_opt_get_size(opts, LOCAL_CACHE_OPT_SIZE,
+                             LOCAL_CACHE_DEFAULT_SIZE);
+    s->cluster_size = qemu_opt_get_size(opts, LOCAL_CACHE_OPT_CLUSTER_SIZE,
+                                        LOCAL_CACHE_DEFAULT_CLUSTER_SIZE);
+    if (s->cluster_size < LOCAL_CACHE_MIN_CLUSTER_SIZE ||
+        s->cluster_size > LOCAL_CACHE_MAX_CLUSTER_SIZE ||
+        !is_power_of_2(s->cluster_size))
+    {
+        ret = -EINVAL;
+        error_setg(errp, "Cluster size must be a power of two between 4k "
+                   "and 2M");
+        goto fail;
+    }
+    if (size < s->cluster_size) {
+        ret = -EINVAL;
+        error_setg(errp, "Cache size must be at least one cluster");
+        goto fail;
+    }
+    s->nb_slots = size / s->cluster_size;
+    s->table_offset = LOCAL_CACHE_TABLE_OFFSET;
+    s->data_offset = QEMU_ALIGN_UP(s->table_offset +
+                                   s->nb_slots * sizeof(uint64_t),
+                                   s->cluster_size);
+
+    /* Open the data source */
+    bs->file = bdrv_open_child(NULL, options, "file", bs, &child_file, false,
+                               &local_err);
+    if (local_err) {
+        ret = -EINVAL;
+        error_propagate(errp, local_err);
+        goto fail;
+    }
+
+    /* The cache image is written even if this node is read-only */
+    if (!qdict_haskey(options, "cache")) {
+        qdict_set_default_str(options, "cache." BDRV_OPT_READ_ONLY, "off");
+    }
+    s->cache = bdrv_open_child(NULL, options, "cache", bs, &child_file, false,
+                               &local_err);
+    if (local_err) {
+        ret = -EINVAL;
+        error_propagate(errp, local_err);
+        goto fail;
+    }
+
+    file_length = bdrv_getlength(bs->file->bs);
+    if (file_length < 0) {
+        ret = file_length;
+        error_setg_errno(errp, -ret, "Could not get the image length");
+        goto fail_cache;
+    }
+
+    qemu_co_mutex_init(&s->lock);
+    s->slots = g_try_new0(LocalCacheSlot, s->nb_slots);
+    if (!s->slots) {
+        ret = -ENOMEM;
+        error_setg(errp, "Could not allocate the cache table");
+        goto fail_cache;
+    }
+    for (i = 0; i < s->nb_slots; i++) {
+        s->slots[i].index = -1;
+    }
+    s->map = g_hash_table_new(g_int64_hash, g_int64_equal);
+
+    ret = local_cache_load(bs, file_length, errp);
+    if (ret == 0) {
+        ret = local_cache_format(bs, file_length, errp);
+    }
+    if (ret < 0) {
+        g_hash_table_destroy(s->map);
+        g_free(s->slots);
+        goto fail_cache;
+    }
+
+    bs->supported_write_flags = BDRV_REQ_WRITE_UNCHANGED |
+        (BDRV_REQ_FUA & bs->file->bs->supported_write_flags);
+    bs->supported_zero_flags = BDRV_REQ_WRITE_UNCHANGED |
+        ((BDRV_REQ_FUA | BDRV_REQ_MAY_UNMAP | BDRV_REQ_NO_FALLBACK) &
+            bs->file->bs->supported_zero_flags);
+
+    ret = 0;
+fail_cache:
+    if (ret < 0) {
+        bdrv_unref_child(bs, s->cache);
+        s->cache = NULL;
+    }
+fail:
+    if (ret < 0) {
+        bdrv_unref_child(bs, bs->file);
+        bs->file = NULL;
+    }
+    qemu_opts_del(opts);
+    return ret;
+}
+
+static void local_cache_close(BlockDriverState *bs)
+{
+    BDRVLocalCacheState *s = bs->opaque;
+
+    assert(s->populating == 0);
+
+    g_hash_table_destroy(s->map);
+    g_free(s->slots);
+
+    bdrv_unref_child(bs, s->cache);
+    s->cache = NULL;
+}
+
+static int64_t local_cache_getlength(BlockDriverState *bs)
+{
+    return bdrv_getlength(bs->file->bs);
+}
+
+static LocalCacheSlot *local_cache_lookup(BDRVLocalCacheState *s,
+                                          int64_t cluster)
+{
+    int64_t index = cluster / s->cluster_size;
+
+    return g_hash_table_lookup(s->map, &index);
+}
+
+static int coroutine_fn local_cache_write_entry(BDRVLocalCacheState *s,
+                                                LocalCacheSlot *slot,
+                                                int64_t index)
+{
+    uint64_t entry = cpu_to_le64(index < 0 ? 0 : index + 1);
+
+    return bdrv_co_pwrite(s->cache, s->table_offset +
+                          local_cache_slot_number(s, slot) * sizeof(entry),
+                          sizeof(entry), &entry, 0);
+}
+
+/* Remove a slot from the map; its table entry must already be cleared on
+ * disk and flushed */
+static void local_cache_drop_slot(BDRVLocalCacheState *s,
+                                  LocalCacheSlot *slot)
+{
+    g_hash_table_remove(s->map, &slot->index);
+    slot->index = -1;
+    s->nb_used--;
+}
+
+/*
+ * Drop the clusters overlapping [@offset, @offset + @bytes) from the cache
+ * and make that durable, before the file child is changed.  Called with
+ * s->lock held.
+ */
+static int coroutine_fn local_cache_invalidate(BlockDriverState *bs,
+                                               int64_t offset, int64_t bytes)
+{
+    BDRVLocalCacheState *s = bs->opaque;
+    int64_t cluster;
+    bool changed = false;
+    int ret;
+
+    for (cluster = QEMU_ALIGN_DOWN(offset, s->cluster_size);
+         cluster < offset + bytes; cluster += s->cluster_size)
+    {
+        LocalCacheSlot *slot = local_cache_lookup(s, cluster);
+        if (!slot) {
+            continue;
+        }
+
+        ret = local_cache_write_entry(s, slot, -1);
+        if (ret < 0) {
+            return ret;
+        }
+        changed = true;
+    }
+
+    if (!changed) {
+        return 0;
+    }
+    ret = bdrv_co_flush(s->cache->bs);
+    if (ret < 0) {
+        return ret;
+    }
+
+    for (cluster = QEMU_ALIGN_DOWN(offset, s->cluster_size);
+         cluster < offset + bytes; cluster += s->cluster_size)
+    {
+        LocalCacheSlot *slot = local_cache_lookup(s, cluster);
+        if (slot) {
+            local_cache_drop_slot(s, slot);
+            s->invalidations++;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Find a slot for a new cluster with the CLOCK algorithm and pin it.  The
+ * slot may still hold an old cluster, which the caller must drop once the
+ * cleared table entry is durable.  Returns NULL if all slots are pinned.
+ * Called with s->lock held.
+ */
+static LocalCacheSlot *local_cache_alloc_slot(BDRVLocalCacheState *s)
+{
+    int64_t i;
+
+    for (i = 0; i < 2 * s->nb_slots; i++) {
+        LocalCacheSlot *slot = &s->slots[s->clock_hand];
+
+        s->clock_hand = (s->clock_hand + 1) % s->nb_slots;
+        if (slot->pinned) {
+            continue;
+        }
+        if (slot->index >= 0 && slot->referenced) {
+            slot->referenced = false;
+            continue;
+        }
+
+        slot->pinned++;
+        return slot;
+    }
+
+    return NULL;
+}
+
+static void coroutine_fn local_cache_populate_entry(void *opaque)
+{
+    LocalCachePopulate *p = opaque;
+    BlockDriverState *bs = p->bs;
+    BDRVLocalCacheState *s = bs->opaque;
+    int64_t nb_clusters = p->bytes / s->cluster_size;
+    LocalCacheSlot **slots = g_new0(LocalCacheSlot *, nb_clusters);
+    int64_t i;
+    int ret = 0;
+
+    qemu_co_mutex_lock(&s->lock);
+    if (s->writes_in_flight || s->write_seq != p->write_seq) {
+        goto out;
+    }
+
+    /* Take slots for the clusters that are not cached yet, and make sure
+     * that their old contents are gone from the table */
+    for (i = 0; i < nb_clusters; i++) {
+        if (local_cache_lookup(s, p->start + i * s->cluster_size)) {
+            continue;
+        }
+        slots[i] = local_cache_alloc_slot(s);
+        if (!slots[i]) {
+            break;
+        }
+        ret = local_cache_write_entry(s, slots[i], -1);
+        if (ret < 0) {
+            goto out;
+        }
+    }
+    ret = bdrv_co_flush(s->cache->bs);
+    if (ret < 0) {
+        goto out;
+    }
+
+    /* Until now, the evicted clusters were still valid in their slots */
+    for (i = 0; i < nb_clusters; i++) {
+        if (slots[i] && slots[i]->index >= 0) {
+            local_cache_drop_slot(s, slots[i]);
+            s->evictions++;
+        }
+    }
+    qemu_co_mutex_unlock(&s->lock);
+
+    /* The slots are pinned and not in the map, so nobody else touches them */
+    for (i = 0; i < nb_clusters; i++) {
+        if (slots[i]) {
+            int64_t slot = local_cache_slot_number(s, slots[i]);
+
+            ret = bdrv_co_pwrite(s->cache, local_cache_slot_offset(s, slot),
+                                 s->cluster_size,
+                                 p->buf + i * s->cluster_size, 0);
+            if (ret < 0) {
+                break;
+            }
+        }
+    }
+    if (ret >= 0) {
+        ret = bdrv_co_flush(s->cache->bs);
+    }
+
+    qemu_co_mutex_lock(&s->lock);
+    if (ret < 0 || s->writes_in_flight || s->write_seq != p->write_seq) {
+        goto out;
+    }
+
+    for (i = 0; i < nb_clusters; i++) {
+        LocalCacheSlot *slot = slots[i];
+        int64_t index = p->start / s->cluster_size + i;
+
+        if (!slot || g_hash_table_contains(s->map, &index)) {
+            continue;
+        }
+        /* The data is durable, so map the cluster even if the entry could
+         * not be written: the entry may have reached the disk, and only
+         * mapped clusters are cleared by local_cache_invalidate() */
+        local_cache_write_entry(s, slot, index);
+        slot->index = index;
+        slot->referenced = true;
+        g_hash_table_insert(s->map, &slot->index, slot);
+        s->nb_used++;
+    }
+
+out:
+    for (i = 0; i < nb_clusters; i++) {
+        if (slots[i]) {
+            slots[i]->pinned--;
+        }
+    }
+    s->populating--;
+    qemu_co_mutex_unlock(&s->lock);
+
+    g_free(slots);
+    qemu_vfree(p->buf);
+    g_free(p);
+    bdrv_dec_in_flight(bs);
+}
+
+/* Copy the clusters of @buf into the cache in the background.  Takes
+ * ownership of @buf.  Called with s->lock held. */
+static void local_cache_populate(BlockDriverState *bs, int64_t start,
+                                 int64_t bytes, uint8_t *buf,
+                                 uint64_t write_seq)
+{
+    BDRVLocalCacheState *s = bs->opaque;
+    LocalCachePopulate *p = g_new(LocalCachePopulate, 1);
+    Coroutine *co;
+
+    *p = (LocalCachePopulate) {
+        .bs         = bs,
+        .start      = start,
+        .bytes      = bytes,
+        .buf        = buf,
+        .write_seq  = write_seq,
+    };
+
+    s->populating++;
+    bdrv_inc_in_flight(bs);
+    co = qemu_coroutine_create(local_cache_populate_entry, p);
+    aio_co_enter(bdrv_get_aio_context(bs), co);
+}
+
+/* Read the cached clusters of a request.  Returns -EAGAIN if not all of
+ * them are cached. */
+static int coroutine_fn local_cache_read_cached(BlockDriverState *bs,
+                                                uint64_t offset,
+                                                uint64_t bytes,
+                                                QEMUIOVector *qiov)
+{
+    BDRVLocalCacheState *s = bs->opaque;
+    int64_t start = QEMU_ALIGN_DOWN(offset, s->cluster_size);
+    int64_t end = QEMU_ALIGN_UP(offset + bytes, s->cluster_size);
+    int64_t nb_clusters = (end - start) / s->cluster_size;
+    LocalCacheSlot **slots;
+    QEMUIOVector local_qiov;
+    int64_t i;
+    int ret = 0;
+
+    slots = g_new(LocalCacheSlot *, nb_clusters);
+
+    qemu_co_mutex_lock(&s->lock);
+    for (i = 0; i < nb_clusters; i++) {
+        slots[i] = local_cache_lookup(s, start + i * s->cluster_size);
+        if (!slots[i]) {
+            s->misses++;
+            qemu_co_mutex_unlock(&s->lock);
+            g_free(slots);
+            return -EAGAIN;
+        }
+    }
+    for (i = 0; i < nb_clusters; i++) {
+        slots[i]->pinned++;
+        slots[i]->referenced = true;
+    }
+    qemu_co_mutex_unlock(&s->lock);
+
+    qemu_iovec_init(&local_qiov, qiov->niov);
+    for (i = 0; i < nb_clusters && ret >= 0; i++) {
+        int64_t cluster = start + i * s->cluster_size;
+        int64_t c_start = MAX(offset, cluster);
+        int64_t c_end = MIN(offset + bytes, cluster + s->cluster_size);
+        int64_t slot = local_cache_slot_number(s, slots[i]);
+
+        qemu_iovec_reset(&local_qiov);
+        qemu_iovec_concat(&local_qiov, qiov, c_start - offset,
+                          c_end - c_start);
+        ret = bdrv_co_preadv(s->cache, local_cache_slot_offset(s, slot) +
+                             (c_start - cluster),
+                             c_end - c_start, &local_qiov, 0);
+    }
+    qemu_iovec_destroy(&local_qiov);
+
+    qemu_co_mutex_lock(&s->lock);
+    for (i = 0; i < nb_clusters; i++) {
+        slots[i]->pinned--;
+    }
+    if (ret >= 0) {
+        s->hits++;
+    } else {
+        s->misses++;
+    }
+    qemu_co_mutex_unlock(&s->lock);
+
+    g_free(slots);
+
+    /* Errors of the cache image are not the guest's problem */
+    return ret < 0 ? -EAGAIN : 0;
+}
+
+static int coroutine_fn local_cache_co_preadv(BlockDriverState *bs,
+                                              uint64_t offset, uint64_t bytes,
+                                              QEMUIOVector *qiov, int flags)
+{
+    BDRVLocalCacheState *s = bs->opaque;
+    int64_t start, end, length;
+    uint64_t write_seq;
+    bool populate;
+    uint8_t *buf;
+    int ret;
+
+    length = bdrv_getlength(bs->file->bs);
+    if (length < 0) {
+        return length;
+    }
+
+    /* Only whole clusters are cached, so the tail of an image that is not
+     * cluster aligned always comes from the file child */
+    start = QEMU_ALIGN_DOWN(offset, s->cluster_size);
+    end = QEMU_ALIGN_UP(offset + bytes, s->cluster_size);
+    if (end > QEMU_ALIGN_DOWN(length, s->cluster_size)) {
+        return bdrv_co_preadv(bs->file, offset, bytes, qiov, flags);
+    }
+
+    ret = local_cache_read_cached(bs, offset, bytes, qiov);
+    if (ret != -EAGAIN) {
+        return ret;
+    }
+
+    qemu_co_mutex_lock(&s->lock);
+    populate = s->populating < LOCAL_CACHE_MAX_POPULATE &&
+               !s->writes_in_flight;
+    write_seq = s->write_seq;
+    qemu_co_mutex_unlock(&s->lock);
+
+    if (!populate) {
+        return bdrv_co_preadv(bs->file, offset, bytes, qiov, flags);
+    }
+
+    buf = qemu_try_blockalign(bs->file->bs, end - start);
+    if (!buf) {
+        return bdrv_co_preadv(bs->file, offset, bytes, qiov, flags);
+    }
+
+    ret = bdrv_co_pread(bs->file, start, end - start, buf, flags);
+    if (ret < 0) {
+        qemu_vfree(buf);
+        return ret;
+    }
+    qemu_iovec_from_buf(qiov, 0, buf + (offset - start), bytes);
+
+    qemu_co_mutex_lock(&s->lock);
+    if (s->populating < LOCAL_CACHE_MAX_POPULATE) {
+        local_cache_populate(bs, start, end - start, buf, write_seq);
+        buf = NULL;
+    }
+    qemu_co_mutex_unlock(&s->lock);
+
+    qemu_vfree(buf);
+    return 0;
+}
+
+static void local_cache_write_begin(BDRVLocalCacheState *s)
+{
+    s->writes_in_flight++;
+    s->write_seq++;
+}
+
+static void local_cache_write_end(BDRVLocalCacheState *s)
+{
+    assert(s->writes_in_flight > 0);
+    s->writes_in_flight--;
+    s->write_seq++;
+}
+
+/*
+ * Prepare a change of [@offset, @offset + @bytes) in the file child.  If
+ * the cache can not be invalidated, the change must not happen.
+ */
+static int coroutine_fn local_cache_write_prepare(BlockDriverState *bs,
+                                                  int64_t offset,
+                                                  int64_t bytes)
+{
+    BDRVLocalCacheState *s = bs->opaque;
+    int ret;
+
+    qemu_co_mutex_lock(&s->lock);
+    ret = local_cache_invalidate(bs, offset, bytes);
+    if (ret >= 0) {
+        local_cache_write_begin(s);
+    }
+    qemu_co_mutex_unlock(&s->lock);
+
+    return ret;
+}
+
+static void coroutine_fn local_cache_write_finish(BlockDriverState *bs)
+{
+    BDRVLocalCacheState *s = bs->opaque;
+
+    qemu_co_mutex_lock(&s->lock);
+    local_cache_write_end(s);
+    qemu_co_mutex_unlock(&s->lock);
+}
+
+static int coroutine_fn local_cache_co_pwritev(BlockDriverState *bs,
+                                               uint64_t offset, uint64_t bytes,
+                                               QEMUIOVector *qiov, int flags)
+{
+    int ret;
+
+    ret = local_cache_write_prepare(bs, offset, bytes);
+    if (ret < 0) {
+        return ret;
+    }
+
+    ret = bdrv_co_pwritev(bs->file, offset, bytes, qiov, flags);
+
+    local_cache_write_finish(bs);
+    return ret;
+}
+
+static int coroutine_fn local_cache_co_pwrite_zeroes(BlockDriverState *bs,
+                                                     int64_t offset, int bytes,
+                                                     BdrvRequestFlags flags)
+{
+    int ret;
+
+    ret = local_cache_write_prepare(bs, offset, bytes);
+    if (ret < 0) {
+        return ret;
+    }
+
+    ret = bdrv_co_pwrite_zeroes(bs->file, offset, bytes, flags);
+
+    local_cache_write_finish(bs);
+    return ret;
+}
+
+static int coroutine_fn local_cache_co_pdiscard(BlockDriverState *bs,
+                                                int64_t offset, int bytes)
+{
+    int ret;
+
+    ret = local_cache_write_prepare(bs, offset, bytes);
+    if (ret < 0) {
+        return ret;
+    }
+
+    ret = bdrv_co_pdiscard(bs->file, offset, bytes);
+
+    local_cache_write_finish(bs);
+    return ret;
+}
+
+static ImageInfoSpecific *local_cache_get_specific_info(BlockDriverState *bs,
+                                                        Error **errp)
+{
+    BDRVLocalCacheState *s = bs->opaque;
+    ImageInfoSpecific *spec_info = g_new0(ImageInfoSpecific, 1);
+
+    *spec_info = (ImageInfoSpecific){
+        .type = IMAGE_INFO_SPECIFIC_KIND_LOCAL_CACHE,
+        .u = {
+            .local_cache.data = g_new0(ImageInfoSpecificLocalCache, 1),
+        },
+    };
+
+    *spec_info->u.local_cache.data = (ImageInfoSpecificLocalCache) {
+        .size = s->nb_slots * s->cluster_size,
+        .cluster_size = s->cluster_size,
+        .used = s->nb_used * s->cluster_size,
+        .hits = s->hits,
+        .misses = s->misses,
+        .evictions = s->evictions,
+        .invalidations = s->invalidations,
+    };
+
+    return spec_info;
+}
+
+static bool local_cache_recurse_is_first_non_filter(BlockDriverState *bs,
+                                                    BlockDriverState *candidate)
+{
+    return bdrv_recurse_is_first_non_filter(bs->file->bs, candidate);
+}
+
+static const char *const local_cache_strong_runtime_opts[] = {
+    LOCAL_CACHE_OPT_SIZE,
+    LOCAL_CACHE_OPT_CLUSTER_SIZE,
+
+    NULL
+};
+
+static BlockDriver bdrv_local_cache = {
+    .format_name                        = "local-cache",
+    .instance_size                      = sizeof(BDRVLocalCacheState),
+
+    .bdrv_open                          = local_cache_open,
+    .bdrv_close                         = local_cache_close,
+    .bdrv_child_perm                    = local_cache_child_perm,
+
+    .bdrv_getlength                     = local_cache_getlength,
+
+    .bdrv_co_preadv                     = local_cache_co_preadv,
+    .bdrv_co_pwritev                    = local_cache_co_pwritev,
+    .bdrv_co_pwrite_zeroes              = local_cache_co_pwrite_zeroes,
+    .bdrv_co_pdiscard                   = local_cache_co_pdiscard,
+
+    .bdrv_co_block_status               = bdrv_co_block_status_from_file,
+    .bdrv_get_specific_info             = local_cache_get_specific_info,
+
+    .bdrv_recurse_is_first_non_filter   =
+        local_cache_recurse_is_first_non_filter,
+
+    .is_filter                          = true,
+    .strong_runtime_opts                = local_cache_strong_runtime_opts,
+};
+
+static void bdrv_local_cache_init(void)
+{
+    bdrv_register(&bdrv_local_cache);
+}
+
+block_init(bdrv_local_cache_init);
@@ -0,0 +1,828 @@
+/*
+ * Host memory cache filter block driver
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 or
+ * (at your option) version 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * The cache keeps up to @size bytes of the child node in memory, in
+ * entries of @cluster-size bytes that are evicted in LRU order.
+ *
+ * Reads that hit entries are served from memory.  On a miss, the
+ * cluster-aligned range is read from the child and inserted into the
+ * cache, unless a write to the child was in flight at any time during the
+ * read, in which case the data might already be stale and is only passed
+ * to the caller.  Reads larger than a quarter of the cache bypass the fill
+ * so that a sequential scan does not throw out the working set.
+ *
+ * Writes go through to the child and update the entries they overlap.
+ * With @write-back, writes that only touch cached or fully covered
+ * clusters stay in memory and are written to the child on flush or
+ * eviction; FUA writes are always written through.
+ *
+ * All cache metadata is protected by a CoMutex; child I/O for misses and
+ * write-through writes is done without holding it.
+ */
+
+#include "qemu/osdep.h"
+#include "block/block_int.h"
+#include "qapi/error.h"
+#include "qapi/qapi-visit-block-core.h"
+#include "qemu/bitmap.h"
+#include "qemu/cutils.h"
+#include "qemu/option.h"
+
+#define MEM_CACHE_OPT_SIZE          "size"
+#define MEM_CACHE_OPT_CLUSTER_SIZE  "cluster-size"
+#define MEM_CACHE_OPT_WRITE_BACK    "write-back"
+
+#define MEM_CACHE_DEFAULT_SIZE          (64 * MiB)
+#define MEM_CACHE_DEFAULT_CLUSTER_SIZE  (64 * KiB)
+#define MEM_CACHE_MIN_CLUSTER_SIZE      (4 * KiB)
+#define MEM_CACHE_MAX_CLUSTER_SIZE      (2 * MiB)
+
+typedef struct MemCacheEntry {
+    int64_t index;          /* offset / cluster_size, hash table key */
+    int64_t offset;
+    int64_t bytes;          /* shorter than a cluster at the end of the node */
+    uint8_t *data;
+    bool dirty;
+    QTAILQ_ENTRY(MemCacheEntry) lru;
+} MemCacheEntry;
+
+typedef struct BDRVMemCacheState {
+    CoMutex lock;
+    GHashTable *entries;
+    QTAILQ_HEAD(, MemCacheEntry) lru;   /* least recently used first */
+    int64_t nb_entries;
+    int64_t nb_dirty;
+
+    int64_t max_entries;
+    int64_t cluster_size;
+    bool write_back;
+
+    /*
+     * Number of writes to the child in flight, and a counter that is bumped
+     * whenever one starts or ends.  A miss only fills the cache if neither
+     * changed while its data was read.
+     */
+    int writes_in_flight;
+    uint64_t write_seq;
+
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    uint64_t writebacks;
+} BDRVMemCacheState;
+
+static QemuOptsList mem_cache_opts = {
+    .name = "mem-cache",
+    .head = QTAILQ_HEAD_INITIALIZER(mem_cache_opts.head),
+    .desc = {
+        {
+            .name = MEM_CACHE_OPT_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "Maximum amount of cached data",
+        },
+        {
+            .name = MEM_CACHE_OPT_CLUSTER_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "Size of a cache entry",
+        },
+        {
+            .name = MEM_CACHE_OPT_WRITE_BACK,
+            .type = QEMU_OPT_BOOL,
+            .help = "Keep written data in memory until the next flush",
+        },
+        { /* end of list */ }
+    },
+};
+
+static int mem_cache_open(BlockDriverState *bs, QDict *options, int flags,
+                          Error **errp)
+{
+    BDRVMemCacheState *s = bs->opaque;
+    QemuOpts *opts;
+    Error *local_err = NULL;
+    uint64_t size;
+    int ret;
+
+    bs->file = bdrv_open_child(NULL, options, "file", bs, &child_file, false,
+                               errp);
+    if (!bs->file) {
+        return -EINVAL;
+    }
+
+    opts = qemu_opts_create(&mem_cache_opts, NULL, 0, &error_abort);
+    qemu_opts_absorb_qdict(opts, options, &local_err);
+    if (local_err) {
+        error_propagate(errp, local_err);
+        ret = -EINVAL;
+        goto fail;
+    }
+
+    size = qemu_opt_get_size(opts, MEM_CACHE_OPT_SIZE,
+                             MEM_CACHE_DEFAULT_SIZE);
+    s->cluster_size = qemu_opt_get_size(opts, MEM_CACHE_OPT_CLUSTER_SIZE,
+                                        MEM_CACHE_DEFAULT_CLUSTER_SIZE);
+    s->write_back = qemu_opt_get_bool(opts, MEM_CACHE_OPT_WRITE_BACK, false);
+
+    if (s->cluster_size < MEM_CACHE_MIN_CLUSTER_SIZE ||
+        s->cluster_size > MEM_CACHE_MAX_CLUSTER_SIZE ||
+        !is_power_of_2(s->cluster_size))
+    {
+        error_setg(errp, "Cluster size must be a power of two between 4k "
+                   "and 2M");
+        ret = -EINVAL;
+        goto fail;
+    }
+    if (size < s->cluster_size) {
+        error_setg(errp, "Cache size must be at least one cluster (%" PRId64
+                   " bytes)", s->cluster_size);
+        ret = -EINVAL;
+        goto fail;
+    }
+    s->max_entries = size / s->cluster_size;
+
+    qemu_co_mutex_init(&s->lock);
+    s->entries = g_hash_table_new(g_int64_hash, g_int64_equal);
+    QTAILQ_INIT(&s->lru);
+
+    bs->supported_write_flags = BDRV_REQ_WRITE_UNCHANGED |
+        (BDRV_REQ_FUA & bs->file->bs->supported_write_flags);
+
+    bs->supported_zero_flags = BDRV_REQ_WRITE_UNCHANGED |
+        ((BDRV_REQ_FUA | BDRV_REQ_MAY_UNMAP | BDRV_REQ_NO_FALLBACK) &
+            bs->file->bs->supported_zero_flags);
+
+    ret = 0;
+fail:
+    qemu_opts_del(opts);
+    return ret;
+}
+
+static void mem_cache_free_entry(BDRVMemCacheState *s, MemCacheEntry *e)
+{
+    g_hash_table_remove(s->entries, &e->index);
+    QTAILQ_REMOVE(&s->lru, e, lru);
+    if (e->dirty) {
+        s->nb_dirty--;
+    }
+    s->nb_entries--;
+    qemu_vfree(e->data);
+    g_free(e);
+}
+
+static void mem_cache_close(BlockDriverState *bs)
+{
+    BDRVMemCacheState *s = bs->opaque;
+    MemCacheEntry *e, *next;
+
+    /* bdrv_close() has flushed the node already; anything still dirty
+     * could not be written back and is lost */
+    QTAILQ_FOREACH_SAFE(e, &s->lru, lru, next) {
+        mem_cache_free_entry(s, e);
+    }
+    g_hash_table_destroy(s->entries);
+}
+
+static int64_t mem_cache_getlength(BlockDriverState *bs)
+{
+    return bdrv_getlength(bs->file->bs);
+}
+
+static MemCacheEntry *mem_cache_lookup(BDRVMemCacheState *s, int64_t offset)
+{
+    int64_t index = offset / s->cluster_size;
+
+    return g_hash_table_lookup(s->entries, &index);
+}
+
+/* Mark an entry as the most recently used one */
+static void mem_cache_touch(BDRVMemCacheState *s, MemCacheEntry *e)
+{
+    QTAILQ_REMOVE(&s->lru, e, lru);
+    QTAILQ_INSERT_TAIL(&s->lru, e, lru);
+}
+
+static void mem_cache_set_dirty(BDRVMemCacheState *s, MemCacheEntry *e,
+                                bool dirty)
+{
+    if (e->dirty != dirty) {
+        s->nb_dirty += dirty ? 1 : -1;
+        e->dirty = dirty;
+    }
+}
+
+static void mem_cache_write_begin(BDRVMemCacheState *s)
+{
+    s->writes_in_flight++;
+    s->write_seq++;
+}
+
+static void mem_cache_write_end(BDRVMemCacheState *s)
+{
+    assert(s->writes_in_flight > 0);
+    s->writes_in_flight--;
+    s->write_seq++;
+}
+
+/* Called with s->lock held, which is kept during the write */
+static int coroutine_fn mem_cache_writeback(BlockDriverState *bs,
+                                            MemCacheEntry *e)
+{
+    BDRVMemCacheState *s = bs->opaque;
+    int ret;
+
+    assert(e->dirty);
+
+    mem_cache_write_begin(s);
+    ret = bdrv_co_pwrite(bs->file, e->offset, e->bytes, e->data, 0);
+    mem_cache_write_end(s);
+
+    if (ret < 0) {
+        return ret;
+    }
+
+    mem_cache_set_dirty(s, e, false);
+    s->writebacks++;
+    return 0;
+}
+
+/*
+ * Return a new entry for the cluster at @offset, evicting the least
+ * recently used entry if the cache is full.  The contents of the entry are
+ * undefined.  Returns NULL if no memory is available or a dirty victim
+ * could not be written back.  Called with s->lock held.
+ */
+static MemCacheEntry * coroutine_fn mem_cache_alloc(BlockDriverState *bs,
+                                                    int64_t offset,
+                                                    int64_t length)
+{
+    BDRVMemCacheState *s = bs->opaque;
+    MemCacheEntry *e;
+
+    assert(QEMU_IS_ALIGNED(offset, s->cluster_size));
+    assert(!mem_cache_lookup(s, offset));
+
+    if (s->nb_entries >= s->max_entries) {
+        e = QTAILQ_FIRST(&s->lru);
+        if (e->dirty && mem_cache_writeback(bs, e) < 0) {
+            return NULL;
+        }
+        s->evictions++;
+
+        /* Reuse the buffer of the victim */
+        g_hash_table_remove(s->entries, &e->index);
+        QTAILQ_REMOVE(&s->lru, e, lru);
+        s->nb_entries--;
+    } else {
+        e = g_new0(MemCacheEntry, 1);
+        e->data = qemu_try_blockalign(bs->file->bs, s->cluster_size);
+        if (!e->data) {
+            g_free(e);
+            return NULL;
+        }
+    }
+
+    e->index = offset / s->cluster_size;
+    e->offset = offset;
+    e->bytes = MIN(s->cluster_size, length - offset);
+    e->dirty = false;
+
+    g_hash_table_insert(s->entries, &e->index, e);
+    QTAILQ_INSERT_TAIL(&s->lru, e, lru);
+    s->nb_entries++;
+
+    return e;
+}
+
+/*
+ * Copy the part of @qiov that overlaps @e into the entry.  @qiov describes
+ * the request [@offset, @offset + @bytes).
+ */
+static void mem_cache_update_entry(MemCacheEntry *e, int64_t offset,
+                                   int64_t bytes, QEMUIOVector *qiov)
+{
+    int64_t start = MAX(offset, e->offset);
+    int64_t end = MIN(offset + bytes, e->offset + e->bytes);
+
+    if (start < end) {
+        qemu_iovec_to_buf(qiov, start - offset, e->data + (start - e->offset),
+                          end - start);
+    }
+}
+
+/* Copy the part of @e that overlaps the request into @qiov */
+static void mem_cache_read_entry(MemCacheEntry *e, int64_t offset,
+                                 int64_t bytes, QEMUIOVector *qiov)
+{
+    int64_t start = MAX(offset, e->offset);
+    int64_t end = MIN(offset + bytes, e->offset + e->bytes);
+
+    if (start < end) {
+        qemu_iovec_from_buf(qiov, start - offset,
+                            e->data + (start - e->offset), end - start);
+    }
+}
+
+static int coroutine_fn mem_cache_co_preadv(BlockDriverState *bs,
+                                            uint64_t offset, uint64_t bytes,
+                                            QEMUIOVector *qiov, int flags)
+{
+    BDRVMemCacheState *s = bs->opaque;
+    int64_t start, end, length, cluster, nb_clusters, i;
+    unsigned long *done;
+    uint64_t write_seq;
+    uint8_t *buf;
+    bool fill;
+    int ret;
+
+    length = bdrv_getlength(bs->file->bs);
+    if (length < 0) {
+        return length;
+    }
+
+    start = QEMU_ALIGN_DOWN(offset, s->cluster_size);
+    end = MIN(QEMU_ALIGN_UP(offset + bytes, s->cluster_size),
+              QEMU_ALIGN_UP(length, s->cluster_size));
+    if (start >= end) {
+        /* Entirely beyond the end of the node, let the child handle it */
+        return bdrv_co_preadv(bs->file, offset, bytes, qiov, flags);
+    }
+    nb_clusters = (end - start) / s->cluster_size;
+
+    /* Serve what is cached; if that is everything, we are done */
+    done = bitmap_new(nb_clusters);
+
+    qemu_co_mutex_lock(&s->lock);
+    for (i = 0; i < nb_clusters; i++) {
+        MemCacheEntry *e = mem_cache_lookup(s, start + i * s->cluster_size);
+        if (e) {
+            mem_cache_read_entry(e, offset, bytes, qiov);
+            mem_cache_touch(s, e);
+            set_bit(i, done);
+        }
+    }
+
+    if (find_first_zero_bit(done, nb_clusters) == nb_clusters &&
+        offset + bytes <= length)
+    {
+        s->hits++;
+        qemu_co_mutex_unlock(&s->lock);
+        g_free(done);
+        return 0;
+    }
+
+    s->misses++;
+    fill = s->writes_in_flight == 0 &&
+           end - start <= s->max_entries * s->cluster_size / 4;
+    write_seq = s->write_seq;
+    qemu_co_mutex_unlock(&s->lock);
+
+    /* Read the whole aligned range so that complete entries can be filled */
+    buf = qemu_try_blockalign(bs->file->bs, end - start);
+    if (!buf) {
+        g_free(done);
+        return -ENOMEM;
+    }
+
+    ret = bdrv_co_pread(bs->file, start, end - start, buf, flags);
+    if (ret < 0) {
+        goto out;
+    }
+
+    qemu_co_mutex_lock(&s->lock);
+    fill = fill && s->writes_in_flight == 0 && s->write_seq == write_seq;
+
+    for (i = 0; i < nb_clusters; i++) {
+        MemCacheEntry *e;
+        int64_t c_start, c_end;
+
+        if (test_bit(i, done)) {
+            continue;
+        }
+
+        cluster = start + i * s->cluster_size;
+        e = mem_cache_lookup(s, cluster);
+        if (!e && fill) {
+            e = mem_cache_alloc(bs, cluster, length);
+            if (e) {
+                memcpy(e->data, buf + (cluster - start), e->bytes);
+            }
+            /* Writing back the victim may have made later parts of buf
+             * stale */
+            fill = s->write_seq == write_seq;
+        }
+
+        if (e) {
+            /* The entry may be newer than what we read from the child */
+            mem_cache_read_entry(e, offset, bytes, qiov);
+            continue;
+        }
+
+        c_start = MAX(offset, cluster);
+        c_end = MIN(offset + bytes, cluster + s->cluster_size);
+        qemu_iovec_from_buf(qiov, c_start - offset, buf + (c_start - start),
+                            c_end - c_start);
+    }
+    qemu_co_mutex_unlock(&s->lock);
+
+    /* Anything beyond the end of the child reads as zeroes */
+    if (offset + bytes > length) {
+        int64_t eof = MAX(offset, length);
+        qemu_iovec_memset(qiov, eof - offset, 0, offset + bytes - eof);
+    }
+
+    ret = 0;
+out:
+    qemu_vfree(buf);
+    g_free(done);
+    return ret;
+}
+
+/*
+ * Try to complete a write in memory only.  This works if every cluster it
+ * touches is either cached already or completely overwritten.  Called with
+ * s->lock held.
+ */
+static bool coroutine_fn mem_cache_try_write_back(BlockDriverState *bs,
+                                                  uint64_t offset,
+                                                  uint64_t bytes,
+                                                  QEMUIOVector *qiov)
+{
+    BDRVMemCacheState *s = bs->opaque;
+    int64_t cluster, length;
+    int64_t start = QEMU_ALIGN_DOWN(offset, s->cluster_size);
+    int64_t end = QEMU_ALIGN_UP(offset + bytes, s->cluster_size);
+
+    length = bdrv_getlength(bs->file->bs);
+    if (length < 0 || offset + bytes > length ||
+        (end - start) / s->cluster_size > s->max_entries / 4)
+    {
+        return false;
+    }
+
+    for (cluster = start; cluster < end; cluster += s->cluster_size) {
+        int64_t cluster_end = MIN(cluster + s->cluster_size, length);
+
+        if (!mem_cache_lookup(s, cluster) &&
+            (cluster < offset || cluster_end > offset + bytes))
+        {
+            return false;
+        }
+    }
+
+    /* Make sure that allocating entries below evicts none of ours */
+    for (cluster = start; cluster < end; cluster += s->cluster_size) {
+        MemCacheEntry *e = mem_cache_lookup(s, cluster);
+        if (e) {
+            mem_cache_touch(s, e);
+        }
+    }
+
+    for (cluster = start; cluster < end; cluster += s->cluster_size) {
+        MemCacheEntry *e = mem_cache_lookup(s, cluster);
+
+        if (!e) {
+            e = mem_cache_alloc(bs, cluster, length);
+            if (!e) {
+                /* Clusters already updated are dirty, which is fine as the
+                 * caller writes the whole request to the child now */
+                return false;
+            }
+        }
+        mem_cache_update_entry(e, offset, bytes, qiov);
+        mem_cache_set_dirty(s, e, true);
+        mem_cache_touch(s, e);
+    }
+
+    return true;
+}
+
+static int coroutine_fn mem_cache_co_pwritev(BlockDriverState *bs,
+                                             uint64_t offset, uint64_t bytes,
+                                             QEMUIOVector *qiov, int flags)
+{
+    BDRVMemCacheState *s = bs->opaque;
+    int64_t cluster;
+    int ret;
+
+    qemu_co_mutex_lock(&s->lock);
+    if (s->write_back && !(flags & BDRV_REQ_FUA) &&
+        mem_cache_try_write_back(bs, offset, bytes, qiov))
+    {
+        qemu_co_mutex_unlock(&s->lock);
+        return 0;
+    }
+
+    /* Write through, keeping the cached copies up to date */
+    for (cluster = QEMU_ALIGN_DOWN(offset, s->cluster_size);
+         cluster < offset + bytes; cluster += s->cluster_size)
+    {
+        MemCacheEntry *e = mem_cache_lookup(s, cluster);
+        if (e) {
+            mem_cache_update_entry(e, offset, bytes, qiov);
+        }
+    }
+    mem_cache_write_begin(s);
+    qemu_co_mutex_unlock(&s->lock);
+
+    ret = bdrv_co_pwritev(bs->file, offset, bytes, qiov, flags);
+
+    qemu_co_mutex_lock(&s->lock);
+    mem_cache_write_end(s);
+    if (ret < 0) {
+        /* Clean entries must match the child, so drop what we updated */
+        for (cluster = QEMU_ALIGN_DOWN(offset, s->cluster_size);
+             cluster < offset + bytes; cluster += s->cluster_size)
+        {
+            MemCacheEntry *e = mem_cache_lookup(s, cluster);
+            if (e && !e->dirty) {
+                mem_cache_free_entry(s, e);
+            }
+        }
+    }
+    qemu_co_mutex_unlock(&s->lock);
+
+    return ret;
+}
+
+/*
+ * Drop the entries overlapping [@offset, @offset + @bytes) before the range
+ * is changed behind the back of the cache.  Dirty entries that are only
+ * partially covered are written back first.  Called with s->lock held.
+ */
+static int coroutine_fn mem_cache_invalidate_range(BlockDriverState *bs,
+                                                   int64_t offset,
+                                                   int64_t bytes)
+{
+    BDRVMemCacheState *s = bs->opaque;
+    int64_t cluster;
+    int ret;
+
+    for (cluster = QEMU_ALIGN_DOWN(offset, s->cluster_size);
+         cluster < offset + bytes; cluster += s->cluster_size)
+    {
+        MemCacheEntry *e = mem_cache_lookup(s, cluster);
+        if (!e) {
+            continue;
+        }
+        if (e->dirty && (e->offset < offset ||
+                         e->offset + e->bytes > offset + bytes))
+        {
+            ret = mem_cache_writeback(bs, e);
+            if (ret < 0) {
+                return ret;
+            }
+        }
+        mem_cache_free_entry(s, e);
+    }
+
+    return 0;
+}
+
+static int coroutine_fn mem_cache_co_pwrite_zeroes(BlockDriverState *bs,
+                                                   int64_t offset, int bytes,
+                                                   BdrvRequestFlags flags)
+{
+    BDRVMemCacheState *s = bs->opaque;
+    int ret;
+
+    qemu_co_mutex_lock(&s->lock);
+    ret = mem_cache_invalidate_range(bs, offset, bytes);
+    if (ret < 0) {
+        qemu_co_mutex_unlock(&s->lock);
+        return ret;
+    }
+    mem_cache_write_begin(s);
+    qemu_co_mutex_unlock(&s->lock);
+
+    ret = bdrv_co_pwrite_zeroes(bs->file, offset, bytes, flags);
+
+    qemu_co_mutex_lock(&s->lock);
+    mem_cache_write_end(s);
+    qemu_co_mutex_unlock(&s->lock);
+
+    return ret;
+}
+
+static int coroutine_fn mem_cache_co_pdiscard(BlockDriverState *bs,
+                                              int64_t offset, int bytes)
+{
+    BDRVMemCacheState *s = bs->opaque;
+    int ret;
+
+    qemu_co_mutex_lock(&s->lock);
+    ret = mem_cache_invalidate_range(bs, offset, bytes);
+    if (ret < 0) {
+        qemu_co_mutex_unlock(&s->lock);
+        return ret;
+    }
+    mem_cache_write_begin(s);
+    qemu_co_mutex_unlock(&s->lock);
+
+    ret = bdrv_co_pdiscard(bs->file, offset, bytes);
+
+    qemu_co_mutex_lock(&s->lock);
+    mem_cache_write_end(s);
+    qemu_co_mutex_unlock(&s->lock);
+
+    return ret;
+}
+
+/* Write back all dirty entries; the block layer then flushes the child */
+static int coroutine_fn mem_cache_co_flush_to_os(BlockDriverState *bs)
+{
+    BDRVMemCacheState *s = bs->opaque;
+    MemCacheEntry *e;
+    int ret = 0;
+
+    qemu_co_mutex_lock(&s->lock);
+    QTAILQ_FOREACH(e, &s->lru, lru) {
+        if (s->nb_dirty == 0) {
+            break;
+        }
+        if (e->dirty) {
+            ret = mem_cache_writeback(bs, e);
+            if (ret < 0) {
+                break;
+            }
+        }
+    }
+    qemu_co_mutex_unlock(&s->lock);
+
+    return ret;
+}
+
+static int coroutine_fn mem_cache_co_truncate(BlockDriverState *bs,
+                                              int64_t offset,
+                                              PreallocMode prealloc,
+                                              Error **errp)
+{
+    BDRVMemCacheState *s = bs->opaque;
+    MemCacheEntry *e, *next;
+    int ret;
+
+    /* Entries at the end of the node change size, so start from scratch */
+    qemu_co_mutex_lock(&s->lock);
+    QTAILQ_FOREACH_SAFE(e, &s->lru, lru, next) {
+        if (e->dirty) {
+            ret = mem_cache_writeback(bs, e);
+            if (ret < 0) {
+                qemu_co_mutex_unlock(&s->lock);
+                error_setg_errno(errp, -ret,
+                                 "Could not write back cached data");
+                return ret;
+            }
+        }
+        mem_cache_free_entry(s, e);
+    }
+    mem_cache_write_begin(s);
+    qemu_co_mutex_unlock(&s->lock);
+
+    ret = bdrv_co_truncate(bs->file, offset, prealloc, errp);
+
+    qemu_co_mutex_lock(&s->lock);
+    mem_cache_write_end(s);
+    qemu_co_mutex_unlock(&s->lock);
+
+    return ret;
+}
+
+static int coroutine_fn mem_cache_co_block_status(BlockDriverState *bs,
+                                                  bool want_zero,
+                                                  int64_t offset,
+                                                  int64_t bytes,
+                                                  int64_t *pnum,
+                                                  int64_t *map,
+                                                  BlockDriverState **file)
+{
+    BDRVMemCacheState *s = bs->opaque;
+    int64_t cluster;
+
+    /* The child does not know about dirty data yet, so report it as data
+     * and stop before the next dirty cluster otherwise */
+    if (s->nb_dirty) {
+        for (cluster = QEMU_ALIGN_DOWN(offset, s->cluster_size);
+             cluster < offset + bytes; cluster += s->cluster_size)
+        {
+            MemCacheEntry *e = mem_cache_lookup(s, cluster);
+            if (e && e->dirty) {
+                if (cluster <= offset) {
+                    *pnum = MIN(bytes, cluster + s->cluster_size - offset);
+                    return BDRV_BLOCK_DATA;
+                }
+                bytes = cluster - offset;
+                break;
+            }
+        }
+    }
+
+    return bdrv_co_block_status_from_file(bs, want_zero, offset, bytes,
+                                          pnum, map, file);
+}
+
+static void coroutine_fn mem_cache_co_invalidate_cache(BlockDriverState *bs,
+                                                       Error **errp)
+{
+    BDRVMemCacheState *s = bs->opaque;
+    MemCacheEntry *e, *next;
+
+    /* Someone else may have written to the image while we were inactive */
+    qemu_co_mutex_lock(&s->lock);
+    QTAILQ_FOREACH_SAFE(e, &s->lru, lru, next) {
+        if (!e->dirty) {
+            mem_cache_free_entry(s, e);
+        }
+    }
+    qemu_co_mutex_unlock(&s->lock);
+}
+
+static ImageInfoSpecific *mem_cache_get_specific_info(BlockDriverState *bs,
+                                                      Error **errp)
+{
+    BDRVMemCacheState *s = bs->opaque;
+    ImageInfoSpecific *spec_info = g_new0(ImageInfoSpecific, 1);
+
+    *spec_info = (ImageInfoSpecific){
+        .type = IMAGE_INFO_SPECIFIC_KIND_MEM_CACHE,
+        .u = {
+            .mem_cache.data = g_new0(ImageInfoSpecificMemCache, 1),
+        },
+    };
+
+    *spec_info->u.mem_cache.data = (ImageInfoSpecificMemCache) {
+        .size = s->max_entries * s->cluster_size,
+        .cluster_size = s->cluster_size,
+        .write_back = s->write_back,
+        .used = s->nb_entries * s->cluster_size,
+        .dirty = s->nb_dirty * s->cluster_size,
+        .hits = s->hits,
+        .misses = s->misses,
+        .evictions = s->evictions,
+        .writebacks = s->writebacks,
+    };
+
+    return spec_info;
+}
+
+static bool mem_cache_recurse_is_first_non_filter(BlockDriverState *bs,
+                                                  BlockDriverState *candidate)
+{
+    return bdrv_recurse_is_first_non_filter(bs->file->bs, candidate);
+}
+
+static const char *const mem_cache_strong_runtime_opts[] = {
+    MEM_CACHE_OPT_SIZE,
+    MEM_CACHE_OPT_CLUSTER_SIZE,
+    MEM_CACHE_OPT_WRITE_BACK,
+
+    NULL
+};
+
+static BlockDriver bdrv_mem_cache = {
+    .format_name                        = "mem-cache",
+    .instance_size                      = sizeof(BDRVMemCacheState),
+
+    .bdrv_open                          = mem_cache_open,
+    .bdrv_close                         = mem_cache_close,
+    .bdrv_child_perm                    = bdrv_filter_default_perms,
+
+    .bdrv_getlength                     = mem_cache_getlength,
+    .bdrv_co_truncate                   = mem_cache_co_truncate,
+
+    .bdrv_co_preadv                     = mem_cache_co_preadv,
+    .bdrv_co_pwritev                    = mem_cache_co_pwritev,
+    .bdrv_co_pwrite_zeroes              = mem_cache_co_pwrite_zeroes,
+    .bdrv_co_pdiscard                   = mem_cache_co_pdiscard,
+    .bdrv_co_flush_to_os                = mem_cache_co_flush_to_os,
+
+    .bdrv_co_block_status               = mem_cache_co_block_status,
+    .bdrv_co_invalidate_cache           = mem_cache_co_invalidate_cache,
+    .bdrv_get_specific_info             = mem_cache_get_specific_info,
+
+    .bdrv_recurse_is_first_non_filter   = mem_cache_recurse_is_first_non_filter,
+
+    .has_variable_length                = true,
+    .is_filter                          = true,
+    .strong_runtime_opts                = mem_cache_strong_runtime_opts,
+};
+
+static void bdrv_mem_cache_init(void)
+{
+    bdrv_register(&bdrv_mem_cache);
+}
+
+block_init(bdrv_mem_cache_init);
@@ -448,8 +448,8 @@ static uint64_t coroutine_fn mirror_iteration(MirrorBlockJob *s)
     MirrorOp *pseudo_op;
     int64_t offset;
     uint64_t delay_ns = 0, ret = 0;
-    /* At least the first dirty chunk is mirrored in one iteration. */
-    int nb_chunks = 1;
+    int64_t next_clean, first_chunk;
+    int nb_chunks;
     bool write_zeroes_ok = bdrv_can_write_zeroes_with_unmap(blk_bs(s->target));
     int max_io_bytes = MAX(s->buf_size / MAX_IN_FLIGHT, MAX_IO_BYTES);
 
@@ -468,29 +468,20 @@ static uint64_t coroutine_fn mirror_iteration(MirrorBlockJob *s)
     job_pause_point(&s->common.job);
 
     /* Find the number of consective dirty chunks following the first dirty
-     * one, and wait for in flight requests in them. */
+     * one, stopping at the first one that is already in flight. */
     bdrv_dirty_bitmap_lock(s->dirty_bitmap);
-    while (nb_chunks * s->granularity < s->buf_size) {
-        int64_t next_dirty;
-        int64_t next_offset = offset + nb_chunks * s->granularity;
-        int64_t next_chunk = next_offset / s->granularity;
-        if (next_offset >= s->bdev_length ||
-            !bdrv_get_dirty_locked(source, s->dirty_bitmap, next_offset)) {
-            break;
-        }
-        if (test_bit(next_chunk, s->in_flight_bitmap)) {
-            break;
-        }
-
-        next_dirty = bdrv_dirty_iter_next(s->dbi);
-        if (next_dirty > next_offset || next_dirty < 0) {
-            /* The bitmap iterator's cache is stale, refresh it */
-            bdrv_set_dirty_iter(s->dbi, next_offset);
-            next_dirty = bdrv_dirty_iter_next(s->dbi);
-        }
-        assert(next_dirty == next_offset);
-        nb_chunks++;
-    }
+    nb_chunks = MIN(DIV_ROUND_UP(s->buf_size, s->granularity),
+                    DIV_ROUND_UP(s->bdev_length - offset, s->granularity));
+    next_clean = bdrv_dirty_bitmap_next_zero(s->dirty_bitmap, offset,
+                                             (uint64_t)nb_chunks *
+                                             s->granularity);
+    if (next_clean >= 0) {
+        /* At least the first dirty chunk is mirrored in one iteration. */
+        nb_chunks = MAX(1, DIV_ROUND_UP(next_clean - offset, s->granularity));
+    }
+    first_chunk = offset / s->granularity;
+    nb_chunks = find_next_bit(s->in_flight_bitmap, first_chunk + nb_chunks,
+                              first_chunk + 1) - first_chunk;
 
     /* Clear dirty bits before querying the block status, because
      * calling bdrv_block_status_above could yield - if some blocks are
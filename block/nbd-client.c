@@ -49,9 +49,9 @@ static void nbd_recv_coroutines_wake_all(NBDClientSession *s)
     }
 }
 
-static void nbd_teardown_connection(BlockDriverState *bs)
+static void nbd_teardown_connection(NBDClientSession *client)
 {
-    NBDClientSession *client = nbd_get_client_session(bs);
+    BlockDriverState *bs = client->bs;
 
     assert(client->ioc);
 
@@ -61,7 +61,7 @@ static void nbd_teardown_connection(BlockDriverState *bs)
                          NULL);
     BDRV_POLL_WHILE(bs, client->connection_co);
 
-    nbd_client_detach_aio_context(bs);
+    qio_channel_detach_aio_context(QIO_CHANNEL(client->ioc));
     object_unref(OBJECT(client->sioc));
     client->sioc = NULL;
     object_unref(OBJECT(client->ioc));
@@ -132,11 +132,29 @@ static coroutine_fn void nbd_connection_entry(void *opaque)
     aio_wait_kick();
 }
 
-static int nbd_co_send_request(BlockDriverState *bs,
+/*
+ * Pick the connection for a new request.  Additional connections are only
+ * opened if the server guarantees consistency between them, so any live
+ * connection will do; prefer the one with the fewest requests in flight.
+ * If all connections are dead, the first one is used to fail the request.
+ */
+static NBDClientSession *nbd_client_pick_session(BlockDriverState *bs)
+{
+    NBDClientSession *client = NULL;
+    NBDClientSession *s;
+
+    for (s = nbd_get_client_session(bs); s; s = s->next) {
+        if (!s->quit && (!client || s->in_flight < client->in_flight)) {
+            client = s;
+        }
+    }
+    return client ?: nbd_get_client_session(bs);
+}
+
+static int nbd_co_send_request(NBDClientSession *s,
                                NBDRequest *request,
                                QEMUIOVector *qiov)
 {
-    NBDClientSession *s = nbd_get_client_session(bs);
     int rc, i;
 
     qemu_co_mutex_lock(&s->send_mutex);
@@ -807,12 +825,11 @@ static int nbd_co_receive_blockstatus_reply(NBDClientSession *s,
     return iter.ret;
 }
 
-static int nbd_co_request(BlockDriverState *bs, NBDRequest *request,
+static int nbd_co_request(NBDClientSession *client, NBDRequest *request,
                           QEMUIOVector *write_qiov)
 {
     int ret, request_ret;
     Error *local_err = NULL;
-    NBDClientSession *client = nbd_get_client_session(bs);
 
     assert(request->type != NBD_CMD_READ);
     if (write_qiov) {
@@ -821,7 +838,7 @@ static int nbd_co_request(BlockDriverState *bs, NBDRequest *request,
     } else {
         assert(request->type != NBD_CMD_WRITE);
     }
-    ret = nbd_co_send_request(bs, request, write_qiov);
+    ret = nbd_co_send_request(client, request, write_qiov);
     if (ret < 0) {
         return ret;
     }
@@ -843,7 +860,7 @@ int nbd_client_co_preadv(BlockDriverState *bs, uint64_t offset,
 {
     int ret, request_ret;
     Error *local_err = NULL;
-    NBDClientSession *client = nbd_get_client_session(bs);
+    NBDClientSession *client = nbd_client_pick_session(bs);
     NBDRequest request = {
         .type = NBD_CMD_READ,
         .from = offset,
@@ -875,7 +892,7 @@ int nbd_client_co_preadv(BlockDriverState *bs, uint64_t offset,
         request.len -= slop;
     }
 
-    ret = nbd_co_send_request(bs, &request, NULL);
+    ret = nbd_co_send_request(client, &request, NULL);
     if (ret < 0) {
         return ret;
     }
@@ -895,7 +912,7 @@ int nbd_client_co_preadv(BlockDriverState *bs, uint64_t offset,
 int nbd_client_co_pwritev(BlockDriverState *bs, uint64_t offset,
                           uint64_t bytes, QEMUIOVector *qiov, int flags)
 {
-    NBDClientSession *client = nbd_get_client_session(bs);
+    NBDClientSession *client = nbd_client_pick_session(bs);
     NBDRequest request = {
         .type = NBD_CMD_WRITE,
         .from = offset,
@@ -913,13 +930,13 @@ int nbd_client_co_pwritev(BlockDriverState *bs, uint64_t offset,
     if (!bytes) {
         return 0;
     }
-    return nbd_co_request(bs, &request, qiov);
+    return nbd_co_request(client, &request, qiov);
 }
 
 int nbd_client_co_pwrite_zeroes(BlockDriverState *bs, int64_t offset,
                                 int bytes, BdrvRequestFlags flags)
 {
-    NBDClientSession *client = nbd_get_client_session(bs);
+    NBDClientSession *client = nbd_client_pick_session(bs);
     NBDRequest request = {
         .type = NBD_CMD_WRITE_ZEROES,
         .from = offset,
@@ -942,12 +959,12 @@ int nbd_client_co_pwrite_zeroes(BlockDriverState *bs, int64_t offset,
     if (!bytes) {
         return 0;
     }
-    return nbd_co_request(bs, &request, NULL);
+    return nbd_co_request(client, &request, NULL);
 }
 
 int nbd_client_co_flush(BlockDriverState *bs)
 {
-    NBDClientSession *client = nbd_get_client_session(bs);
+    NBDClientSession *client = nbd_client_pick_session(bs);
     NBDRequest request = { .type = NBD_CMD_FLUSH };
 
     if (!(client->info.flags & NBD_FLAG_SEND_FLUSH)) {
@@ -957,12 +974,12 @@ int nbd_client_co_flush(BlockDriverState *bs)
     request.from = 0;
     request.len = 0;
 
-    return nbd_co_request(bs, &request, NULL);
+    return nbd_co_request(client, &request, NULL);
 }
 
 int nbd_client_co_pdiscard(BlockDriverState *bs, int64_t offset, int bytes)
 {
-    NBDClientSession *client = nbd_get_client_session(bs);
+    NBDClientSession *client = nbd_client_pick_session(bs);
     NBDRequest request = {
         .type = NBD_CMD_TRIM,
         .from = offset,
@@ -974,7 +991,7 @@ int nbd_client_co_pdiscard(BlockDriverState *bs, int64_t offset, int bytes)
         return 0;
     }
 
-    return nbd_co_request(bs, &request, NULL);
+    return nbd_co_request(client, &request, NULL);
 }
 
 int coroutine_fn nbd_client_co_block_status(BlockDriverState *bs,
@@ -985,7 +1002,7 @@ int coroutine_fn nbd_client_co_block_status(BlockDriverState *bs,
 {
     int ret, request_ret;
     NBDExtent extent = { 0 };
-    NBDClientSession *client = nbd_get_client_session(bs);
+    NBDClientSession *client = nbd_client_pick_session(bs);
     Error *local_err = NULL;
 
     NBDRequest request = {
@@ -1022,7 +1039,7 @@ int coroutine_fn nbd_client_co_block_status(BlockDriverState *bs,
     if (client->info.min_block) {
         assert(QEMU_IS_ALIGNED(request.len, client->info.min_block));
     }
-    ret = nbd_co_send_request(bs, &request, NULL);
+    ret = nbd_co_send_request(client, &request, NULL);
     if (ret < 0) {
         return ret;
     }
@@ -1051,14 +1068,17 @@ int coroutine_fn nbd_client_co_block_status(BlockDriverState *bs,
 
 void nbd_client_detach_aio_context(BlockDriverState *bs)
 {
-    NBDClientSession *client = nbd_get_client_session(bs);
-    qio_channel_detach_aio_context(QIO_CHANNEL(client->ioc));
+    NBDClientSession *client;
+
+    for (client = nbd_get_client_session(bs); client; client = client->next) {
+        qio_channel_detach_aio_context(QIO_CHANNEL(client->ioc));
+    }
 }
 
 static void nbd_client_attach_aio_context_bh(void *opaque)
 {
-    BlockDriverState *bs = opaque;
-    NBDClientSession *client = nbd_get_client_session(bs);
+    NBDClientSession *client = opaque;
+    BlockDriverState *bs = client->bs;
 
     /* The node is still drained, so we know the coroutine has yielded in
      * nbd_read_eof(), the only place where bs->in_flight can reach 0, or it is
@@ -1068,29 +1088,48 @@ static void nbd_client_attach_aio_context_bh(void *opaque)
     bdrv_dec_in_flight(bs);
 }
 
-void nbd_client_attach_aio_context(BlockDriverState *bs,
-                                   AioContext *new_context)
+static void nbd_client_session_attach_aio_context(NBDClientSession *client,
+                                                  AioContext *new_context)
 {
-    NBDClientSession *client = nbd_get_client_session(bs);
     qio_channel_attach_aio_context(QIO_CHANNEL(client->ioc), new_context);
 
-    bdrv_inc_in_flight(bs);
+    bdrv_inc_in_flight(client->bs);
 
     /* Need to wait here for the BH to run because the BH must run while the
      * node is still drained. */
-    aio_wait_bh_oneshot(new_context, nbd_client_attach_aio_context_bh, bs);
+    aio_wait_bh_oneshot(new_context, nbd_client_attach_aio_context_bh, client);
+}
+
+void nbd_client_attach_aio_context(BlockDriverState *bs,
+                                   AioContext *new_context)
+{
+    NBDClientSession *client;
+
+    for (client = nbd_get_client_session(bs); client; client = client->next) {
+        nbd_client_session_attach_aio_context(client, new_context);
+    }
 }
 
 void nbd_client_close(BlockDriverState *bs)
 {
     NBDClientSession *client = nbd_get_client_session(bs);
+    NBDClientSession *next;
     NBDRequest request = { .type = NBD_CMD_DISC };
 
-    assert(client->ioc);
+    while (client) {
+        assert(client->ioc);
+
+        nbd_send_request(client->ioc, &request);
 
-    nbd_send_request(client->ioc, &request);
+        nbd_teardown_connection(client);
 
-    nbd_teardown_connection(bs);
+        next = client->next;
+        client->next = NULL;
+        if (client != nbd_get_client_session(bs)) {
+            g_free(client);
+        }
+        client = next;
+    }
 }
 
 static QIOChannelSocket *nbd_establish_connection(SocketAddress *saddr,
@@ -1114,7 +1153,7 @@ static QIOChannelSocket *nbd_establish_connection(SocketAddress *saddr,
     return sioc;
 }
 
-static int nbd_client_connect(BlockDriverState *bs,
+static int nbd_client_connect(NBDClientSession *client,
                               SocketAddress *saddr,
                               const char *export,
                               QCryptoTLSCreds *tlscreds,
@@ -1122,7 +1161,8 @@ static int nbd_client_connect(BlockDriverState *bs,
                               const char *x_dirty_bitmap,
                               Error **errp)
 {
-    NBDClientSession *client = nbd_get_client_session(bs);
+    BlockDriverState *bs = client->bs;
+    NBDClientSession *primary = nbd_get_client_session(bs);
     int ret;
 
     /*
@@ -1159,18 +1199,31 @@ static int nbd_client_connect(BlockDriverState *bs,
         ret = -EINVAL;
         goto fail;
     }
-    if (client->info.flags & NBD_FLAG_READ_ONLY) {
-        ret = bdrv_apply_auto_read_only(bs, "NBD export is read-only", errp);
-        if (ret < 0) {
+    if (client != primary) {
+        /* Requests are spread over all connections, so they must agree */
+        if (client->info.size != primary->info.size ||
+            client->info.flags != primary->info.flags ||
+            client->info.structured_reply != primary->info.structured_reply ||
+            client->info.base_allocation != primary->info.base_allocation) {
+            error_setg(errp, "NBD export changed between connections");
+            ret = -EINVAL;
             goto fail;
         }
-    }
-    if (client->info.flags & NBD_FLAG_SEND_FUA) {
-        bs->supported_write_flags = BDRV_REQ_FUA;
-        bs->supported_zero_flags |= BDRV_REQ_FUA;
-    }
-    if (client->info.flags & NBD_FLAG_SEND_WRITE_ZEROES) {
-        bs->supported_zero_flags |= BDRV_REQ_MAY_UNMAP;
+    } else {
+        if (client->info.flags & NBD_FLAG_READ_ONLY) {
+            ret = bdrv_apply_auto_read_only(bs, "NBD export is read-only",
+                                            errp);
+            if (ret < 0) {
+                goto fail;
+            }
+        }
+        if (client->info.flags & NBD_FLAG_SEND_FUA) {
+            bs->supported_write_flags = BDRV_REQ_FUA;
+            bs->supported_zero_flags |= BDRV_REQ_FUA;
+        }
+        if (client->info.flags & NBD_FLAG_SEND_WRITE_ZEROES) {
+            bs->supported_zero_flags |= BDRV_REQ_MAY_UNMAP;
+        }
     }
 
     client->sioc = sioc;
@@ -1185,7 +1238,7 @@ static int nbd_client_connect(BlockDriverState *bs,
     qio_channel_set_blocking(QIO_CHANNEL(sioc), false, NULL);
     client->connection_co = qemu_coroutine_create(nbd_connection_entry, client);
     bdrv_inc_in_flight(bs);
-    nbd_client_attach_aio_context(bs, bdrv_get_aio_context(bs));
+    nbd_client_session_attach_aio_context(client, bdrv_get_aio_context(bs));
 
     logout("Established connection with NBD server\n");
     return 0;
@@ -1207,20 +1260,57 @@ static int nbd_client_connect(BlockDriverState *bs,
     }
 }
 
+static void nbd_client_session_init(NBDClientSession *client,
+                                    BlockDriverState *bs)
+{
+    client->bs = bs;
+    qemu_co_mutex_init(&client->send_mutex);
+    qemu_co_queue_init(&client->free_sema);
+}
+
 int nbd_client_init(BlockDriverState *bs,
                     SocketAddress *saddr,
                     const char *export,
                     QCryptoTLSCreds *tlscreds,
                     const char *hostname,
                     const char *x_dirty_bitmap,
+                    int connections,
                     Error **errp)
 {
     NBDClientSession *client = nbd_get_client_session(bs);
+    NBDClientSession *last = client;
+    int ret, i;
 
-    client->bs = bs;
-    qemu_co_mutex_init(&client->send_mutex);
-    qemu_co_queue_init(&client->free_sema);
+    assert(connections >= 1 && connections <= MAX_NBD_CONNECTIONS);
 
-    return nbd_client_connect(bs, saddr, export, tlscreds, hostname,
-                              x_dirty_bitmap, errp);
+    nbd_client_session_init(client, bs);
+    ret = nbd_client_connect(client, saddr, export, tlscreds, hostname,
+                             x_dirty_bitmap, errp);
+    if (ret < 0) {
+        return ret;
+    }
+
+    /* Without the server's promise that all connections see the same data,
+     * a write on one connection might not be visible to a later read on
+     * another one, so stick to a single connection then. */
+    if (!(client->info.flags & NBD_FLAG_CAN_MULTI_CONN)) {
+        return 0;
+    }
+
+    for (i = 1; i < connections; i++) {
+        NBDClientSession *s = g_new0(NBDClientSession, 1);
+
+        nbd_client_session_init(s, bs);
+        ret = nbd_client_connect(s, saddr, export, tlscreds, hostname,
+                                 x_dirty_bitmap, errp);
+        if (ret < 0) {
+            g_free(s);
+            nbd_client_close(bs);
+            return ret;
+        }
+        last->next = s;
+        last = s;
+    }
+
+    return 0;
 }
@@ -16,6 +16,7 @@
 #endif
 
 #define MAX_NBD_REQUESTS    16
+#define MAX_NBD_CONNECTIONS 16
 
 typedef struct {
     Coroutine *coroutine;
@@ -37,6 +38,10 @@ typedef struct NBDClientSession {
     NBDReply reply;
     BlockDriverState *bs;
     bool quit;
+
+    /* Additional connections to the same export, only used if the server
+     * advertises NBD_FLAG_CAN_MULTI_CONN */
+    struct NBDClientSession *next;
 } NBDClientSession;
 
 NBDClientSession *nbd_get_client_session(BlockDriverState *bs);
@@ -47,6 +52,7 @@ int nbd_client_init(BlockDriverState *bs,
                     QCryptoTLSCreds *tlscreds,
                     const char *hostname,
                     const char *x_dirty_bitmap,
+                    int connections,
                     Error **errp);
 void nbd_client_close(BlockDriverState *bs);
 
@@ -30,6 +30,13 @@
 #define NVME_QUEUE_SIZE 128
 #define NVME_BAR_SIZE 8192
 
+/*
+ * Upper bound for the number of I/O queue pairs.  Each AioContext that
+ * submits requests gets its own queue pair until they run out, so this is
+ * also how many iothreads can submit without sharing a queue lock.
+ */
+#define NVME_MAX_IO_QUEUES 8
+
 typedef struct {
     int32_t  head, tail;
     uint8_t  *queue;
@@ -55,6 +62,13 @@ typedef struct {
     int         index;
     uint8_t     *prp_list_pages;
 
+    /*
+     * The AioContext that submits to this queue pair and processes its
+     * completions, or NULL if none claimed it yet.  Claimed with
+     * atomic_cmpxchg(), released with the node drained.
+     */
+    AioContext  *aio_context;
+
     /* Fields protected by @lock */
     NVMeQueue   sq, cq;
     int         cq_phase;
@@ -62,6 +76,7 @@ typedef struct {
     bool        busy;
     int         need_kick;
     int         inflight;
+    int         plugged;
 } NVMeQueuePair;
 
 /* Memory mapped registers */
@@ -86,7 +101,16 @@ typedef volatile struct {
 
 QEMU_BUILD_BUG_ON(offsetof(NVMeRegs, doorbells) != 0x1000);
 
+typedef struct BDRVNVMeState BDRVNVMeState;
+
+/* An MSI-X vector */
 typedef struct {
+    EventNotifier notifier;
+    BDRVNVMeState *s;
+    int index;
+} NVMeIrq;
+
+struct BDRVNVMeState {
     AioContext *aio_context;
     QEMUVFIOState *vfio;
     NVMeRegs *regs;
@@ -100,11 +124,17 @@ typedef struct {
     /* How many uint32_t elements does each doorbell entry take. */
     size_t doorbell_scale;
     bool write_cache_supported;
-    EventNotifier irq_notifier;
+
+    /* Vector 0 serves the admin queue and vector i serves io queue i.  If
+     * the device has a single vector, io queue 1 shares it with the admin
+     * queue and there are no other io queues.
+     */
+    NVMeIrq irqs[NVME_MAX_IO_QUEUES + 1];
+    int nr_irqs;
+
     uint64_t nsze; /* Namespace size reported by identify command */
     int nsid;      /* The namespace id to read/write data. */
     uint64_t max_transfer;
-    bool plugged;
 
     CoMutex dma_map_lock;
     CoQueue dma_flush_queue;
@@ -114,7 +144,7 @@ typedef struct {
 
     /* PCI address (required for nvme_refresh_filename()) */
     char *device;
-} BDRVNVMeState;
+};
 
 #define NVME_BLOCK_OPT_DEVICE "device"
 #define NVME_BLOCK_OPT_NAMESPACE "namespace"
@@ -227,7 +257,7 @@ fail:
 /* With q->lock */
 static void nvme_kick(BDRVNVMeState *s, NVMeQueuePair *q)
 {
-    if (s->plugged || !q->need_kick) {
+    if (q->plugged || !q->need_kick) {
         return;
     }
     trace_nvme_kick(s, q->index);
@@ -305,7 +335,7 @@ static bool nvme_process_completion(BDRVNVMeState *s, NVMeQueuePair *q)
     NvmeCqe *c;
 
     trace_nvme_process_completion(s, q->index, q->inflight);
-    if (q->busy || s->plugged) {
+    if (q->busy || q->plugged) {
         trace_nvme_process_completion_queue_busy(s, q->index);
         return false;
     }
@@ -471,18 +501,33 @@ out:
     qemu_vfree(resp);
 }
 
-static bool nvme_poll_queues(BDRVNVMeState *s)
+/* With q->lock */
+static bool nvme_poll_queue_pair(BDRVNVMeState *s, NVMeQueuePair *q)
 {
     bool progress = false;
-    int i;
 
-    for (i = 0; i < s->nr_queues; i++) {
-        NVMeQueuePair *q = s->queues[i];
+    while (nvme_process_completion(s, q)) {
+        /* Keep polling */
+        progress = true;
+    }
+    return progress;
+}
+
+static bool nvme_poll_irq(NVMeIrq *irq)
+{
+    BDRVNVMeState *s = irq->s;
+    NVMeQueuePair *q = s->queues[irq->index];
+    bool progress;
+
+    qemu_mutex_lock(&q->lock);
+    progress = nvme_poll_queue_pair(s, q);
+    qemu_mutex_unlock(&q->lock);
+
+    if (irq->index == 0 && s->nr_irqs == 1 && s->nr_queues > 1) {
+        /* io queue 1 shares the vector */
+        q = s->queues[1];
         qemu_mutex_lock(&q->lock);
-        while (nvme_process_completion(s, q)) {
-            /* Keep polling */
-            progress = true;
-        }
+        progress |= nvme_poll_queue_pair(s, q);
         qemu_mutex_unlock(&q->lock);
     }
     return progress;
@@ -490,17 +535,86 @@ static bool nvme_poll_queues(BDRVNVMeState *s)
 
 static void nvme_handle_event(EventNotifier *n)
 {
-    BDRVNVMeState *s = container_of(n, BDRVNVMeState, irq_notifier);
+    NVMeIrq *irq = container_of(n, NVMeIrq, notifier);
 
-    trace_nvme_handle_event(s);
+    trace_nvme_handle_event(irq->s, irq->index);
     event_notifier_test_and_clear(n);
-    nvme_poll_queues(s);
+    nvme_poll_irq(irq);
+}
+
+static NVMeIrq *nvme_queue_pair_irq(BDRVNVMeState *s, NVMeQueuePair *q)
+{
+    return &s->irqs[s->nr_irqs > 1 ? q->index : 0];
+}
+
+static bool nvme_poll_cb(void *opaque)
+{
+    EventNotifier *e = opaque;
+    NVMeIrq *irq = container_of(e, NVMeIrq, notifier);
+
+    trace_nvme_poll_cb(irq->s, irq->index);
+    return nvme_poll_irq(irq);
+}
+
+/* Process completions of @q, and submit its requests, in @ctx */
+static void nvme_attach_queue_pair(BDRVNVMeState *s, NVMeQueuePair *q,
+                                   AioContext *ctx)
+{
+    NVMeIrq *irq = nvme_queue_pair_irq(s, q);
+
+    trace_nvme_attach_queue_pair(s, q->index, ctx);
+    atomic_set(&q->aio_context, ctx);
+    if (q->index == 0 || irq->index != 0) {
+        aio_set_event_notifier(ctx, &irq->notifier, false,
+                               nvme_handle_event, nvme_poll_cb);
+    }
+}
+
+static void nvme_detach_queue_pair(BDRVNVMeState *s, NVMeQueuePair *q)
+{
+    NVMeIrq *irq = nvme_queue_pair_irq(s, q);
+    AioContext *ctx = atomic_read(&q->aio_context);
+
+    if (!ctx) {
+        return;
+    }
+    if (q->index == 0 || irq->index != 0) {
+        aio_set_event_notifier(ctx, &irq->notifier, false, NULL, NULL);
+    }
+    atomic_set(&q->aio_context, NULL);
+}
+
+/*
+ * Return the io queue pair for requests from @ctx.  Every AioContext gets
+ * its own queue pair, so that iothreads do not contend on the queue lock
+ * and each one handles its own completion interrupts; once they are all
+ * taken, AioContexts have to share.
+ */
+static NVMeQueuePair *nvme_get_queue_pair(BDRVNVMeState *s, AioContext *ctx)
+{
+    int i;
+
+    assert(s->nr_queues > 1);
+    for (i = 1; i < s->nr_queues; i++) {
+        NVMeQueuePair *q = s->queues[i];
+        AioContext *owner = atomic_read(&q->aio_context);
+
+        if (owner == ctx) {
+            return q;
+        }
+        if (!owner && !atomic_cmpxchg(&q->aio_context, NULL, ctx)) {
+            nvme_attach_queue_pair(s, q, ctx);
+            return q;
+        }
+    }
+    return s->queues[1 + g_direct_hash(ctx) % (s->nr_queues - 1)];
 }
 
 static bool nvme_add_io_queue(BlockDriverState *bs, Error **errp)
 {
     BDRVNVMeState *s = bs->opaque;
     int n = s->nr_queues;
+    int vector = s->nr_irqs > 1 ? n : 0;
     NVMeQueuePair *q;
     NvmeCmd cmd;
     int queue_size = NVME_QUEUE_SIZE;
@@ -513,7 +627,7 @@ static bool nvme_add_io_queue(BlockDriverState *bs, Error **errp)
         .opcode = NVME_ADM_CMD_CREATE_CQ,
         .prp1 = cpu_to_le64(q->cq.iova),
         .cdw10 = cpu_to_le32(((queue_size - 1) << 16) | (n & 0xFFFF)),
-        .cdw11 = cpu_to_le32(0x3),
+        .cdw11 = cpu_to_le32((vector << 16) | 0x3),
     };
     if (nvme_cmd_sync(bs, s->queues[0], &cmd)) {
         error_setg(errp, "Failed to create io queue [%d]", n);
@@ -537,15 +651,20 @@ static bool nvme_add_io_queue(BlockDriverState *bs, Error **errp)
     return true;
 }
 
-static bool nvme_poll_cb(void *opaque)
+/*
+ * Ask the controller for @n io queue pairs.  It may grant fewer, in which
+ * case creating the extra ones fails.
+ */
+static bool nvme_set_num_queues(BlockDriverState *bs, int n)
 {
-    EventNotifier *e = opaque;
-    BDRVNVMeState *s = container_of(e, BDRVNVMeState, irq_notifier);
-    bool progress = false;
+    BDRVNVMeState *s = bs->opaque;
+    NvmeCmd cmd = {
+        .opcode = NVME_ADM_CMD_SET_FEATURES,
+        .cdw10 = cpu_to_le32(NVME_NUMBER_OF_QUEUES),
+        .cdw11 = cpu_to_le32(((n - 1) << 16) | (n - 1)),
+    };
 
-    trace_nvme_poll_cb(s);
-    progress = nvme_poll_queues(s);
-    return progress;
+    return nvme_cmd_sync(bs, s->queues[0], &cmd) == 0;
 }
 
 static int nvme_init(BlockDriverState *bs, const char *device, int namespace,
@@ -556,6 +675,8 @@ static int nvme_init(BlockDriverState *bs, const char *device, int namespace,
     uint64_t cap;
     uint64_t timeout_ms;
     uint64_t deadline, now;
+    EventNotifier *notifiers[NVME_MAX_IO_QUEUES + 1];
+    int i, nr_irqs, nr_io_queues;
     Error *local_err = NULL;
 
     qemu_co_mutex_init(&s->dma_map_lock);
@@ -563,11 +684,6 @@ static int nvme_init(BlockDriverState *bs, const char *device, int namespace,
     s->device = g_strdup(device);
     s->nsid = namespace;
     s->aio_context = bdrv_get_aio_context(bs);
-    ret = event_notifier_init(&s->irq_notifier, 0);
-    if (ret) {
-        error_setg(errp, "Failed to init event notifier");
-        return ret;
-    }
 
     s->vfio = qemu_vfio_open_pci(device, errp);
     if (!s->vfio) {
@@ -640,13 +756,33 @@ static int nvme_init(BlockDriverState *bs, const char *device, int namespace,
         }
     }
 
-    ret = qemu_vfio_pci_init_irq(s->vfio, &s->irq_notifier,
+    ret = qemu_vfio_pci_get_irq_count(s->vfio, VFIO_PCI_MSIX_IRQ_INDEX, errp);
+    if (ret < 0) {
+        goto out;
+    }
+    if (ret == 0) {
+        error_setg(errp, "Device has no MSI-X interrupts");
+        ret = -EINVAL;
+        goto out;
+    }
+    nr_irqs = MIN(ret, NVME_MAX_IO_QUEUES + 1);
+    for (i = 0; i < nr_irqs; i++) {
+        ret = event_notifier_init(&s->irqs[i].notifier, 0);
+        if (ret) {
+            error_setg(errp, "Failed to init event notifier");
+            goto out;
+        }
+        s->irqs[i].s = s;
+        s->irqs[i].index = i;
+        notifiers[i] = &s->irqs[i].notifier;
+        s->nr_irqs++;
+    }
+    ret = qemu_vfio_pci_init_irq(s->vfio, notifiers, s->nr_irqs,
                                  VFIO_PCI_MSIX_IRQ_INDEX, errp);
     if (ret) {
         goto out;
     }
-    aio_set_event_notifier(bdrv_get_aio_context(bs), &s->irq_notifier,
-                           false, nvme_handle_event, nvme_poll_cb);
+    nvme_attach_queue_pair(s, s->queues[0], s->aio_context);
 
     nvme_identify(bs, namespace, &local_err);
     if (local_err) {
@@ -655,10 +791,28 @@ static int nvme_init(BlockDriverState *bs, const char *device, int namespace,
         goto out;
     }
 
-    /* Set up command queues. */
-    if (!nvme_add_io_queue(bs, errp)) {
-        ret = -EIO;
+    /* Set up command queues, one per interrupt vector if possible. */
+    nr_io_queues = MAX(s->nr_irqs - 1, 1);
+    if (nr_io_queues > 1 && !nvme_set_num_queues(bs, nr_io_queues)) {
+        nr_io_queues = 1;
     }
+    for (i = 0; i < nr_io_queues; i++) {
+        if (!nvme_add_io_queue(bs, &local_err)) {
+            if (i == 0) {
+                error_propagate(errp, local_err);
+                ret = -EIO;
+                goto out;
+            }
+            /* Make do with the queues we have */
+            error_free(local_err);
+            local_err = NULL;
+            break;
+        }
+    }
+    trace_nvme_init_io_queues(s, s->nr_queues - 1, s->nr_irqs);
+
+    /* io queue 1 always belongs to the node's own AioContext */
+    nvme_attach_queue_pair(s, s->queues[1], s->aio_context);
 out:
     /* Cleaning up is done in nvme_file_open() upon error. */
     return ret;
@@ -725,12 +879,13 @@ static void nvme_close(BlockDriverState *bs)
     BDRVNVMeState *s = bs->opaque;
 
     for (i = 0; i < s->nr_queues; ++i) {
+        nvme_detach_queue_pair(s, s->queues[i]);
         nvme_free_queue_pair(bs, s->queues[i]);
     }
     g_free(s->queues);
-    aio_set_event_notifier(bdrv_get_aio_context(bs), &s->irq_notifier,
-                           false, NULL, NULL);
-    event_notifier_cleanup(&s->irq_notifier);
+    for (i = 0; i < s->nr_irqs; ++i) {
+        event_notifier_cleanup(&s->irqs[i].notifier);
+    }
     qemu_vfio_pci_unmap_bar(s->vfio, 0, (void *)s->regs, 0, NVME_BAR_SIZE);
     qemu_vfio_close(s->vfio);
 
@@ -895,14 +1050,17 @@ static void nvme_rw_cb_bh(void *opaque)
     qemu_coroutine_enter(data->co);
 }
 
+/*
+ * Completions are processed by the AioContext that owns the queue pair,
+ * which is not the submitter's if several AioContexts share it, so always
+ * go through a BH in the submitter's context.  The submitting coroutine
+ * yields exactly once, even if the command completed before
+ * nvme_submit_command() returned.
+ */
 static void nvme_rw_cb(void *opaque, int ret)
 {
     NVMeCoData *data = opaque;
     data->ret = ret;
-    if (!data->co) {
-        /* The rw coroutine hasn't yielded, don't try to enter. */
-        return;
-    }
     aio_bh_schedule_oneshot(data->ctx, nvme_rw_cb_bh, data);
 }
 
@@ -914,7 +1072,7 @@ static coroutine_fn int nvme_co_prw_aligned(BlockDriverState *bs,
 {
     int r;
     BDRVNVMeState *s = bs->opaque;
-    NVMeQueuePair *ioq = s->queues[1];
+    NVMeQueuePair *ioq;
     NVMeRequest *req;
     uint32_t cdw12 = (((bytes >> BDRV_SECTOR_BITS) - 1) & 0xFFFF) |
                        (flags & BDRV_REQ_FUA ? 1 << 30 : 0);
@@ -926,12 +1084,12 @@ static coroutine_fn int nvme_co_prw_aligned(BlockDriverState *bs,
         .cdw12 = cpu_to_le32(cdw12),
     };
     NVMeCoData data = {
-        .ctx = bdrv_get_aio_context(bs),
+        .ctx = bdrv_get_request_aio_context(bs),
         .ret = -EINPROGRESS,
     };
 
     trace_nvme_prw_aligned(s, is_write, offset, bytes, flags, qiov->niov);
-    assert(s->nr_queues > 1);
+    ioq = nvme_get_queue_pair(s, data.ctx);
     req = nvme_get_free_req(ioq);
     assert(req);
 
@@ -942,12 +1100,10 @@ static coroutine_fn int nvme_co_prw_aligned(BlockDriverState *bs,
         req->busy = false;
         return r;
     }
-    nvme_submit_command(s, ioq, req, &cmd, nvme_rw_cb, &data);
-
     data.co = qemu_coroutine_self();
-    while (data.ret == -EINPROGRESS) {
-        qemu_coroutine_yield();
-    }
+    nvme_submit_command(s, ioq, req, &cmd, nvme_rw_cb, &data);
+    qemu_coroutine_yield();
+    assert(data.ret != -EINPROGRESS);
 
     qemu_co_mutex_lock(&s->dma_map_lock);
     r = nvme_cmd_unmap_qiov(bs, qiov);
@@ -1028,26 +1184,24 @@ static coroutine_fn int nvme_co_pwritev(BlockDriverState *bs,
 static coroutine_fn int nvme_co_flush(BlockDriverState *bs)
 {
     BDRVNVMeState *s = bs->opaque;
-    NVMeQueuePair *ioq = s->queues[1];
+    NVMeQueuePair *ioq;
     NVMeRequest *req;
     NvmeCmd cmd = {
         .opcode = NVME_CMD_FLUSH,
         .nsid = cpu_to_le32(s->nsid),
     };
     NVMeCoData data = {
-        .ctx = bdrv_get_aio_context(bs),
+        .ctx = bdrv_get_request_aio_context(bs),
         .ret = -EINPROGRESS,
     };
 
-    assert(s->nr_queues > 1);
+    ioq = nvme_get_queue_pair(s, data.ctx);
     req = nvme_get_free_req(ioq);
     assert(req);
-    nvme_submit_command(s, ioq, req, &cmd, nvme_rw_cb, &data);
-
     data.co = qemu_coroutine_self();
-    if (data.ret == -EINPROGRESS) {
-        qemu_coroutine_yield();
-    }
+    nvme_submit_command(s, ioq, req, &cmd, nvme_rw_cb, &data);
+    qemu_coroutine_yield();
+    assert(data.ret != -EINPROGRESS);
 
     return data.ret;
 }
@@ -1079,9 +1233,12 @@ static void nvme_refresh_limits(BlockDriverState *bs, Error **errp)
 static void nvme_detach_aio_context(BlockDriverState *bs)
 {
     BDRVNVMeState *s = bs->opaque;
+    int i;
 
-    aio_set_event_notifier(bdrv_get_aio_context(bs), &s->irq_notifier,
-                           false, NULL, NULL);
+    /* Other AioContexts claim their queue pairs again on the next request */
+    for (i = 0; i < s->nr_queues; i++) {
+        nvme_detach_queue_pair(s, s->queues[i]);
+    }
 }
 
 static void nvme_attach_aio_context(BlockDriverState *bs,
@@ -1090,30 +1247,34 @@ static void nvme_attach_aio_context(BlockDriverState *bs,
     BDRVNVMeState *s = bs->opaque;
 
     s->aio_context = new_context;
-    aio_set_event_notifier(new_context, &s->irq_notifier,
-                           false, nvme_handle_event, nvme_poll_cb);
+    nvme_attach_queue_pair(s, s->queues[0], new_context);
+    nvme_attach_queue_pair(s, s->queues[1], new_context);
 }
 
 static void nvme_aio_plug(BlockDriverState *bs)
 {
     BDRVNVMeState *s = bs->opaque;
-    assert(!s->plugged);
-    s->plugged = true;
+    NVMeQueuePair *q;
+
+    q = nvme_get_queue_pair(s, bdrv_get_request_aio_context(bs));
+    qemu_mutex_lock(&q->lock);
+    q->plugged++;
+    qemu_mutex_unlock(&q->lock);
 }
 
 static void nvme_aio_unplug(BlockDriverState *bs)
 {
-    int i;
     BDRVNVMeState *s = bs->opaque;
-    assert(s->plugged);
-    s->plugged = false;
-    for (i = 1; i < s->nr_queues; i++) {
-        NVMeQueuePair *q = s->queues[i];
-        qemu_mutex_lock(&q->lock);
+    NVMeQueuePair *q;
+
+    q = nvme_get_queue_pair(s, bdrv_get_request_aio_context(bs));
+    qemu_mutex_lock(&q->lock);
+    assert(q->plugged);
+    if (--q->plugged == 0) {
         nvme_kick(s, q);
         nvme_process_completion(s, q);
-        qemu_mutex_unlock(&q->lock);
     }
+    qemu_mutex_unlock(&q->lock);
 }
 
 static void nvme_register_buf(BlockDriverState *bs, void *host, size_t size)
@@ -1148,6 +1309,7 @@ static BlockDriver bdrv_nvme = {
     .format_name              = "nvme",
     .protocol_name            = "nvme",
     .instance_size            = sizeof(BDRVNVMeState),
+    .supports_multiqueue      = true,
 
     .bdrv_parse_filename      = nvme_parse_filename,
     .bdrv_file_open           = nvme_file_open,
@@ -427,10 +427,47 @@ static void bdrv_latency_histogram_stats(BlockLatencyHistogram *hist,
     }
 }
 
+static void bdrv_latency_percentiles(const BlockAcctPercentiles *p,
+                                     bool *not_null,
+                                     BlockLatencyPercentiles **info)
+{
+    *not_null = p->samples > 0;
+    if (*not_null) {
+        *info = g_new0(BlockLatencyPercentiles, 1);
+
+        (*info)->samples = p->samples;
+        (*info)->p50 = p->p50;
+        (*info)->p90 = p->p90;
+        (*info)->p99 = p->p99;
+        (*info)->p999 = p->p999;
+    }
+}
+
+static void bdrv_throttle_stats(ThrottleGroupMember *tgm,
+                                BlockDeviceStats *ds)
+{
+    ThrottleGroupMemberStats stats;
+    BlockThrottleStats *info;
+
+    throttle_group_get_stats(tgm, &stats);
+
+    info = g_new0(BlockThrottleStats, 1);
+    info->rd_queued_operations = stats.queued_reqs[false];
+    info->wr_queued_operations = stats.queued_reqs[true];
+    info->rd_queue_time_ns = stats.queue_time_ns[false];
+    info->wr_queue_time_ns = stats.queue_time_ns[true];
+    info->rd_max_queue_time_ns = stats.max_queue_time_ns[false];
+    info->wr_max_queue_time_ns = stats.max_queue_time_ns[true];
+
+    ds->has_throttle_stats = true;
+    ds->throttle_stats = info;
+}
+
 static void bdrv_query_blk_stats(BlockDeviceStats *ds, BlockBackend *blk)
 {
     BlockAcctStats *stats = blk_get_stats(blk);
     BlockAcctTimedStats *ts = NULL;
+    BlockAcctPercentiles p;
 
     ds->rd_bytes = stats->nr_bytes[BLOCK_ACCT_READ];
     ds->wr_bytes = stats->nr_bytes[BLOCK_ACCT_WRITE];
@@ -491,6 +528,17 @@ static void bdrv_query_blk_stats(BlockDeviceStats *ds, BlockBackend *blk)
             block_acct_queue_depth(ts, BLOCK_ACCT_READ);
         dev_stats->avg_wr_queue_depth =
             block_acct_queue_depth(ts, BLOCK_ACCT_WRITE);
+
+        block_acct_timed_latency_percentiles(ts, BLOCK_ACCT_READ, &p);
+        bdrv_latency_percentiles(&p, &dev_stats->has_rd_latency_percentiles,
+                                 &dev_stats->rd_latency_percentiles);
+        block_acct_timed_latency_percentiles(ts, BLOCK_ACCT_WRITE, &p);
+        bdrv_latency_percentiles(&p, &dev_stats->has_wr_latency_percentiles,
+                                 &dev_stats->wr_latency_percentiles);
+        block_acct_timed_latency_percentiles(ts, BLOCK_ACCT_FLUSH, &p);
+        bdrv_latency_percentiles(&p,
+                                 &dev_stats->has_flush_latency_percentiles,
+                                 &dev_stats->flush_latency_percentiles);
     }
 
     bdrv_latency_histogram_stats(&stats->latency_histogram[BLOCK_ACCT_READ],
@@ -502,6 +550,23 @@ static void bdrv_query_blk_stats(BlockDeviceStats *ds, BlockBackend *blk)
     bdrv_latency_histogram_stats(&stats->latency_histogram[BLOCK_ACCT_FLUSH],
                                  &ds->has_flush_latency_histogram,
                                  &ds->flush_latency_histogram);
+
+    block_acct_latency_percentiles(stats, BLOCK_ACCT_READ, &p);
+    bdrv_latency_percentiles(&p, &ds->has_rd_latency_percentiles,
+                             &ds->rd_latency_percentiles);
+    block_acct_latency_percentiles(stats, BLOCK_ACCT_WRITE, &p);
+    bdrv_latency_percentiles(&p, &ds->has_wr_latency_percentiles,
+                             &ds->wr_latency_percentiles);
+    block_acct_latency_percentiles(stats, BLOCK_ACCT_FLUSH, &p);
+    bdrv_latency_percentiles(&p, &ds->has_flush_latency_percentiles,
+                             &ds->flush_latency_percentiles);
+
+    /* Throttling of the device takes precedence over a throttle node at
+     * the top of its graph */
+    if (blk_get_public(blk)->throttle_group_member.throttle_state) {
+        qapi_free_BlockThrottleStats(ds->throttle_stats);
+        bdrv_throttle_stats(&blk_get_public(blk)->throttle_group_member, ds);
+    }
 }
 
 static BlockStats *bdrv_query_bds_stats(BlockDriverState *bs,
@@ -531,6 +596,15 @@ static BlockStats *bdrv_query_bds_stats(BlockDriverState *bs,
 
     s->stats->wr_highest_offset = stat64_get(&bs->wr_highest_offset);
 
+    if (bs->detect_zeroes != BLOCKDEV_DETECT_ZEROES_OPTIONS_OFF) {
+        s->stats->has_detected_zero_bytes = true;
+        s->stats->detected_zero_bytes = stat64_get(&bs->detected_zero_bytes);
+    }
+
+    if (bs->drv && !strcmp(bs->drv->format_name, "throttle")) {
+        bdrv_throttle_stats(bs->opaque, s->stats);
+    }
+
     if (bs->file) {
         s->has_parent = true;
         s->parent = bdrv_query_bds_stats(bs->file->bs, blk_level);
@@ -28,11 +28,20 @@
 #include "qcow2.h"
 #include "trace.h"
 
+/*
+ * Cached tables are found through a hash table indexed by their offset in
+ * the image file, so that lookups stay O(1) with hundreds of thousands of
+ * entries.  Victims for replacement are picked with the clock algorithm:
+ * the hand skips (and clears the referenced bit of) every table that was
+ * used since it last came by, and takes the first one that wasn't.
+ */
 typedef struct Qcow2CachedTable {
     int64_t  offset;
     uint64_t lru_counter;
     int      ref;
+    int      hash_next;     /* next entry in the same bucket, or -1 */
     bool     dirty;
+    bool     referenced;
 } Qcow2CachedTable;
 
 struct Qcow2Cache {
@@ -42,8 +51,13 @@ struct Qcow2Cache {
     int                     table_size;
     bool                    depends_on_flush;
     void                   *table_array;
+    int                    *buckets;
+    unsigned                bucket_mask;
+    int                     clock_hand;
+    int                     prefetch_hand;
     uint64_t                lru_counter;
     uint64_t                cache_clean_lru_counter;
+    uint64_t                generation;
 };
 
 static inline void *qcow2_cache_get_table_addr(Qcow2Cache *c, int table)
@@ -59,6 +73,80 @@ static inline int qcow2_cache_get_table_idx(Qcow2Cache *c, void *table)
     return idx;
 }
 
+static inline int *qcow2_cache_bucket(Qcow2Cache *c, uint64_t offset)
+{
+    return &c->buckets[(offset / c->table_size) & c->bucket_mask];
+}
+
+static int qcow2_cache_find(Qcow2Cache *c, uint64_t offset)
+{
+    int i;
+
+    for (i = *qcow2_cache_bucket(c, offset); i >= 0;
+         i = c->entries[i].hash_next) {
+        if (c->entries[i].offset == offset) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/* Change the offset of entry @i, keeping the hash table up to date */
+static void qcow2_cache_set_offset(Qcow2Cache *c, int i, uint64_t offset)
+{
+    Qcow2CachedTable *t = &c->entries[i];
+    int *p;
+
+    if (t->offset == offset) {
+        return;
+    }
+
+    if (t->offset) {
+        for (p = qcow2_cache_bucket(c, t->offset); *p != i;
+             p = &c->entries[*p].hash_next) {
+            assert(*p >= 0);
+        }
+        *p = t->hash_next;
+        t->hash_next = -1;
+    }
+
+    t->offset = offset;
+
+    if (offset) {
+        p = qcow2_cache_bucket(c, offset);
+        t->hash_next = *p;
+        *p = i;
+    }
+}
+
+/*
+ * Advance the clock hand to an unused table, giving every table that was
+ * referenced since the last pass a second chance.  Returns -1 if all
+ * tables are in use.
+ */
+static int qcow2_cache_find_victim(Qcow2Cache *c)
+{
+    int n;
+
+    for (n = 0; n < 2 * c->size; n++) {
+        Qcow2CachedTable *t = &c->entries[c->clock_hand];
+        int i = c->clock_hand;
+
+        if (++c->clock_hand == c->size) {
+            c->clock_hand = 0;
+        }
+        if (t->ref) {
+            continue;
+        }
+        if (t->offset && t->referenced) {
+            t->referenced = false;
+            continue;
+        }
+        return i;
+    }
+    return -1;
+}
+
 static inline const char *qcow2_cache_get_name(BDRVQcow2State *s, Qcow2Cache *c)
 {
     if (c == s->refcount_block_cache) {
@@ -106,8 +194,9 @@ void qcow2_cache_clean_unused(Qcow2Cache *c)
 
         /* And count how many we can clean in a row */
         while (i < c->size && can_clean_entry(c, i)) {
-            c->entries[i].offset = 0;
+            qcow2_cache_set_offset(c, i, 0);
             c->entries[i].lru_counter = 0;
+            c->entries[i].referenced = false;
             i++;
             to_clean++;
         }
@@ -125,25 +214,38 @@ Qcow2Cache *qcow2_cache_create(BlockDriverState *bs, int num_tables,
 {
     BDRVQcow2State *s = bs->opaque;
     Qcow2Cache *c;
+    unsigned nb_buckets;
+    int i;
 
     assert(num_tables > 0);
     assert(is_power_of_2(table_size));
     assert(table_size >= (1 << MIN_CLUSTER_BITS));
     assert(table_size <= s->cluster_size);
 
+    /* Keep the load factor of the hash table at or below one */
+    nb_buckets = pow2ceil(num_tables);
+
     c = g_new0(Qcow2Cache, 1);
     c->size = num_tables;
     c->table_size = table_size;
+    c->bucket_mask = nb_buckets - 1;
     c->entries = g_try_new0(Qcow2CachedTable, num_tables);
+    c->buckets = g_try_new(int, nb_buckets);
     c->table_array = qemu_try_blockalign(bs->file->bs,
                                          (size_t) num_tables * c->table_size);
 
-    if (!c->entries || !c->table_array) {
+    if (!c->entries || !c->buckets || !c->table_array) {
         qemu_vfree(c->table_array);
+        g_free(c->buckets);
         g_free(c->entries);
         g_free(c);
-        c = NULL;
+        return NULL;
+    }
+
+    for (i = 0; i < num_tables; i++) {
+        c->entries[i].hash_next = -1;
     }
+    memset(c->buckets, -1, nb_buckets * sizeof(int));
 
     return c;
 }
@@ -157,6 +259,7 @@ int qcow2_cache_destroy(Qcow2Cache *c)
     }
 
     qemu_vfree(c->table_array);
+    g_free(c->buckets);
     g_free(c->entries);
     g_free(c);
 
@@ -224,6 +327,7 @@ static int qcow2_cache_entry_flush(BlockDriverState *bs, Qcow2Cache *c, int i)
         BLKDBG_EVENT(bs->file, BLKDBG_L2_UPDATE);
     }
 
+    c->generation++;
     ret = bdrv_pwrite(bs->file, c->entries[i].offset,
                       qcow2_cache_get_table_addr(c, i), c->table_size);
     if (ret < 0) {
@@ -307,13 +411,16 @@ int qcow2_cache_empty(BlockDriverState *bs, Qcow2Cache *c)
 
     for (i = 0; i < c->size; i++) {
         assert(c->entries[i].ref == 0);
-        c->entries[i].offset = 0;
+        qcow2_cache_set_offset(c, i, 0);
         c->entries[i].lru_counter = 0;
+        c->entries[i].referenced = false;
     }
 
     qcow2_cache_table_release(c, 0, c->size);
 
     c->lru_counter = 0;
+    c->clock_hand = 0;
+    c->generation++;
 
     return 0;
 }
@@ -324,9 +431,6 @@ static int qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c,
     BDRVQcow2State *s = bs->opaque;
     int i;
     int ret;
-    int lookup_index;
-    uint64_t min_lru_counter = UINT64_MAX;
-    int min_lru_index = -1;
 
     assert(offset != 0);
 
@@ -341,29 +445,19 @@ static int qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c,
     }
 
     /* Check if the table is already cached */
-    i = lookup_index = (offset / c->table_size * 4) % c->size;
-    do {
-        const Qcow2CachedTable *t = &c->entries[i];
-        if (t->offset == offset) {
-            goto found;
-        }
-        if (t->ref == 0 && t->lru_counter < min_lru_counter) {
-            min_lru_counter = t->lru_counter;
-            min_lru_index = i;
-        }
-        if (++i == c->size) {
-            i = 0;
-        }
-    } while (i != lookup_index);
+    i = qcow2_cache_find(c, offset);
+    if (i >= 0) {
+        goto found;
+    }
 
-    if (min_lru_index == -1) {
+    i = qcow2_cache_find_victim(c);
+    if (i < 0) {
         /* This can't happen in current synchronous code, but leave the check
          * here as a reminder for whoever starts using AIO with the cache */
         abort();
     }
 
     /* Cache miss: write a table back and replace it */
-    i = min_lru_index;
     trace_qcow2_cache_get_replace_entry(qemu_coroutine_self(),
                                         c == s->l2_table_cache, i);
 
@@ -374,7 +468,7 @@ static int qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c,
 
     trace_qcow2_cache_get_read(qemu_coroutine_self(),
                                c == s->l2_table_cache, i);
-    c->entries[i].offset = 0;
+    qcow2_cache_set_offset(c, i, 0);
     if (read_from_disk) {
         if (c == s->l2_table_cache) {
             BLKDBG_EVENT(bs->file, BLKDBG_L2_LOAD);
@@ -388,11 +482,12 @@ static int qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c,
         }
     }
 
-    c->entries[i].offset = offset;
+    qcow2_cache_set_offset(c, i, offset);
 
     /* And return the right table */
 found:
     c->entries[i].ref++;
+    c->entries[i].referenced = true;
     *table = qcow2_cache_get_table_addr(c, i);
 
     trace_qcow2_cache_get_done(qemu_coroutine_self(),
@@ -413,6 +508,23 @@ int qcow2_cache_get_empty(BlockDriverState *bs, Qcow2Cache *c, uint64_t offset,
     return qcow2_cache_do_get(bs, c, offset, table, false);
 }
 
+/*
+ * Like qcow2_cache_get(), but never does I/O and therefore never yields:
+ * returns NULL if the table at @offset is not in the cache.
+ */
+void *qcow2_cache_lookup(Qcow2Cache *c, uint64_t offset)
+{
+    int i = qcow2_cache_find(c, offset);
+
+    if (i < 0) {
+        return NULL;
+    }
+
+    c->entries[i].ref++;
+    c->entries[i].referenced = true;
+    return qcow2_cache_get_table_addr(c, i);
+}
+
 void qcow2_cache_put(Qcow2Cache *c, void **table)
 {
     int i = qcow2_cache_get_table_idx(c, *table);
@@ -432,18 +544,14 @@ void qcow2_cache_entry_mark_dirty(Qcow2Cache *c, void *table)
     int i = qcow2_cache_get_table_idx(c, table);
     assert(c->entries[i].offset != 0);
     c->entries[i].dirty = true;
+    c->generation++;
 }
 
 void *qcow2_cache_is_table_offset(Qcow2Cache *c, uint64_t offset)
 {
-    int i;
+    int i = qcow2_cache_find(c, offset);
 
-    for (i = 0; i < c->size; i++) {
-        if (c->entries[i].offset == offset) {
-            return qcow2_cache_get_table_addr(c, i);
-        }
-    }
-    return NULL;
+    return i >= 0 ? qcow2_cache_get_table_addr(c, i) : NULL;
 }
 
 void qcow2_cache_discard(Qcow2Cache *c, void *table)
@@ -452,9 +560,59 @@ void qcow2_cache_discard(Qcow2Cache *c, void *table)
 
     assert(c->entries[i].ref == 0);
 
-    c->entries[i].offset = 0;
+    qcow2_cache_set_offset(c, i, 0);
     c->entries[i].lru_counter = 0;
     c->entries[i].dirty = false;
+    c->entries[i].referenced = false;
+    c->generation++;
 
     qcow2_cache_table_release(c, i, 1);
 }
+
+/*
+ * Returns a counter that changes whenever a table in the cache is modified,
+ * written back or discarded.  A table that was read from the image file
+ * while the counter didn't change is identical to what the cache would
+ * have read itself.
+ */
+uint64_t qcow2_cache_generation(Qcow2Cache *c)
+{
+    return c->generation;
+}
+
+/*
+ * Adds a clean copy of the table at @offset that the caller read from the
+ * image file itself.  Only unused entries are filled, so that prefetching
+ * never evicts a table that is actually in use, and nothing is written
+ * back, so this never yields.
+ *
+ * Returns false if the cache has no unused entry left.
+ */
+bool qcow2_cache_prefetch(Qcow2Cache *c, uint64_t offset, const void *table)
+{
+    int i, n;
+
+    assert(offset != 0 && QEMU_IS_ALIGNED(offset, c->table_size));
+
+    if (qcow2_cache_find(c, offset) >= 0) {
+        return true;
+    }
+
+    for (n = 0; n < c->size; n++) {
+        i = c->prefetch_hand;
+        if (++c->prefetch_hand == c->size) {
+            c->prefetch_hand = 0;
+        }
+
+        if (c->entries[i].offset == 0 && c->entries[i].ref == 0) {
+            memcpy(qcow2_cache_get_table_addr(c, i), table, c->table_size);
+            qcow2_cache_set_offset(c, i, offset);
+            c->entries[i].dirty = false;
+            c->entries[i].referenced = false;
+            c->entries[i].lru_counter = ++c->lru_counter;
+            return true;
+        }
+    }
+
+    return false;
+}
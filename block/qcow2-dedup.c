@@ -0,0 +1,245 @@
+/*
+ * Deduplication of guest data for the QCOW2 format
+ *
+ * Copyright (c) 2004-2006 Fabrice Bellard
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * With the dedup option, the guest data of every write that covers a whole
+ * cluster is hashed.  If a cluster with the same hash was written before,
+ * the guest cluster is linked to the existing data cluster and its refcount
+ * is increased instead of allocating and writing a new one.  Shared data
+ * clusters are copied on write like clusters shared with a snapshot, so the
+ * image stays a plain qcow2 image that every version of QEMU and qemu-img
+ * check understand.
+ *
+ * The index maps the content hash of data clusters to their host offset and
+ * the guest offset of their first reference, which is needed to clear its
+ * QCOW_OFLAG_COPIED when the cluster becomes shared.  It lives in memory
+ * only and is built from the writes of the current session.  Entries are
+ * dropped when their data cluster is written in place or freed, so an entry
+ * always describes the current contents of its cluster.  When the index is
+ * full, the oldest entries are dropped.
+ *
+ * When a guest write copies a shared cluster away, the remaining reference
+ * of the old cluster may be the only one left, but there is no way to find
+ * it to set its QCOW_OFLAG_COPIED.  Instead, the image is marked dirty
+ * before the first cluster is shared and the flags of the active L2 tables
+ * are recomputed when it is marked clean again.  After a crash, the usual
+ * repair of dirty images does the same.
+ *
+ * All functions must be called with s->lock held.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/queue.h"
+#include "block/block_int.h"
+#include "qcow2.h"
+#include "trace.h"
+
+typedef struct Qcow2DedupEntry {
+    uint8_t hash[QCOW2_DEDUP_HASH_SIZE];
+    uint64_t host_offset;       /* data cluster */
+    uint64_t offset;            /* guest cluster that first referenced it */
+    QTAILQ_ENTRY(Qcow2DedupEntry) next;
+} Qcow2DedupEntry;
+
+struct Qcow2Dedup {
+    GHashTable *by_hash;        /* hash -> Qcow2DedupEntry */
+    GHashTable *by_host;        /* host_offset -> Qcow2DedupEntry */
+    QTAILQ_HEAD(, Qcow2DedupEntry) entries; /* oldest first */
+    size_t nb_entries;
+};
+
+/* The hash is cryptographic, so any part of it is a good GHashTable hash */
+static guint qcow2_dedup_hash_func(gconstpointer key)
+{
+    guint h;
+
+    memcpy(&h, key, sizeof(h));
+    return h;
+}
+
+static gboolean qcow2_dedup_hash_equal(gconstpointer a, gconstpointer b)
+{
+    return !memcmp(a, b, QCOW2_DEDUP_HASH_SIZE);
+}
+
+void qcow2_dedup_init(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2Dedup *d;
+
+    assert(!s->dedup);
+
+    d = g_new0(Qcow2Dedup, 1);
+    d->by_hash = g_hash_table_new(qcow2_dedup_hash_func,
+                                  qcow2_dedup_hash_equal);
+    d->by_host = g_hash_table_new(g_int64_hash, g_int64_equal);
+    QTAILQ_INIT(&d->entries);
+
+    s->dedup = d;
+}
+
+void qcow2_dedup_free(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2Dedup *d = s->dedup;
+    Qcow2DedupEntry *e, *next;
+
+    if (!d) {
+        return;
+    }
+
+    QTAILQ_FOREACH_SAFE(e, &d->entries, next, next) {
+        g_free(e);
+    }
+    g_hash_table_destroy(d->by_hash);
+    g_hash_table_destroy(d->by_host);
+    g_free(d);
+
+    s->dedup = NULL;
+}
+
+static void qcow2_dedup_remove(Qcow2Dedup *d, Qcow2DedupEntry *e)
+{
+    g_hash_table_remove(d->by_hash, e->hash);
+    g_hash_table_remove(d->by_host, &e->host_offset);
+    QTAILQ_REMOVE(&d->entries, e, next);
+    d->nb_entries--;
+    g_free(e);
+}
+
+/*
+ * Drop the index entries of the data clusters in [@host_offset,
+ * @host_offset + @bytes), whose contents are about to change.
+ */
+void qcow2_dedup_forget(BlockDriverState *bs, uint64_t host_offset,
+                        uint64_t bytes)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2Dedup *d = s->dedup;
+    uint64_t cluster = start_of_cluster(s, host_offset);
+
+    if (!d || !d->nb_entries) {
+        return;
+    }
+
+    for (; cluster < host_offset + bytes; cluster += s->cluster_size) {
+        Qcow2DedupEntry *e = g_hash_table_lookup(d->by_host, &cluster);
+        if (e) {
+            qcow2_dedup_remove(d, e);
+        }
+    }
+}
+
+/*
+ * Record that the guest cluster at @offset was just written with data that
+ * has the content hash @hash, and linked to the new data cluster at
+ * @host_offset.
+ */
+void qcow2_dedup_insert(BlockDriverState *bs, uint64_t offset,
+                        uint64_t host_offset, const uint8_t *hash)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2Dedup *d = s->dedup;
+    Qcow2DedupEntry *e;
+
+    if (!d || g_hash_table_contains(d->by_hash, hash)) {
+        return;
+    }
+
+    /* A stale entry for the cluster may exist if a write failed */
+    qcow2_dedup_forget(bs, host_offset, s->cluster_size);
+
+    if (d->nb_entries >= QCOW2_DEDUP_MAX_ENTRIES) {
+        qcow2_dedup_remove(d, QTAILQ_FIRST(&d->entries));
+    }
+
+    e = g_new(Qcow2DedupEntry, 1);
+    memcpy(e->hash, hash, QCOW2_DEDUP_HASH_SIZE);
+    e->host_offset = host_offset;
+    e->offset = offset;
+
+    g_hash_table_insert(d->by_hash, e->hash, e);
+    g_hash_table_insert(d->by_host, &e->host_offset, e);
+    QTAILQ_INSERT_TAIL(&d->entries, e, next);
+    d->nb_entries++;
+}
+
+/*
+ * Try to link the guest cluster at @offset, which the caller is about to
+ * overwrite completely with data that has the content hash @hash, to an
+ * existing data cluster with the same contents.
+ *
+ * Returns 1 if the cluster was linked and the write is complete, 0 if it
+ * must be done normally and -errno in error cases.
+ */
+int qcow2_dedup_link(BlockDriverState *bs, uint64_t offset,
+                     const uint8_t *hash)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2Dedup *d = s->dedup;
+    Qcow2DedupEntry *e;
+    QCowL2Meta *m;
+    int ret;
+
+    assert(offset_into_cluster(s, offset) == 0);
+
+    e = d ? g_hash_table_lookup(d->by_hash, hash) : NULL;
+    if (!e) {
+        return 0;
+    }
+
+    /* Leave clusters alone that are being allocated by another request */
+    QLIST_FOREACH(m, &s->cluster_allocs, next_in_flight) {
+        uint64_t start = start_of_cluster(s, l2meta_cow_start(m));
+        uint64_t end = ROUND_UP(l2meta_cow_end(m), s->cluster_size);
+
+        if (offset < end && offset + s->cluster_size > start) {
+            return 0;
+        }
+    }
+
+    /*
+     * Once a shared cluster is written to, its other reference may be left
+     * without QCOW_OFLAG_COPIED.  Keep the image dirty so that this is
+     * repaired after a crash, see qcow2_mark_clean().
+     */
+    if (!s->fix_copied) {
+        ret = qcow2_mark_dirty(bs);
+        if (ret < 0) {
+            return ret;
+        }
+        s->fix_copied = true;
+    }
+
+    ret = qcow2_share_cluster(bs, offset, e->host_offset, e->offset);
+    if (ret == -ESTALE) {
+        /* The image changed behind our back, e.g. a snapshot was applied */
+        qcow2_dedup_remove(d, e);
+        return 0;
+    } else if (ret > 0) {
+        trace_qcow2_dedup_link(qemu_coroutine_self(), offset, e->host_offset);
+    }
+
+    return ret;
+}
@@ -894,6 +894,10 @@ static int QEMU_WARN_UNUSED_RESULT update_refcount(BlockDriverState *bs,
                 qcow2_cache_discard(s->l2_table_cache, table);
             }
 
+            if (s->dedup) {
+                qcow2_dedup_forget(bs, cluster_offset, s->cluster_size);
+            }
+
             if (s->discard_passthrough[type]) {
                 update_refcount_discard(bs, cluster_offset, s->cluster_size);
             }
@@ -1058,6 +1062,133 @@ int64_t qcow2_alloc_clusters_at(BlockDriverState *bs, uint64_t offset,
     return i;
 }
 
+static void coroutine_fn qcow2_prealloc_refill_entry(void *opaque)
+{
+    BlockDriverState *bs = opaque;
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2PreallocRange *range;
+    uint64_t size;
+    int64_t offset;
+    int ret;
+
+    qemu_co_mutex_lock(&s->lock);
+
+    size = s->prealloc_size;
+    if (size == 0) {
+        goto out;
+    }
+
+    offset = qcow2_alloc_clusters(bs, size);
+    if (offset < 0) {
+        goto out;
+    }
+
+    ret = qcow2_pre_write_overlap_check(bs, 0, offset, size, true);
+    if (ret < 0) {
+        qcow2_free_clusters(bs, offset, size, QCOW2_DISCARD_NEVER);
+        goto out;
+    }
+
+    /*
+     * Nothing references the new clusters yet, so they can be zeroed
+     * without holding the lock.  If the image file can't do this cheaply,
+     * the pool still saves the refcount updates.
+     */
+    qemu_co_mutex_unlock(&s->lock);
+    ret = bdrv_co_pwrite_zeroes(bs->file, offset, size, BDRV_REQ_NO_FALLBACK);
+    qemu_co_mutex_lock(&s->lock);
+
+    range = g_new(Qcow2PreallocRange, 1);
+    *range = (Qcow2PreallocRange) {
+        .offset         = offset,
+        .nb_clusters    = size >> s->cluster_bits,
+        .zeroed         = ret == 0,
+    };
+    QSIMPLEQ_INSERT_TAIL(&s->prealloc_ranges, range, next);
+    s->prealloc_nb_clusters += range->nb_clusters;
+
+out:
+    s->prealloc_refilling = false;
+    qemu_co_mutex_unlock(&s->lock);
+    bdrv_dec_in_flight(bs);
+}
+
+/*
+ * Takes up to *nb_clusters contiguous clusters from the pool of preallocated
+ * host clusters.  The clusters already have a refcount of 1.  If *host_offset
+ * is not INV_OFFSET, only clusters that start exactly at *host_offset are
+ * taken.
+ *
+ * Returns true and updates *host_offset, *nb_clusters and *zeroed if clusters
+ * were taken from the pool, false if the caller must allocate them itself.
+ * Either way, a background refill of the pool is started if it runs low.
+ *
+ * Called with s->lock held.
+ */
+bool qcow2_prealloc_take(BlockDriverState *bs, uint64_t *host_offset,
+                         uint64_t *nb_clusters, bool *zeroed)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2PreallocRange *range = QSIMPLEQ_FIRST(&s->prealloc_ranges);
+    bool taken = false;
+    uint64_t n;
+
+    if (s->prealloc_size == 0) {
+        return false;
+    }
+
+    if (range && (*host_offset == INV_OFFSET ||
+                  *host_offset == range->offset))
+    {
+        n = MIN(*nb_clusters, range->nb_clusters);
+
+        *host_offset = range->offset;
+        *nb_clusters = n;
+        *zeroed = range->zeroed;
+
+        range->offset += n << s->cluster_bits;
+        range->nb_clusters -= n;
+        s->prealloc_nb_clusters -= n;
+        if (range->nb_clusters == 0) {
+            QSIMPLEQ_REMOVE_HEAD(&s->prealloc_ranges, next);
+            g_free(range);
+        }
+        taken = true;
+    }
+
+    if (!s->prealloc_refilling &&
+        s->prealloc_nb_clusters < (s->prealloc_size >> s->cluster_bits) / 2)
+    {
+        s->prealloc_refilling = true;
+        bdrv_inc_in_flight(bs);
+        aio_co_schedule(bdrv_get_aio_context(bs),
+                        qemu_coroutine_create(qcow2_prealloc_refill_entry,
+                                              bs));
+    }
+
+    return taken;
+}
+
+/*
+ * Returns all clusters of the preallocated cluster pool to the free space.
+ * This must be done before the image is closed or its refcounts are checked,
+ * otherwise they would show up as leaked clusters.
+ */
+void qcow2_prealloc_release(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2PreallocRange *range;
+
+    while ((range = QSIMPLEQ_FIRST(&s->prealloc_ranges)) != NULL) {
+        QSIMPLEQ_REMOVE_HEAD(&s->prealloc_ranges, next);
+        qcow2_free_clusters(bs, range->offset,
+                            range->nb_clusters << s->cluster_bits,
+                            QCOW2_DISCARD_NEVER);
+        g_free(range);
+    }
+    s->prealloc_nb_clusters = 0;
+}
+
 /* only used to allocate compressed sectors. We try to allocate
    contiguous sectors. size must be <= cluster_size */
 int64_t qcow2_alloc_bytes(BlockDriverState *bs, int size)
@@ -1250,7 +1381,7 @@ int qcow2_update_snapshot_refcount(BlockDriverState *bs,
     l2_slice = NULL;
     l1_table = NULL;
     l1_size2 = l1_size * sizeof(uint64_t);
-    slice_size2 = s->l2_slice_size * sizeof(uint64_t);
+    slice_size2 = s->l2_slice_size * l2_entry_size(s);
     n_slices = s->cluster_size / slice_size2;
 
     s->cache_discards = true;
@@ -1306,7 +1437,7 @@ int qcow2_update_snapshot_refcount(BlockDriverState *bs,
                     uint64_t cluster_index;
                     uint64_t offset;
 
-                    entry = be64_to_cpu(l2_slice[j]);
+                    entry = get_l2_entry(s, l2_slice, j);
                     old_entry = entry;
                     entry &= ~QCOW_OFLAG_COPIED;
                     offset = entry & L2E_OFFSET_MASK;
@@ -1380,7 +1511,7 @@ int qcow2_update_snapshot_refcount(BlockDriverState *bs,
                             qcow2_cache_set_dependency(bs, s->l2_table_cache,
                                                        s->refcount_block_cache);
                         }
-                        l2_slice[j] = cpu_to_be64(entry);
+                        set_l2_entry(s, l2_slice, j, entry);
                         qcow2_cache_entry_mark_dirty(s->l2_table_cache,
                                                      l2_slice);
                     }
@@ -1601,7 +1732,7 @@ static int check_refcounts_l2(BlockDriverState *bs, BdrvCheckResult *res,
     int i, l2_size, nb_csectors, ret;
 
     /* Read L2 table from disk */
-    l2_size = s->l2_size * sizeof(uint64_t);
+    l2_size = s->l2_size * l2_entry_size(s);
     l2_table = g_malloc(l2_size);
 
     ret = bdrv_pread(bs->file, l2_offset, l2_table, l2_size);
@@ -1613,9 +1744,36 @@ static int check_refcounts_l2(BlockDriverState *bs, BdrvCheckResult *res,
 
     /* Do the actual checks */
     for(i = 0; i < s->l2_size; i++) {
-        l2_entry = be64_to_cpu(l2_table[i]);
+        QCow2ClusterType type;
+
+        l2_entry = get_l2_entry(s, l2_table, i);
+        type = qcow2_get_cluster_type(bs, l2_entry);
+
+        if (has_subclusters(s)) {
+            uint64_t l2_bitmap = get_l2_bitmap(s, l2_table, i);
+
+            if (l2_bitmap & (l2_bitmap >> 32)) {
+                fprintf(stderr, "ERROR L2 entry %d has subclusters that are "
+                        "both allocated and zero, bitmap=0x%" PRIx64 "\n",
+                        i, l2_bitmap);
+                res->corruptions++;
+            }
+            if (type == QCOW2_CLUSTER_COMPRESSED && l2_bitmap) {
+                fprintf(stderr, "ERROR compressed cluster %d with non-zero "
+                        "subcluster bitmap, bitmap=0x%" PRIx64 "\n",
+                        i, l2_bitmap);
+                res->corruptions++;
+            }
+            if (type == QCOW2_CLUSTER_UNALLOCATED &&
+                (l2_bitmap & QCOW_L2_BITMAP_ALL_ALLOC)) {
+                fprintf(stderr, "ERROR unallocated cluster %d with allocated "
+                        "subclusters, bitmap=0x%" PRIx64 "\n",
+                        i, l2_bitmap);
+                res->corruptions++;
+            }
+        }
 
-        switch (qcow2_get_cluster_type(bs, l2_entry)) {
+        switch (type) {
         case QCOW2_CLUSTER_COMPRESSED:
             /* Compressed clusters don't have QCOW_OFLAG_COPIED */
             if (l2_entry & QCOW_OFLAG_COPIED) {
@@ -1667,9 +1825,7 @@ static int check_refcounts_l2(BlockDriverState *bs, BdrvCheckResult *res,
             if (offset_into_cluster(s, offset)) {
                 res->corruptions++;
 
-                if (qcow2_get_cluster_type(bs, l2_entry) ==
-                    QCOW2_CLUSTER_ZERO_ALLOC)
-                {
+                if (type == QCOW2_CLUSTER_ZERO_ALLOC) {
                     fprintf(stderr, "%s offset=%" PRIx64 ": Preallocated zero "
                             "cluster is not properly aligned; L2 entry "
                             "corrupted.\n",
@@ -1677,12 +1833,14 @@ static int check_refcounts_l2(BlockDriverState *bs, BdrvCheckResult *res,
                             offset);
                     if (fix & BDRV_FIX_ERRORS) {
                         uint64_t l2e_offset =
-                            l2_offset + (uint64_t)i * sizeof(uint64_t);
+                            l2_offset + (uint64_t)i * l2_entry_size(s);
                         int ign = active ? QCOW2_OL_ACTIVE_L2 :
                                            QCOW2_OL_INACTIVE_L2;
 
+                        /* Zero clusters only exist without subclusters */
+                        assert(!has_subclusters(s));
                         l2_entry = QCOW_OFLAG_ZERO;
-                        l2_table[i] = cpu_to_be64(l2_entry);
+                        set_l2_entry(s, l2_table, i, l2_entry);
                         ret = qcow2_pre_write_overlap_check(bs, ign,
                                 l2e_offset, sizeof(uint64_t), false);
                         if (ret < 0) {
@@ -1901,7 +2059,7 @@ static int check_oflag_copied(BlockDriverState *bs, BdrvCheckResult *res,
         }
 
         ret = bdrv_pread(bs->file, l2_offset, l2_table,
-                         s->l2_size * sizeof(uint64_t));
+                         s->l2_size * l2_entry_size(s));
         if (ret < 0) {
             fprintf(stderr, "ERROR: Could not read L2 table: %s\n",
                     strerror(-ret));
@@ -1910,7 +2068,7 @@ static int check_oflag_copied(BlockDriverState *bs, BdrvCheckResult *res,
         }
 
         for (j = 0; j < s->l2_size; j++) {
-            uint64_t l2_entry = be64_to_cpu(l2_table[j]);
+            uint64_t l2_entry = get_l2_entry(s, l2_table, j);
             uint64_t data_offset = l2_entry & L2E_OFFSET_MASK;
             QCow2ClusterType cluster_type = qcow2_get_cluster_type(bs, l2_entry);
 
@@ -1933,9 +2091,9 @@ static int check_oflag_copied(BlockDriverState *bs, BdrvCheckResult *res,
                             "l2_entry=%" PRIx64 " refcount=%" PRIu64 "\n",
                             repair ? "Repairing" : "ERROR", l2_entry, refcount);
                     if (repair) {
-                        l2_table[j] = cpu_to_be64(refcount == 1
-                                    ? l2_entry |  QCOW_OFLAG_COPIED
-                                    : l2_entry & ~QCOW_OFLAG_COPIED);
+                        set_l2_entry(s, l2_table, j, refcount == 1
+                                     ? l2_entry |  QCOW_OFLAG_COPIED
+                                     : l2_entry & ~QCOW_OFLAG_COPIED);
                         l2_dirty++;
                     }
                 }
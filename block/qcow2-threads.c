@@ -0,0 +1,640 @@
+/*
+ * Threaded data processing for Qcow2: compression, encryption, hashing
+ *
+ * Copyright (c) 2004-2006 Fabrice Bellard
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "qemu/osdep.h"
+
+#include <zlib.h>
+
+#ifdef CONFIG_ZSTD
+#include <zstd.h>
+#include <zstd_errors.h>
+#endif
+
+#include "qcow2.h"
+#include "block/thread-pool.h"
+#include "crypto/hash.h"
+
+static int coroutine_fn
+qcow2_co_process(BlockDriverState *bs, ThreadPoolFunc *func, void *arg)
+{
+    int ret;
+    BDRVQcow2State *s = bs->opaque;
+    ThreadPool *pool = aio_get_thread_pool(bdrv_get_aio_context(bs));
+
+    while (s->nb_threads >= QCOW2_MAX_THREADS) {
+        qemu_co_queue_wait(&s->thread_task_queue, NULL);
+    }
+
+    s->nb_threads++;
+    ret = thread_pool_submit_co(pool, func, arg);
+    s->nb_threads--;
+
+    qemu_co_queue_next(&s->thread_task_queue);
+
+    return ret;
+}
+
+
+/*
+ * Task groups
+ */
+
+void qcow2_task_group_init(Qcow2TaskGroup *tg)
+{
+    *tg = (Qcow2TaskGroup) { 0 };
+}
+
+static void coroutine_fn qcow2_task_group_yield(Qcow2TaskGroup *tg)
+{
+    assert(!tg->waiter);
+    tg->waiter = qemu_coroutine_self();
+    qemu_coroutine_yield();
+    assert(!tg->waiter);
+}
+
+/*
+ * Run @entry(@opaque) in a new coroutine.  The coroutine must call
+ * qcow2_task_group_done() as the very last thing it does.  Blocks while
+ * QCOW2_MAX_WORKERS tasks of the group are already running.
+ */
+void coroutine_fn qcow2_task_group_start(Qcow2TaskGroup *tg,
+                                         CoroutineEntry *entry, void *opaque)
+{
+    while (tg->in_flight >= QCOW2_MAX_WORKERS) {
+        qcow2_task_group_yield(tg);
+    }
+
+    tg->in_flight++;
+    qemu_coroutine_enter(qemu_coroutine_create(entry, opaque));
+}
+
+void coroutine_fn qcow2_task_group_done(Qcow2TaskGroup *tg, int ret)
+{
+    Coroutine *waiter = tg->waiter;
+
+    assert(tg->in_flight > 0);
+    tg->in_flight--;
+    if (ret < 0 && tg->ret == 0) {
+        tg->ret = ret;
+    }
+
+    if (waiter) {
+        /* The waiter only runs once this task's coroutine has terminated */
+        tg->waiter = NULL;
+        aio_co_wake(waiter);
+    }
+}
+
+/* Wait for all tasks of the group and return the first error, if any */
+int coroutine_fn qcow2_task_group_wait(Qcow2TaskGroup *tg)
+{
+    while (tg->in_flight > 0) {
+        qcow2_task_group_yield(tg);
+    }
+
+    return tg->ret;
+}
+
+
+/*
+ * Compression
+ */
+
+typedef ssize_t (*Qcow2CompressFunc)(void *dest, size_t dest_size,
+                                     const void *src, size_t src_size);
+typedef struct Qcow2CompressData {
+    void *dest;
+    size_t dest_size;
+    const void *src;
+    size_t src_size;
+    ssize_t ret;
+
+    Qcow2CompressFunc func;
+} Qcow2CompressData;
+
+/*
+ * qcow2_zlib_compress()
+ *
+ * Compress @src_size bytes of data using zlib compression method
+ *
+ * @dest - destination buffer, @dest_size bytes
+ * @src - source buffer, @src_size bytes
+ *
+ * Returns: compressed size on success
+ *          -ENOMEM destination buffer is not enough to store compressed data
+ *          -EIO    on any other error
+ */
+static ssize_t qcow2_zlib_compress(void *dest, size_t dest_size,
+                                   const void *src, size_t src_size)
+{
+    ssize_t ret;
+    z_stream strm;
+
+    /* best compression, small window, no zlib header */
+    memset(&strm, 0, sizeof(strm));
+    ret = deflateInit2(&strm, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+                       -12, 9, Z_DEFAULT_STRATEGY);
+    if (ret != Z_OK) {
+        return -EIO;
+    }
+
+    /* strm.next_in is not const in old zlib versions, such as those used on
+     * OpenBSD/NetBSD, so cast the const away */
+    strm.avail_in = src_size;
+    strm.next_in = (void *) src;
+    strm.avail_out = dest_size;
+    strm.next_out = dest;
+
+    ret = deflate(&strm, Z_FINISH);
+    if (ret == Z_STREAM_END) {
+        ret = dest_size - strm.avail_out;
+    } else {
+        ret = (ret == Z_OK ? -ENOMEM : -EIO);
+    }
+
+    deflateEnd(&strm);
+
+    return ret;
+}
+
+/*
+ * qcow2_zlib_decompress()
+ *
+ * Decompress some data (not more than @src_size bytes) to produce exactly
+ * @dest_size bytes using zlib compression method
+ *
+ * @dest - destination buffer, @dest_size bytes
+ * @src - source buffer, @src_size bytes
+ *
+ * Returns: 0 on success
+ *          -EIO on fail
+ */
+static ssize_t qcow2_zlib_decompress(void *dest, size_t dest_size,
+                                     const void *src, size_t src_size)
+{
+    int ret;
+    z_stream strm;
+
+    memset(&strm, 0, sizeof(strm));
+    strm.avail_in = src_size;
+    strm.next_in = (void *) src;
+    strm.avail_out = dest_size;
+    strm.next_out = dest;
+
+    ret = inflateInit2(&strm, -12);
+    if (ret != Z_OK) {
+        return -EIO;
+    }
+
+    ret = inflate(&strm, Z_FINISH);
+    if ((ret == Z_STREAM_END || ret == Z_BUF_ERROR) && strm.avail_out == 0) {
+        /* We approve Z_BUF_ERROR because we need @dest buffer to be filled, but
+         * @src buffer may be processed partly (because in qcow2 we know size of
+         * compressed data with precision of one sector) */
+        ret = 0;
+    } else {
+        ret = -EIO;
+    }
+
+    inflateEnd(&strm);
+
+    return ret;
+}
+
+#ifdef CONFIG_ZSTD
+
+/*
+ * qcow2_zstd_compress()
+ *
+ * Compress @src_size bytes of data using zstd compression method
+ *
+ * @dest - destination buffer, @dest_size bytes
+ * @src - source buffer, @src_size bytes
+ *
+ * Returns: compressed size on success
+ *          -ENOMEM destination buffer is not enough to store compressed data
+ *          -EIO    on any other error
+ */
+static ssize_t qcow2_zstd_compress(void *dest, size_t dest_size,
+                                   const void *src, size_t src_size)
+{
+    ssize_t ret;
+    size_t zstd_ret;
+    ZSTD_outBuffer output = {
+        .dst = dest,
+        .size = dest_size,
+        .pos = 0
+    };
+    ZSTD_inBuffer input = {
+        .src = src,
+        .size = src_size,
+        .pos = 0
+    };
+    ZSTD_CCtx *cctx = ZSTD_createCCtx();
+
+    if (!cctx) {
+        return -EIO;
+    }
+
+    /*
+     * Use the streaming interface so that the result is a single frame
+     * that the streaming decompression below can consume.  The whole
+     * output buffer is passed at once, so ZSTD_e_end either finishes the
+     * frame in one call or tells us that the buffer is too small.
+     */
+    zstd_ret = ZSTD_compressStream2(cctx, &output, &input, ZSTD_e_end);
+
+    if (ZSTD_isError(zstd_ret)) {
+        ret = ZSTD_getErrorCode(zstd_ret) == ZSTD_error_dstSize_tooSmall ?
+              -ENOMEM : -EIO;
+    } else if (zstd_ret > 0) {
+        /* Data left to flush: the output buffer is full */
+        ret = -ENOMEM;
+    } else {
+        ret = output.pos;
+    }
+
+    ZSTD_freeCCtx(cctx);
+    return ret;
+}
+
+/*
+ * qcow2_zstd_decompress()
+ *
+ * Decompress some data (not more than @src_size bytes) to produce exactly
+ * @dest_size bytes using zstd compression method
+ *
+ * @dest - destination buffer, @dest_size bytes
+ * @src - source buffer, @src_size bytes
+ *
+ * Returns: 0 on success
+ *          -EIO on any error
+ */
+static ssize_t qcow2_zstd_decompress(void *dest, size_t dest_size,
+                                     const void *src, size_t src_size)
+{
+    size_t zstd_ret = 0;
+    ssize_t ret = 0;
+    ZSTD_outBuffer output = {
+        .dst = dest,
+        .size = dest_size,
+        .pos = 0
+    };
+    ZSTD_inBuffer input = {
+        .src = src,
+        .size = src_size,
+        .pos = 0
+    };
+    ZSTD_DCtx *dctx = ZSTD_createDCtx();
+
+    if (!dctx) {
+        return -EIO;
+    }
+
+    /*
+     * The size of the compressed data is only known with sector
+     * precision, so @src may continue past the end of the frame.  Stop as
+     * soon as the cluster is complete instead of insisting that all input
+     * is consumed.
+     */
+    while (output.pos < output.size) {
+        size_t last_in_pos = input.pos;
+        size_t last_out_pos = output.pos;
+
+        zstd_ret = ZSTD_decompressStream(dctx, &output, &input);
+        if (ZSTD_isError(zstd_ret)) {
+            ret = -EIO;
+            break;
+        }
+
+        /* Don't loop forever on truncated input */
+        if (last_in_pos >= input.pos && last_out_pos >= output.pos) {
+            ret = -EIO;
+            break;
+        }
+    }
+
+    /*
+     * If the frame is not fully flushed, it decompresses to more than a
+     * cluster, so the image is damaged.
+     */
+    if (zstd_ret > 0) {
+        ret = -EIO;
+    }
+
+    ZSTD_freeDCtx(dctx);
+    return ret;
+}
+
+#endif
+
+static int qcow2_compress_pool_func(void *opaque)
+{
+    Qcow2CompressData *data = opaque;
+
+    data->ret = data->func(data->dest, data->dest_size,
+                           data->src, data->src_size);
+
+    return 0;
+}
+
+static ssize_t coroutine_fn
+qcow2_co_do_compress(BlockDriverState *bs, void *dest, size_t dest_size,
+                     const void *src, size_t src_size, Qcow2CompressFunc func)
+{
+    Qcow2CompressData arg = {
+        .dest = dest,
+        .dest_size = dest_size,
+        .src = src,
+        .src_size = src_size,
+        .func = func,
+    };
+
+    qcow2_co_process(bs, qcow2_compress_pool_func, &arg);
+
+    return arg.ret;
+}
+
+/*
+ * qcow2_co_compress()
+ *
+ * Compress @src_size bytes of data using the compression
+ * method defined by the image compression type
+ *
+ * @dest - destination buffer, @dest_size bytes
+ * @src - source buffer, @src_size bytes
+ *
+ * Returns: compressed size on success
+ *          -ENOMEM destination buffer is not enough to store compressed data
+ *          -EIO    on any other error
+ */
+ssize_t coroutine_fn
+qcow2_co_compress(BlockDriverState *bs, void *dest, size_t dest_size,
+                  const void *src, size_t src_size)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2CompressFunc fn;
+
+    switch (s->compression_type) {
+    case QCOW2_COMPRESSION_TYPE_ZLIB:
+        fn = qcow2_zlib_compress;
+        break;
+
+#ifdef CONFIG_ZSTD
+    case QCOW2_COMPRESSION_TYPE_ZSTD:
+        fn = qcow2_zstd_compress;
+        break;
+#endif
+
+    default:
+        abort();
+    }
+
+    return qcow2_co_do_compress(bs, dest, dest_size, src, src_size, fn);
+}
+
+/*
+ * qcow2_co_decompress()
+ *
+ * Decompress some data (not more than @src_size bytes) to produce exactly
+ * @dest_size bytes using the compression method defined by the image
+ * compression type
+ *
+ * @dest - destination buffer, @dest_size bytes
+ * @src - source buffer, @src_size bytes
+ *
+ * Returns: 0 on success
+ *          a negative error code on failure
+ */
+ssize_t coroutine_fn
+qcow2_co_decompress(BlockDriverState *bs, void *dest, size_t dest_size,
+                    const void *src, size_t src_size)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2CompressFunc fn;
+
+    switch (s->compression_type) {
+    case QCOW2_COMPRESSION_TYPE_ZLIB:
+        fn = qcow2_zlib_decompress;
+        break;
+
+#ifdef CONFIG_ZSTD
+    case QCOW2_COMPRESSION_TYPE_ZSTD:
+        fn = qcow2_zstd_decompress;
+        break;
+#endif
+
+    default:
+        abort();
+    }
+
+    return qcow2_co_do_compress(bs, dest, dest_size, src, src_size, fn);
+}
+
+
+/*
+ * Cryptography
+ */
+
+/*
+ * Qcow2EncDecFunc: common prototype of qcrypto_block_encrypt() and
+ * qcrypto_block_decrypt().
+ */
+typedef int (*Qcow2EncDecFunc)(QCryptoBlock *block, uint64_t offset,
+                               uint8_t *buf, size_t len, Error **errp);
+typedef struct Qcow2EncDecData {
+    Qcow2TaskGroup *tg;
+    BlockDriverState *bs;
+    QCryptoBlock *block;
+    uint64_t offset;
+    uint8_t *buf;
+    size_t len;
+
+    Qcow2EncDecFunc func;
+} Qcow2EncDecData;
+
+static int qcow2_encdec_pool_func(void *opaque)
+{
+    Qcow2EncDecData *data = opaque;
+
+    return data->func(data->block, data->offset, data->buf, data->len, NULL);
+}
+
+static void coroutine_fn qcow2_encdec_entry(void *opaque)
+{
+    Qcow2EncDecData *data = opaque;
+    int ret;
+
+    ret = qcow2_co_process(data->bs, qcow2_encdec_pool_func, data);
+    qcow2_task_group_done(data->tg, ret);
+}
+
+/*
+ * Encrypt or decrypt @len bytes in @buf.  Requests larger than a cluster
+ * are split into up to QCOW2_MAX_THREADS cluster-aligned chunks that are
+ * processed in parallel; the crypto block has one cipher for each thread.
+ */
+static int coroutine_fn
+qcow2_co_encdec(BlockDriverState *bs, uint64_t host_offset,
+                uint64_t guest_offset, void *buf, size_t len,
+                Qcow2EncDecFunc func)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2EncDecData data[QCOW2_MAX_THREADS];
+    Qcow2TaskGroup tg;
+    uint64_t offset = s->crypt_physical_offset ? host_offset : guest_offset;
+    uint8_t *p = buf;
+    size_t chunk_size;
+    int i;
+
+    assert(QEMU_IS_ALIGNED(offset, BDRV_SECTOR_SIZE));
+    assert(QEMU_IS_ALIGNED(len, BDRV_SECTOR_SIZE));
+    assert(s->crypto);
+
+    if (len == 0) {
+        return 0;
+    }
+
+    chunk_size = QEMU_ALIGN_UP(DIV_ROUND_UP(len, QCOW2_MAX_THREADS),
+                               s->cluster_size);
+
+    if (chunk_size >= len) {
+        data[0] = (Qcow2EncDecData) {
+            .block = s->crypto,
+            .offset = offset,
+            .buf = p,
+            .len = len,
+            .func = func,
+        };
+        return qcow2_co_process(bs, qcow2_encdec_pool_func, &data[0]) == 0 ?
+               0 : -EIO;
+    }
+
+    qcow2_task_group_init(&tg);
+    for (i = 0; len > 0; i++) {
+        size_t cur_len = MIN(chunk_size, len);
+
+        assert(i < QCOW2_MAX_THREADS);
+        data[i] = (Qcow2EncDecData) {
+            .tg = &tg,
+            .bs = bs,
+            .block = s->crypto,
+            .offset = offset,
+            .buf = p,
+            .len = cur_len,
+            .func = func,
+        };
+        qcow2_task_group_start(&tg, qcow2_encdec_entry, &data[i]);
+
+        offset += cur_len;
+        p += cur_len;
+        len -= cur_len;
+    }
+
+    return qcow2_task_group_wait(&tg) == 0 ? 0 : -EIO;
+}
+
+/*
+ * qcow2_co_encrypt()
+ *
+ * Encrypts one or more contiguous aligned sectors
+ *
+ * @host_offset - underlying storage offset of the first sector of the
+ * data to be encrypted
+ *
+ * @guest_offset - guest (virtual) offset of the first sector of the
+ * data to be encrypted
+ *
+ * Returns: 0 on success, -EIO on failure
+ */
+int coroutine_fn
+qcow2_co_encrypt(BlockDriverState *bs, uint64_t host_offset,
+                 uint64_t guest_offset, void *buf, size_t len)
+{
+    return qcow2_co_encdec(bs, host_offset, guest_offset, buf, len,
+                           qcrypto_block_encrypt);
+}
+
+/*
+ * qcow2_co_decrypt()
+ *
+ * Decrypts one or more contiguous aligned sectors
+ * Similar to qcow2_co_encrypt
+ */
+int coroutine_fn
+qcow2_co_decrypt(BlockDriverState *bs, uint64_t host_offset,
+                 uint64_t guest_offset, void *buf, size_t len)
+{
+    return qcow2_co_encdec(bs, host_offset, guest_offset, buf, len,
+                           qcrypto_block_decrypt);
+}
+
+
+/*
+ * Content hashing for deduplication
+ */
+
+typedef struct Qcow2HashData {
+    QEMUIOVector *qiov;
+    uint8_t *hash;
+} Qcow2HashData;
+
+static int qcow2_hash_pool_func(void *opaque)
+{
+    Qcow2HashData *data = opaque;
+    uint8_t *result = NULL;
+    size_t result_len;
+    int ret;
+
+    ret = qcrypto_hash_bytesv(QCRYPTO_HASH_ALG_SHA256, data->qiov->iov,
+                              data->qiov->niov, &result, &result_len, NULL);
+    if (ret < 0) {
+        return -EIO;
+    }
+
+    assert(result_len == QCOW2_DEDUP_HASH_SIZE);
+    memcpy(data->hash, result, QCOW2_DEDUP_HASH_SIZE);
+    g_free(result);
+
+    return 0;
+}
+
+/*
+ * qcow2_co_hash()
+ *
+ * Computes the QCOW2_DEDUP_HASH_SIZE bytes content hash of @qiov in a
+ * worker thread and stores it in @hash.
+ *
+ * Returns: 0 on success, -EIO on failure
+ */
+int coroutine_fn
+qcow2_co_hash(BlockDriverState *bs, QEMUIOVector *qiov, uint8_t *hash)
+{
+    Qcow2HashData arg = {
+        .qiov = qiov,
+        .hash = hash,
+    };
+
+    return qcow2_co_process(bs, qcow2_hash_pool_func, &arg);
+}
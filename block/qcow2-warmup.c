@@ -0,0 +1,421 @@
+/*
+ * L2 table cache warm-up for the QCOW2 format
+ *
+ * Copyright (c) 2004-2006 Fabrice Bellard
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * Right after an image is opened, the first access to each part of the disk
+ * has to wait for its L2 slice to be read into the cache before the data I/O
+ * can be issued.  The warm-up coroutine loads L2 slices into unused cache
+ * entries in the background instead:
+ *
+ * - first the slices listed in a hint file, in the order in which they were
+ *   first used during the previous session (l2-warmup-hints), then
+ * - all L2 tables referenced by the active L1 table, in L1 order (l2-warmup).
+ *   L2 tables that are adjacent in the image file are read with one request.
+ *
+ * The warm-up never evicts a table from the cache, so it stops as soon as the
+ * cache is full.  It pauses while the node is drained.
+ *
+ * The slices are read without holding s->lock.  A slice is only added to the
+ * cache if neither the L1 entries nor any table in the L2 cache changed while
+ * it was read, so it is exactly what qcow2_cache_get() would have read.
+ */
+
+#include "qemu/osdep.h"
+#include "qapi/error.h"
+#include "qemu/bitmap.h"
+#include "qemu/cutils.h"
+#include "qemu/error-report.h"
+#include "block/block_int.h"
+#include "qcow2.h"
+
+/* Maximum size of a single read of adjacent L2 tables */
+#define QCOW2_WARMUP_MAX_READ (1 * MiB)
+
+/* Maximum number of L2 slices recorded for the next hint file */
+#define QCOW2_WARMUP_MAX_HINTS (1 << 20)
+
+#define QCOW2_WARMUP_HINTS_HEADER "# qcow2 L2 warm-up hints\n"
+
+struct Qcow2Warmup {
+    bool scan;                  /* warm up all active L2 tables */
+    char *hints_file;
+
+    /* Guest offsets of the L2 slices from the hint file */
+    uint64_t *hints;
+    size_t nb_hints;
+    size_t hint_pos;
+
+    /* Next L1 index to warm up */
+    uint64_t l1_pos;
+
+    Coroutine *co;
+    bool stop;
+    bool done;
+
+    /*
+     * L2 slices used during this session, for the next hint file.  Slices are
+     * identified by the guest offset of the first cluster they map.
+     */
+    uint64_t slice_size;        /* guest bytes mapped by one slice */
+    uint64_t nb_slices;
+    unsigned long *touched;
+    GArray *record;
+};
+
+static void qcow2_warmup_load_hints(Qcow2Warmup *w)
+{
+    GError *gerr = NULL;
+    gchar *contents;
+    gchar **lines;
+    GArray *hints;
+    int i;
+
+    if (!g_file_get_contents(w->hints_file, &contents, NULL, &gerr)) {
+        if (!g_error_matches(gerr, G_FILE_ERROR, G_FILE_ERROR_NOENT)) {
+            warn_report("Could not read L2 warm-up hints: %s", gerr->message);
+        }
+        g_error_free(gerr);
+        return;
+    }
+
+    hints = g_array_new(false, false, sizeof(uint64_t));
+    lines = g_strsplit(contents, "\n", -1);
+    for (i = 0; lines[i]; i++) {
+        uint64_t offset;
+
+        if (lines[i][0] == '\0' || lines[i][0] == '#') {
+            continue;
+        }
+        if (qemu_strtou64(lines[i], NULL, 0, &offset) < 0) {
+            warn_report("Ignoring invalid line %d of L2 warm-up hints '%s'",
+                        i + 1, w->hints_file);
+            continue;
+        }
+        g_array_append_val(hints, offset);
+    }
+    g_strfreev(lines);
+    g_free(contents);
+
+    w->nb_hints = hints->len;
+    w->hints = (uint64_t *) g_array_free(hints, false);
+}
+
+/*
+ * Sets up the warm-up of the L2 cache.  If @scan is true, all L2 tables of the
+ * active L1 table are loaded.  If @hints_file is given, the slices listed
+ * there are loaded first, and the slices used until the image is inactivated
+ * are written back to it.
+ */
+void qcow2_warmup_init(BlockDriverState *bs, bool scan, const char *hints_file)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2Warmup *w;
+
+    assert(!s->warmup);
+
+    if (!scan && !hints_file) {
+        return;
+    }
+
+    w = g_new0(Qcow2Warmup, 1);
+    w->scan = scan;
+    w->slice_size = (uint64_t) s->l2_slice_size << s->cluster_bits;
+
+    if (hints_file) {
+        w->hints_file = g_strdup(hints_file);
+        qcow2_warmup_load_hints(w);
+
+        w->nb_slices = DIV_ROUND_UP(bs->total_sectors * BDRV_SECTOR_SIZE,
+                                    w->slice_size);
+        w->touched = bitmap_new(w->nb_slices);
+        w->record = g_array_new(false, false, sizeof(uint64_t));
+    }
+
+    s->warmup = w;
+}
+
+void qcow2_warmup_free(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2Warmup *w = s->warmup;
+
+    if (!w) {
+        return;
+    }
+
+    assert(!w->co);
+    if (w->record) {
+        g_array_free(w->record, true);
+    }
+    g_free(w->touched);
+    g_free(w->hints);
+    g_free(w->hints_file);
+    g_free(w);
+    s->warmup = NULL;
+}
+
+/*
+ * Reads the part [@start, @start + @bytes) of the L2 tables of the @nb_tables
+ * L1 entries starting at @l1_index, which must be adjacent in the image file
+ * unless @nb_tables is 1, and adds all of its slices to the L2 cache.
+ *
+ * Returns -ENOSPC if the cache is full, 0 or another negative errno
+ * otherwise.
+ */
+static int coroutine_fn qcow2_warmup_tables(BlockDriverState *bs,
+                                            uint64_t l1_index, int nb_tables,
+                                            uint64_t start, uint64_t bytes)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t table_size = (uint64_t) s->l2_size * l2_entry_size(s);
+    uint64_t slice_size = (uint64_t) s->l2_slice_size * l2_entry_size(s);
+    uint64_t *l1_entries = NULL;
+    uint64_t generation, l2_offset, len;
+    uint8_t *buf = NULL;
+    int i, ret;
+
+    assert(nb_tables == 1 || (start == 0 && bytes == table_size));
+    assert(QEMU_IS_ALIGNED(start, slice_size) &&
+           QEMU_IS_ALIGNED(bytes, slice_size));
+
+    qemu_co_mutex_lock(&s->lock);
+
+    if (l1_index + nb_tables > s->l1_size) {
+        ret = 0;
+        goto out;
+    }
+    l1_entries = g_memdup(&s->l1_table[l1_index],
+                          nb_tables * sizeof(uint64_t));
+    generation = qcow2_cache_generation(s->l2_table_cache);
+    l2_offset = l1_entries[0] & L1E_OFFSET_MASK;
+
+    qemu_co_mutex_unlock(&s->lock);
+
+    len = (nb_tables - 1) * table_size + bytes;
+    buf = qemu_try_blockalign(bs->file->bs, len);
+    if (buf == NULL) {
+        ret = -ENOMEM;
+        goto out_unlocked;
+    }
+
+    BLKDBG_EVENT(bs->file, BLKDBG_L2_LOAD);
+    ret = bdrv_pread(bs->file, l2_offset + start, buf, len);
+    if (ret < 0) {
+        goto out_unlocked;
+    }
+
+    qemu_co_mutex_lock(&s->lock);
+
+    /* Drop the data if anything changed while it was read */
+    if (l1_index + nb_tables > s->l1_size ||
+        memcmp(l1_entries, &s->l1_table[l1_index],
+               nb_tables * sizeof(uint64_t)) ||
+        generation != qcow2_cache_generation(s->l2_table_cache))
+    {
+        ret = 0;
+        goto out;
+    }
+
+    ret = 0;
+    for (i = 0; i < len / slice_size; i++) {
+        if (!qcow2_cache_prefetch(s->l2_table_cache,
+                                  l2_offset + start + i * slice_size,
+                                  buf + i * slice_size))
+        {
+            ret = -ENOSPC;
+            break;
+        }
+    }
+
+out:
+    qemu_co_mutex_unlock(&s->lock);
+out_unlocked:
+    qemu_vfree(buf);
+    g_free(l1_entries);
+    return ret;
+}
+
+/* Returns true if the L1 entry at @l1_index points to a valid L2 table */
+static bool qcow2_warmup_l1_entry_valid(BDRVQcow2State *s, uint64_t l1_index)
+{
+    uint64_t l2_offset;
+
+    if (l1_index >= s->l1_size) {
+        return false;
+    }
+    l2_offset = s->l1_table[l1_index] & L1E_OFFSET_MASK;
+    return l2_offset && !offset_into_cluster(s, l2_offset);
+}
+
+static int coroutine_fn qcow2_warmup_next_hint(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2Warmup *w = s->warmup;
+    uint64_t offset = w->hints[w->hint_pos++];
+    uint64_t l1_index = offset_to_l1_index(s, offset);
+    uint64_t slice_size = (uint64_t) s->l2_slice_size * l2_entry_size(s);
+    uint64_t start;
+
+    if (offset >= bs->total_sectors * BDRV_SECTOR_SIZE ||
+        !qcow2_warmup_l1_entry_valid(s, l1_index))
+    {
+        return 0;
+    }
+
+    start = offset_to_l2_index(s, offset) - offset_to_l2_slice_index(s, offset);
+    start *= l2_entry_size(s);
+    return qcow2_warmup_tables(bs, l1_index, 1, start, slice_size);
+}
+
+static int coroutine_fn qcow2_warmup_next_tables(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2Warmup *w = s->warmup;
+    uint64_t table_size = (uint64_t) s->l2_size * l2_entry_size(s);
+    uint64_t l1_index, l2_offset;
+    int n;
+
+    while (w->l1_pos < s->l1_size &&
+           !qcow2_warmup_l1_entry_valid(s, w->l1_pos)) {
+        w->l1_pos++;
+    }
+    if (w->l1_pos >= s->l1_size) {
+        return 0;
+    }
+
+    /* Read ahead the following tables as long as they are adjacent */
+    l1_index = w->l1_pos;
+    l2_offset = s->l1_table[l1_index] & L1E_OFFSET_MASK;
+    for (n = 1; (n + 1) * table_size <= QCOW2_WARMUP_MAX_READ; n++) {
+        if (!qcow2_warmup_l1_entry_valid(s, l1_index + n) ||
+            (s->l1_table[l1_index + n] & L1E_OFFSET_MASK) !=
+            l2_offset + n * table_size)
+        {
+            break;
+        }
+    }
+    w->l1_pos += n;
+
+    return qcow2_warmup_tables(bs, l1_index, n, 0, table_size);
+}
+
+static void coroutine_fn qcow2_warmup_entry(void *opaque)
+{
+    BlockDriverState *bs = opaque;
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2Warmup *w = s->warmup;
+    int ret = 0;
+
+    while (!w->stop && ret != -ENOSPC) {
+        if (w->hint_pos < w->nb_hints) {
+            ret = qcow2_warmup_next_hint(bs);
+        } else if (w->scan && w->l1_pos < s->l1_size) {
+            ret = qcow2_warmup_next_tables(bs);
+        } else {
+            break;
+        }
+    }
+
+    /* The warm-up is only an optimisation, so errors just end it */
+    if (!w->stop) {
+        w->done = true;
+    }
+    w->co = NULL;
+    bdrv_dec_in_flight(bs);
+}
+
+/* Starts or resumes the warm-up in the background */
+void qcow2_warmup_start(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2Warmup *w = s->warmup;
+
+    if (!w || w->done || w->co || (bs->open_flags & BDRV_O_INACTIVE)) {
+        return;
+    }
+
+    w->stop = false;
+    w->co = qemu_coroutine_create(qcow2_warmup_entry, bs);
+    bdrv_inc_in_flight(bs);
+    aio_co_schedule(bdrv_get_aio_context(bs), w->co);
+}
+
+/*
+ * Asks the warm-up to pause.  It is only done when the in-flight counter of
+ * the node drops, so callers must drain it or poll until s->warmup->co is
+ * NULL.
+ */
+void qcow2_warmup_stop(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+
+    if (s->warmup) {
+        s->warmup->stop = true;
+    }
+}
+
+/* Notes that the L2 slice that maps the guest @offset is used */
+void qcow2_warmup_record(BlockDriverState *bs, uint64_t offset)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2Warmup *w = s->warmup;
+    uint64_t slice = offset / w->slice_size;
+
+    if (!w->record || slice >= w->nb_slices || test_bit(slice, w->touched)) {
+        return;
+    }
+
+    set_bit(slice, w->touched);
+    if (w->record->len < QCOW2_WARMUP_MAX_HINTS) {
+        offset = slice * w->slice_size;
+        g_array_append_val(w->record, offset);
+    }
+}
+
+/* Writes the L2 slices used during this session to the hint file */
+void qcow2_warmup_save(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2Warmup *w = s->warmup;
+    GError *gerr = NULL;
+    GString *str;
+    int i;
+
+    /* Keep the old hints if the image wasn't used at all */
+    if (!w || !w->record || w->record->len == 0) {
+        return;
+    }
+
+    str = g_string_new(QCOW2_WARMUP_HINTS_HEADER);
+    for (i = 0; i < w->record->len; i++) {
+        g_string_append_printf(str, "%#" PRIx64 "\n",
+                               g_array_index(w->record, uint64_t, i));
+    }
+
+    if (!g_file_set_contents(w->hints_file, str->str, str->len, &gerr)) {
+        warn_report("Could not write L2 warm-up hints: %s", gerr->message);
+        g_error_free(gerr);
+    }
+    g_string_free(str, true);
+}
@@ -24,9 +24,6 @@
 
 #include "qemu/osdep.h"
 
-#define ZLIB_CONST
-#include <zlib.h>
-
 #include "block/block_int.h"
 #include "block/qdict.h"
 #include "sysemu/block-backend.h"
@@ -44,7 +41,6 @@
 #include "qapi/qobject-input-visitor.h"
 #include "qapi/qapi-visit-block-core.h"
 #include "crypto.h"
-#include "block/thread-pool.h"
 
 /*
   Differences with QCOW:
@@ -82,6 +78,8 @@ qcow2_co_preadv_compressed(BlockDriverState *bs,
                            uint64_t bytes,
                            QEMUIOVector *qiov);
 
+static bool is_zero(BlockDriverState *bs, int64_t offset, int64_t bytes);
+
 static int qcow2_probe(const uint8_t *buf, int buf_size, const char *filename)
 {
     const QCowHeader *cow_header = (const void *)buf;
@@ -302,7 +300,7 @@ static int qcow2_read_extensions(BlockDriverState *bs, uint64_t start_offset,
             }
             s->crypto = qcrypto_block_open(s->crypto_opts, "encrypt.",
                                            qcow2_crypto_hdr_read_func,
-                                           bs, cflags, 1, errp);
+                                           bs, cflags, QCOW2_MAX_THREADS, errp);
             if (!s->crypto) {
                 return -EINVAL;
             }
@@ -529,6 +527,15 @@ static int qcow2_mark_clean(BlockDriverState *bs)
     if (s->incompatible_features & QCOW2_INCOMPAT_DIRTY) {
         int ret;
 
+        if (s->fix_copied) {
+            ret = qcow2_update_snapshot_refcount(bs, s->l1_table_offset,
+                                                 s->l1_size, 0);
+            if (ret < 0) {
+                return ret;
+            }
+            s->fix_copied = false;
+        }
+
         s->incompatible_features &= ~QCOW2_INCOMPAT_DIRTY;
 
         ret = qcow2_flush_caches(bs);
@@ -576,7 +583,12 @@ static int coroutine_fn qcow2_co_check_locked(BlockDriverState *bs,
                                               BdrvCheckResult *result,
                                               BdrvCheckMode fix)
 {
-    int ret = qcow2_check_refcounts(bs, result, fix);
+    int ret;
+
+    /* Preallocated clusters would show up as leaks */
+    qcow2_prealloc_release(bs);
+
+    ret = qcow2_check_refcounts(bs, result, fix);
     if (ret < 0) {
         return ret;
     }
@@ -648,6 +660,7 @@ static const char *const mutable_opts[] = {
     QCOW2_OPT_L2_CACHE_ENTRY_SIZE,
     QCOW2_OPT_REFCOUNT_CACHE_SIZE,
     QCOW2_OPT_CACHE_CLEAN_INTERVAL,
+    QCOW2_OPT_PREALLOC_SIZE,
     NULL
 };
 
@@ -759,6 +772,29 @@ static QemuOptsList qcow2_runtime_opts = {
             .type = QEMU_OPT_NUMBER,
             .help = "Clean unused cache entries after this time (in seconds)",
         },
+        {
+            .name = QCOW2_OPT_PREALLOC_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "Keep a pool of this many bytes of preallocated host "
+                    "clusters for new guest data (0 = disabled)",
+        },
+        {
+            .name = QCOW2_OPT_L2_WARMUP,
+            .type = QEMU_OPT_BOOL,
+            .help = "Load all L2 tables into the cache in the background",
+        },
+        {
+            .name = QCOW2_OPT_L2_WARMUP_HINTS,
+            .type = QEMU_OPT_STRING,
+            .help = "File that records which L2 tables are used, so that "
+                    "they can be loaded first when the image is opened again",
+        },
+        {
+            .name = QCOW2_OPT_DEDUP,
+            .type = QEMU_OPT_BOOL,
+            .help = "Share the host clusters of identical guest clusters "
+                    "written while the image is open",
+        },
         BLOCK_CRYPTO_OPT_DEF_KEY_SECRET("encrypt.",
             "ID of secret providing qcow2 AES key or LUKS passphrase"),
         { /* end of list */ }
@@ -831,7 +867,9 @@ static void read_cache_sizes(BlockDriverState *bs, QemuOpts *opts,
     bool l2_cache_entry_size_set;
     int min_refcount_cache = MIN_REFCOUNT_CACHE_SIZE * s->cluster_size;
     uint64_t virtual_disk_size = bs->total_sectors * BDRV_SECTOR_SIZE;
-    uint64_t max_l2_cache = virtual_disk_size / (s->cluster_size / 8);
+    uint64_t max_l2_entries = DIV_ROUND_UP(virtual_disk_size, s->cluster_size);
+    uint64_t max_l2_cache = ROUND_UP(max_l2_entries * l2_entry_size(s),
+                                     s->cluster_size);
 
     combined_cache_size_set = qemu_opt_get(opts, QCOW2_OPT_CACHE_SIZE);
     l2_cache_size_set = qemu_opt_get(opts, QCOW2_OPT_L2_CACHE_SIZE);
@@ -914,6 +952,10 @@ typedef struct Qcow2ReopenState {
     int overlap_check;
     bool discard_passthrough[QCOW2_DISCARD_MAX];
     uint64_t cache_clean_interval;
+    uint64_t prealloc_size;
+    bool l2_warmup;
+    char *l2_warmup_hints;
+    bool dedup;
     QCryptoBlockOpenOptions *crypto_opts; /* Disk encryption runtime options */
 } Qcow2ReopenState;
 
@@ -991,7 +1033,7 @@ static int qcow2_update_options_prepare(BlockDriverState *bs,
         }
     }
 
-    r->l2_slice_size = l2_cache_entry_size / sizeof(uint64_t);
+    r->l2_slice_size = l2_cache_entry_size / l2_entry_size(s);
     r->l2_table_cache = qcow2_cache_create(bs, l2_cache_size,
                                            l2_cache_entry_size);
     r->refcount_block_cache = qcow2_cache_create(bs, refcount_cache_size,
@@ -1020,6 +1062,42 @@ static int qcow2_update_options_prepare(BlockDriverState *bs,
         goto fail;
     }
 
+    /* Size of the preallocated cluster pool */
+    r->prealloc_size = qemu_opt_get_size(opts, QCOW2_OPT_PREALLOC_SIZE, 0);
+    if (r->prealloc_size > QCOW2_MAX_PREALLOC_SIZE) {
+        error_setg(errp, QCOW2_OPT_PREALLOC_SIZE " must be at most %" PRIu64,
+                   (uint64_t) QCOW2_MAX_PREALLOC_SIZE);
+        ret = -EINVAL;
+        goto fail;
+    }
+    r->prealloc_size = ROUND_UP(r->prealloc_size, s->cluster_size);
+
+    /* L2 cache warm-up, only used when the image is opened */
+    r->l2_warmup = qemu_opt_get_bool(opts, QCOW2_OPT_L2_WARMUP, false);
+    r->l2_warmup_hints = g_strdup(qemu_opt_get(opts,
+                                               QCOW2_OPT_L2_WARMUP_HINTS));
+
+    /* Deduplication relies on refcounts and on data that doesn't depend on
+     * the guest offset, so it can't work with external data files or
+     * encryption */
+    r->dedup = qemu_opt_get_bool(opts, QCOW2_OPT_DEDUP, false);
+    if (r->dedup && (s->incompatible_features & QCOW2_INCOMPAT_DATA_FILE)) {
+        error_setg(errp, "dedup is not supported with an external data file");
+        ret = -EINVAL;
+        goto fail;
+    }
+    if (r->dedup && s->crypt_method_header != QCOW_CRYPT_NONE) {
+        error_setg(errp, "dedup is not supported for encrypted images");
+        ret = -EINVAL;
+        goto fail;
+    }
+    if (r->dedup && s->qcow_version < 3) {
+        error_setg(errp, "dedup requires a qcow2 image with at least "
+                   "qemu 1.1 compatibility level");
+        ret = -EINVAL;
+        goto fail;
+    }
+
     /* lazy-refcounts; flush if going from enabled to disabled */
     r->use_lazy_refcounts = qemu_opt_get_bool(opts, QCOW2_OPT_LAZY_REFCOUNTS,
         (s->compatible_features & QCOW2_COMPAT_LAZY_REFCOUNTS));
@@ -1170,6 +1248,22 @@ static void qcow2_update_options_commit(BlockDriverState *bs,
         cache_clean_timer_init(bs, bdrv_get_aio_context(bs));
     }
 
+    if (s->prealloc_size != r->prealloc_size) {
+        qcow2_prealloc_release(bs);
+        s->prealloc_size = r->prealloc_size;
+    }
+
+    if (!s->warmup) {
+        qcow2_warmup_init(bs, r->l2_warmup, r->l2_warmup_hints);
+    }
+    g_free(r->l2_warmup_hints);
+
+    if (r->dedup && !s->dedup) {
+        qcow2_dedup_init(bs);
+    } else if (!r->dedup && s->dedup) {
+        qcow2_dedup_free(bs);
+    }
+
     qapi_free_QCryptoBlockOpenOptions(s->crypto_opts);
     s->crypto_opts = r->crypto_opts;
 }
@@ -1183,6 +1277,7 @@ static void qcow2_update_options_abort(BlockDriverState *bs,
     if (r->refcount_block_cache) {
         qcow2_cache_destroy(r->refcount_block_cache);
     }
+    g_free(r->l2_warmup_hints);
     qapi_free_QCryptoBlockOpenOptions(r->crypto_opts);
 }
 
@@ -1202,6 +1297,42 @@ static int qcow2_update_options(BlockDriverState *bs, QDict *options,
     return ret;
 }
 
+static int validate_compression_type(BDRVQcow2State *s, Error **errp)
+{
+    switch (s->compression_type) {
+    case QCOW2_COMPRESSION_TYPE_ZLIB:
+#ifdef CONFIG_ZSTD
+    case QCOW2_COMPRESSION_TYPE_ZSTD:
+#endif
+        break;
+
+    default:
+        error_setg(errp, "qcow2: unknown compression type: %u",
+                   s->compression_type);
+        return -ENOTSUP;
+    }
+
+    /*
+     * Only zlib may be used without the incompatible feature bit, so that
+     * older versions refuse to open images that they can't read
+     */
+    if (s->compression_type == QCOW2_COMPRESSION_TYPE_ZLIB) {
+        if (s->incompatible_features & QCOW2_INCOMPAT_COMPRESSION) {
+            error_setg(errp, "qcow2: Compression type incompatible feature "
+                       "bit must not be set");
+            return -EINVAL;
+        }
+    } else {
+        if (!(s->incompatible_features & QCOW2_INCOMPAT_COMPRESSION)) {
+            error_setg(errp, "qcow2: Compression type incompatible feature "
+                       "bit must be set");
+            return -EINVAL;
+        }
+    }
+
+    return 0;
+}
+
 /* Called with s->lock held.  */
 static int coroutine_fn qcow2_do_open(BlockDriverState *bs, QDict *options,
                                       int flags, Error **errp)
@@ -1340,6 +1471,17 @@ static int coroutine_fn qcow2_do_open(BlockDriverState *bs, QDict *options,
         }
     }
 
+    if (header.header_length > offsetof(QCowHeader, compression_type)) {
+        s->compression_type = header.compression_type;
+    } else {
+        s->compression_type = QCOW2_COMPRESSION_TYPE_ZLIB;
+    }
+
+    ret = validate_compression_type(s, errp);
+    if (ret < 0) {
+        goto fail;
+    }
+
     /* Check support for various header values */
     if (header.refcount_order > 6) {
         error_setg(errp, "Reference count entry width too large; may not "
@@ -1380,7 +1522,21 @@ static int coroutine_fn qcow2_do_open(BlockDriverState *bs, QDict *options,
         bs->encrypted = true;
     }
 
-    s->l2_bits = s->cluster_bits - 3; /* L2 is always one cluster */
+    s->subclusters_per_cluster =
+        has_subclusters(s) ? QCOW_EXTL2_SUBCLUSTERS_PER_CLUSTER : 1;
+    s->subcluster_size = s->cluster_size / s->subclusters_per_cluster;
+    s->subcluster_bits = ctz32(s->subcluster_size);
+
+    if (has_subclusters(s) && s->cluster_bits < MIN_EXTL2_CLUSTER_BITS) {
+        error_setg(errp, "Unsupported cluster size for extended L2 entries: "
+                   "%d bytes (at least %d required)", s->cluster_size,
+                   1 << MIN_EXTL2_CLUSTER_BITS);
+        ret = -EINVAL;
+        goto fail;
+    }
+
+    /* L2 is always one cluster */
+    s->l2_bits = s->cluster_bits - ctz32(l2_entry_size(s));
     s->l2_size = 1 << s->l2_bits;
     /* 2^(s->refcount_order - 3) is the refcount width in bytes */
     s->refcount_block_bits = s->cluster_bits - (s->refcount_order - 3);
@@ -1482,6 +1638,7 @@ static int coroutine_fn qcow2_do_open(BlockDriverState *bs, QDict *options,
 
     QLIST_INIT(&s->cluster_allocs);
     QTAILQ_INIT(&s->discards);
+    QSIMPLEQ_INIT(&s->prealloc_ranges);
 
     /* read qcow2 extensions */
     if (qcow2_read_extensions(bs, header.header_length, ext_end, NULL,
@@ -1543,7 +1700,8 @@ static int coroutine_fn qcow2_do_open(BlockDriverState *bs, QDict *options,
                 cflags |= QCRYPTO_BLOCK_OPEN_NO_IO;
             }
             s->crypto = qcrypto_block_open(s->crypto_opts, "encrypt.",
-                                           NULL, NULL, cflags, 1, errp);
+                                           NULL, NULL, cflags,
+                                           QCOW2_MAX_THREADS, errp);
             if (!s->crypto) {
                 ret = -EINVAL;
                 goto fail;
@@ -1698,7 +1856,11 @@ static int coroutine_fn qcow2_do_open(BlockDriverState *bs, QDict *options,
     }
 #endif
 
-    qemu_co_queue_init(&s->compress_wait_queue);
+    qemu_co_queue_init(&s->thread_task_queue);
+
+    if (!(flags & BDRV_O_INACTIVE)) {
+        qcow2_warmup_start(bs);
+    }
 
     return ret;
 
@@ -1723,6 +1885,8 @@ static int coroutine_fn qcow2_do_open(BlockDriverState *bs, QDict *options,
     }
     qcrypto_block_free(s->crypto);
     qapi_free_QCryptoBlockOpenOptions(s->crypto_opts);
+    qcow2_warmup_free(bs);
+    qcow2_dedup_free(bs);
     return ret;
 }
 
@@ -1784,7 +1948,7 @@ static void qcow2_refresh_limits(BlockDriverState *bs, Error **errp)
         /* Encryption works on a sector granularity */
         bs->bl.request_alignment = qcrypto_block_get_sector_size(s->crypto);
     }
-    bs->bl.pwrite_zeroes_alignment = s->cluster_size;
+    bs->bl.pwrite_zeroes_alignment = s->subcluster_size;
     bs->bl.pdiscard_alignment = s->cluster_size;
 }
 
@@ -1805,6 +1969,8 @@ static int qcow2_reopen_prepare(BDRVReopenState *state,
 
     /* We need to write out any unwritten data if we reopen read-only. */
     if ((state->flags & BDRV_O_RDWR) == 0) {
+        qcow2_prealloc_release(state->bs);
+
         ret = qcow2_reopen_bitmaps_ro(state->bs, errp);
         if (ret < 0) {
             goto fail;
@@ -1894,31 +2060,37 @@ static int coroutine_fn qcow2_co_block_status(BlockDriverState *bs,
                                               BlockDriverState **file)
 {
     BDRVQcow2State *s = bs->opaque;
-    uint64_t cluster_offset;
-    int index_in_cluster, ret;
+    uint64_t host_offset;
     unsigned int bytes;
-    int status = 0;
+    QCow2SubclusterType type;
+    int ret, status = 0;
 
     bytes = MIN(INT_MAX, count);
-    qemu_co_mutex_lock(&s->lock);
-    ret = qcow2_get_cluster_offset(bs, offset, &bytes, &cluster_offset);
-    qemu_co_mutex_unlock(&s->lock);
+    ret = qcow2_get_host_offset_nowait(bs, offset, &bytes, &host_offset,
+                                       &type);
+    if (ret == -EAGAIN) {
+        qemu_co_mutex_lock(&s->lock);
+        ret = qcow2_get_host_offset(bs, offset, &bytes, &host_offset, &type);
+        qemu_co_mutex_unlock(&s->lock);
+    }
     if (ret < 0) {
         return ret;
     }
 
     *pnum = bytes;
 
-    if ((ret == QCOW2_CLUSTER_NORMAL || ret == QCOW2_CLUSTER_ZERO_ALLOC) &&
-        !s->crypto) {
-        index_in_cluster = offset & (s->cluster_size - 1);
-        *map = cluster_offset | index_in_cluster;
+    if ((type == QCOW2_SUBCLUSTER_NORMAL ||
+         type == QCOW2_SUBCLUSTER_ZERO_ALLOC ||
+         type == QCOW2_SUBCLUSTER_UNALLOCATED_ALLOC) && !s->crypto) {
+        *map = host_offset;
         *file = s->data_file->bs;
         status |= BDRV_BLOCK_OFFSET_VALID;
     }
-    if (ret == QCOW2_CLUSTER_ZERO_PLAIN || ret == QCOW2_CLUSTER_ZERO_ALLOC) {
+    if (type == QCOW2_SUBCLUSTER_ZERO_PLAIN ||
+        type == QCOW2_SUBCLUSTER_ZERO_ALLOC) {
         status |= BDRV_BLOCK_ZERO;
-    } else if (ret != QCOW2_CLUSTER_UNALLOCATED) {
+    } else if (type != QCOW2_SUBCLUSTER_UNALLOCATED_PLAIN &&
+               type != QCOW2_SUBCLUSTER_UNALLOCATED_ALLOC) {
         status |= BDRV_BLOCK_DATA;
     }
     return status;
@@ -1959,150 +2131,176 @@ out:
     return ret;
 }
 
-static coroutine_fn int qcow2_co_preadv(BlockDriverState *bs, uint64_t offset,
-                                        uint64_t bytes, QEMUIOVector *qiov,
-                                        int flags)
+static coroutine_fn int qcow2_co_preadv_task(BlockDriverState *bs,
+                                             QCow2SubclusterType type,
+                                             uint64_t host_offset,
+                                             uint64_t offset, uint64_t bytes,
+                                             QEMUIOVector *qiov)
 {
     BDRVQcow2State *s = bs->opaque;
-    int offset_in_cluster;
+    QEMUIOVector crypt_qiov;
+    uint8_t *crypt_buf;
     int ret;
-    unsigned int cur_bytes; /* number of bytes in current iteration */
-    uint64_t cluster_offset = 0;
-    uint64_t bytes_done = 0;
-    QEMUIOVector hd_qiov;
-    uint8_t *cluster_data = NULL;
 
-    qemu_iovec_init(&hd_qiov, qiov->niov);
+    switch (type) {
+    case QCOW2_SUBCLUSTER_UNALLOCATED_PLAIN:
+    case QCOW2_SUBCLUSTER_UNALLOCATED_ALLOC:
+        assert(bs->backing); /* otherwise handled in qcow2_co_preadv */
 
-    qemu_co_mutex_lock(&s->lock);
+        BLKDBG_EVENT(bs->file, BLKDBG_READ_BACKING_AIO);
+        return bdrv_co_preadv(bs->backing, offset, bytes, qiov, 0);
 
-    while (bytes != 0) {
+    case QCOW2_SUBCLUSTER_COMPRESSED:
+        return qcow2_co_preadv_compressed(bs, host_offset, offset, bytes,
+                                          qiov);
 
-        /* prepare next request */
-        cur_bytes = MIN(bytes, INT_MAX);
-        if (s->crypto) {
-            cur_bytes = MIN(cur_bytes,
-                            QCOW_MAX_CRYPT_CLUSTERS * s->cluster_size);
+    case QCOW2_SUBCLUSTER_NORMAL:
+        if (!bs->encrypted) {
+            BLKDBG_EVENT(bs->file, BLKDBG_READ_AIO);
+            return bdrv_co_preadv(s->data_file, host_offset, bytes, qiov, 0);
+        }
+
+        /*
+         * For encrypted images, read everything into a temporary
+         * contiguous buffer on which the AES functions can work.
+         */
+        assert(s->crypto);
+        assert(bytes <= QCOW_MAX_CRYPT_CLUSTERS * s->cluster_size);
+        assert((offset & (BDRV_SECTOR_SIZE - 1)) == 0);
+        assert((bytes & (BDRV_SECTOR_SIZE - 1)) == 0);
+
+        crypt_buf = qemu_try_blockalign(s->data_file->bs, bytes);
+        if (crypt_buf == NULL) {
+            return -ENOMEM;
         }
+        qemu_iovec_init_buf(&crypt_qiov, crypt_buf, bytes);
 
-        ret = qcow2_get_cluster_offset(bs, offset, &cur_bytes, &cluster_offset);
+        BLKDBG_EVENT(bs->file, BLKDBG_READ_AIO);
+        ret = bdrv_co_preadv(s->data_file, host_offset, bytes, &crypt_qiov, 0);
         if (ret < 0) {
-            goto fail;
+            goto out;
         }
 
-        offset_in_cluster = offset_into_cluster(s, offset);
+        if (qcow2_co_decrypt(bs, host_offset, offset, crypt_buf, bytes) < 0) {
+            ret = -EIO;
+            goto out;
+        }
+        qemu_iovec_from_buf(qiov, 0, crypt_buf, bytes);
+out:
+        qemu_vfree(crypt_buf);
+        return ret;
 
-        qemu_iovec_reset(&hd_qiov);
-        qemu_iovec_concat(&hd_qiov, qiov, bytes_done, cur_bytes);
+    default:
+        g_assert_not_reached();
+        return -EIO;
+    }
+}
 
-        switch (ret) {
-        case QCOW2_CLUSTER_UNALLOCATED:
+typedef struct Qcow2ReadTask {
+    Qcow2TaskGroup *tg;
+    BlockDriverState *bs;
+    QCow2SubclusterType type;
+    uint64_t host_offset;
+    uint64_t offset;
+    uint64_t bytes;
+    QEMUIOVector qiov;
+} Qcow2ReadTask;
 
-            if (bs->backing) {
-                BLKDBG_EVENT(bs->file, BLKDBG_READ_BACKING_AIO);
-                qemu_co_mutex_unlock(&s->lock);
-                ret = bdrv_co_preadv(bs->backing, offset, cur_bytes,
-                                     &hd_qiov, 0);
-                qemu_co_mutex_lock(&s->lock);
-                if (ret < 0) {
-                    goto fail;
-                }
-            } else {
-                /* Note: in this case, no need to wait */
-                qemu_iovec_memset(&hd_qiov, 0, 0, cur_bytes);
-            }
-            break;
+static void coroutine_fn qcow2_co_preadv_task_entry(void *opaque)
+{
+    Qcow2ReadTask *task = opaque;
+    Qcow2TaskGroup *tg = task->tg;
+    int ret;
 
-        case QCOW2_CLUSTER_ZERO_PLAIN:
-        case QCOW2_CLUSTER_ZERO_ALLOC:
-            qemu_iovec_memset(&hd_qiov, 0, 0, cur_bytes);
-            break;
+    ret = qcow2_co_preadv_task(task->bs, task->type, task->host_offset,
+                               task->offset, task->bytes, &task->qiov);
 
-        case QCOW2_CLUSTER_COMPRESSED:
-            qemu_co_mutex_unlock(&s->lock);
-            ret = qcow2_co_preadv_compressed(bs, cluster_offset,
-                                             offset, cur_bytes,
-                                             &hd_qiov);
-            qemu_co_mutex_lock(&s->lock);
-            if (ret < 0) {
-                goto fail;
-            }
+    qemu_iovec_destroy(&task->qiov);
+    g_free(task);
+    qcow2_task_group_done(tg, ret);
+}
 
-            break;
+static coroutine_fn int qcow2_co_preadv(BlockDriverState *bs, uint64_t offset,
+                                        uint64_t bytes, QEMUIOVector *qiov,
+                                        int flags)
+{
+    BDRVQcow2State *s = bs->opaque;
+    int ret = 0, tg_ret;
+    unsigned int cur_bytes; /* number of bytes in current iteration */
+    uint64_t host_offset = 0;
+    QCow2SubclusterType type;
+    uint64_t bytes_done = 0;
+    Qcow2TaskGroup tg;
+    Qcow2ReadTask *task;
 
-        case QCOW2_CLUSTER_NORMAL:
-            if ((cluster_offset & 511) != 0) {
-                ret = -EIO;
-                goto fail;
-            }
+    qcow2_task_group_init(&tg);
 
-            if (bs->encrypted) {
-                assert(s->crypto);
-
-                /*
-                 * For encrypted images, read everything into a temporary
-                 * contiguous buffer on which the AES functions can work.
-                 */
-                if (!cluster_data) {
-                    cluster_data =
-                        qemu_try_blockalign(s->data_file->bs,
-                                            QCOW_MAX_CRYPT_CLUSTERS
-                                            * s->cluster_size);
-                    if (cluster_data == NULL) {
-                        ret = -ENOMEM;
-                        goto fail;
-                    }
-                }
+    /*
+     * Each host extent of the request is read by its own coroutine, so that
+     * the reads of a fragmented request are all in flight at the same time.
+     * Stop issuing new reads as soon as one of them failed.
+     */
+    while (bytes != 0 && tg.ret == 0) {
 
-                assert(cur_bytes <= QCOW_MAX_CRYPT_CLUSTERS * s->cluster_size);
-                qemu_iovec_reset(&hd_qiov);
-                qemu_iovec_add(&hd_qiov, cluster_data, cur_bytes);
-            }
+        /* prepare next request */
+        cur_bytes = MIN(bytes, INT_MAX);
+        if (s->crypto) {
+            cur_bytes = MIN(cur_bytes,
+                            QCOW_MAX_CRYPT_CLUSTERS * s->cluster_size);
+        }
 
-            BLKDBG_EVENT(bs->file, BLKDBG_READ_AIO);
-            qemu_co_mutex_unlock(&s->lock);
-            ret = bdrv_co_preadv(s->data_file,
-                                 cluster_offset + offset_in_cluster,
-                                 cur_bytes, &hd_qiov, 0);
+        ret = qcow2_get_host_offset_nowait(bs, offset, &cur_bytes,
+                                           &host_offset, &type);
+        if (ret == -EAGAIN) {
             qemu_co_mutex_lock(&s->lock);
+            ret = qcow2_get_host_offset(bs, offset, &cur_bytes, &host_offset,
+                                        &type);
+            qemu_co_mutex_unlock(&s->lock);
+        }
+        if (ret < 0) {
+            goto out;
+        }
+
+        if (type == QCOW2_SUBCLUSTER_ZERO_PLAIN ||
+            type == QCOW2_SUBCLUSTER_ZERO_ALLOC ||
+            (type == QCOW2_SUBCLUSTER_UNALLOCATED_PLAIN && !bs->backing) ||
+            (type == QCOW2_SUBCLUSTER_UNALLOCATED_ALLOC && !bs->backing))
+        {
+            /* Note: in this case, no need to wait */
+            qemu_iovec_memset(qiov, bytes_done, 0, cur_bytes);
+        } else if (bytes_done == 0 && cur_bytes == bytes) {
+            /* The whole request is one extent, don't bother with a task */
+            ret = qcow2_co_preadv_task(bs, type, host_offset, offset,
+                                       cur_bytes, qiov);
             if (ret < 0) {
-                goto fail;
-            }
-            if (bs->encrypted) {
-                assert(s->crypto);
-                assert((offset & (BDRV_SECTOR_SIZE - 1)) == 0);
-                assert((cur_bytes & (BDRV_SECTOR_SIZE - 1)) == 0);
-                if (qcrypto_block_decrypt(s->crypto,
-                                          (s->crypt_physical_offset ?
-                                           cluster_offset + offset_in_cluster :
-                                           offset),
-                                          cluster_data,
-                                          cur_bytes,
-                                          NULL) < 0) {
-                    ret = -EIO;
-                    goto fail;
-                }
-                qemu_iovec_from_buf(qiov, bytes_done, cluster_data, cur_bytes);
+                goto out;
             }
-            break;
-
-        default:
-            g_assert_not_reached();
-            ret = -EIO;
-            goto fail;
+        } else {
+            task = g_new(Qcow2ReadTask, 1);
+            *task = (Qcow2ReadTask) {
+                .tg             = &tg,
+                .bs             = bs,
+                .type           = type,
+                .host_offset    = host_offset,
+                .offset         = offset,
+                .bytes          = cur_bytes,
+            };
+            qemu_iovec_init(&task->qiov, qiov->niov);
+            qemu_iovec_concat(&task->qiov, qiov, bytes_done, cur_bytes);
+            qcow2_task_group_start(&tg, qcow2_co_preadv_task_entry, task);
         }
 
         bytes -= cur_bytes;
         offset += cur_bytes;
         bytes_done += cur_bytes;
     }
-    ret = 0;
 
-fail:
-    qemu_co_mutex_unlock(&s->lock);
-
-    qemu_iovec_destroy(&hd_qiov);
-    qemu_vfree(cluster_data);
+out:
+    /* The tasks still read into @qiov */
+    tg_ret = qcow2_task_group_wait(&tg);
+    if (ret == 0) {
+        ret = tg_ret;
+    }
 
     return ret;
 }
@@ -2145,27 +2343,159 @@ static bool merge_cow(uint64_t offset, unsigned bytes,
     return false;
 }
 
+/*
+ * Clusters taken from a zeroed part of the preallocated pool already read as
+ * zeroes, so COW regions whose guest data is zero don't need to be written.
+ */
+static void coroutine_fn skip_zero_cow(BlockDriverState *bs,
+                                       QCowL2Meta *l2meta)
+{
+    QCowL2Meta *m;
+
+    if (bs->encrypted) {
+        return;
+    }
+
+    for (m = l2meta; m != NULL; m = m->next) {
+        if (!m->alloc_zeroed) {
+            continue;
+        }
+
+        if (is_zero(bs, l2meta_cow_start(m), m->cow_start.nb_bytes) &&
+            is_zero(bs, m->offset + m->cow_end.offset, m->cow_end.nb_bytes))
+        {
+            m->cow_start.nb_bytes = 0;
+            m->cow_end.nb_bytes = 0;
+        }
+    }
+}
+
+/*
+ * Encrypt and write the guest data of one allocated host extent, then
+ * link the new clusters into the L2 tables.  Takes ownership of @l2meta.
+ * If @dedup_hash is not NULL, the extent is one new cluster whose content
+ * hash is added to the dedup index once it is linked.
+ */
+static coroutine_fn int qcow2_co_pwritev_task(BlockDriverState *bs,
+                                              uint64_t host_offset,
+                                              uint64_t offset, uint64_t bytes,
+                                              QEMUIOVector *qiov,
+                                              QCowL2Meta *l2meta,
+                                              const uint8_t *dedup_hash)
+{
+    BDRVQcow2State *s = bs->opaque;
+    QEMUIOVector crypt_qiov;
+    uint8_t *crypt_buf = NULL;
+    int ret;
+
+    if (bs->encrypted) {
+        assert(s->crypto);
+        assert(bytes <= QCOW_MAX_CRYPT_CLUSTERS * s->cluster_size);
+        crypt_buf = qemu_try_blockalign(bs->file->bs, bytes);
+        if (crypt_buf == NULL) {
+            ret = -ENOMEM;
+            goto out_unlocked;
+        }
+        qemu_iovec_to_buf(qiov, 0, crypt_buf, bytes);
+
+        if (qcow2_co_encrypt(bs, host_offset, offset, crypt_buf, bytes) < 0) {
+            ret = -EIO;
+            goto out_unlocked;
+        }
+
+        qemu_iovec_init_buf(&crypt_qiov, crypt_buf, bytes);
+        qiov = &crypt_qiov;
+    }
+
+    skip_zero_cow(bs, l2meta);
+
+    /* If we need to do COW, check if it's possible to merge the
+     * writing of the guest data together with that of the COW regions.
+     * If it's not possible (or not necessary) then write the
+     * guest data now. */
+    if (!merge_cow(offset, bytes, qiov, l2meta)) {
+        BLKDBG_EVENT(bs->file, BLKDBG_WRITE_AIO);
+        trace_qcow2_writev_data(qemu_coroutine_self(), host_offset);
+        ret = bdrv_co_pwritev(s->data_file, host_offset, bytes, qiov, 0);
+        if (ret < 0) {
+            goto out_unlocked;
+        }
+    }
+
+    qemu_co_mutex_lock(&s->lock);
+
+    ret = qcow2_handle_l2meta(bs, &l2meta, true);
+    if (ret == 0 && dedup_hash) {
+        qcow2_dedup_insert(bs, offset, host_offset, dedup_hash);
+    }
+    goto out_locked;
+
+out_unlocked:
+    qemu_co_mutex_lock(&s->lock);
+
+out_locked:
+    qcow2_handle_l2meta(bs, &l2meta, false);
+    qemu_co_mutex_unlock(&s->lock);
+
+    qemu_vfree(crypt_buf);
+
+    return ret;
+}
+
+typedef struct Qcow2WriteTask {
+    Qcow2TaskGroup *tg;
+    BlockDriverState *bs;
+    uint64_t host_offset;
+    uint64_t offset;
+    uint64_t bytes;
+    QEMUIOVector qiov;
+    QCowL2Meta *l2meta;
+    bool dedup;
+    uint8_t dedup_hash[QCOW2_DEDUP_HASH_SIZE];
+} Qcow2WriteTask;
+
+static void coroutine_fn qcow2_co_pwritev_task_entry(void *opaque)
+{
+    Qcow2WriteTask *task = opaque;
+    Qcow2TaskGroup *tg = task->tg;
+    int ret;
+
+    ret = qcow2_co_pwritev_task(task->bs, task->host_offset, task->offset,
+                                task->bytes, &task->qiov, task->l2meta,
+                                task->dedup ? task->dedup_hash : NULL);
+
+    qemu_iovec_destroy(&task->qiov);
+    g_free(task);
+    qcow2_task_group_done(tg, ret);
+}
+
 static coroutine_fn int qcow2_co_pwritev(BlockDriverState *bs, uint64_t offset,
                                          uint64_t bytes, QEMUIOVector *qiov,
                                          int flags)
 {
     BDRVQcow2State *s = bs->opaque;
     int offset_in_cluster;
-    int ret;
+    int ret = 0, tg_ret;
     unsigned int cur_bytes; /* number of sectors in current iteration */
     uint64_t cluster_offset;
-    QEMUIOVector hd_qiov;
     uint64_t bytes_done = 0;
-    uint8_t *cluster_data = NULL;
     QCowL2Meta *l2meta = NULL;
+    Qcow2TaskGroup tg;
+    Qcow2WriteTask *task;
+    QEMUIOVector hash_qiov;
+    uint8_t hash[QCOW2_DEDUP_HASH_SIZE];
+    bool dedup;
 
     trace_qcow2_writev_start_req(qemu_coroutine_self(), offset, bytes);
 
-    qemu_iovec_init(&hd_qiov, qiov->niov);
+    qcow2_task_group_init(&tg);
 
-    qemu_co_mutex_lock(&s->lock);
-
-    while (bytes != 0) {
+    /*
+     * Clusters are allocated one host extent at a time under s->lock; the
+     * data of each extent is then written by its own coroutine while the
+     * next extent is allocated.
+     */
+    while (bytes != 0 && tg.ret == 0) {
 
         l2meta = NULL;
 
@@ -2178,90 +2508,104 @@ static coroutine_fn int qcow2_co_pwritev(BlockDriverState *bs, uint64_t offset,
                             - offset_in_cluster);
         }
 
-        ret = qcow2_alloc_cluster_offset(bs, offset, &cur_bytes,
-                                         &cluster_offset, &l2meta);
-        if (ret < 0) {
-            goto fail;
+        /* With dedup, clusters are written one at a time so that each
+         * complete one can be shared */
+        if (s->dedup) {
+            cur_bytes = MIN(cur_bytes, s->cluster_size - offset_in_cluster);
         }
-
-        assert((cluster_offset & 511) == 0);
-
-        qemu_iovec_reset(&hd_qiov);
-        qemu_iovec_concat(&hd_qiov, qiov, bytes_done, cur_bytes);
-
-        if (bs->encrypted) {
-            assert(s->crypto);
-            if (!cluster_data) {
-                cluster_data = qemu_try_blockalign(bs->file->bs,
-                                                   QCOW_MAX_CRYPT_CLUSTERS
-                                                   * s->cluster_size);
-                if (cluster_data == NULL) {
-                    ret = -ENOMEM;
-                    goto fail;
-                }
+        dedup = s->dedup && cur_bytes == s->cluster_size;
+        if (dedup) {
+            qemu_iovec_init(&hash_qiov, qiov->niov);
+            qemu_iovec_concat(&hash_qiov, qiov, bytes_done, cur_bytes);
+            ret = qcow2_co_hash(bs, &hash_qiov, hash);
+            qemu_iovec_destroy(&hash_qiov);
+            if (ret < 0) {
+                goto out;
             }
+        }
 
-            assert(hd_qiov.size <=
-                   QCOW_MAX_CRYPT_CLUSTERS * s->cluster_size);
-            qemu_iovec_to_buf(&hd_qiov, 0, cluster_data, hd_qiov.size);
+        qemu_co_mutex_lock(&s->lock);
 
-            if (qcrypto_block_encrypt(s->crypto,
-                                      (s->crypt_physical_offset ?
-                                       cluster_offset + offset_in_cluster :
-                                       offset),
-                                      cluster_data,
-                                      cur_bytes, NULL) < 0) {
-                ret = -EIO;
-                goto fail;
+        if (dedup) {
+            ret = qcow2_dedup_link(bs, offset, hash);
+            if (ret < 0) {
+                goto out_locked;
+            } else if (ret > 0) {
+                qemu_co_mutex_unlock(&s->lock);
+                ret = 0;
+                goto next;
             }
+        }
 
-            qemu_iovec_reset(&hd_qiov);
-            qemu_iovec_add(&hd_qiov, cluster_data, cur_bytes);
+        ret = qcow2_alloc_cluster_offset(bs, offset, &cur_bytes,
+                                         &cluster_offset, &l2meta);
+        if (ret < 0) {
+            goto out_locked;
         }
 
+        /* Only newly allocated clusters are added to the dedup index */
+        dedup = dedup && l2meta && !l2meta->next &&
+                l2meta->nb_clusters == 1 && !l2meta->keep_old_clusters;
+
+        assert((cluster_offset & 511) == 0);
+
         ret = qcow2_pre_write_overlap_check(bs, 0,
                 cluster_offset + offset_in_cluster, cur_bytes, true);
         if (ret < 0) {
-            goto fail;
+            goto out_locked;
         }
 
-        /* If we need to do COW, check if it's possible to merge the
-         * writing of the guest data together with that of the COW regions.
-         * If it's not possible (or not necessary) then write the
-         * guest data now. */
-        if (!merge_cow(offset, cur_bytes, &hd_qiov, l2meta)) {
-            qemu_co_mutex_unlock(&s->lock);
-            BLKDBG_EVENT(bs->file, BLKDBG_WRITE_AIO);
-            trace_qcow2_writev_data(qemu_coroutine_self(),
-                                    cluster_offset + offset_in_cluster);
-            ret = bdrv_co_pwritev(s->data_file,
-                                  cluster_offset + offset_in_cluster,
-                                  cur_bytes, &hd_qiov, 0);
-            qemu_co_mutex_lock(&s->lock);
+        /*
+         * The allocated clusters are protected by l2meta, so the lock can
+         * be dropped while the data is encrypted and written.
+         */
+        qemu_co_mutex_unlock(&s->lock);
+
+        if (bytes_done == 0 && cur_bytes == bytes) {
+            /* The whole request is one extent, don't bother with a task */
+            ret = qcow2_co_pwritev_task(bs, cluster_offset + offset_in_cluster,
+                                        offset, cur_bytes, qiov, l2meta,
+                                        dedup ? hash : NULL);
             if (ret < 0) {
-                goto fail;
+                goto out;
             }
+        } else {
+            task = g_new(Qcow2WriteTask, 1);
+            *task = (Qcow2WriteTask) {
+                .tg             = &tg,
+                .bs             = bs,
+                .host_offset    = cluster_offset + offset_in_cluster,
+                .offset         = offset,
+                .bytes          = cur_bytes,
+                .l2meta         = l2meta,
+                .dedup          = dedup,
+            };
+            if (dedup) {
+                memcpy(task->dedup_hash, hash, QCOW2_DEDUP_HASH_SIZE);
+            }
+            qemu_iovec_init(&task->qiov, qiov->niov);
+            qemu_iovec_concat(&task->qiov, qiov, bytes_done, cur_bytes);
+            qcow2_task_group_start(&tg, qcow2_co_pwritev_task_entry, task);
         }
 
-        ret = qcow2_handle_l2meta(bs, &l2meta, true);
-        if (ret) {
-            goto fail;
-        }
-
+next:
         bytes -= cur_bytes;
         offset += cur_bytes;
         bytes_done += cur_bytes;
         trace_qcow2_writev_done_part(qemu_coroutine_self(), cur_bytes);
     }
-    ret = 0;
+    goto out;
 
-fail:
+out_locked:
     qcow2_handle_l2meta(bs, &l2meta, false);
-
     qemu_co_mutex_unlock(&s->lock);
 
-    qemu_iovec_destroy(&hd_qiov);
-    qemu_vfree(cluster_data);
+out:
+    tg_ret = qcow2_task_group_wait(&tg);
+    if (ret == 0) {
+        ret = tg_ret;
+    }
+
     trace_qcow2_writev_done_req(qemu_coroutine_self(), ret);
 
     return ret;
@@ -2273,6 +2617,14 @@ static int qcow2_inactivate(BlockDriverState *bs)
     int ret, result = 0;
     Error *local_err = NULL;
 
+    qcow2_prealloc_release(bs);
+
+    /* The image may be handed over to another process now, and the drained
+     * section of vm_stop() has ended and restarted the warm-up */
+    qcow2_warmup_stop(bs);
+    BDRV_POLL_WHILE(bs, s->warmup && s->warmup->co);
+    qcow2_warmup_save(bs);
+
     qcow2_store_persistent_dirty_bitmaps(bs, &local_err);
     if (local_err != NULL) {
         result = -EINVAL;
@@ -2320,6 +2672,9 @@ static void qcow2_close(BlockDriverState *bs)
     qcrypto_block_free(s->crypto);
     s->crypto = NULL;
 
+    qcow2_warmup_free(bs);
+    qcow2_dedup_free(bs);
+
     g_free(s->unknown_header_fields);
     cleanup_unknown_header_ext(bs);
 
@@ -2335,6 +2690,18 @@ static void qcow2_close(BlockDriverState *bs)
     qcow2_free_snapshots(bs);
 }
 
+static void coroutine_fn qcow2_co_drain_begin(BlockDriverState *bs)
+{
+    qcow2_warmup_stop(bs);
+}
+
+static void coroutine_fn qcow2_co_drain_end(BlockDriverState *bs)
+{
+    if (atomic_read(&bs->quiesce_counter) == 0) {
+        qcow2_warmup_start(bs);
+    }
+}
+
 static void coroutine_fn qcow2_co_invalidate_cache(BlockDriverState *bs,
                                                    Error **errp)
 {
@@ -2455,6 +2822,7 @@ int qcow2_update_header(BlockDriverState *bs)
         .autoclear_features     = cpu_to_be64(s->autoclear_features),
         .refcount_order         = cpu_to_be32(s->refcount_order),
         .header_length          = cpu_to_be32(header_length),
+        .compression_type       = s->compression_type,
     };
 
     /* For older versions, write a shorter header */
@@ -2547,6 +2915,16 @@ int qcow2_update_header(BlockDriverState *bs)
                 .bit  = QCOW2_INCOMPAT_DATA_FILE_BITNR,
                 .name = "external data file",
             },
+            {
+                .type = QCOW2_FEAT_TYPE_INCOMPATIBLE,
+                .bit  = QCOW2_INCOMPAT_COMPRESSION_BITNR,
+                .name = "compression type",
+            },
+            {
+                .type = QCOW2_FEAT_TYPE_INCOMPATIBLE,
+                .bit  = QCOW2_INCOMPAT_EXTL2_BITNR,
+                .name = "extended L2 entries",
+            },
             {
                 .type = QCOW2_FEAT_TYPE_COMPATIBLE,
                 .bit  = QCOW2_COMPAT_LAZY_REFCOUNTS_BITNR,
@@ -2847,28 +3225,31 @@ int64_t qcow2_refcount_metadata_size(int64_t clusters, size_t cluster_size,
  * @total_size: virtual disk size in bytes
  * @cluster_size: cluster size in bytes
  * @refcount_order: refcount bits power-of-2 exponent
+ * @extended_l2: true if the image has extended L2 entries
  *
  * Returns: Total number of bytes required for the fully allocated image
  * (including metadata).
  */
 static int64_t qcow2_calc_prealloc_size(int64_t total_size,
                                         size_t cluster_size,
-                                        int refcount_order)
+                                        int refcount_order,
+                                        bool extended_l2)
 {
     int64_t meta_size = 0;
     uint64_t nl1e, nl2e;
     int64_t aligned_total_size = ROUND_UP(total_size, cluster_size);
+    size_t l2e_size = extended_l2 ? L2E_SIZE_EXTENDED : L2E_SIZE_NORMAL;
 
     /* header: 1 cluster */
     meta_size += cluster_size;
 
     /* total size of L2 tables */
     nl2e = aligned_total_size / cluster_size;
-    nl2e = ROUND_UP(nl2e, cluster_size / sizeof(uint64_t));
-    meta_size += nl2e * sizeof(uint64_t);
+    nl2e = ROUND_UP(nl2e, cluster_size / l2e_size);
+    meta_size += nl2e * l2e_size;
 
     /* total size of L1 tables */
-    nl1e = nl2e * sizeof(uint64_t) / cluster_size;
+    nl1e = nl2e * l2e_size / cluster_size;
     nl1e = ROUND_UP(nl1e, cluster_size / sizeof(uint64_t));
     meta_size += nl1e * sizeof(uint64_t);
 
@@ -2973,6 +3354,7 @@ qcow2_co_create(BlockdevCreateOptions *create_options, Error **errp)
     int version;
     int refcount_order;
     uint64_t* refcount_table;
+    Qcow2CompressionType compression_type = QCOW2_COMPRESSION_TYPE_ZLIB;
     Error *local_err = NULL;
     int ret;
 
@@ -3064,6 +3446,37 @@ qcow2_co_create(BlockdevCreateOptions *create_options, Error **errp)
     }
     refcount_order = ctz32(qcow2_opts->refcount_bits);
 
+    if (!qcow2_opts->has_extended_l2) {
+        qcow2_opts->extended_l2 = false;
+    }
+    if (qcow2_opts->extended_l2) {
+        if (version < 3) {
+            error_setg(errp, "Extended L2 entries are only supported with "
+                       "compatibility level 1.1 and above (use version=v3 or "
+                       "greater)");
+            ret = -EINVAL;
+            goto out;
+        }
+        if (cluster_size < (1 << MIN_EXTL2_CLUSTER_BITS)) {
+            error_setg(errp, "Extended L2 entries require a cluster size of "
+                       "at least %d bytes", 1 << MIN_EXTL2_CLUSTER_BITS);
+            ret = -EINVAL;
+            goto out;
+        }
+    }
+
+    if (qcow2_opts->has_compression_type &&
+        qcow2_opts->compression_type != QCOW2_COMPRESSION_TYPE_ZLIB) {
+        if (version < 3) {
+            error_setg(errp, "Non-zlib compression type is only supported with "
+                       "compatibility level 1.1 and above (use version=v3 or "
+                       "greater)");
+            ret = -EINVAL;
+            goto out;
+        }
+        compression_type = qcow2_opts->compression_type;
+    }
+
     if (qcow2_opts->data_file_raw && !qcow2_opts->data_file) {
         error_setg(errp, "data-file-raw requires data-file");
         ret = -EINVAL;
@@ -3119,6 +3532,7 @@ qcow2_co_create(BlockdevCreateOptions *create_options, Error **errp)
         .refcount_table_clusters    = cpu_to_be32(1),
         .refcount_order             = cpu_to_be32(refcount_order),
         .header_length              = cpu_to_be32(sizeof(*header)),
+        .compression_type           = compression_type,
     };
 
     /* We'll update this to correct value later */
@@ -3132,6 +3546,14 @@ qcow2_co_create(BlockdevCreateOptions *create_options, Error **errp)
         header->incompatible_features |=
             cpu_to_be64(QCOW2_INCOMPAT_DATA_FILE);
     }
+    if (qcow2_opts->extended_l2) {
+        header->incompatible_features |=
+            cpu_to_be64(QCOW2_INCOMPAT_EXTL2);
+    }
+    if (compression_type != QCOW2_COMPRESSION_TYPE_ZLIB) {
+        header->incompatible_features |=
+            cpu_to_be64(QCOW2_INCOMPAT_COMPRESSION);
+    }
     if (qcow2_opts->data_file_raw) {
         header->autoclear_features |=
             cpu_to_be64(QCOW2_AUTOCLEAR_DATA_FILE_RAW);
@@ -3318,6 +3740,8 @@ static int coroutine_fn qcow2_co_create_opts(const char *filename, QemuOpts *opt
         { BLOCK_OPT_ENCRYPT,            BLOCK_OPT_ENCRYPT_FORMAT },
         { BLOCK_OPT_COMPAT_LEVEL,       "version" },
         { BLOCK_OPT_DATA_FILE_RAW,      "data-file-raw" },
+        { BLOCK_OPT_EXTL2,              "extended-l2" },
+        { BLOCK_OPT_COMPRESSION_TYPE,   "compression-type" },
         { NULL, NULL },
     };
 
@@ -3422,8 +3846,8 @@ static coroutine_fn int qcow2_co_pwrite_zeroes(BlockDriverState *bs,
     int ret;
     BDRVQcow2State *s = bs->opaque;
 
-    uint32_t head = offset % s->cluster_size;
-    uint32_t tail = (offset + bytes) % s->cluster_size;
+    uint32_t head = offset_into_subcluster(s, offset);
+    uint32_t tail = offset_into_subcluster(s, offset + bytes);
 
     trace_qcow2_pwrite_zeroes_start_req(qemu_coroutine_self(), offset, bytes);
     if (offset + bytes == bs->total_sectors * BDRV_SECTOR_SIZE) {
@@ -3433,27 +3857,30 @@ static coroutine_fn int qcow2_co_pwrite_zeroes(BlockDriverState *bs,
     if (head || tail) {
         uint64_t off;
         unsigned int nr;
+        QCow2SubclusterType type;
 
-        assert(head + bytes <= s->cluster_size);
+        assert(head + bytes <= s->subcluster_size);
 
-        /* check whether remainder of cluster already reads as zero */
+        /* check whether remainder of subcluster already reads as zero */
         if (!(is_zero(bs, offset - head, head) &&
               is_zero(bs, offset + bytes,
-                      tail ? s->cluster_size - tail : 0))) {
+                      tail ? s->subcluster_size - tail : 0))) {
             return -ENOTSUP;
         }
 
         qemu_co_mutex_lock(&s->lock);
         /* We can have new write after previous check */
-        offset = QEMU_ALIGN_DOWN(offset, s->cluster_size);
-        bytes = s->cluster_size;
-        nr = s->cluster_size;
-        ret = qcow2_get_cluster_offset(bs, offset, &nr, &off);
-        if (ret != QCOW2_CLUSTER_UNALLOCATED &&
-            ret != QCOW2_CLUSTER_ZERO_PLAIN &&
-            ret != QCOW2_CLUSTER_ZERO_ALLOC) {
+        offset = QEMU_ALIGN_DOWN(offset, s->subcluster_size);
+        bytes = s->subcluster_size;
+        nr = s->subcluster_size;
+        ret = qcow2_get_host_offset(bs, offset, &nr, &off, &type);
+        if (ret < 0 ||
+            (type != QCOW2_SUBCLUSTER_UNALLOCATED_PLAIN &&
+             type != QCOW2_SUBCLUSTER_UNALLOCATED_ALLOC &&
+             type != QCOW2_SUBCLUSTER_ZERO_PLAIN &&
+             type != QCOW2_SUBCLUSTER_ZERO_ALLOC)) {
             qemu_co_mutex_unlock(&s->lock);
-            return -ENOTSUP;
+            return ret < 0 ? ret : -ENOTSUP;
         }
     } else {
         qemu_co_mutex_lock(&s->lock);
@@ -3461,8 +3888,8 @@ static coroutine_fn int qcow2_co_pwrite_zeroes(BlockDriverState *bs,
 
     trace_qcow2_pwrite_zeroes(qemu_coroutine_self(), offset, bytes);
 
-    /* Whatever is left can use real zero clusters */
-    ret = qcow2_cluster_zeroize(bs, offset, bytes, flags);
+    /* Whatever is left can use real zero (sub)clusters */
+    ret = qcow2_subcluster_zeroize(bs, offset, bytes, flags);
     qemu_co_mutex_unlock(&s->lock);
 
     return ret;
@@ -3509,17 +3936,20 @@ qcow2_co_copy_range_from(BlockDriverState *bs,
 
     while (bytes != 0) {
         uint64_t copy_offset = 0;
+        QCow2SubclusterType type;
         /* prepare next request */
         cur_bytes = MIN(bytes, INT_MAX);
         cur_write_flags = write_flags;
 
-        ret = qcow2_get_cluster_offset(bs, src_offset, &cur_bytes, &copy_offset);
+        ret = qcow2_get_host_offset(bs, src_offset, &cur_bytes,
+                                    &copy_offset, &type);
         if (ret < 0) {
             goto out;
         }
 
-        switch (ret) {
-        case QCOW2_CLUSTER_UNALLOCATED:
+        switch (type) {
+        case QCOW2_SUBCLUSTER_UNALLOCATED_PLAIN:
+        case QCOW2_SUBCLUSTER_UNALLOCATED_ALLOC:
             if (bs->backing && bs->backing->bs) {
                 int64_t backing_length = bdrv_getlength(bs->backing->bs);
                 if (src_offset >= backing_length) {
@@ -3534,18 +3964,17 @@ qcow2_co_copy_range_from(BlockDriverState *bs,
             }
             break;
 
-        case QCOW2_CLUSTER_ZERO_PLAIN:
-        case QCOW2_CLUSTER_ZERO_ALLOC:
+        case QCOW2_SUBCLUSTER_ZERO_PLAIN:
+        case QCOW2_SUBCLUSTER_ZERO_ALLOC:
             cur_write_flags |= BDRV_REQ_ZERO_WRITE;
             break;
 
-        case QCOW2_CLUSTER_COMPRESSED:
+        case QCOW2_SUBCLUSTER_COMPRESSED:
             ret = -ENOTSUP;
             goto out;
 
-        case QCOW2_CLUSTER_NORMAL:
+        case QCOW2_SUBCLUSTER_NORMAL:
             child = s->data_file;
-            copy_offset += offset_into_cluster(s, src_offset);
             if ((copy_offset & 511) != 0) {
                 ret = -EIO;
                 goto out;
@@ -3699,6 +4128,9 @@ static int coroutine_fn qcow2_co_truncate(BlockDriverState *bs, int64_t offset,
             goto fail;
         }
 
+        /* Don't keep the image file from shrinking */
+        qcow2_prealloc_release(bs);
+
         ret = qcow2_cluster_discard(bs, ROUND_UP(offset, s->cluster_size),
                                     old_length - ROUND_UP(offset,
                                                           s->cluster_size),
@@ -3812,7 +4244,7 @@ static int coroutine_fn qcow2_co_truncate(BlockDriverState *bs, int64_t offset,
          *  preallocation. All that matters is that we will not have to allocate
          *  new refcount structures for them.) */
         nb_new_l2_tables = DIV_ROUND_UP(nb_new_data_clusters,
-                                        s->cluster_size / sizeof(uint64_t));
+                                        s->cluster_size / l2_entry_size(s));
         /* The cluster range may not be aligned to L2 boundaries, so add one L2
          * table for a potential head/tail */
         nb_new_l2_tables++;
@@ -3921,176 +4353,11 @@ fail:
     return ret;
 }
 
-/*
- * qcow2_compress()
- *
- * @dest - destination buffer, @dest_size bytes
- * @src - source buffer, @src_size bytes
- *
- * Returns: compressed size on success
- *          -ENOMEM destination buffer is not enough to store compressed data
- *          -EIO    on any other error
- */
-static ssize_t qcow2_compress(void *dest, size_t dest_size,
-                              const void *src, size_t src_size)
-{
-    ssize_t ret;
-    z_stream strm;
-
-    /* best compression, small window, no zlib header */
-    memset(&strm, 0, sizeof(strm));
-    ret = deflateInit2(&strm, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
-                       -12, 9, Z_DEFAULT_STRATEGY);
-    if (ret != Z_OK) {
-        return -EIO;
-    }
-
-    /* strm.next_in is not const in old zlib versions, such as those used on
-     * OpenBSD/NetBSD, so cast the const away */
-    strm.avail_in = src_size;
-    strm.next_in = (void *) src;
-    strm.avail_out = dest_size;
-    strm.next_out = dest;
-
-    ret = deflate(&strm, Z_FINISH);
-    if (ret == Z_STREAM_END) {
-        ret = dest_size - strm.avail_out;
-    } else {
-        ret = (ret == Z_OK ? -ENOMEM : -EIO);
-    }
-
-    deflateEnd(&strm);
-
-    return ret;
-}
-
-/*
- * qcow2_decompress()
- *
- * Decompress some data (not more than @src_size bytes) to produce exactly
- * @dest_size bytes.
- *
- * @dest - destination buffer, @dest_size bytes
- * @src - source buffer, @src_size bytes
- *
- * Returns: 0 on success
- *          -1 on fail
- */
-static ssize_t qcow2_decompress(void *dest, size_t dest_size,
-                                const void *src, size_t src_size)
-{
-    int ret = 0;
-    z_stream strm;
-
-    memset(&strm, 0, sizeof(strm));
-    strm.avail_in = src_size;
-    strm.next_in = (void *) src;
-    strm.avail_out = dest_size;
-    strm.next_out = dest;
-
-    ret = inflateInit2(&strm, -12);
-    if (ret != Z_OK) {
-        return -1;
-    }
-
-    ret = inflate(&strm, Z_FINISH);
-    if ((ret != Z_STREAM_END && ret != Z_BUF_ERROR) || strm.avail_out != 0) {
-        /* We approve Z_BUF_ERROR because we need @dest buffer to be filled, but
-         * @src buffer may be processed partly (because in qcow2 we know size of
-         * compressed data with precision of one sector) */
-        ret = -1;
-    }
-
-    inflateEnd(&strm);
-
-    return ret;
-}
-
-#define MAX_COMPRESS_THREADS 4
-
-typedef ssize_t (*Qcow2CompressFunc)(void *dest, size_t dest_size,
-                                     const void *src, size_t src_size);
-typedef struct Qcow2CompressData {
-    void *dest;
-    size_t dest_size;
-    const void *src;
-    size_t src_size;
-    ssize_t ret;
-
-    Qcow2CompressFunc func;
-} Qcow2CompressData;
-
-static int qcow2_compress_pool_func(void *opaque)
-{
-    Qcow2CompressData *data = opaque;
-
-    data->ret = data->func(data->dest, data->dest_size,
-                           data->src, data->src_size);
-
-    return 0;
-}
-
-static void qcow2_compress_complete(void *opaque, int ret)
-{
-    qemu_coroutine_enter(opaque);
-}
-
-static ssize_t coroutine_fn
-qcow2_co_do_compress(BlockDriverState *bs, void *dest, size_t dest_size,
-                     const void *src, size_t src_size, Qcow2CompressFunc func)
-{
-    BDRVQcow2State *s = bs->opaque;
-    BlockAIOCB *acb;
-    ThreadPool *pool = aio_get_thread_pool(bdrv_get_aio_context(bs));
-    Qcow2CompressData arg = {
-        .dest = dest,
-        .dest_size = dest_size,
-        .src = src,
-        .src_size = src_size,
-        .func = func,
-    };
-
-    while (s->nb_compress_threads >= MAX_COMPRESS_THREADS) {
-        qemu_co_queue_wait(&s->compress_wait_queue, NULL);
-    }
-
-    s->nb_compress_threads++;
-    acb = thread_pool_submit_aio(pool, qcow2_compress_pool_func, &arg,
-                                 qcow2_compress_complete,
-                                 qemu_coroutine_self());
-
-    if (!acb) {
-        s->nb_compress_threads--;
-        return -EINVAL;
-    }
-    qemu_coroutine_yield();
-    s->nb_compress_threads--;
-    qemu_co_queue_next(&s->compress_wait_queue);
-
-    return arg.ret;
-}
-
-static ssize_t coroutine_fn
-qcow2_co_compress(BlockDriverState *bs, void *dest, size_t dest_size,
-                  const void *src, size_t src_size)
-{
-    return qcow2_co_do_compress(bs, dest, dest_size, src, src_size,
-                                qcow2_compress);
-}
-
-static ssize_t coroutine_fn
-qcow2_co_decompress(BlockDriverState *bs, void *dest, size_t dest_size,
-                    const void *src, size_t src_size)
-{
-    return qcow2_co_do_compress(bs, dest, dest_size, src, src_size,
-                                qcow2_decompress);
-}
-
 /* XXX: put compressed sectors first, then all the cluster aligned
    tables to avoid losing bytes in alignment */
 static coroutine_fn int
-qcow2_co_pwritev_compressed(BlockDriverState *bs, uint64_t offset,
-                            uint64_t bytes, QEMUIOVector *qiov)
+qcow2_co_pwritev_compressed_cluster(BlockDriverState *bs, uint64_t offset,
+                                    uint64_t bytes, QEMUIOVector *qiov)
 {
     BDRVQcow2State *s = bs->opaque;
     int ret;
@@ -4098,32 +4365,10 @@ qcow2_co_pwritev_compressed(BlockDriverState *bs, uint64_t offset,
     uint8_t *buf, *out_buf;
     uint64_t cluster_offset;
 
-    if (has_data_file(bs)) {
-        return -ENOTSUP;
-    }
-
-    if (bytes == 0) {
-        /* align end of file to a sector boundary to ease reading with
-           sector based I/Os */
-        int64_t len = bdrv_getlength(bs->file->bs);
-        if (len < 0) {
-            return len;
-        }
-        return bdrv_co_truncate(bs->file, len, PREALLOC_MODE_OFF, NULL);
-    }
-
-    if (offset_into_cluster(s, offset)) {
-        return -EINVAL;
-    }
+    assert(bytes <= s->cluster_size);
 
     buf = qemu_blockalign(bs, s->cluster_size);
     if (bytes != s->cluster_size) {
-        if (bytes > s->cluster_size ||
-            offset + bytes != bs->total_sectors << BDRV_SECTOR_BITS)
-        {
-            qemu_vfree(buf);
-            return -EINVAL;
-        }
         /* Zero-pad last write if image size is not cluster aligned */
         memset(buf + bytes, 0, s->cluster_size - bytes);
     }
@@ -4172,6 +4417,91 @@ fail:
     return ret;
 }
 
+typedef struct Qcow2CompressedWriteTask {
+    Qcow2TaskGroup *tg;
+    BlockDriverState *bs;
+    uint64_t offset;
+    uint64_t bytes;
+    QEMUIOVector qiov;
+} Qcow2CompressedWriteTask;
+
+static void coroutine_fn qcow2_co_pwritev_compressed_entry(void *opaque)
+{
+    Qcow2CompressedWriteTask *task = opaque;
+    Qcow2TaskGroup *tg = task->tg;
+    int ret;
+
+    ret = qcow2_co_pwritev_compressed_cluster(task->bs, task->offset,
+                                              task->bytes, &task->qiov);
+
+    qemu_iovec_destroy(&task->qiov);
+    g_free(task);
+    qcow2_task_group_done(tg, ret);
+}
+
+/*
+ * Requests may span several clusters; they must start at a cluster
+ * boundary and only the last cluster of the image may be written
+ * partially.  The clusters are compressed in parallel.
+ */
+static coroutine_fn int
+qcow2_co_pwritev_compressed(BlockDriverState *bs, uint64_t offset,
+                            uint64_t bytes, QEMUIOVector *qiov)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2CompressedWriteTask *task;
+    Qcow2TaskGroup tg;
+    uint64_t bytes_done = 0;
+
+    if (has_data_file(bs)) {
+        return -ENOTSUP;
+    }
+
+    if (bytes == 0) {
+        /* align end of file to a sector boundary to ease reading with
+           sector based I/Os */
+        int64_t len = bdrv_getlength(bs->file->bs);
+        if (len < 0) {
+            return len;
+        }
+        return bdrv_co_truncate(bs->file, len, PREALLOC_MODE_OFF, NULL);
+    }
+
+    if (offset_into_cluster(s, offset)) {
+        return -EINVAL;
+    }
+
+    if (offset_into_cluster(s, bytes) &&
+        offset + bytes != bs->total_sectors << BDRV_SECTOR_BITS)
+    {
+        return -EINVAL;
+    }
+
+    if (bytes <= s->cluster_size) {
+        return qcow2_co_pwritev_compressed_cluster(bs, offset, bytes, qiov);
+    }
+
+    qcow2_task_group_init(&tg);
+    while (bytes_done < bytes) {
+        uint64_t cur_bytes = MIN(bytes - bytes_done, s->cluster_size);
+
+        task = g_new(Qcow2CompressedWriteTask, 1);
+        *task = (Qcow2CompressedWriteTask) {
+            .tg     = &tg,
+            .bs     = bs,
+            .offset = offset + bytes_done,
+            .bytes  = cur_bytes,
+        };
+        qemu_iovec_init(&task->qiov, qiov->niov);
+        qemu_iovec_concat(&task->qiov, qiov, bytes_done, cur_bytes);
+        qcow2_task_group_start(&tg, qcow2_co_pwritev_compressed_entry, task);
+
+        bytes_done += cur_bytes;
+    }
+
+    return qcow2_task_group_wait(&tg);
+}
+
 static int coroutine_fn
 qcow2_co_preadv_compressed(BlockDriverState *bs,
                            uint64_t file_cluster_offset,
@@ -4494,6 +4824,8 @@ static BlockMeasureInfo *qcow2_measure(QemuOpts *opts, BlockDriverState *in_bs,
     PreallocMode prealloc;
     bool has_backing_file;
     bool has_luks;
+    bool extended_l2;
+    size_t l2e_size;
 
     /* Parse image creation options */
     cluster_size = qcow2_opt_get_cluster_size_del(opts, &local_err);
@@ -4511,6 +4843,14 @@ static BlockMeasureInfo *qcow2_measure(QemuOpts *opts, BlockDriverState *in_bs,
         goto err;
     }
 
+    extended_l2 = qemu_opt_get_bool_del(opts, BLOCK_OPT_EXTL2, false);
+    if (extended_l2 && cluster_size < (1 << MIN_EXTL2_CLUSTER_BITS)) {
+        error_setg(&local_err, "Extended L2 entries require a cluster size "
+                   "of at least %d bytes", 1 << MIN_EXTL2_CLUSTER_BITS);
+        goto err;
+    }
+    l2e_size = extended_l2 ? L2E_SIZE_EXTENDED : L2E_SIZE_NORMAL;
+
     optstr = qemu_opt_get_del(opts, BLOCK_OPT_PREALLOC);
     prealloc = qapi_enum_parse(&PreallocMode_lookup, optstr,
                                PREALLOC_MODE_OFF, &local_err);
@@ -4542,7 +4882,7 @@ static BlockMeasureInfo *qcow2_measure(QemuOpts *opts, BlockDriverState *in_bs,
 
     /* Check that virtual disk size is valid */
     l2_tables = DIV_ROUND_UP(virtual_size / cluster_size,
-                             cluster_size / sizeof(uint64_t));
+                             cluster_size / l2e_size);
     if (l2_tables * sizeof(uint64_t) > QCOW_MAX_L1_SIZE) {
         error_setg(&local_err, "The image size is too large "
                                "(try using a larger cluster size)");
@@ -4607,7 +4947,8 @@ static BlockMeasureInfo *qcow2_measure(QemuOpts *opts, BlockDriverState *in_bs,
     info = g_new(BlockMeasureInfo, 1);
     info->fully_allocated =
         qcow2_calc_prealloc_size(virtual_size, cluster_size,
-                                 ctz32(refcount_bits)) + luks_payload_size;
+                                 ctz32(refcount_bits), extended_l2) +
+        luks_payload_size;
 
     /* Remove data clusters that are not required.  This overestimates the
      * required size because metadata needed for the fully allocated file is
@@ -4679,6 +5020,10 @@ static ImageInfoSpecific *qcow2_get_specific_info(BlockDriverState *bs,
             .data_file          = g_strdup(s->image_data_file),
             .has_data_file_raw  = has_data_file(bs),
             .data_file_raw      = data_file_is_raw(bs),
+            .has_extended_l2    = true,
+            .extended_l2        = has_subclusters(s),
+            .has_compression_type = true,
+            .compression_type   = s->compression_type,
         };
     } else {
         /* if this assertion fails, this probably means a new version was
@@ -4760,6 +5105,11 @@ static int qcow2_downgrade(BlockDriverState *bs, int target_version,
         return -ENOTSUP;
     }
 
+    if (has_subclusters(s)) {
+        error_setg(errp, "Cannot downgrade an image with extended L2 entries");
+        return -ENOTSUP;
+    }
+
     /* clear incompatible features */
     if (s->incompatible_features & QCOW2_INCOMPAT_DIRTY) {
         ret = qcow2_mark_clean(bs);
@@ -4979,6 +5329,21 @@ static int qcow2_amend_options(BlockDriverState *bs, QemuOpts *opts,
                                  "images");
                 return -EINVAL;
             }
+        } else if (!strcmp(desc->name, BLOCK_OPT_EXTL2)) {
+            if (qemu_opt_get_bool(opts, BLOCK_OPT_EXTL2, false) !=
+                has_subclusters(s)) {
+                error_setg(errp, "Changing extended_l2 is not supported");
+                return -ENOTSUP;
+            }
+        } else if (!strcmp(desc->name, BLOCK_OPT_COMPRESSION_TYPE)) {
+            const char *ctype = qemu_opt_get(opts, BLOCK_OPT_COMPRESSION_TYPE);
+
+            if (ctype && strcmp(ctype, Qcow2CompressionType_str(
+                                    s->compression_type))) {
+                error_setg(errp, "Changing the compression type is not "
+                           "supported");
+                return -ENOTSUP;
+            }
         } else {
             /* if this point is reached, this probably means a new option was
              * added without having it covered here */
@@ -5225,6 +5590,12 @@ static QemuOptsList qcow2_create_opts = {
             .help = "qcow2 cluster size",
             .def_value_str = stringify(DEFAULT_CLUSTER_SIZE)
         },
+        {
+            .name = BLOCK_OPT_EXTL2,
+            .type = QEMU_OPT_BOOL,
+            .help = "Extended L2 tables with 32 subclusters per cluster",
+            .def_value_str = "off"
+        },
         {
             .name = BLOCK_OPT_PREALLOC,
             .type = QEMU_OPT_STRING,
@@ -5243,6 +5614,11 @@ static QemuOptsList qcow2_create_opts = {
             .help = "Width of a reference count entry in bits",
             .def_value_str = "16"
         },
+        {
+            .name = BLOCK_OPT_COMPRESSION_TYPE,
+            .type = QEMU_OPT_STRING,
+            .help = "Compression method used for image cluster compression",
+        },
         { /* end of list */ }
     }
 };
@@ -5299,6 +5675,8 @@ BlockDriver bdrv_qcow2 = {
     .bdrv_refresh_limits        = qcow2_refresh_limits,
     .bdrv_co_invalidate_cache   = qcow2_co_invalidate_cache,
     .bdrv_inactivate            = qcow2_inactivate,
+    .bdrv_co_drain_begin        = qcow2_co_drain_begin,
+    .bdrv_co_drain_end          = qcow2_co_drain_end,
 
     .create_opts         = &qcow2_create_opts,
     .strong_runtime_opts = qcow2_strong_runtime_opts,
@@ -534,6 +534,20 @@ static int coroutine_fn raw_co_copy_range_to(BlockDriverState *bs,
                                  read_flags, write_flags);
 }
 
+static int coroutine_fn raw_co_send_to_fd(BlockDriverState *bs,
+                                          uint64_t offset, uint64_t bytes,
+                                          int fd, const void *hdr,
+                                          size_t hdr_len)
+{
+    int ret;
+
+    ret = raw_adjust_offset(bs, &offset, bytes, false);
+    if (ret) {
+        return ret;
+    }
+    return bdrv_co_send_to_fd(bs->file, offset, bytes, fd, hdr, hdr_len);
+}
+
 static const char *const raw_strong_runtime_opts[] = {
     "offset",
     "size",
@@ -544,6 +558,7 @@ static const char *const raw_strong_runtime_opts[] = {
 BlockDriver bdrv_raw = {
     .format_name          = "raw",
     .instance_size        = sizeof(BDRVRawState),
+    .supports_multiqueue  = true,
     .bdrv_probe           = &raw_probe,
     .bdrv_reopen_prepare  = &raw_reopen_prepare,
     .bdrv_reopen_commit   = &raw_reopen_commit,
@@ -558,6 +573,7 @@ BlockDriver bdrv_raw = {
     .bdrv_co_block_status = &raw_co_block_status,
     .bdrv_co_copy_range_from = &raw_co_copy_range_from,
     .bdrv_co_copy_range_to  = &raw_co_copy_range_to,
+    .bdrv_co_send_to_fd     = &raw_co_send_to_fd,
     .bdrv_co_truncate     = &raw_co_truncate,
     .bdrv_getlength       = &raw_getlength,
     .has_variable_length  = true,
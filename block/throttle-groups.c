@@ -69,12 +69,15 @@ typedef struct ThrottleGroup {
     bool is_initialized;
     char *name; /* This is constant during the lifetime of the group */
 
-    QemuMutex lock; /* This lock protects the following four fields */
+    QemuMutex lock; /* This lock protects the following six fields */
     ThrottleState ts;
     QLIST_HEAD(, ThrottleGroupMember) head;
     ThrottleGroupMember *tokens[2];
     bool any_timer_armed[2];
     QEMUClockType clock_type;
+    ThrottleGroupPolicy policy;
+    /* Virtual time of the last request started with the fair policy */
+    uint64_t vclock[2];
 
     /* This field is protected by the global QEMU mutex */
     QTAILQ_ENTRY(ThrottleGroup) list;
@@ -205,6 +208,34 @@ static inline bool tgm_has_pending_reqs(ThrottleGroupMember *tgm,
     return tgm->pending_reqs[is_write];
 }
 
+/* Return the ThrottleGroupMember with pending I/O requests that has the
+ * smallest virtual time, i.e. the one that is furthest behind its share of
+ * the group bandwidth.
+ *
+ * This assumes that tg->lock is held.
+ *
+ * @tgm:       the current ThrottleGroupMember
+ * @is_write:  the type of operation (read/write)
+ * @ret:       the ThrottleGroupMember with pending requests that must run
+ *             next, or tgm if there is none.
+ */
+static ThrottleGroupMember *next_fair_token(ThrottleGroupMember *tgm,
+                                            bool is_write)
+{
+    ThrottleState *ts = tgm->throttle_state;
+    ThrottleGroup *tg = container_of(ts, ThrottleGroup, ts);
+    ThrottleGroupMember *iter, *token = NULL;
+
+    QLIST_FOREACH(iter, &tg->head, round_robin) {
+        if (tgm_has_pending_reqs(iter, is_write) &&
+            (!token || iter->vtime[is_write] < token->vtime[is_write])) {
+            token = iter;
+        }
+    }
+
+    return token ?: tgm;
+}
+
 /* Return the next ThrottleGroupMember in the round-robin sequence with pending
  * I/O requests.
  *
@@ -231,6 +262,10 @@ static ThrottleGroupMember *next_throttle_token(ThrottleGroupMember *tgm,
         return tgm;
     }
 
+    if (tg->policy == THROTTLE_GROUP_POLICY_FAIR) {
+        return next_fair_token(tgm, is_write);
+    }
+
     start = token = tg->tokens[is_write];
 
     /* get next bs round in round robin style */
@@ -334,8 +369,10 @@ static void schedule_next_request(ThrottleGroupMember *tgm, bool is_write)
 
     /* If it doesn't have to wait, queue it for immediate execution */
     if (!must_wait) {
-        /* Give preference to requests from the current tgm */
+        /* Give preference to requests from the current tgm, unless the fair
+         * policy has picked another one */
         if (qemu_in_coroutine() &&
+            (tg->policy != THROTTLE_GROUP_POLICY_FAIR || token == tgm) &&
             throttle_group_co_restart_queue(tgm, is_write)) {
             token = tgm;
         } else {
@@ -348,9 +385,33 @@ static void schedule_next_request(ThrottleGroupMember *tgm, bool is_write)
     }
 }
 
+/* Fixed cost of a request in the fair policy, in bytes.  It is charged on
+ * top of the request size so that members sending many small requests can
+ * not monopolize an iops limit. */
+#define THROTTLE_GROUP_REQ_COST 4096
+
+/* Charge a request that is about to be executed to the virtual time of its
+ * ThrottleGroupMember.
+ *
+ * This assumes that tg->lock is held.
+ *
+ * @tgm:       the current ThrottleGroupMember
+ * @bytes:     the number of bytes for this I/O
+ * @is_write:  the type of operation (read/write)
+ */
+static void throttle_group_charge(ThrottleGroupMember *tgm, unsigned int bytes,
+                                  bool is_write)
+{
+    ThrottleGroup *tg = container_of(tgm->throttle_state, ThrottleGroup, ts);
+    uint64_t cost = (uint64_t)bytes + THROTTLE_GROUP_REQ_COST;
+
+    tg->vclock[is_write] = MAX(tg->vclock[is_write], tgm->vtime[is_write]);
+    tgm->vtime[is_write] += cost * THROTTLE_GROUP_WEIGHT_DEFAULT / tgm->weight;
+}
+
 /* Check if an I/O request needs to be throttled, wait and set a timer
- * if necessary, and schedule the next request using a round robin
- * algorithm.
+ * if necessary, and schedule the next request using the policy of the
+ * group.
  *
  * @tgm:       the current ThrottleGroupMember
  * @bytes:     the number of bytes for this I/O
@@ -365,12 +426,21 @@ void coroutine_fn throttle_group_co_io_limits_intercept(ThrottleGroupMember *tgm
     ThrottleGroup *tg = container_of(tgm->throttle_state, ThrottleGroup, ts);
     qemu_mutex_lock(&tg->lock);
 
+    /* A member that was idle must not have saved up credit to use in a
+     * burst, so it starts again at the current virtual time */
+    if (!tgm->pending_reqs[is_write]) {
+        tgm->vtime[is_write] = MAX(tgm->vtime[is_write], tg->vclock[is_write]);
+    }
+
     /* First we check if this I/O has to be throttled. */
     token = next_throttle_token(tgm, is_write);
     must_wait = throttle_group_schedule_timer(token, is_write);
 
     /* Wait if there's a timer set or queued requests of this type */
     if (must_wait || tgm->pending_reqs[is_write]) {
+        int64_t start = qemu_clock_get_ns(tg->clock_type);
+        uint64_t wait_ns;
+
         tgm->pending_reqs[is_write]++;
         qemu_mutex_unlock(&tg->lock);
         qemu_co_mutex_lock(&tgm->throttled_reqs_lock);
@@ -379,10 +449,17 @@ void coroutine_fn throttle_group_co_io_limits_intercept(ThrottleGroupMember *tgm
         qemu_co_mutex_unlock(&tgm->throttled_reqs_lock);
         qemu_mutex_lock(&tg->lock);
         tgm->pending_reqs[is_write]--;
+
+        wait_ns = qemu_clock_get_ns(tg->clock_type) - start;
+        tgm->queued_reqs[is_write]++;
+        tgm->queue_time_ns[is_write] += wait_ns;
+        tgm->max_queue_time_ns[is_write] =
+            MAX(tgm->max_queue_time_ns[is_write], wait_ns);
     }
 
     /* The I/O will be executed, so do the accounting */
     throttle_account(tgm->throttle_state, is_write, bytes);
+    throttle_group_charge(tgm, bytes, is_write);
 
     /* Schedule the next request */
     schedule_next_request(tgm, is_write);
@@ -492,6 +569,43 @@ void throttle_group_get_config(ThrottleGroupMember *tgm, ThrottleConfig *cfg)
     qemu_mutex_unlock(&tg->lock);
 }
 
+/* Set the share of the group bandwidth that a ThrottleGroupMember gets
+ * with the fair policy, relative to THROTTLE_GROUP_WEIGHT_DEFAULT.
+ *
+ * @tgm:    a ThrottleGroupMember that is a member of the group
+ * @weight: the new weight, between 1 and THROTTLE_GROUP_WEIGHT_MAX
+ */
+void throttle_group_set_weight(ThrottleGroupMember *tgm, unsigned weight)
+{
+    ThrottleGroup *tg = container_of(tgm->throttle_state, ThrottleGroup, ts);
+
+    assert(weight > 0 && weight <= THROTTLE_GROUP_WEIGHT_MAX);
+
+    qemu_mutex_lock(&tg->lock);
+    tgm->weight = weight;
+    qemu_mutex_unlock(&tg->lock);
+}
+
+/* Get the queueing statistics of a ThrottleGroupMember.
+ *
+ * @tgm:   a ThrottleGroupMember that is a member of the group
+ * @stats: the statistics will be written here
+ */
+void throttle_group_get_stats(ThrottleGroupMember *tgm,
+                              ThrottleGroupMemberStats *stats)
+{
+    ThrottleGroup *tg = container_of(tgm->throttle_state, ThrottleGroup, ts);
+    int i;
+
+    qemu_mutex_lock(&tg->lock);
+    for (i = 0; i < 2; i++) {
+        stats->queued_reqs[i] = tgm->queued_reqs[i];
+        stats->queue_time_ns[i] = tgm->queue_time_ns[i];
+        stats->max_queue_time_ns[i] = tgm->max_queue_time_ns[i];
+    }
+    qemu_mutex_unlock(&tg->lock);
+}
+
 /* ThrottleTimers callback. This wakes up a request that was waiting
  * because it had been throttled.
  *
@@ -551,6 +665,12 @@ void throttle_group_register_tgm(ThrottleGroupMember *tgm,
         if (!tg->tokens[i]) {
             tg->tokens[i] = tgm;
         }
+        tgm->vtime[i] = tg->vclock[i];
+    }
+
+    /* Keep the weight if the member is only moving to another group */
+    if (!tgm->weight) {
+        tgm->weight = THROTTLE_GROUP_WEIGHT_DEFAULT;
     }
 
     QLIST_INSERT_HEAD(&tg->head, tgm, round_robin);
@@ -756,6 +876,7 @@ static void throttle_group_obj_init(Object *obj)
         tg->clock_type = QEMU_CLOCK_VIRTUAL;
     }
     tg->is_initialized = false;
+    tg->policy = THROTTLE_GROUP_POLICY_ROUND_ROBIN;
     qemu_mutex_init(&tg->lock);
     throttle_init(&tg->ts);
     QLIST_INIT(&tg->head);
@@ -933,6 +1054,29 @@ static void throttle_group_get_limits(Object *obj, Visitor *v,
     visit_type_ThrottleLimits(v, name, &argp, errp);
 }
 
+static int throttle_group_get_policy(Object *obj, Error **errp)
+{
+    ThrottleGroup *tg = THROTTLE_GROUP(obj);
+    int policy;
+
+    qemu_mutex_lock(&tg->lock);
+    policy = tg->policy;
+    qemu_mutex_unlock(&tg->lock);
+
+    return policy;
+}
+
+static void throttle_group_set_policy(Object *obj, int value, Error **errp)
+{
+    ThrottleGroup *tg = THROTTLE_GROUP(obj);
+
+    /* Both policies only decide which member goes next, so the policy can
+     * be switched at any time */
+    qemu_mutex_lock(&tg->lock);
+    tg->policy = value;
+    qemu_mutex_unlock(&tg->lock);
+}
+
 static bool throttle_group_can_be_deleted(UserCreatable *uc)
 {
     return OBJECT(uc)->ref == 1;
@@ -964,6 +1108,14 @@ static void throttle_group_obj_class_init(ObjectClass *klass, void *class_data)
                               throttle_group_set_limits,
                               NULL, NULL,
                               &error_abort);
+
+    /* ThrottleGroupPolicy */
+    object_class_property_add_enum(klass,
+                                   "policy", "ThrottleGroupPolicy",
+                                   &ThrottleGroupPolicy_lookup,
+                                   throttle_group_get_policy,
+                                   throttle_group_set_policy,
+                                   &error_abort);
 }
 
 static const TypeInfo throttle_group_info = {
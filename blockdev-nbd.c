@@ -188,8 +188,12 @@ void qmp_nbd_server_add(const char *device, bool has_name, const char *name,
         writable = false;
     }
 
+    /* All clients of an export share its BlockBackend, so a flush on any
+     * connection covers the writes completed on all of them and clients
+     * may spread their requests over multiple connections. */
     exp = nbd_export_new(bs, 0, len, name, NULL, bitmap,
-                         writable ? 0 : NBD_FLAG_READ_ONLY,
+                         NBD_FLAG_CAN_MULTI_CONN |
+                         (writable ? 0 : NBD_FLAG_READ_ONLY),
                          NULL, false, on_eject_blk, errp);
     if (!exp) {
         return;
@@ -225,6 +229,11 @@ void qmp_nbd_server_remove(const char *name,
     nbd_export_remove(exp, mode, errp);
 }
 
+NbdExportStatsList *qmp_query_nbd_exports(Error **errp)
+{
+    return nbd_export_query_stats();
+}
+
 void qmp_nbd_server_stop(Error **errp)
 {
     if (!nbd_server) {
@@ -293,6 +293,9 @@ BlockJobInfo *block_job_query(BlockJob *job, Error **errp)
     info->auto_dismiss  = job->job.auto_dismiss;
     info->has_error = job->job.ret != 0;
     info->error     = job->job.ret ? g_strdup(strerror(-job->job.ret)) : NULL;
+    if (block_job_driver(job)->query) {
+        block_job_driver(job)->query(job, info);
+    }
     return info;
 }
 
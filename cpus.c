@@ -189,13 +189,29 @@ static bool check_tcg_memory_orders_compatible(void)
 #endif
 }
 
+/*
+ * Front-ends that define TCG_GUEST_MO_EMULATED have been checked to rely
+ * only on plain loads and stores for their ordering guarantees, so they can
+ * also run on a more weakly ordered host: tcg_gen_req_mo() inserts the
+ * barriers needed to cover the difference in front of every guest load and
+ * store.  This costs some single-thread performance but is still correct.
+ */
+static bool check_tcg_memory_orders_emulatable(void)
+{
+#if defined(TCG_GUEST_DEFAULT_MO) && defined(TCG_GUEST_MO_EMULATED)
+    return true;
+#else
+    return check_tcg_memory_orders_compatible();
+#endif
+}
+
 static bool default_mttcg_enabled(void)
 {
     if (use_icount || TCG_OVERSIZED_GUEST) {
         return false;
     } else {
 #ifdef TARGET_SUPPORTS_MTTCG
-        return check_tcg_memory_orders_compatible();
+        return check_tcg_memory_orders_emulatable();
 #else
         return false;
 #endif
@@ -216,7 +232,7 @@ void qemu_tcg_configure(QemuOpts *opts, Error **errp)
                 warn_report("Guest not yet converted to MTTCG - "
                             "you may get unexpected results");
 #endif
-                if (!check_tcg_memory_orders_compatible()) {
+                if (!check_tcg_memory_orders_emulatable()) {
                     warn_report("Guest expects a stronger memory ordering "
                                 "than the host provides");
                     error_printf("This may cause strange/hard to debug errors\n");
@@ -27,6 +27,7 @@
 
 #include "qemu/timed-average.h"
 #include "qemu/thread.h"
+#include "qemu/stats64.h"
 #include "qapi/qapi-builtin-types.h"
 
 typedef struct BlockAcctTimedStats BlockAcctTimedStats;
@@ -39,9 +40,44 @@ enum BlockAcctType {
     BLOCK_MAX_IOTYPE,
 };
 
+/*
+ * Latency distribution for percentiles.  Latencies below
+ * BLOCK_LATENCY_LOG_SUB_BUCKETS nanoseconds have a bucket each, every
+ * power of two above is split into BLOCK_LATENCY_LOG_SUB_BUCKETS buckets.
+ * A bucket is therefore never wider than 1/BLOCK_LATENCY_LOG_SUB_BUCKETS
+ * of its lower bound.  Latencies of 2^BLOCK_LATENCY_LOG_MAX_BITS ns (about
+ * 18 minutes) and more end up in the last bucket.
+ */
+#define BLOCK_LATENCY_LOG_SUB_BITS      3
+#define BLOCK_LATENCY_LOG_SUB_BUCKETS   (1 << BLOCK_LATENCY_LOG_SUB_BITS)
+#define BLOCK_LATENCY_LOG_MAX_BITS      40
+#define BLOCK_LATENCY_LOG_BUCKETS \
+    ((BLOCK_LATENCY_LOG_MAX_BITS - BLOCK_LATENCY_LOG_SUB_BITS + 1) * \
+     BLOCK_LATENCY_LOG_SUB_BUCKETS)
+
+typedef struct BlockLatencyLog {
+    Stat64 buckets[BLOCK_LATENCY_LOG_BUCKETS];
+} BlockLatencyLog;
+
+/* A BlockLatencyLog that is cleared every time it expires */
+typedef struct BlockLatencyLogWindow {
+    BlockLatencyLog log;
+    int64_t expiration;
+} BlockLatencyLogWindow;
+
+typedef struct BlockAcctPercentiles {
+    uint64_t samples;
+    uint64_t p50;
+    uint64_t p90;
+    uint64_t p99;
+    uint64_t p999;
+} BlockAcctPercentiles;
+
 struct BlockAcctTimedStats {
     BlockAcctStats *stats;
     TimedAverage latency[BLOCK_MAX_IOTYPE];
+    /* Two windows offset by half an interval, like in TimedAverage */
+    BlockLatencyLogWindow latency_log[BLOCK_MAX_IOTYPE][2];
     unsigned interval_length; /* in seconds */
     QSLIST_ENTRY(BlockAcctTimedStats) entries;
 };
@@ -89,6 +125,8 @@ struct BlockAcctStats {
     bool account_invalid;
     bool account_failed;
     BlockLatencyHistogram latency_histogram[BLOCK_MAX_IOTYPE];
+    /* Updated without @lock */
+    BlockLatencyLog latency_log[BLOCK_MAX_IOTYPE];
 };
 
 typedef struct BlockAcctCookie {
@@ -117,5 +155,11 @@ double block_acct_queue_depth(BlockAcctTimedStats *stats,
 int block_latency_histogram_set(BlockAcctStats *stats, enum BlockAcctType type,
                                 uint64List *boundaries);
 void block_latency_histograms_clear(BlockAcctStats *stats);
+void block_acct_latency_percentiles(BlockAcctStats *stats,
+                                   enum BlockAcctType type,
+                                   BlockAcctPercentiles *p);
+void block_acct_timed_latency_percentiles(BlockAcctTimedStats *stats,
+                                         enum BlockAcctType type,
+                                         BlockAcctPercentiles *p);
 
 #endif
@@ -0,0 +1,108 @@
+/*
+ * block_copy API
+ *
+ * Copyright (C) 2013 Proxmox Server Solutions
+ *
+ * Authors:
+ *  Dietmar Maurer (dietmar@proxmox.com)
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef BLOCK_COPY_H
+#define BLOCK_COPY_H
+
+#include "block/block.h"
+#include "qemu/hbitmap.h"
+#include "qemu/coroutine.h"
+
+/* Default number of chunks copied in parallel by one block_copy() call */
+#define BLOCK_COPY_MAX_WORKERS_DEFAULT 4
+#define BLOCK_COPY_MAX_WORKERS 64
+
+typedef struct BlockCopyInFlightReq {
+    int64_t start_byte;
+    int64_t end_byte;
+    QLIST_ENTRY(BlockCopyInFlightReq) list;
+    CoQueue wait_queue; /* coroutines blocked on this request */
+} BlockCopyInFlightReq;
+
+typedef void (*ProgressBytesCallbackFunc)(int64_t bytes, void *opaque);
+
+typedef struct BlockCopyStats {
+    uint64_t bytes_copied;      /* bytes read and written via a buffer */
+    uint64_t bytes_offloaded;   /* bytes copied with copy_range */
+    uint64_t bytes_zeroed;      /* bytes written as zeroes */
+    uint64_t requests;          /* number of chunks issued */
+    int64_t start_ns;           /* QEMU_CLOCK_REALTIME at creation */
+} BlockCopyStats;
+
+typedef struct BlockCopyState {
+    BlockBackend *source;
+    BlockBackend *target;
+
+    /*
+     * One bit per cluster that still has to be copied.  Users set bits to
+     * schedule copying; block_copy() clears them once the data is safe on
+     * the target and sets them again if copying fails.
+     */
+    HBitmap *copy_bitmap;
+    int64_t cluster_size;
+    int64_t len;
+    QLIST_HEAD(, BlockCopyInFlightReq) inflight_reqs;
+
+    /* Largest request issued to the target, a multiple of cluster_size */
+    int64_t chunk_size;
+    int max_workers;
+    bool use_copy_range;
+    int64_t copy_range_size;
+    BdrvRequestFlags write_flags;
+
+    BlockCopyStats stats;
+
+    ProgressBytesCallbackFunc progress_bytes_callback;
+    void *progress_opaque;
+} BlockCopyState;
+
+/*
+ * block_copy_state_new:
+ * @source, @target: BlockBackends to copy between; they are not owned by
+ *                   the returned state and must outlive it.
+ * @cluster_size: granularity of @copy_bitmap
+ * @max_chunk: upper bound for a single request, or 0 to use the limits of
+ *             the nodes.  Rounded up to a multiple of @cluster_size.
+ * @max_workers: number of chunks that one block_copy() call keeps in flight,
+ *               or 0 for BLOCK_COPY_MAX_WORKERS_DEFAULT
+ * @use_copy_range: try copy_range offloading before buffered copying
+ * @write_flags: flags for all writes to @target.  With
+ *               BDRV_REQ_WRITE_COMPRESSED every request covers exactly one
+ *               cluster and copy_range is never used.
+ */
+BlockCopyState *block_copy_state_new(BlockBackend *source,
+                                     BlockBackend *target,
+                                     int64_t cluster_size, int64_t max_chunk,
+                                     int max_workers, bool use_copy_range,
+                                     BdrvRequestFlags write_flags,
+                                     Error **errp);
+void block_copy_state_free(BlockCopyState *s);
+
+void block_copy_set_callbacks(BlockCopyState *s,
+                              ProgressBytesCallbackFunc progress_bytes_callback,
+                              void *progress_opaque);
+
+/*
+ * Copy all dirty clusters of [@start, @start + @bytes) from source to
+ * target.  Runs of clusters the source reports as zero are written with
+ * write_zeroes; everything else is split into chunks that are copied by up
+ * to @max_workers coroutines in parallel.
+ *
+ * Returns 0 on success or the first error, in which case @error_is_read
+ * (if not NULL) tells whether reading the source or writing the target
+ * failed.  Set @is_write_notifier when called from a before-write notifier
+ * of the source, so that the reads do not wait for the guest request.
+ */
+int coroutine_fn block_copy(BlockCopyState *s, int64_t start, uint64_t bytes,
+                            bool *error_is_read, bool is_write_notifier);
+
+#endif /* BLOCK_COPY_H */
@@ -121,6 +121,7 @@ typedef struct HDGeometry {
                                       ignoring the format layer */
 #define BDRV_O_NO_IO       0x10000 /* don't initialize for I/O */
 #define BDRV_O_AUTO_RDONLY 0x20000 /* degrade to read-only if opening read-write fails */
+#define BDRV_O_IO_URING    0x40000 /* use io_uring instead of the thread pool */
 
 #define BDRV_O_CACHE_MASK  (BDRV_O_NOCACHE | BDRV_O_NO_FLUSH)
 
@@ -291,6 +292,7 @@ void bdrv_replace_node(BlockDriverState *from, BlockDriverState *to,
                        Error **errp);
 
 int bdrv_parse_cache_mode(const char *mode, int *flags, bool *writethrough);
+int bdrv_parse_aio(const char *mode, int *flags);
 int bdrv_parse_discard_flags(const char *mode, int *flags);
 BdrvChild *bdrv_open_child(const char *filename,
                            QDict *options, const char *bdref_key,
@@ -572,6 +574,23 @@ bool bdrv_debug_is_suspended(BlockDriverState *bs, const char *tag);
  */
 AioContext *bdrv_get_aio_context(BlockDriverState *bs);
 
+/**
+ * bdrv_get_request_aio_context:
+ *
+ * Returns: the #AioContext that I/O requests from the current thread run in.
+ * This is bdrv_get_aio_context(@bs) except for requests that a multiqueue
+ * BlockBackend submitted from another iothread.
+ */
+AioContext *bdrv_get_request_aio_context(BlockDriverState *bs);
+
+/**
+ * bdrv_supports_multiqueue:
+ *
+ * Returns: true if @bs and all of its children can process requests from
+ * several AioContexts at the same time.
+ */
+bool bdrv_supports_multiqueue(BlockDriverState *bs);
+
 /**
  * Transfer control to @co in the aio context of @bs
  */
@@ -732,4 +751,35 @@ int coroutine_fn bdrv_co_copy_range(BdrvChild *src, uint64_t src_offset,
                                     BdrvChild *dst, uint64_t dst_offset,
                                     uint64_t bytes, BdrvRequestFlags read_flags,
                                     BdrvRequestFlags write_flags);
+
+/**
+ *
+ * bdrv_co_send_to_fd:
+ *
+ * Send @hdr_len bytes from @hdr followed by the data of @child in
+ * [offset, offset + bytes) to the non-blocking socket @fd, without copying
+ * the data through a userspace buffer (e.g. with sendfile(2)).
+ *
+ * Only as much as fits into the socket buffer is sent; the block layer never
+ * waits for @fd to become writable.  The caller has to do that and call
+ * again for the rest.
+ *
+ * The block layer doesn't fall back to a bounce buffer; the caller has to do
+ * that if -ENOTSUP is returned.
+ *
+ * @child: Child to read the data from
+ * @offset: offset in @child to read data
+ * @bytes: number of bytes to send
+ * @fd: socket to send the data to
+ * @hdr: data to send before the image data, may be NULL if @hdr_len is 0
+ * @hdr_len: number of bytes in @hdr
+ *
+ * Returns: the number of bytes sent, counting @hdr, which is less than
+ * @hdr_len + @bytes if @fd would have blocked; -ENOTSUP if the driver or the
+ * backend storage doesn't support it, in which case nothing has been sent.
+ * On other errors an unknown amount of data may have been sent to @fd.
+ **/
+int coroutine_fn bdrv_co_send_to_fd(BdrvChild *child, uint64_t offset,
+                                    uint64_t bytes, int fd,
+                                    const void *hdr, size_t hdr_len);
 #endif
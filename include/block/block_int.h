@@ -58,6 +58,8 @@
 #define BLOCK_OPT_REFCOUNT_BITS     "refcount_bits"
 #define BLOCK_OPT_DATA_FILE         "data_file"
 #define BLOCK_OPT_DATA_FILE_RAW     "data_file_raw"
+#define BLOCK_OPT_EXTL2             "extended_l2"
+#define BLOCK_OPT_COMPRESSION_TYPE  "compression_type"
 
 #define BLOCK_PROBE_BUF_SIZE        512
 
@@ -120,6 +122,16 @@ struct BlockDriver {
     /* Set if a driver can support backing files */
     bool supports_backing;
 
+    /*
+     * Set if the driver's I/O callbacks can be called concurrently from
+     * several AioContexts, not just from bdrv_get_aio_context(bs).  Such
+     * drivers must not keep per-request state in the node's AioContext and
+     * should use bdrv_get_request_aio_context() instead.  Plugging is
+     * tracked per AioContext as well, so bdrv_io_plug/bdrv_io_unplug are
+     * forwarded for every nesting level.
+     */
+    bool supports_multiqueue;
+
     /* For handling image reopen for split or non-split files */
     int (*bdrv_reopen_prepare)(BDRVReopenState *reopen_state,
                                BlockReopenQueue *queue, Error **errp);
@@ -275,6 +287,17 @@ struct BlockDriver {
                                               BdrvRequestFlags read_flags,
                                               BdrvRequestFlags write_flags);
 
+    /* Map [offset, offset + bytes) onto a child and invoke
+     * bdrv_co_send_to_fd() on it, or send the data if @bs is the leaf.
+     *
+     * See the comment of bdrv_co_send_to_fd for the parameter and return
+     * value semantics.
+     */
+    int coroutine_fn (*bdrv_co_send_to_fd)(BlockDriverState *bs,
+                                           uint64_t offset, uint64_t bytes,
+                                           int fd, const void *hdr,
+                                           size_t hdr_len);
+
     /*
      * Building block for bdrv_block_status[_above] and
      * bdrv_is_allocated[_above].  The driver should answer only
@@ -854,6 +877,9 @@ struct BlockDriverState {
     /* Offset after the highest byte written to */
     Stat64 wr_highest_offset;
 
+    /* Bytes of data writes that detect-zeroes turned into zero writes */
+    Stat64 detected_zero_bytes;
+
     /* If true, copy read backing sectors into image.  Can be >1 if more
      * than one client has requested copy-on-read.  Accessed with atomic
      * ops.
@@ -1136,6 +1162,8 @@ void mirror_start(const char *job_id, BlockDriverState *bs,
  * @speed: The maximum speed, in bytes per second, or 0 for unlimited.
  * @sync_mode: What parts of the disk image should be copied to the destination.
  * @sync_bitmap: The dirty bitmap if sync_mode is MIRROR_SYNC_MODE_INCREMENTAL.
+ * @compress: Write compressed clusters to @target.
+ * @perf: Tuning of the copy engine, or %NULL for the defaults.
  * @on_source_error: The action to take upon error reading from the source.
  * @on_target_error: The action to take upon error writing to the target.
  * @creation_flags: Flags that control the behavior of the Job lifetime.
@@ -1151,7 +1179,7 @@ BlockJob *backup_job_create(const char *job_id, BlockDriverState *bs,
                             BlockDriverState *target, int64_t speed,
                             MirrorSyncMode sync_mode,
                             BdrvDirtyBitmap *sync_bitmap,
-                            bool compress,
+                            bool compress, const BackupPerf *perf,
                             BlockdevOnError on_source_error,
                             BlockdevOnError on_target_error,
                             int creation_flags,
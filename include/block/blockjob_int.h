@@ -63,6 +63,12 @@ struct BlockJobDriver {
      * stuff.
      */
     void (*drain)(BlockJob *job);
+
+    /*
+     * If the callback is not NULL, it will be invoked by block_job_query()
+     * to fill in the fields of @info that are specific to the job type.
+     */
+    void (*query)(BlockJob *job, BlockJobInfo *info);
 };
 
 /**
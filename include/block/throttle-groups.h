@@ -56,8 +56,29 @@ typedef struct ThrottleGroupMember {
     unsigned       pending_reqs[2];
     QLIST_ENTRY(ThrottleGroupMember) round_robin;
 
+    /* Share of the group bandwidth relative to the other members, only
+     * used by THROTTLE_GROUP_POLICY_FAIR.  Also protected by the
+     * ThrottleGroup lock. */
+    unsigned       weight;
+    /* Virtual time of the next request, in weighted bytes */
+    uint64_t       vtime[2];
+
+    /* Queueing statistics, protected by the ThrottleGroup lock */
+    uint64_t       queued_reqs[2];
+    uint64_t       queue_time_ns[2];
+    uint64_t       max_queue_time_ns[2];
+
 } ThrottleGroupMember;
 
+#define THROTTLE_GROUP_WEIGHT_DEFAULT 100
+#define THROTTLE_GROUP_WEIGHT_MAX     10000
+
+typedef struct ThrottleGroupMemberStats {
+    uint64_t queued_reqs[2];        /* requests that had to wait */
+    uint64_t queue_time_ns[2];      /* total time spent waiting */
+    uint64_t max_queue_time_ns[2];  /* longest single wait */
+} ThrottleGroupMemberStats;
+
 #define TYPE_THROTTLE_GROUP "throttle-group"
 #define THROTTLE_GROUP(obj) OBJECT_CHECK(ThrottleGroup, (obj), TYPE_THROTTLE_GROUP)
 
@@ -68,6 +89,9 @@ void throttle_group_unref(ThrottleState *ts);
 
 void throttle_group_config(ThrottleGroupMember *tgm, ThrottleConfig *cfg);
 void throttle_group_get_config(ThrottleGroupMember *tgm, ThrottleConfig *cfg);
+void throttle_group_set_weight(ThrottleGroupMember *tgm, unsigned weight);
+void throttle_group_get_stats(ThrottleGroupMember *tgm,
+                              ThrottleGroupMemberStats *stats);
 
 void throttle_group_register_tgm(ThrottleGroupMember *tgm,
                                 const char *groupname,
@@ -260,6 +260,8 @@ int walk_memory_regions(void *, walk_memory_regions_fn);
 int page_get_flags(target_ulong address);
 void page_set_flags(target_ulong start, target_ulong end, int flags);
 int page_check_range(target_ulong start, target_ulong len, int flags);
+target_ulong page_find_mapped(target_ulong start, target_ulong last);
+bool page_range_has_flags(target_ulong start, target_ulong last, int flags);
 #endif
 
 CPUArchState *cpu_copy(CPUArchState *env);
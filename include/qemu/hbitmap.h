@@ -311,6 +311,20 @@ unsigned long hbitmap_iter_skip_words(HBitmapIter *hbi);
  */
 int64_t hbitmap_next_zero(const HBitmap *hb, uint64_t start, uint64_t count);
 
+/* hbitmap_next_dirty:
+ *
+ * Find next dirty bit within selected range. If not found, return -1.
+ * Clean areas are skipped a whole word of the level above at a time, so
+ * this is cheap even on huge, sparsely dirty bitmaps.
+ *
+ * @hb: The HBitmap to operate on
+ * @start: The bit to start from.
+ * @count: Number of bits to proceed. If @start+@count > bitmap size, the whole
+ * bitmap is looked through. You can use UINT64_MAX as @count to search up to
+ * the bitmap end.
+ */
+int64_t hbitmap_next_dirty(const HBitmap *hb, uint64_t start, uint64_t count);
+
 /* hbitmap_next_dirty_area:
  * @hb: The HBitmap to operate on
  * @start: in-out parameter.
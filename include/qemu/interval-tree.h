@@ -0,0 +1,82 @@
+/*
+ * Interval trees
+ *
+ * A balanced binary tree of closed intervals [start, last], ordered by
+ * start and augmented with the largest "last" of each subtree, so that
+ * the intervals overlapping a query range can be found in O(log n).
+ *
+ * The tree does not allocate memory: callers embed an IntervalTreeNode
+ * in their own structures and use container_of() to get back to them.
+ * No locking is done; callers are responsible for serializing access.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef QEMU_INTERVAL_TREE_H
+#define QEMU_INTERVAL_TREE_H
+
+typedef struct IntervalTreeNode IntervalTreeNode;
+
+struct IntervalTreeNode {
+    uint64_t start;             /* inclusive */
+    uint64_t last;              /* inclusive */
+
+    /* private */
+    IntervalTreeNode *parent;
+    IntervalTreeNode *left;
+    IntervalTreeNode *right;
+    uint64_t subtree_last;
+    int height;
+};
+
+typedef struct IntervalTreeRoot {
+    IntervalTreeNode *root;
+} IntervalTreeRoot;
+
+/**
+ * interval_tree_insert:
+ * @node: the node to insert, with start and last filled in
+ * @root: the tree
+ *
+ * Add @node to the tree.  Overlapping and duplicate intervals are
+ * allowed.
+ */
+void interval_tree_insert(IntervalTreeNode *node, IntervalTreeRoot *root);
+
+/**
+ * interval_tree_remove:
+ * @node: a node currently in @root
+ * @root: the tree
+ *
+ * Remove @node from the tree.  The node's start and last must not have
+ * been changed since it was inserted.
+ */
+void interval_tree_remove(IntervalTreeNode *node, IntervalTreeRoot *root);
+
+/**
+ * interval_tree_iter_first:
+ * @root: the tree
+ * @start: first address of the query range
+ * @last: last address of the query range, inclusive
+ *
+ * Returns the node with the lowest start that overlaps [@start, @last],
+ * or NULL if there is none.
+ */
+IntervalTreeNode *interval_tree_iter_first(IntervalTreeRoot *root,
+                                           uint64_t start, uint64_t last);
+
+/**
+ * interval_tree_iter_next:
+ * @node: a node returned by interval_tree_iter_first/next
+ * @start: first address of the query range
+ * @last: last address of the query range, inclusive
+ *
+ * Returns the next node in start order that overlaps [@start, @last],
+ * or NULL if there is none.  The tree must not be modified between
+ * calls.
+ */
+IntervalTreeNode *interval_tree_iter_next(IntervalTreeNode *node,
+                                          uint64_t start, uint64_t last);
+
+#endif /* QEMU_INTERVAL_TREE_H */
@@ -15,6 +15,7 @@
 
 #include "qemu/iov.h"
 #include "block/throttle-groups.h"
+#include "io/channel.h"
 
 /*
  * TODO Have to include block/block.h for a bunch of block layer
@@ -104,6 +105,8 @@ void blk_get_perm(BlockBackend *blk, uint64_t *perm, uint64_t *shared_perm);
 
 void blk_set_allow_write_beyond_eof(BlockBackend *blk, bool allow);
 void blk_set_allow_aio_context_change(BlockBackend *blk, bool allow);
+int blk_set_multiqueue(BlockBackend *blk, bool enable, Error **errp);
+bool blk_get_multiqueue(BlockBackend *blk);
 void blk_iostatus_enable(BlockBackend *blk);
 bool blk_iostatus_is_enabled(const BlockBackend *blk);
 BlockDeviceIoStatus blk_iostatus(const BlockBackend *blk);
@@ -258,6 +261,9 @@ int coroutine_fn blk_co_copy_range(BlockBackend *blk_in, int64_t off_in,
                                    BlockBackend *blk_out, int64_t off_out,
                                    int bytes, BdrvRequestFlags read_flags,
                                    BdrvRequestFlags write_flags);
+int coroutine_fn blk_co_send_to_fd(BlockBackend *blk, int64_t offset,
+                                   unsigned int bytes, QIOChannel *ioc, int fd,
+                                   const void *hdr, size_t hdr_len);
 
 const BdrvChild *blk_root(BlockBackend *blk);
 
@@ -5,6 +5,7 @@
 #include <sys/resource.h>
 
 #include "qemu.h"
+#include "vdso.h"
 #include "disas/disas.h"
 #include "qemu/path.h"
 #include "qemu/guest-random.h"
@@ -1901,6 +1902,9 @@ static abi_ulong create_elf_tables(abi_ulong p, int argc, int envc,
     size = (DLINFO_ITEMS + 1) * 2;
     if (k_platform)
         size += 2;
+    if (info->vdso) {
+        size += 2;
+    }
 #ifdef DLINFO_ARCH_ITEMS
     size += DLINFO_ARCH_ITEMS * 2;
 #endif
@@ -1976,6 +1980,9 @@ static abi_ulong create_elf_tables(abi_ulong p, int argc, int envc,
     if (u_platform) {
         NEW_AUX_ENT(AT_PLATFORM, u_platform);
     }
+    if (info->vdso) {
+        NEW_AUX_ENT(AT_SYSINFO_EHDR, info->vdso);
+    }
     NEW_AUX_ENT (AT_NULL, 0);
 #undef NEW_AUX_ENT
 
@@ -2697,6 +2704,44 @@ uint32_t get_elf_eflags(int fd)
     return ehdr.e_flags;
 }
 
+#ifdef HAVE_VDSO_IMAGE
+#include "vdso-image.inc.c"
+
+/*
+ * Map the prebuilt guest vDSO, preceded by the data page its functions
+ * read, and return the guest address of its ELF header.  Returns 0 if
+ * no vDSO could be set up, in which case the guest simply keeps using
+ * system calls.
+ */
+static abi_ulong load_elf_vdso(void)
+{
+    abi_ulong image_len = TARGET_PAGE_ALIGN(sizeof(vdso_image));
+    abi_ulong total_len = VDSO_DATA_SIZE + image_len;
+    abi_long base;
+    abi_ulong image;
+
+    base = target_mmap(0, total_len, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == -1) {
+        return 0;
+    }
+    image = base + VDSO_DATA_SIZE;
+
+    if (memcpy_to_target(image, vdso_image, sizeof(vdso_image)) ||
+        target_mprotect(image, image_len, PROT_READ | PROT_EXEC) ||
+        !vdso_data_init(base)) {
+        target_munmap(base, total_len);
+        return 0;
+    }
+    return image;
+}
+#else
+static abi_ulong load_elf_vdso(void)
+{
+    return 0;
+}
+#endif
+
 int load_elf_binary(struct linux_binprm *bprm, struct image_info *info)
 {
     struct image_info interp_info;
@@ -2770,6 +2815,8 @@ int load_elf_binary(struct linux_binprm *bprm, struct image_info *info)
 #endif
     }
 
+    info->vdso = load_elf_vdso();
+
     bprm->p = create_elf_tables(bprm->p, bprm->argc, bprm->envc, &elf_ex,
                                 info, (elf_interpreter ? &interp_info : NULL));
     info->start_stack = bprm->p;
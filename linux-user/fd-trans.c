@@ -261,8 +261,87 @@ enum {
     QEMU___RTA_MAX
 };
 
-TargetFdTrans **target_fd_trans;
-unsigned int target_fd_max;
+TargetFdTable *target_fd_table;
+static pthread_mutex_t target_fd_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Make room for @fd in the table.  Called with target_fd_lock held.  */
+static TargetFdTable *fd_trans_table_grow(int fd)
+{
+    TargetFdTable *old = target_fd_table;
+    TargetFdTable *table;
+    unsigned int oldmax = old ? old->max : 0;
+    unsigned int max;
+
+    if (fd < oldmax) {
+        return old;
+    }
+
+    max = ((fd >> 6) + 1) << 6; /* by slice of 64 entries */
+    table = g_malloc0(sizeof(*table) + max * sizeof(TargetFdTrans *));
+    table->max = max;
+    if (old) {
+        memcpy(table->trans, old->trans, oldmax * sizeof(TargetFdTrans *));
+    }
+    atomic_rcu_set(&target_fd_table, table);
+    if (old) {
+        g_free_rcu(old, rcu);
+    }
+    return table;
+}
+
+void fd_trans_register(int fd, TargetFdTrans *trans)
+{
+    TargetFdTable *table;
+
+    pthread_mutex_lock(&target_fd_lock);
+    table = fd_trans_table_grow(fd);
+    atomic_rcu_set(&table->trans[fd], trans);
+    pthread_mutex_unlock(&target_fd_lock);
+}
+
+void fd_trans_unregister(int fd)
+{
+    TargetFdTable *table;
+
+    /*
+     * This runs for every fd the guest opens or closes, and almost
+     * none of them have a translator: don't take the lock for those.
+     */
+    if (!fd_trans_get(fd)) {
+        return;
+    }
+
+    pthread_mutex_lock(&target_fd_lock);
+    table = target_fd_table;
+    atomic_set(&table->trans[fd], NULL);
+    pthread_mutex_unlock(&target_fd_lock);
+}
+
+void fd_trans_dup(int oldfd, int newfd)
+{
+    TargetFdTrans *trans;
+
+    fd_trans_unregister(newfd);
+    trans = fd_trans_get(oldfd);
+    if (trans) {
+        fd_trans_register(newfd, trans);
+    }
+}
+
+/* Keep the table consistent across fork(), like mmap_fork_start().  */
+void fd_trans_fork_start(void)
+{
+    pthread_mutex_lock(&target_fd_lock);
+}
+
+void fd_trans_fork_end(int child)
+{
+    if (child) {
+        pthread_mutex_init(&target_fd_lock, NULL);
+    } else {
+        pthread_mutex_unlock(&target_fd_lock);
+    }
+}
 
 static void tswap_nlmsghdr(struct nlmsghdr *nlh)
 {
@@ -16,6 +16,8 @@
 #ifndef FD_TRANS_H
 #define FD_TRANS_H
 
+#include "qemu/rcu.h"
+
 typedef abi_long (*TargetFdDataFunc)(void *, size_t);
 typedef abi_long (*TargetFdAddrFunc)(void *, abi_ulong, socklen_t);
 typedef struct TargetFdTrans {
@@ -24,64 +26,61 @@ typedef struct TargetFdTrans {
     TargetFdAddrFunc target_to_host_addr;
 } TargetFdTrans;
 
-extern TargetFdTrans **target_fd_trans;
+/*
+ * Translators indexed by guest fd.  Lookups happen on every read, write
+ * and socket call, so they are lock-free: the table is replaced as a
+ * whole when it grows and the old copy is freed after an RCU grace
+ * period.  Updates are serialized in fd-trans.c.
+ */
+typedef struct TargetFdTable {
+    struct rcu_head rcu;
+    unsigned int max;
+    TargetFdTrans *trans[];
+} TargetFdTable;
 
-extern unsigned int target_fd_max;
+extern TargetFdTable *target_fd_table;
 
-static inline TargetFdDataFunc fd_trans_target_to_host_data(int fd)
+static inline TargetFdTrans *fd_trans_get(int fd)
 {
-    if (fd >= 0 && fd < target_fd_max && target_fd_trans[fd]) {
-        return target_fd_trans[fd]->target_to_host_data;
-    }
-    return NULL;
-}
+    TargetFdTable *table;
+    TargetFdTrans *trans = NULL;
 
-static inline TargetFdDataFunc fd_trans_host_to_target_data(int fd)
-{
-    if (fd >= 0 && fd < target_fd_max && target_fd_trans[fd]) {
-        return target_fd_trans[fd]->host_to_target_data;
+    rcu_read_lock();
+    table = atomic_rcu_read(&target_fd_table);
+    if (table && fd >= 0 && fd < table->max) {
+        trans = atomic_rcu_read(&table->trans[fd]);
     }
-    return NULL;
+    rcu_read_unlock();
+    return trans;
 }
 
-static inline TargetFdAddrFunc fd_trans_target_to_host_addr(int fd)
+static inline TargetFdDataFunc fd_trans_target_to_host_data(int fd)
 {
-    if (fd >= 0 && fd < target_fd_max && target_fd_trans[fd]) {
-        return target_fd_trans[fd]->target_to_host_addr;
-    }
-    return NULL;
+    TargetFdTrans *trans = fd_trans_get(fd);
+
+    return trans ? trans->target_to_host_data : NULL;
 }
 
-static inline void fd_trans_register(int fd, TargetFdTrans *trans)
+static inline TargetFdDataFunc fd_trans_host_to_target_data(int fd)
 {
-    unsigned int oldmax;
+    TargetFdTrans *trans = fd_trans_get(fd);
 
-    if (fd >= target_fd_max) {
-        oldmax = target_fd_max;
-        target_fd_max = ((fd >> 6) + 1) << 6; /* by slice of 64 entries */
-        target_fd_trans = g_renew(TargetFdTrans *,
-                                  target_fd_trans, target_fd_max);
-        memset((void *)(target_fd_trans + oldmax), 0,
-               (target_fd_max - oldmax) * sizeof(TargetFdTrans *));
-    }
-    target_fd_trans[fd] = trans;
+    return trans ? trans->host_to_target_data : NULL;
 }
 
-static inline void fd_trans_unregister(int fd)
+static inline TargetFdAddrFunc fd_trans_target_to_host_addr(int fd)
 {
-    if (fd >= 0 && fd < target_fd_max) {
-        target_fd_trans[fd] = NULL;
-    }
-}
+    TargetFdTrans *trans = fd_trans_get(fd);
 
-static inline void fd_trans_dup(int oldfd, int newfd)
-{
-    fd_trans_unregister(newfd);
-    if (oldfd < target_fd_max && target_fd_trans[oldfd]) {
-        fd_trans_register(newfd, target_fd_trans[oldfd]);
-    }
+    return trans ? trans->target_to_host_addr : NULL;
 }
 
+void fd_trans_register(int fd, TargetFdTrans *trans);
+void fd_trans_unregister(int fd);
+void fd_trans_dup(int oldfd, int newfd);
+void fd_trans_fork_start(void);
+void fd_trans_fork_end(int child);
+
 extern TargetFdTrans target_packet_trans;
 #ifdef CONFIG_RTNETLINK
 extern TargetFdTrans target_netlink_route_trans;
@@ -39,6 +39,8 @@
 #include "trace/control.h"
 #include "target_elf.h"
 #include "cpu_loop-common.h"
+#include "vdso.h"
+#include "fd-trans.h"
 #include "crypto/init.h"
 
 char *exec_path;
@@ -118,11 +120,13 @@ void fork_start(void)
 {
     start_exclusive();
     mmap_fork_start();
+    fd_trans_fork_start();
     cpu_list_lock();
 }
 
 void fork_end(int child)
 {
+    fd_trans_fork_end(child);
     mmap_fork_end(child);
     if (child) {
         CPUState *cpu, *next_cpu;
@@ -135,6 +139,7 @@ void fork_end(int child)
         }
         qemu_init_cpu_list();
         gdbserver_fork(thread_cpu);
+        vdso_fork_child();
         /* qemu_init_cpu_list() takes care of reinitializing the
          * exclusive state, so we don't need to end_exclusive() here.
          */
@@ -176,6 +181,11 @@ void stop_all_tasks(void)
 void init_task_state(TaskState *ts)
 {
     ts->used = 1;
+    ts->sigaltstack_used = (struct target_sigaltstack) {
+        .ss_sp = 0,
+        .ss_size = 0,
+        .ss_flags = TARGET_SS_DISABLE,
+    };
 }
 
 CPUArchState *cpu_copy(CPUArchState *env)
@@ -206,7 +206,7 @@ static abi_ulong mmap_find_vma_reserved(abi_ulong start, abi_ulong size)
 {
     abi_ulong addr;
     abi_ulong end_addr;
-    int prot;
+    abi_ulong used;
     int looped = 0;
 
     if (size > reserved_va) {
@@ -218,26 +218,27 @@ static abi_ulong mmap_find_vma_reserved(abi_ulong start, abi_ulong size)
     if (end_addr > reserved_va) {
         end_addr = reserved_va;
     }
-    addr = end_addr - qemu_host_page_size;
 
+    /*
+     * Search downwards for the highest free range that ends at or below
+     * end_addr: whenever the candidate overlaps a mapping, retry just
+     * below the lowest page in use.  Each step skips a whole mapping.
+     */
     while (1) {
-        if (addr > end_addr) {
+        if (end_addr <= size) {
             if (looped) {
                 return (abi_ulong)-1;
             }
             end_addr = reserved_va;
-            addr = end_addr - qemu_host_page_size;
             looped = 1;
             continue;
         }
-        prot = page_get_flags(addr);
-        if (prot) {
-            end_addr = addr;
-        }
-        if (addr && addr + size == end_addr) {
+        addr = end_addr - size;
+        used = page_find_mapped(addr, end_addr - 1);
+        if (used == (abi_ulong)-1) {
             break;
         }
-        addr -= qemu_host_page_size;
+        end_addr = used & qemu_host_page_mask;
     }
 
     if (start == mmap_next_start) {
@@ -52,6 +52,7 @@ struct image_info {
         uint32_t        elf_flags;
         int		personality;
         abi_ulong       alignment;
+        abi_ulong       vdso;
 
         /* The fields below are used in FDPIC mode.  */
         abi_ulong       loadmap_addr;
@@ -152,6 +153,8 @@ typedef struct TaskState {
      */
     int signal_pending;
 
+    /* This thread's alternate signal stack, as set by sigaltstack().  */
+    struct target_sigaltstack sigaltstack_used;
 } __attribute__((aligned(16))) TaskState;
 
 extern char *exec_path;
@@ -19,7 +19,13 @@
 
 #ifndef SIGNAL_COMMON_H
 #define SIGNAL_COMMON_H
-extern struct target_sigaltstack target_sigaltstack_used;
+
+static inline struct target_sigaltstack *target_sigaltstack_used(void)
+{
+    TaskState *ts = (TaskState *)thread_cpu->opaque;
+
+    return &ts->sigaltstack_used;
+}
 
 int on_sig_stack(unsigned long sp);
 int sas_ss_flags(unsigned long sp);
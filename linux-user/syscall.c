@@ -6666,6 +6666,7 @@ static int open_self_maps(void *cpu_env, int fd)
 
     while ((read = getline(&line, &len, fp)) != -1) {
         int fields, dev_maj, dev_min, inode;
+        bool mapped;
         uint64_t min, max, offset;
         char flag_r, flag_w, flag_x, flag_p;
         char path[512] = "";
@@ -6677,9 +6678,17 @@ static int open_self_maps(void *cpu_env, int fd)
             continue;
         }
         if (h2g_valid(min)) {
-            int flags = page_get_flags(h2g(min));
+            int flags;
+
             max = h2g_valid(max - 1) ? max : (uintptr_t)g2h(GUEST_ADDR_MAX) + 1;
-            if (page_check_range(h2g(min), max - min, flags) == -1) {
+
+            /* Only hold the lock for the lookup, not the file I/O */
+            mmap_lock();
+            flags = page_get_flags(h2g(min)) & (PAGE_READ | PAGE_WRITE_ORG);
+            mapped = page_range_has_flags(h2g(min), h2g(max - 1),
+                                          flags | PAGE_VALID);
+            mmap_unlock();
+            if (!mapped) {
                 continue;
             }
             if (h2g(min) == ts->info->stack_limit) {
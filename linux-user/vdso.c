@@ -0,0 +1,224 @@
+/*
+ *  Guest vDSO data page
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/host-utils.h"
+#include "qemu/memfd.h"
+#include "qemu/thread.h"
+#include "qemu/timer.h"
+
+#include "qemu.h"
+#include "vdso.h"
+
+/*
+ * The guest vDSO computes time from the guest cycle counter, which
+ * linux-user backs with cpu_get_host_ticks(), as
+ *
+ *     ns = base_ns + ((ticks - base_ticks) * mult) >> shift
+ *
+ * so that clock_gettime() and friends need not leave translated code.
+ * The parameters are refreshed by a helper thread under a sequence
+ * counter: readers retry while it is odd or if it changed under them.
+ *
+ * The layout is guest ABI, stored in guest byte order.  Keep it in sync
+ * with linux-user/<target>/vdso.S.
+ */
+typedef struct VdsoData {
+    uint32_t seq;
+    uint32_t valid;         /* 0 until calibrated: use the syscall */
+    uint64_t ticks;
+    uint64_t mult;
+    uint32_t shift;
+    uint32_t pad;
+    uint64_t mono_ns;
+    uint64_t real_ns;
+} VdsoData;
+
+QEMU_BUILD_BUG_ON(sizeof(VdsoData) > VDSO_DATA_SIZE);
+
+/* How often the data page is refreshed */
+#define VDSO_UPDATE_INTERVAL_US     10000
+/* Length of the window used to measure the tick rate */
+#define VDSO_CALIBRATE_NS           NANOSECONDS_PER_SECOND
+#define VDSO_CALIBRATE_MIN_NS       (10 * SCALE_MS)
+#define VDSO_MULT_SHIFT             32
+
+static struct {
+    VdsoData *data;         /* QEMU's writable view of the data page */
+    abi_ulong guest_addr;
+    uint32_t seq;
+
+    /* Last published parameters, in host byte order */
+    bool valid;
+    uint64_t ticks;
+    uint64_t mult;
+    uint64_t mono_ns;
+
+    /* Start of the current calibration window */
+    uint64_t ref_ticks;
+    int64_t ref_ns;
+
+    QemuThread thread;
+} vdso;
+
+static int64_t vdso_realtime_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return ts.tv_sec * NANOSECONDS_PER_SECOND + ts.tv_nsec;
+}
+
+static uint64_t vdso_ticks_to_ns(uint64_t delta, uint64_t mult)
+{
+    uint64_t lo, hi;
+
+    mulu64(&lo, &hi, delta, mult);
+    return (lo >> VDSO_MULT_SHIFT) | (hi << (64 - VDSO_MULT_SHIFT));
+}
+
+static void vdso_update(void)
+{
+    VdsoData *d = vdso.data;
+    uint64_t ticks;
+    int64_t mono_ns, real_ns;
+
+    /*
+     * Sample the clocks while the sequence count is odd: a reader that
+     * completes with the old parameters read its counter before this
+     * sample, so the monotonic clock cannot step back across updates.
+     */
+    atomic_set(&d->seq, tswap32(++vdso.seq));
+    smp_wmb();
+
+    ticks = cpu_get_host_ticks();
+    mono_ns = get_clock();
+    real_ns = vdso_realtime_ns();
+
+    if (vdso.ref_ns == 0 || ticks < vdso.ref_ticks) {
+        /* First sample, or the host counter wrapped: start over */
+        vdso.valid = false;
+        vdso.ref_ticks = ticks;
+        vdso.ref_ns = mono_ns;
+    } else if (mono_ns - vdso.ref_ns >=
+               (vdso.valid ? VDSO_CALIBRATE_NS : VDSO_CALIBRATE_MIN_NS)) {
+        uint64_t dticks = ticks - vdso.ref_ticks;
+        uint64_t dns = mono_ns - vdso.ref_ns;
+
+        if (dticks && dns < (1ULL << (64 - VDSO_MULT_SHIFT))) {
+            vdso.mult = (dns << VDSO_MULT_SHIFT) / dticks;
+            vdso.valid = vdso.mult != 0;
+        }
+        vdso.ref_ticks = ticks;
+        vdso.ref_ns = mono_ns;
+    }
+
+    if (vdso.valid) {
+        uint64_t predicted = vdso.mono_ns +
+            vdso_ticks_to_ns(ticks - vdso.ticks, vdso.mult);
+
+        /* Never let the monotonic clock go backwards */
+        if (d->valid && predicted > mono_ns) {
+            mono_ns = predicted;
+        }
+        vdso.ticks = ticks;
+        vdso.mono_ns = mono_ns;
+
+        d->ticks = tswap64(ticks);
+        d->mult = tswap64(vdso.mult);
+        d->shift = tswap32(VDSO_MULT_SHIFT);
+        d->mono_ns = tswap64(mono_ns);
+        d->real_ns = tswap64(real_ns);
+    }
+    d->valid = tswap32(vdso.valid);
+
+    smp_wmb();
+    atomic_set(&d->seq, tswap32(++vdso.seq));
+}
+
+static void *vdso_update_thread(void *opaque)
+{
+    for (;;) {
+        vdso_update();
+        g_usleep(VDSO_UPDATE_INTERVAL_US);
+    }
+    return NULL;
+}
+
+/* Back the guest data page with a fresh shared mapping */
+static bool vdso_data_map(abi_ulong guest_addr)
+{
+    VdsoData *data;
+    abi_long ret;
+    int fd;
+
+    data = qemu_memfd_alloc("qemu-vdso", VDSO_DATA_SIZE, 0, &fd, NULL);
+    if (!data) {
+        return false;
+    }
+
+    ret = target_mmap(guest_addr, VDSO_DATA_SIZE, PROT_READ,
+                      MAP_SHARED | MAP_FIXED, fd, 0);
+    close(fd);
+    if (ret == -1) {
+        munmap(data, VDSO_DATA_SIZE);
+        return false;
+    }
+
+    vdso.data = data;
+    vdso.guest_addr = guest_addr;
+    vdso.seq = 0;
+    vdso.valid = false;
+    vdso.ref_ns = 0;
+    return true;
+}
+
+bool vdso_data_init(abi_ulong guest_addr)
+{
+    /* The guest must see the same memory that QEMU updates */
+    if (qemu_host_page_size != VDSO_DATA_SIZE) {
+        return false;
+    }
+    if (!vdso_data_map(guest_addr)) {
+        return false;
+    }
+
+    vdso_update();
+    qemu_thread_create(&vdso.thread, "vdso-update", vdso_update_thread,
+                       NULL, QEMU_THREAD_DETACHED);
+    return true;
+}
+
+void vdso_fork_child(void)
+{
+    VdsoData *old = vdso.data;
+
+    if (!old) {
+        return;
+    }
+
+    /* The parent still updates the shared page, switch to our own */
+    if (!vdso_data_map(vdso.guest_addr)) {
+        /* Keep reading the parent's page; it is still a valid clock */
+        return;
+    }
+    munmap(old, VDSO_DATA_SIZE);
+
+    vdso_update();
+    qemu_thread_create(&vdso.thread, "vdso-update", vdso_update_thread,
+                       NULL, QEMU_THREAD_DETACHED);
+}
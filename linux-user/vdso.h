@@ -0,0 +1,42 @@
+/*
+ *  Guest vDSO data page
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef LINUX_USER_VDSO_H
+#define LINUX_USER_VDSO_H
+
+/* Size of the data page mapped right below the vDSO image */
+#define VDSO_DATA_SIZE 4096
+
+/**
+ * vdso_data_init:
+ * @guest_addr: guest address of the data page
+ *
+ * Map the time data page read by the guest vDSO at @guest_addr and start
+ * keeping it up to date.  Returns false if the page could not be set up,
+ * in which case the vDSO must not be advertised to the guest.
+ */
+bool vdso_data_init(abi_ulong guest_addr);
+
+/**
+ * vdso_fork_child:
+ *
+ * Give a freshly forked child its own data page.  Must be called in the
+ * child after fork(), since the updater thread does not survive it.
+ */
+void vdso_fork_child(void);
+
+#endif /* LINUX_USER_VDSO_H */
@@ -214,24 +214,27 @@ static void send_bitmap_complete(QEMUFile *f, DirtyBitmapMigBitmapState *dbms)
 static void send_bitmap_bits(QEMUFile *f, DirtyBitmapMigBitmapState *dbms,
                              uint64_t start_sector, uint32_t nr_sectors)
 {
-    /* align for buffer_is_zero() */
+    /* the buffer size on the wire has always been aligned like this */
     uint64_t align = 4 * sizeof(long);
     uint64_t unaligned_size =
         bdrv_dirty_bitmap_serialization_size(
             dbms->bitmap, start_sector << BDRV_SECTOR_BITS,
             (uint64_t)nr_sectors << BDRV_SECTOR_BITS);
     uint64_t buf_size = QEMU_ALIGN_UP(unaligned_size, align);
-    uint8_t *buf = g_malloc0(buf_size);
+    uint8_t *buf = NULL;
     uint32_t flags = DIRTY_BITMAP_MIG_FLAG_BITS;
 
-    bdrv_dirty_bitmap_serialize_part(
-        dbms->bitmap, buf, start_sector << BDRV_SECTOR_BITS,
-        (uint64_t)nr_sectors << BDRV_SECTOR_BITS);
-
-    if (buffer_is_zero(buf, buf_size)) {
-        g_free(buf);
-        buf = NULL;
+    /* Clean chunks are found without serializing them */
+    if (bdrv_dirty_bitmap_next_dirty(dbms->bitmap,
+                                     start_sector << BDRV_SECTOR_BITS,
+                                     (uint64_t)nr_sectors <<
+                                     BDRV_SECTOR_BITS) < 0) {
         flags |= DIRTY_BITMAP_MIG_FLAG_ZEROES;
+    } else {
+        buf = g_malloc0(buf_size);
+        bdrv_dirty_bitmap_serialize_part(
+            dbms->bitmap, buf, start_sector << BDRV_SECTOR_BITS,
+            (uint64_t)nr_sectors << BDRV_SECTOR_BITS);
     }
 
     trace_send_bitmap_bits(flags, start_sector, nr_sectors, buf_size);
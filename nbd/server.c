@@ -90,6 +90,10 @@ struct NBDExport {
 
     BdrvDirtyBitmap *export_bitmap;
     char *export_bitmap_context;
+
+    /* Read payload sent without and with a bounce buffer */
+    uint64_t zero_copy_bytes;
+    uint64_t buffered_bytes;
 };
 
 static QTAILQ_HEAD(, NBDExport) exports = QTAILQ_HEAD_INITIALIZER(exports);
@@ -1672,6 +1676,26 @@ void nbd_export_close_all(void)
     }
 }
 
+NbdExportStatsList *nbd_export_query_stats(void)
+{
+    NbdExportStatsList *head = NULL, **tail = &head;
+    NBDExport *exp;
+
+    QTAILQ_FOREACH(exp, &exports, next) {
+        NbdExportStats *stats = g_new0(NbdExportStats, 1);
+
+        stats->name = g_strdup(exp->name);
+        stats->zero_copy_bytes = exp->zero_copy_bytes;
+        stats->buffered_bytes = exp->buffered_bytes;
+
+        *tail = g_new0(NbdExportStatsList, 1);
+        (*tail)->value = stats;
+        tail = &(*tail)->next;
+    }
+
+    return head;
+}
+
 static int coroutine_fn nbd_co_send_iov(NBDClient *client, struct iovec *iov,
                                         unsigned niov, Error **errp)
 {
@@ -1714,10 +1738,60 @@ static int nbd_co_send_simple_reply(NBDClient *client,
     trace_nbd_co_send_simple_reply(handle, nbd_err, nbd_err_lookup(nbd_err),
                                    len);
     set_be_simple_reply(&reply, nbd_err, handle);
+    client->exp->buffered_bytes += len;
 
     return nbd_co_send_iov(client, iov, len ? 2 : 1, errp);
 }
 
+/*
+ * Send @hdr followed by @size bytes of the export at @offset, passing the
+ * data from the image to the socket without copying it through a buffer.
+ * Returns -ENOTSUP without sending anything if the export or the channel
+ * does not allow it.  Read errors can only be reported by dropping the
+ * connection, as the reply header has been sent already at that point.
+ */
+static int coroutine_fn nbd_co_send_zero_copy(NBDClient *client, void *hdr,
+                                              size_t hdr_len, uint64_t offset,
+                                              uint32_t size, Error **errp)
+{
+    NBDExport *exp = client->exp;
+    int ret;
+
+    /* TLS has to encrypt the payload */
+    if (client->ioc != QIO_CHANNEL(client->sioc)) {
+        return -ENOTSUP;
+    }
+
+    qemu_co_mutex_lock(&client->send_lock);
+    ret = blk_co_send_to_fd(exp->blk, offset + exp->dev_offset, size,
+                            client->ioc, client->sioc->fd, hdr, hdr_len);
+    qemu_co_mutex_unlock(&client->send_lock);
+
+    if (ret == -ENOTSUP) {
+        return ret;
+    }
+    trace_nbd_co_send_zero_copy(offset, size, ret);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "sending data from file failed");
+        return -EIO;
+    }
+    exp->zero_copy_bytes += size;
+    return 0;
+}
+
+static int coroutine_fn nbd_co_send_simple_read_zero_copy(NBDClient *client,
+                                                          uint64_t handle,
+                                                          uint64_t offset,
+                                                          uint32_t size,
+                                                          Error **errp)
+{
+    NBDSimpleReply reply;
+
+    set_be_simple_reply(&reply, 0, handle);
+    return nbd_co_send_zero_copy(client, &reply, sizeof(reply), offset, size,
+                                 errp);
+}
+
 static inline void set_be_chunk(NBDStructuredReplyChunk *chunk, uint16_t flags,
                                 uint16_t type, uint64_t handle, uint32_t length)
 {
@@ -1763,10 +1837,28 @@ static int coroutine_fn nbd_co_send_structured_read(NBDClient *client,
                  NBD_REPLY_TYPE_OFFSET_DATA, handle,
                  sizeof(chunk) - sizeof(chunk.h) + size);
     stq_be_p(&chunk.offset, offset);
+    client->exp->buffered_bytes += size;
 
     return nbd_co_send_iov(client, iov, 2, errp);
 }
 
+static int coroutine_fn
+nbd_co_send_structured_read_zero_copy(NBDClient *client, uint64_t handle,
+                                      uint64_t offset, uint32_t size,
+                                      bool final, Error **errp)
+{
+    NBDStructuredReadData chunk;
+
+    assert(size);
+    set_be_chunk(&chunk.h, final ? NBD_REPLY_FLAG_DONE : 0,
+                 NBD_REPLY_TYPE_OFFSET_DATA, handle,
+                 sizeof(chunk) - sizeof(chunk.h) + size);
+    stq_be_p(&chunk.offset, offset);
+
+    return nbd_co_send_zero_copy(client, &chunk, sizeof(chunk), offset, size,
+                                 errp);
+}
+
 static int coroutine_fn nbd_co_send_structured_error(NBDClient *client,
                                                      uint64_t handle,
                                                      uint32_t error,
@@ -1840,15 +1932,21 @@ static int coroutine_fn nbd_co_send_sparse_read(NBDClient *client,
             stl_be_p(&chunk.length, pnum);
             ret = nbd_co_send_iov(client, iov, 1, errp);
         } else {
-            ret = blk_pread(exp->blk, offset + progress + exp->dev_offset,
-                            data + progress, pnum);
-            if (ret < 0) {
-                error_setg_errno(errp, -ret, "reading from file failed");
-                break;
+            ret = nbd_co_send_structured_read_zero_copy(client, handle,
+                                                        offset + progress,
+                                                        pnum, final, errp);
+            if (ret == -ENOTSUP) {
+                ret = blk_pread(exp->blk, offset + progress + exp->dev_offset,
+                                data + progress, pnum);
+                if (ret < 0) {
+                    error_setg_errno(errp, -ret, "reading from file failed");
+                    break;
+                }
+                ret = nbd_co_send_structured_read(client, handle,
+                                                  offset + progress,
+                                                  data + progress, pnum,
+                                                  final, errp);
             }
-            ret = nbd_co_send_structured_read(client, handle, offset + progress,
-                                              data + progress, pnum, final,
-                                              errp);
         }
 
         if (ret < 0) {
@@ -2207,6 +2305,23 @@ static coroutine_fn int nbd_do_cmd_read(NBDClient *client, NBDRequest *request,
                                        data, request->len, errp);
     }
 
+    if (request->len && request->type != NBD_CMD_CACHE) {
+        if (client->structured_reply) {
+            ret = nbd_co_send_structured_read_zero_copy(client,
+                                                        request->handle,
+                                                        request->from,
+                                                        request->len, true,
+                                                        errp);
+        } else {
+            ret = nbd_co_send_simple_read_zero_copy(client, request->handle,
+                                                    request->from,
+                                                    request->len, errp);
+        }
+        if (ret != -ENOTSUP) {
+            return ret;
+        }
+    }
+
     ret = blk_pread(exp->blk, request->from + exp->dev_offset, data,
                     request->len);
     if (ret < 0 || request->type == NBD_CMD_CACHE) {
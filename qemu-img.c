@@ -1560,6 +1560,15 @@ enum ImgConvertBlockStatus {
 
 #define MAX_COROUTINES 16
 
+/* Upper bound for the number of entries in the extent map (24 MB) */
+#define MAX_CONVERT_EXTENTS (1 << 20)
+
+typedef struct ImgConvertExtent {
+    int64_t sector_num;
+    int64_t nb_sectors;
+    enum ImgConvertBlockStatus status;
+} ImgConvertExtent;
+
 typedef struct ImgConvertState {
     BlockBackend **src;
     int64_t *src_sectors;
@@ -1571,6 +1580,8 @@ typedef struct ImgConvertState {
     int64_t wr_offs;
     enum ImgConvertBlockStatus status;
     int64_t sector_next_status;
+    GArray *extents;
+    guint extent_idx;
     BlockBackend *target;
     bool has_zero_init;
     bool compressed;
@@ -1583,6 +1594,7 @@ typedef struct ImgConvertState {
     int alignment;
     size_t cluster_sectors;
     size_t buf_sectors;
+    size_t buf_align;
     long num_coroutines;
     int running_coroutines;
     Coroutine *co[MAX_COROUTINES];
@@ -1677,6 +1689,86 @@ static int convert_iteration_sectors(ImgConvertState *s, int64_t sector_num)
     return n;
 }
 
+/*
+ * Record the status of [sector_num, sector_num + nb_sectors) in the extent
+ * map, merging it with the previous extent if possible.  Returns false if
+ * the map is full; the remaining extents are then looked up lazily while
+ * copying.
+ */
+static bool convert_add_extent(ImgConvertState *s, int64_t sector_num,
+                               int64_t nb_sectors,
+                               enum ImgConvertBlockStatus status)
+{
+    ImgConvertExtent *last = NULL;
+    ImgConvertExtent e = {
+        .sector_num = sector_num,
+        .nb_sectors = nb_sectors,
+        .status     = status,
+    };
+
+    if (s->extents->len) {
+        last = &g_array_index(s->extents, ImgConvertExtent,
+                              s->extents->len - 1);
+        assert(last->sector_num + last->nb_sectors == sector_num);
+        if (last->status == status) {
+            last->nb_sectors += nb_sectors;
+            return true;
+        }
+    }
+
+    if (s->extents->len >= MAX_CONVERT_EXTENTS) {
+        return false;
+    }
+    g_array_append_val(s->extents, e);
+    return true;
+}
+
+/*
+ * Pick the next chunk to copy and advance s->sector_num past it.  Chunks are
+ * taken from the extent map as long as it covers s->sector_num, so that
+ * dispatching does not have to wait for block status queries.  Returns the
+ * number of sectors in the chunk, 0 at the end of the image or a negative
+ * errno.
+ */
+static int convert_next_chunk(ImgConvertState *s, int64_t *sector_num,
+                              enum ImgConvertBlockStatus *status)
+{
+    ImgConvertExtent *e = NULL;
+    int64_t n;
+
+    if (s->sector_num >= s->total_sectors) {
+        return 0;
+    }
+
+    if (s->extent_idx < s->extents->len) {
+        e = &g_array_index(s->extents, ImgConvertExtent, s->extent_idx);
+        assert(s->sector_num >= e->sector_num &&
+               s->sector_num < e->sector_num + e->nb_sectors);
+        /* keep whole clusters together for compressed targets */
+        n = MIN(e->sector_num + e->nb_sectors - s->sector_num,
+                QEMU_ALIGN_DOWN(BDRV_REQUEST_MAX_SECTORS, s->buf_sectors));
+        *status = e->status;
+    } else {
+        n = convert_iteration_sectors(s, s->sector_num);
+        if (n < 0) {
+            return n;
+        }
+        *status = s->status;
+    }
+
+    if (*status == BLK_DATA || (!s->min_sparse && *status == BLK_ZERO)) {
+        n = MIN(n, s->buf_sectors);
+    }
+
+    *sector_num = s->sector_num;
+    s->sector_num += n;
+    if (e && s->sector_num == e->sector_num + e->nb_sectors) {
+        s->extent_idx++;
+    }
+
+    return n;
+}
+
 static int coroutine_fn convert_co_read(ImgConvertState *s, int64_t sector_num,
                                         int nb_sectors, uint8_t *buf)
 {
@@ -1824,7 +1916,9 @@ static void coroutine_fn convert_co_do_copy(void *opaque)
     assert(index >= 0);
 
     s->running_coroutines++;
-    buf = blk_blockalign(s->target, s->buf_sectors * BDRV_SECTOR_SIZE);
+    /* The buffer is used for both source and target, so it must satisfy the
+     * memory alignment of all of them (e.g. with O_DIRECT on either side) */
+    buf = qemu_memalign(s->buf_align, s->buf_sectors * BDRV_SECTOR_SIZE);
 
     while (1) {
         int n;
@@ -1833,26 +1927,20 @@ static void coroutine_fn convert_co_do_copy(void *opaque)
         bool copy_range;
 
         qemu_co_mutex_lock(&s->lock);
-        if (s->ret != -EINPROGRESS || s->sector_num >= s->total_sectors) {
+        if (s->ret != -EINPROGRESS) {
             qemu_co_mutex_unlock(&s->lock);
             break;
         }
-        n = convert_iteration_sectors(s, s->sector_num);
-        if (n < 0) {
-            qemu_co_mutex_unlock(&s->lock);
-            s->ret = n;
+        /* take the next chunk so that other coroutines can already continue
+         * reading beyond this request */
+        n = convert_next_chunk(s, &sector_num, &status);
+        qemu_co_mutex_unlock(&s->lock);
+        if (n <= 0) {
+            if (n < 0) {
+                s->ret = n;
+            }
             break;
         }
-        /* save current sector and allocation status to local variables */
-        sector_num = s->sector_num;
-        status = s->status;
-        if (!s->min_sparse && s->status == BLK_ZERO) {
-            n = MIN(n, s->buf_sectors);
-        }
-        /* increment global sector counter so that other coroutines can
-         * already continue reading beyond this request */
-        s->sector_num += n;
-        qemu_co_mutex_unlock(&s->lock);
 
         if (status == BLK_DATA || (!s->min_sparse && status == BLK_ZERO)) {
             s->allocated_done += n;
@@ -1861,7 +1949,7 @@ static void coroutine_fn convert_co_do_copy(void *opaque)
         }
 
 retry:
-        copy_range = s->copy_range && s->status == BLK_DATA;
+        copy_range = s->copy_range && status == BLK_DATA;
         if (status == BLK_DATA && !copy_range) {
             ret = convert_co_read(s, sector_num, n, buf);
             if (ret < 0) {
@@ -1931,6 +2019,7 @@ static int convert_do_copy(ImgConvertState *s)
 {
     int ret, i, n;
     int64_t sector_num = 0;
+    bool map_full;
 
     /* Check whether we have zero initialisation or can get it efficiently */
     s->has_zero_init = s->min_sparse && !s->target_has_backing
@@ -1956,15 +2045,29 @@ static int convert_do_copy(ImgConvertState *s)
         s->buf_sectors = s->cluster_sectors;
     }
 
+    s->buf_align = bdrv_opt_mem_align(blk_bs(s->target));
+    for (i = 0; i < s->src_num; i++) {
+        s->buf_align = MAX(s->buf_align, bdrv_opt_mem_align(blk_bs(s->src[i])));
+    }
+
+    /* Build the extent map up front, so that the copy coroutines can be fed
+     * without querying the block status of the sources in between */
+    s->extents = g_array_new(false, false, sizeof(ImgConvertExtent));
+    s->extent_idx = 0;
+    map_full = false;
     while (sector_num < s->total_sectors) {
         n = convert_iteration_sectors(s, sector_num);
         if (n < 0) {
-            return n;
+            ret = n;
+            goto out;
         }
         if (s->status == BLK_DATA || (!s->min_sparse && s->status == BLK_ZERO))
         {
             s->allocated_sectors += n;
         }
+        if (!map_full) {
+            map_full = !convert_add_extent(s, sector_num, n, s->status);
+        }
         sector_num += n;
     }
 
@@ -1983,15 +2086,16 @@ static int convert_do_copy(ImgConvertState *s)
         main_loop_wait(false);
     }
 
-    if (s->compressed && !s->ret) {
+    ret = s->ret;
+    if (s->compressed && !ret) {
         /* signal EOF to align */
         ret = blk_pwrite_compressed(s->target, 0, NULL, 0);
-        if (ret < 0) {
-            return ret;
-        }
     }
 
-    return s->ret;
+out:
+    g_array_free(s->extents, true);
+    s->extents = NULL;
+    return ret;
 }
 
 #define MAX_BUF_SECTORS 32768
@@ -2405,13 +2509,19 @@ static int img_convert(int argc, char **argv)
     }
 
     /* increase bufsectors from the default 4096 (2M) if opt_transfer
-     * or discard_alignment of the out_bs is greater. Limit to
-     * MAX_BUF_SECTORS as maximum which is currently 32768 (16MB). */
-    s.buf_sectors = MIN(MAX_BUF_SECTORS,
-                        MAX(s.buf_sectors,
-                            MAX(out_bs->bl.opt_transfer >> BDRV_SECTOR_BITS,
-                                out_bs->bl.pdiscard_alignment >>
-                                BDRV_SECTOR_BITS)));
+     * or discard_alignment of the out_bs or opt_transfer of one of the
+     * sources is greater. Limit to MAX_BUF_SECTORS as maximum which is
+     * currently 32768 (16MB). */
+    s.buf_sectors = MAX(s.buf_sectors,
+                        MAX(out_bs->bl.opt_transfer >> BDRV_SECTOR_BITS,
+                            out_bs->bl.pdiscard_alignment >>
+                            BDRV_SECTOR_BITS));
+    for (bs_i = 0; bs_i < s.src_num; bs_i++) {
+        s.buf_sectors = MAX(s.buf_sectors,
+                            blk_bs(s.src[bs_i])->bl.opt_transfer >>
+                            BDRV_SECTOR_BITS);
+    }
+    s.buf_sectors = MIN(MAX_BUF_SECTORS, s.buf_sectors);
 
     /* try to align the write requests to the destination to avoid unnecessary
      * RMW cycles. */
@@ -980,6 +980,33 @@ Clean unused entries in the L2 and refcount caches. The interval is in seconds.
 The default value is 600 on supporting platforms, and 0 on other platforms.
 Setting it to 0 disables this feature.
 
+@item prealloc-size
+Keep a pool of this many bytes of host clusters allocated and zeroed in the
+background, so that writes to unallocated clusters don't have to wait for
+refcount updates and for the image file to grow. Unused clusters of the pool
+are released when the image is closed. The default value is 0, which disables
+this feature.
+
+@item l2-warmup
+Load the L2 tables of the image into the L2 cache in the background after the
+image is opened, so that the first access to each part of the disk doesn't
+have to wait for its L2 table to be read. Tables are only loaded as long as
+the cache has unused entries (on/off; default: off)
+
+@item l2-warmup-hints
+Name of a file in which the L2 tables that are used while the image is open are
+recorded when it is closed. The next time the image is opened with the same
+file, these tables are loaded into the cache first, in the order in which they
+were used.
+
+@item dedup
+Hash the data of every write that covers a whole cluster and, if an identical
+cluster was written before while the image is open, make the guest cluster
+share its host cluster instead of allocating a new one. Shared clusters are
+copied when they are written to, like clusters shared with an internal
+snapshot. Not supported for encrypted images and images with an external data
+file (on/off; default: off)
+
 @item pass-discard-request
 Whether discard requests to the qcow2 device should be forwarded to the data
 source (on/off; default: on if discard=unmap is specified, off otherwise)
@@ -1020,7 +1047,8 @@ DEF("drive", HAS_ARG, QEMU_OPTION_drive,
     "-drive [file=file][,if=type][,bus=n][,unit=m][,media=d][,index=i]\n"
     "       [,cache=writethrough|writeback|none|directsync|unsafe][,format=f]\n"
     "       [,snapshot=on|off][,rerror=ignore|stop|report]\n"
-    "       [,werror=ignore|stop|report|enospc][,id=name][,aio=threads|native]\n"
+    "       [,werror=ignore|stop|report|enospc][,id=name]\n"
+    "       [,aio=threads|native|io_uring]\n"
     "       [,readonly=on|off][,copy-on-read=on|off]\n"
     "       [,discard=ignore|unmap][,detect-zeroes=on|off|unmap]\n"
     "       [[,bps=b]|[[,bps_rd=r][,bps_wr=w]]]\n"
@@ -1088,7 +1116,9 @@ unsafe       │ on                off            on
 The default mode is @option{cache=writeback}.
 
 @item aio=@var{aio}
-@var{aio} is "threads", or "native" and selects between pthread based disk I/O and native Linux AIO.
+@var{aio} is "threads", "native" or "io_uring" and selects between pthread
+based disk I/O, native Linux AIO and Linux io_uring.  Unlike native AIO,
+io_uring does not require @option{cache.direct=on}.
 @item format=@var{format}
 Specify which disk @var{format} will be used rather than detecting
 the format.  Can be used to specify format=raw to avoid interpreting
@@ -0,0 +1,32 @@
+#!/usr/bin/env python
+#
+# Convert a prebuilt linux-user guest vDSO into a C array
+#
+# The image is mapped into the guest unmodified, so it must be a
+# position independent shared object without dynamic relocations.
+#
+# This work is licensed under the terms of the GNU GPL, version 2 or later.
+# See the COPYING file in the top-level directory.
+
+from __future__ import print_function
+import sys
+
+if len(sys.argv) != 3:
+    print('usage: gen-vdso-image.py input output')
+    sys.exit(1)
+
+data = bytearray(open(sys.argv[1], 'rb').read())
+if data[:4] != b'\x7fELF':
+    sys.exit('%s: not an ELF image' % sys.argv[1])
+
+with open(sys.argv[2], 'w') as fout:
+    fout.write('/* Generated from %s by gen-vdso-image.py, do not edit */\n\n'
+               % sys.argv[1].split('/')[-1])
+    fout.write('static const uint8_t vdso_image[%d] '
+               '__attribute__((aligned(16))) = {\n' % len(data))
+    for i in range(0, len(data), 12):
+        fout.write('   ')
+        for b in data[i:i + 12]:
+            fout.write(' 0x%02x,' % b)
+        fout.write('\n')
+    fout.write('};\n')
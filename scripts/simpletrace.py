@@ -12,6 +12,7 @@
 from __future__ import print_function
 import struct
 import inspect
+import io
 from tracetool import read_events, Event
 from tracetool.backend.simple import is_string
 
@@ -25,6 +26,9 @@ record_type_event = 1
 log_header_fmt = '=QQQ'
 rec_header_fmt = '=QQII'
 
+# Since version 5 every item in the log is padded to this alignment
+log_align = 8
+
 def read_header(fobj, hfmt):
     '''Read a trace record header'''
     hlen = struct.calcsize(hfmt)
@@ -66,16 +70,22 @@ def get_record(edict, idtoname, rechdr, fobj):
         rec = rec + (value,)
     return rec
 
-def get_mapping(fobj):
+def get_mapping(fobj, log_version=4):
     (event_id, ) = struct.unpack('=Q', fobj.read(8))
     (len, ) = struct.unpack('=L', fobj.read(4))
     name = fobj.read(len).decode()
+    if log_version >= 5:
+        fobj.read(-(8 + 8 + 4 + len) % log_align)
 
     return (event_id, name)
 
-def read_record(edict, idtoname, fobj):
+def read_record(edict, idtoname, fobj, log_version=4):
     """Deserialize a trace record from a file into a tuple (event_num, timestamp, pid, arg1, ..., arg6)."""
     rechdr = read_header(fobj, rec_header_fmt)
+    if rechdr is not None and log_version >= 5:
+        # The record length includes alignment padding, consume it all
+        body = fobj.read(rechdr[2] - struct.calcsize(rec_header_fmt))
+        return get_record(edict, idtoname, rechdr, io.BytesIO(body))
     return get_record(edict, idtoname, rechdr, fobj)
 
 def read_trace_header(fobj):
@@ -91,13 +101,14 @@ def read_trace_header(fobj):
                          (header[1], header_magic))
 
     log_version = header[2]
-    if log_version not in [0, 2, 3, 4]:
+    if log_version not in [0, 2, 3, 4, 5]:
         raise ValueError('Unknown version of tracelog format!')
-    if log_version != 4:
+    if log_version not in [4, 5]:
         raise ValueError('Log format %d not supported with this QEMU release!'
                          % log_version)
+    return log_version
 
-def read_trace_records(edict, idtoname, fobj):
+def read_trace_records(edict, idtoname, fobj, log_version=4):
     """Deserialize trace records from a file, yielding record tuples (event_num, timestamp, pid, arg1, ..., arg6).
 
     Note that `idtoname` is modified if the file contains mapping records.
@@ -106,6 +117,7 @@ def read_trace_records(edict, idtoname, fobj):
         edict (str -> Event): events dict, indexed by name
         idtoname (int -> str): event names dict, indexed by event ID
         fobj (file): input file
+        log_version (int): log format version from the file header
 
     """
     while True:
@@ -115,10 +127,10 @@ def read_trace_records(edict, idtoname, fobj):
 
         (rectype, ) = struct.unpack('=Q', t)
         if rectype == record_type_mapping:
-            event_id, name = get_mapping(fobj)
+            event_id, name = get_mapping(fobj, log_version)
             idtoname[event_id] = name
         else:
-            rec = read_record(edict, idtoname, fobj)
+            rec = read_record(edict, idtoname, fobj, log_version)
 
             yield rec
 
@@ -172,8 +184,9 @@ def process(events, log, analyzer, read_header=True):
     if isinstance(log, str):
         log = open(log, 'rb')
 
+    log_version = 4
     if read_header:
-        read_trace_header(log)
+        log_version = read_trace_header(log)
 
     dropped_event = Event.build("Dropped_Event(uint64_t num_events_dropped)")
     edict = {"dropped": dropped_event}
@@ -209,7 +222,7 @@ def process(events, log, analyzer, read_header=True):
 
     analyzer.begin()
     fn_cache = {}
-    for rec in read_trace_records(edict, idtoname, log):
+    for rec in read_trace_records(edict, idtoname, log, log_version):
         event_num = rec[0]
         event = edict[event_num]
         if event_num not in fn_cache:
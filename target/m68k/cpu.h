@@ -23,6 +23,11 @@
 
 #define TARGET_LONG_BITS 32
 
+/* The m68k family presents a sequentially consistent memory model */
+#define TCG_GUEST_DEFAULT_MO      (TCG_MO_ALL)
+/* ... which tcg_gen_req_mo() can emulate on weaker hosts, see cpus.c */
+#define TCG_GUEST_MO_EMULATED
+
 #define CPUArchState struct CPUM68KState
 
 #include "qemu-common.h"
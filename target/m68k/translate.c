@@ -2775,19 +2775,56 @@ DISAS_INSN(illegal)
     gen_exception(s, s->base.pc_next, EXCP_ILLEGAL);
 }
 
-/* ??? This should be atomic.  */
+/* TAS is an indivisible read-modify-write cycle on the bus; perform it
+   with a host atomic so it remains a valid lock primitive under MTTCG.  */
 DISAS_INSN(tas)
 {
-    TCGv dest;
+    int mode = extract32(insn, 3, 3);
+    int reg0 = REG(insn, 0);
     TCGv src1;
     TCGv addr;
+    TCGv bit;
 
-    dest = tcg_temp_new();
-    SRC_EA(env, src1, OS_BYTE, 1, &addr);
+    if (mode == 0) {
+        /* data register direct */
+        TCGv dest = cpu_dregs[reg0];
+        gen_logic_cc(s, dest, OS_BYTE);
+        tcg_gen_ori_i32(dest, dest, 0x80);
+        return;
+    }
+
+    /* The operand must be data alterable: no An, PC relative or
+       immediate operands.  */
+    if (mode == 1 || (mode == 7 && reg0 >= 2)) {
+        gen_exception(s, s->base.pc_next, EXCP_ILLEGAL);
+        return;
+    }
+
+    addr = gen_lea_mode(env, s, mode, reg0, OS_BYTE);
+    if (IS_NULL_QREG(addr)) {
+        gen_addr_fault(s);
+        return;
+    }
+
+    src1 = tcg_temp_new();
+    bit = tcg_const_i32(0x80);
+    tcg_gen_atomic_fetch_or_i32(src1, addr, bit, IS_USER(s), MO_SB);
     gen_logic_cc(s, src1, OS_BYTE);
-    tcg_gen_ori_i32(dest, src1, 0x80);
-    DEST_EA(env, insn, OS_BYTE, dest, &addr);
-    tcg_temp_free(dest);
+    tcg_temp_free(bit);
+    tcg_temp_free(src1);
+
+    switch (mode) {
+    case 3: /* Indirect postincrement.  */
+        if (reg0 == 7 && m68k_feature(s->env, M68K_FEATURE_M68000)) {
+            tcg_gen_addi_i32(AREG(insn, 0), addr, 2);
+        } else {
+            tcg_gen_addi_i32(AREG(insn, 0), addr, 1);
+        }
+        break;
+    case 4: /* Indirect predecrememnt.  */
+        tcg_gen_mov_i32(AREG(insn, 0), addr);
+        break;
+    }
 }
 
 DISAS_INSN(mull)
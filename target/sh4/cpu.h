@@ -26,6 +26,9 @@
 #define TARGET_LONG_BITS 32
 #define ALIGNED_ONLY
 
+/* SH-4A multiprocessors are weakly ordered and order accesses with SYNCO */
+#define TCG_GUEST_DEFAULT_MO      (0)
+
 /* CPU Subtypes */
 #define SH_CPU_SH7750  (1 << 0)
 #define SH_CPU_SH7750S (1 << 1)
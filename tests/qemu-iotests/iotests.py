@@ -491,10 +491,14 @@ class VM(qtest.QEMUQtestMachine):
         self.qmp('human-monitor-command',
                     command_line='qemu-io %s "remove_break bp_%s"' % (drive, drive))
 
-    def hmp_qemu_io(self, drive, cmd):
+    def hmp_qemu_io(self, drive, cmd, use_log=False):
         '''Write to a given drive using an HMP command'''
-        return self.qmp('human-monitor-command',
-                        command_line='qemu-io %s "%s"' % (drive, cmd))
+        qmp_cmd = 'human-monitor-command'
+        kwargs = {'command-line': 'qemu-io %s "%s"' % (drive, cmd)}
+        if use_log:
+            return self.qmp_log(qmp_cmd, **kwargs)
+        else:
+            return self.qmp(qmp_cmd, **kwargs)
 
     def flatten_qmp_object(self, obj, output=None, basestr=''):
         if output is None:
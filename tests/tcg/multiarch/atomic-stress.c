@@ -0,0 +1,98 @@
+/*
+ * Concurrent atomic operation stress test
+ *
+ * Hammers a handful of shared words from several threads at once so
+ * that the guest atomic helpers, the barriers TCG inserts for the
+ * guest memory model and the exclusive-step fallback all get
+ * exercised while vCPUs really run in parallel.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+#define NR_THREADS  4
+#define NR_ITERS    100000
+
+static unsigned long counter_add;
+static unsigned long counter_cas;
+static unsigned long counter_locked;
+static unsigned char lock;
+
+/* message passing: data published before the flag must be seen with it */
+static unsigned long mp_data;
+static unsigned long mp_flag;
+
+static void spin_lock(unsigned char *l)
+{
+    while (__atomic_test_and_set(l, __ATOMIC_ACQUIRE)) {
+        while (__atomic_load_n(l, __ATOMIC_RELAXED)) {
+            /* spin */
+        }
+    }
+}
+
+static void spin_unlock(unsigned char *l)
+{
+    __atomic_clear(l, __ATOMIC_RELEASE);
+}
+
+static void *stress_func(void *arg)
+{
+    unsigned long id = (unsigned long)arg;
+    int i;
+
+    for (i = 0; i < NR_ITERS; i++) {
+        unsigned long old;
+
+        __atomic_fetch_add(&counter_add, 1, __ATOMIC_SEQ_CST);
+
+        old = __atomic_load_n(&counter_cas, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&counter_cas, &old, old + 1,
+                                            false, __ATOMIC_SEQ_CST,
+                                            __ATOMIC_RELAXED)) {
+            /* retry with the refreshed value */
+        }
+
+        spin_lock(&lock);
+        counter_locked++;
+        spin_unlock(&lock);
+
+        if (id == 0) {
+            mp_data = i + 1;
+            __atomic_store_n(&mp_flag, i + 1, __ATOMIC_RELEASE);
+        } else {
+            unsigned long f = __atomic_load_n(&mp_flag, __ATOMIC_ACQUIRE);
+            assert(mp_data >= f);
+        }
+    }
+    return NULL;
+}
+
+int main(int argc, char **argv)
+{
+    pthread_t threads[NR_THREADS];
+    unsigned long expected = (unsigned long)NR_THREADS * NR_ITERS;
+    unsigned long i;
+
+    for (i = 0; i < NR_THREADS; i++) {
+        pthread_create(&threads[i], NULL, stress_func, (void *)i);
+    }
+    for (i = 0; i < NR_THREADS; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    if (counter_add != expected || counter_cas != expected ||
+        counter_locked != expected) {
+        printf("FAIL: add %lu cas %lu locked %lu (expected %lu)\n",
+               counter_add, counter_cas, counter_locked, expected);
+        return EXIT_FAILURE;
+    }
+    printf("End of atomic stress test.\n");
+    return EXIT_SUCCESS;
+}
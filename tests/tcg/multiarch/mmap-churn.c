@@ -0,0 +1,119 @@
+/*
+ * mmap/munmap churn benchmark
+ *
+ * Keeps a few thousand small anonymous mappings alive and keeps
+ * replacing random ones, the way malloc arenas and garbage collectors
+ * do, with the occasional mprotect and /proc/self/maps read thrown in.
+ * Under qemu-user the cost of each operation depends on how guest
+ * mappings are tracked, so the rate printed at the end shows whether
+ * finding free space stays cheap as the address space fills up.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#define NR_SLOTS    2048
+#define NR_OPS      50000
+#define MAX_PAGES   16
+
+struct slot {
+    unsigned char *addr;
+    size_t len;
+    unsigned char tag;
+};
+
+static struct slot slots[NR_SLOTS];
+static size_t pagesize;
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void slot_map(struct slot *s, unsigned char tag)
+{
+    s->len = (1 + rand() % MAX_PAGES) * pagesize;
+    s->addr = mmap(NULL, s->len, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    assert(s->addr != MAP_FAILED);
+    s->tag = tag;
+    s->addr[0] = tag;
+    s->addr[s->len - 1] = tag;
+}
+
+static void slot_unmap(struct slot *s)
+{
+    /* Nobody else may have been handed our pages in the meantime */
+    assert(s->addr[0] == s->tag);
+    assert(s->addr[s->len - 1] == s->tag);
+    assert(munmap(s->addr, s->len) == 0);
+}
+
+static size_t read_maps(void)
+{
+    FILE *fp = fopen("/proc/self/maps", "r");
+    size_t lines = 0;
+    int c;
+
+    assert(fp);
+    while ((c = fgetc(fp)) != EOF) {
+        lines += c == '\n';
+    }
+    fclose(fp);
+    return lines;
+}
+
+int main(int argc, char **argv)
+{
+    double t_fill, t_churn;
+    size_t maps = 0;
+    int i;
+
+    pagesize = getpagesize();
+    srand(1);
+
+    t_fill = now();
+    for (i = 0; i < NR_SLOTS; i++) {
+        slot_map(&slots[i], i);
+    }
+    t_fill = now() - t_fill;
+
+    t_churn = now();
+    for (i = 0; i < NR_OPS; i++) {
+        struct slot *s = &slots[rand() % NR_SLOTS];
+
+        slot_unmap(s);
+        slot_map(s, i);
+
+        if (i % 16 == 0) {
+            /* Split the mapping in two and join it back */
+            assert(mprotect(s->addr, pagesize, PROT_READ) == 0);
+            assert(mprotect(s->addr, pagesize, PROT_READ | PROT_WRITE) == 0);
+        }
+        if (i % 10000 == 0) {
+            maps += read_maps();
+        }
+    }
+    t_churn = now() - t_churn;
+
+    for (i = 0; i < NR_SLOTS; i++) {
+        slot_unmap(&slots[i]);
+    }
+
+    printf("fill: %d mappings in %.3fs\n", NR_SLOTS, t_fill);
+    printf("churn: %d mmap+munmap pairs in %.3fs, %.0f pairs/s\n",
+           NR_OPS, t_churn, NR_OPS / t_churn);
+    printf("maps: %zu lines read\n", maps);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,122 @@
+/*
+ * Syscall scalability benchmark
+ *
+ * Runs the same mix of cheap I/O syscalls from 1, 2, 4 and 8 threads
+ * and prints the aggregate rate for each.  Every thread works on its
+ * own file descriptors, so on a multi-core host the rate should grow
+ * with the thread count unless the emulator serializes the syscalls.
+ *
+ * eventfd and dup/close go through linux-user's fd translation tables,
+ * and each thread installs its own sigaltstack, which must not be
+ * visible to the others.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <assert.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+
+#define MAX_THREADS 8
+#define NR_ITERS    20000
+#define ALTSTACK_SIZE (64 * 1024)
+
+static pthread_barrier_t barrier;
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void *worker(void *arg)
+{
+    uintptr_t id = (uintptr_t)arg;
+    static char altstacks[MAX_THREADS][ALTSTACK_SIZE];
+    stack_t ss = {
+        .ss_sp = altstacks[id],
+        .ss_size = ALTSTACK_SIZE,
+    };
+    stack_t old;
+    int pipefd[2];
+    int efd, i;
+
+    assert(sigaltstack(&ss, NULL) == 0);
+    efd = eventfd(0, 0);
+    assert(efd >= 0);
+    assert(pipe(pipefd) == 0);
+
+    pthread_barrier_wait(&barrier);
+
+    for (i = 0; i < NR_ITERS; i++) {
+        uint64_t val = i + 1;
+        char c = i;
+        int fd;
+
+        assert(write(efd, &val, sizeof(val)) == sizeof(val));
+        val = 0;
+        assert(read(efd, &val, sizeof(val)) == sizeof(val));
+        assert(val == i + 1);
+
+        assert(write(pipefd[1], &c, 1) == 1);
+        assert(read(pipefd[0], &c, 1) == 1);
+        assert(c == (char)i);
+
+        fd = dup(efd);
+        assert(fd >= 0);
+        assert(close(fd) == 0);
+
+        getppid();
+    }
+
+    /* Other threads must not have replaced our alternate stack */
+    assert(sigaltstack(NULL, &old) == 0);
+    assert(old.ss_sp == altstacks[id]);
+
+    close(pipefd[0]);
+    close(pipefd[1]);
+    close(efd);
+    return NULL;
+}
+
+static double run(int nr_threads)
+{
+    pthread_t threads[MAX_THREADS];
+    double t;
+    uintptr_t i;
+
+    pthread_barrier_init(&barrier, NULL, nr_threads + 1);
+    for (i = 0; i < nr_threads; i++) {
+        assert(pthread_create(&threads[i], NULL, worker, (void *)i) == 0);
+    }
+    pthread_barrier_wait(&barrier);
+    t = now();
+    for (i = 0; i < nr_threads; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    t = now() - t;
+    pthread_barrier_destroy(&barrier);
+    return t;
+}
+
+int main(int argc, char **argv)
+{
+    int n;
+
+    for (n = 1; n <= MAX_THREADS; n *= 2) {
+        double t = run(n);
+
+        printf("%d threads: %.3fs, %.0f iterations/s\n",
+               n, t, n * NR_ITERS / t);
+    }
+    return EXIT_SUCCESS;
+}
@@ -63,6 +63,7 @@ static int coroutine_fn bdrv_test_co_block_status(BlockDriverState *bs,
 static BlockDriver bdrv_test = {
     .format_name            = "test",
     .instance_size          = 1,
+    .supports_multiqueue    = true,
 
     .bdrv_co_preadv         = bdrv_test_co_prwv,
     .bdrv_co_pwritev        = bdrv_test_co_prwv,
@@ -658,6 +659,116 @@ static void test_propagate_mirror(void)
     bdrv_unref(target);
 }
 
+#define MQ_REQS_PER_THREAD 64
+
+static QemuEvent mq_done_event;
+static int mq_completed;
+static int mq_expected;
+
+static void test_multiqueue_cb(void *opaque, int ret)
+{
+    AioContext *ctx = opaque;
+
+    /* Requests complete in the iothread that submitted them */
+    g_assert_cmpint(ret, ==, 0);
+    g_assert(qemu_get_current_aio_context() == ctx);
+
+    if (atomic_inc_fetch(&mq_completed) == atomic_read(&mq_expected)) {
+        qemu_event_set(&mq_done_event);
+    }
+}
+
+static void test_multiqueue_submit_bh(void *opaque)
+{
+    BlockBackend *blk = opaque;
+    AioContext *ctx = qemu_get_current_aio_context();
+    int i;
+
+    for (i = 0; i < MQ_REQS_PER_THREAD; i++) {
+        if (i & 1) {
+            blk_aio_flush(blk, test_multiqueue_cb, ctx);
+        } else {
+            blk_aio_pwrite_zeroes(blk, i * 512, 512, 0,
+                                  test_multiqueue_cb, ctx);
+        }
+    }
+}
+
+static void test_multiqueue_wait(int expected)
+{
+    qemu_event_wait(&mq_done_event);
+    qemu_event_reset(&mq_done_event);
+    g_assert_cmpint(atomic_read(&mq_completed), ==, expected);
+}
+
+/*
+ * Submit requests to a BlockBackend in one iothread from that iothread
+ * and from a second one at the same time.
+ */
+static void test_multiqueue(void)
+{
+    IOThread *iothread_a = iothread_new();
+    IOThread *iothread_b = iothread_new();
+    AioContext *ctx_a = iothread_get_aio_context(iothread_a);
+    AioContext *ctx_b = iothread_get_aio_context(iothread_b);
+    BlockBackend *blk;
+    BlockDriverState *bs, *bs_aio;
+    QDict *options;
+    Error *local_err = NULL;
+
+    qemu_event_init(&mq_done_event, false);
+    mq_completed = 0;
+
+    blk = blk_new(BLK_PERM_ALL, BLK_PERM_ALL);
+    bs = bdrv_new_open_driver(&bdrv_test, "base", BDRV_O_RDWR, &error_abort);
+    bs->total_sectors = 65536;
+    blk_insert_bs(blk, bs, &error_abort);
+
+    blk_set_aio_context(blk, ctx_a);
+    g_assert(blk_set_multiqueue(blk, true, &error_abort) == 0);
+    g_assert(blk_get_multiqueue(blk));
+
+    /* Both iothreads submit concurrently */
+    atomic_set(&mq_expected, 2 * MQ_REQS_PER_THREAD);
+    aio_bh_schedule_oneshot(ctx_a, test_multiqueue_submit_bh, blk);
+    aio_bh_schedule_oneshot(ctx_b, test_multiqueue_submit_bh, blk);
+    test_multiqueue_wait(2 * MQ_REQS_PER_THREAD);
+
+    /* Requests from the other iothread wait for the drained section */
+    atomic_set(&mq_expected, 3 * MQ_REQS_PER_THREAD);
+    aio_context_acquire(ctx_a);
+    bdrv_drained_begin(bs);
+    aio_bh_schedule_oneshot(ctx_b, test_multiqueue_submit_bh, blk);
+    g_usleep(10000);
+    g_assert_cmpint(atomic_read(&mq_completed), ==, 2 * MQ_REQS_PER_THREAD);
+    bdrv_drained_end(bs);
+    aio_context_release(ctx_a);
+    test_multiqueue_wait(3 * MQ_REQS_PER_THREAD);
+
+    aio_context_acquire(ctx_a);
+    blk_set_aio_context(blk, qemu_get_aio_context());
+    aio_context_release(ctx_a);
+    blk_unref(blk);
+    bdrv_unref(bs);
+
+    /* Drivers without multiqueue support are refused */
+    options = qdict_new();
+    qdict_put_str(options, "driver", "null-aio");
+    bs_aio = bdrv_open(NULL, NULL, options, BDRV_O_RDWR, &error_abort);
+    blk = blk_new(BLK_PERM_ALL, BLK_PERM_ALL);
+    blk_insert_bs(blk, bs_aio, &error_abort);
+    g_assert(blk_set_multiqueue(blk, true, &local_err) == -ENOTSUP);
+    g_assert(local_err);
+    error_free(local_err);
+    g_assert(!blk_get_multiqueue(blk));
+    blk_unref(blk);
+    bdrv_unref(bs_aio);
+
+    qemu_event_destroy(&mq_done_event);
+    iothread_join(iothread_a);
+    iothread_join(iothread_b);
+}
+
 int main(int argc, char **argv)
 {
     int i;
@@ -676,6 +787,7 @@ int main(int argc, char **argv)
     g_test_add_func("/propagate/basic", test_propagate_basic);
     g_test_add_func("/propagate/diamond", test_propagate_diamond);
     g_test_add_func("/propagate/mirror", test_propagate_mirror);
+    g_test_add_func("/multiqueue/submit", test_multiqueue);
 
     return g_test_run();
 }
@@ -1104,6 +1104,73 @@ static void test_hbitmap_next_dirty_area_4(TestHBitmapData *data,
     test_hbitmap_next_dirty_area_do(data, 4);
 }
 
+static void test_hbitmap_next_dirty_check(TestHBitmapData *data,
+                                          uint64_t start, uint64_t count)
+{
+    int64_t ret1 = hbitmap_next_dirty(data->hb, start, count);
+    int64_t ret2 = start;
+    int64_t end = start >= data->size || data->size - start < count ?
+                data->size : start + count;
+
+    for ( ; ret2 < end && !hbitmap_get(data->hb, ret2); ret2++) {
+        ;
+    }
+    if (ret2 >= end) {
+        ret2 = -1;
+    }
+
+    g_assert_cmpint(ret1, ==, ret2);
+}
+
+static void test_hbitmap_scan_do(TestHBitmapData *data, int granularity)
+{
+    hbitmap_test_init(data, L3, granularity);
+    test_hbitmap_next_dirty_check(data, 0, UINT64_MAX);
+    test_hbitmap_next_dirty_check(data, L3 - 1, 1);
+    test_hbitmap_next_dirty_check(data, L3, 1);
+
+    hbitmap_set(data->hb, L2, 1);
+    test_hbitmap_next_dirty_check(data, 0, UINT64_MAX);
+    test_hbitmap_next_dirty_check(data, 0, L2);
+    test_hbitmap_next_dirty_check(data, 0, L2 + 1);
+    test_hbitmap_next_dirty_check(data, L2 - 1, 2);
+    test_hbitmap_next_dirty_check(data, L2, 1);
+    test_hbitmap_next_dirty_check(data, L2 + 1, UINT64_MAX);
+    test_hbitmap_next_dirty_check(data, L2, 0);
+
+    hbitmap_set(data->hb, L2 + 5, L1);
+    test_hbitmap_next_dirty_check(data, 0, UINT64_MAX);
+    test_hbitmap_next_dirty_check(data, L2 + 1, UINT64_MAX);
+    test_hbitmap_next_dirty_check(data, L2 + 1, 3);
+    test_hbitmap_next_dirty_check(data, L2 + 6, L1 - 2);
+    test_hbitmap_next_dirty_check(data, L2 + 5 + L1, UINT64_MAX);
+
+    hbitmap_set(data->hb, L2 * 2, L3 - L2 * 2);
+    test_hbitmap_next_dirty_check(data, 0, UINT64_MAX);
+    test_hbitmap_next_dirty_check(data, L2 * 2 - L1, L1 + 1);
+    test_hbitmap_next_dirty_check(data, L2 * 2 + 3, L2);
+    test_hbitmap_next_dirty_check(data, L3 - 3, UINT64_MAX);
+
+    hbitmap_reset(data->hb, L2 * 2 + L1 * 8, L1 * 3);
+    test_hbitmap_next_zero_check(data, L2 * 2);
+    test_hbitmap_next_dirty_check(data, L2 * 2 + L1 * 8, L1 * 3);
+    test_hbitmap_next_dirty_check(data, L2 * 2 + L1 * 8 + 1, UINT64_MAX);
+
+    hbitmap_set(data->hb, 0, L3);
+    test_hbitmap_next_dirty_check(data, 0, UINT64_MAX);
+    test_hbitmap_next_dirty_check(data, 1, L3 - 2);
+}
+
+static void test_hbitmap_scan_0(TestHBitmapData *data, const void *unused)
+{
+    test_hbitmap_scan_do(data, 0);
+}
+
+static void test_hbitmap_scan_4(TestHBitmapData *data, const void *unused)
+{
+    test_hbitmap_scan_do(data, 4);
+}
+
 int main(int argc, char **argv)
 {
     g_test_init(&argc, &argv, NULL);
@@ -1177,6 +1244,9 @@ int main(int argc, char **argv)
     hbitmap_test_add("/hbitmap/next_dirty_area/next_dirty_area_4",
                      test_hbitmap_next_dirty_area_4);
 
+    hbitmap_test_add("/hbitmap/scan/scan_0", test_hbitmap_scan_0);
+    hbitmap_test_add("/hbitmap/scan/scan_4", test_hbitmap_scan_4);
+
     g_test_run();
 
     return 0;
@@ -0,0 +1,145 @@
+/*
+ * Interval tree unit tests
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/interval-tree.h"
+
+#define N_NODES 1000
+
+static IntervalTreeNode nodes[N_NODES];
+static bool in_tree[N_NODES];
+
+static bool overlaps(IntervalTreeNode *n, uint64_t start, uint64_t last)
+{
+    return n->start <= last && n->last >= start;
+}
+
+/* Check the iterators against a linear scan of the nodes in the tree */
+static void check_query(IntervalTreeRoot *root, uint64_t start, uint64_t last)
+{
+    IntervalTreeNode *n;
+    uint64_t prev_start = 0;
+    size_t found = 0, expected = 0;
+    size_t i;
+
+    for (i = 0; i < N_NODES; i++) {
+        if (in_tree[i] && overlaps(&nodes[i], start, last)) {
+            expected++;
+        }
+    }
+
+    for (n = interval_tree_iter_first(root, start, last); n;
+         n = interval_tree_iter_next(n, start, last)) {
+        g_assert(overlaps(n, start, last));
+        g_assert(in_tree[n - nodes]);
+        g_assert_cmpuint(n->start, >=, prev_start);
+        prev_start = n->start;
+        found++;
+    }
+    g_assert_cmpuint(found, ==, expected);
+}
+
+static void test_empty(void)
+{
+    IntervalTreeRoot root = { };
+
+    g_assert(interval_tree_iter_first(&root, 0, UINT64_MAX) == NULL);
+}
+
+static void test_basic(void)
+{
+    IntervalTreeRoot root = { };
+    IntervalTreeNode a = { .start = 10, .last = 19 };
+    IntervalTreeNode b = { .start = 20, .last = 29 };
+    IntervalTreeNode c = { .start = 15, .last = 100 };
+    IntervalTreeNode *n;
+
+    interval_tree_insert(&a, &root);
+    interval_tree_insert(&b, &root);
+    interval_tree_insert(&c, &root);
+
+    g_assert(interval_tree_iter_first(&root, 0, 9) == NULL);
+    g_assert(interval_tree_iter_first(&root, 101, UINT64_MAX) == NULL);
+
+    n = interval_tree_iter_first(&root, 0, UINT64_MAX);
+    g_assert(n == &a);
+    n = interval_tree_iter_next(n, 0, UINT64_MAX);
+    g_assert(n == &c);
+    n = interval_tree_iter_next(n, 0, UINT64_MAX);
+    g_assert(n == &b);
+    g_assert(interval_tree_iter_next(n, 0, UINT64_MAX) == NULL);
+
+    /* c is found through a's subtree_last even though it starts later */
+    g_assert(interval_tree_iter_first(&root, 50, 60) == &c);
+
+    n = interval_tree_iter_first(&root, 19, 20);
+    g_assert(n == &a);
+    n = interval_tree_iter_next(n, 19, 20);
+    g_assert(n == &c);
+    g_assert(interval_tree_iter_next(n, 19, 20) == &b);
+
+    interval_tree_remove(&c, &root);
+    g_assert(interval_tree_iter_first(&root, 50, 60) == NULL);
+    interval_tree_remove(&a, &root);
+    g_assert(interval_tree_iter_first(&root, 0, UINT64_MAX) == &b);
+    interval_tree_remove(&b, &root);
+    g_assert(root.root == NULL);
+}
+
+static void test_random(void)
+{
+    IntervalTreeRoot root = { };
+    GRand *rand = g_rand_new_with_seed(0x1234);
+    size_t i, j;
+
+    memset(in_tree, 0, sizeof(in_tree));
+    for (i = 0; i < 20 * N_NODES; i++) {
+        j = g_rand_int_range(rand, 0, N_NODES);
+        if (in_tree[j]) {
+            interval_tree_remove(&nodes[j], &root);
+            in_tree[j] = false;
+        } else {
+            /* Small key space to get plenty of duplicates and overlaps */
+            nodes[j].start = g_rand_int_range(rand, 0, 10000);
+            nodes[j].last = nodes[j].start + g_rand_int_range(rand, 0, 100);
+            interval_tree_insert(&nodes[j], &root);
+            in_tree[j] = true;
+        }
+
+        if (i % 64 == 0) {
+            uint64_t start = g_rand_int_range(rand, 0, 10200);
+            uint64_t last = start + g_rand_int_range(rand, 0, 500);
+
+            check_query(&root, start, last);
+            check_query(&root, start, start);
+        }
+    }
+    check_query(&root, 0, UINT64_MAX);
+
+    /* An AVL tree of n nodes is at most ~1.44 log2(n) high */
+    if (root.root) {
+        g_assert_cmpint(root.root->height, <=, 16);
+    }
+
+    for (j = 0; j < N_NODES; j++) {
+        if (in_tree[j]) {
+            interval_tree_remove(&nodes[j], &root);
+            in_tree[j] = false;
+        }
+    }
+    g_assert(root.root == NULL);
+    g_rand_free(rand);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/interval-tree/empty", test_empty);
+    g_test_add_func("/interval-tree/basic", test_basic);
+    g_test_add_func("/interval-tree/random", test_random);
+    return g_test_run();
+}
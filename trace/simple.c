@@ -12,6 +12,7 @@
 #ifndef _WIN32
 #include <pthread.h>
 #endif
+#include "qemu/atomic.h"
 #include "qemu/timer.h"
 #include "trace/control.h"
 #include "trace/simple.h"
@@ -25,13 +26,16 @@
 #define HEADER_MAGIC 0xf2b177cb0aa429b4ULL
 
 /** Trace file version number, bump if format changes */
-#define HEADER_VERSION 4
+#define HEADER_VERSION 5
 
 /** Records were dropped event ID */
 #define DROPPED_EVENT_ID (~(uint64_t)0 - 1)
 
-/** Trace record is valid */
-#define TRACE_RECORD_VALID ((uint64_t)1 << 63)
+/**
+ * Alignment of every item in the trace file.  Keeping records naturally
+ * aligned lets readers mmap() the file and walk it in place.
+ */
+#define TRACE_RECORD_ALIGN 8
 
 /*
  * Trace records are written out by a dedicated thread.  The thread waits for
@@ -49,10 +53,27 @@ enum {
     TRACE_BUF_FLUSH_THRESHOLD = TRACE_BUF_LEN / 4,
 };
 
-uint8_t trace_buf[TRACE_BUF_LEN];
-static volatile gint trace_idx;
-static unsigned int writeout_idx;
-static volatile gint dropped_events;
+/*
+ * Every thread that emits trace events owns a ring buffer.  The owning thread
+ * is the only producer and the writeout thread the only consumer, so claiming
+ * space for a record needs no atomic read-modify-write and threads never
+ * contend with each other on the hot path.
+ */
+typedef struct TraceThreadBuffer {
+    uint8_t buf[TRACE_BUF_LEN];
+    unsigned int head;      /* published by the owner after each record */
+    unsigned int tail;      /* advanced by the writeout thread */
+    unsigned int limit;     /* writeout thread's snapshot of head */
+    unsigned int dropped;   /* records dropped since the last writeout */
+    bool in_record;         /* owner is between start and finish */
+    bool retired;           /* owner thread has exited */
+    struct TraceThreadBuffer *next;
+} TraceThreadBuffer;
+
+static GMutex trace_buffers_lock;
+static TraceThreadBuffer *trace_buffers;
+static __thread TraceThreadBuffer *trace_thread_buf;
+static uint64_t dropped_events_total; /* protected by trace_buffers_lock */
 static uint32_t trace_pid;
 static FILE *trace_fp;
 static char *trace_file_name;
@@ -64,7 +85,7 @@ static char *trace_file_name;
 typedef struct {
     uint64_t event; /* event ID value */
     uint64_t timestamp_ns;
-    uint32_t length;   /*    in bytes */
+    uint32_t length;   /*    in bytes, including alignment padding */
     uint32_t pid;
     uint64_t arguments[];
 } TraceRecord;
@@ -76,53 +97,64 @@ typedef struct {
 } TraceLogHeader;
 
 
-static void read_from_buffer(unsigned int idx, void *dataptr, size_t size);
-static unsigned int write_to_buffer(unsigned int idx, void *dataptr, size_t size);
-
-static void clear_buffer_range(unsigned int idx, size_t len)
+static void trace_thread_buffer_retire(gpointer opaque)
 {
-    uint32_t num = 0;
-    while (num < len) {
-        if (idx >= TRACE_BUF_LEN) {
-            idx = idx % TRACE_BUF_LEN;
-        }
-        trace_buf[idx++] = 0;
-        num++;
-    }
+    TraceThreadBuffer *tb = opaque;
+
+    /* The writeout thread frees the buffer once it has been drained */
+    atomic_store_release(&tb->retired, true);
+    trace_thread_buf = NULL;
 }
+
+static GPrivate trace_thread_key = G_PRIVATE_INIT(trace_thread_buffer_retire);
+
 /**
- * Read a trace record from the trace buffer
- *
- * @idx         Trace buffer index
- * @record      Trace record to fill
+ * Get the calling thread's trace buffer, creating it on first use
  *
- * Returns false if the record is not valid.
+ * Returns NULL if the buffer could not be allocated.
  */
-static bool get_trace_record(unsigned int idx, TraceRecord **recordptr)
+static TraceThreadBuffer *trace_thread_buffer_get(void)
 {
-    uint64_t event_flag = 0;
-    TraceRecord record;
-    /* read the event flag to see if its a valid record */
-    read_from_buffer(idx, &record, sizeof(event_flag));
+    TraceThreadBuffer *tb = trace_thread_buf;
 
-    if (!(record.event & TRACE_RECORD_VALID)) {
-        return false;
+    if (likely(tb)) {
+        return tb;
     }
 
-    smp_rmb(); /* read memory barrier before accessing record */
-    /* read the record header to know record length */
-    read_from_buffer(idx, &record, sizeof(TraceRecord));
-    *recordptr = malloc(record.length); /* don't use g_malloc, can deadlock when traced */
-    /* make a copy of record to avoid being overwritten */
-    read_from_buffer(idx, *recordptr, record.length);
-    smp_rmb(); /* memory barrier before clearing valid flag */
-    (*recordptr)->event &= ~TRACE_RECORD_VALID;
-    /* clear the trace buffer range for consumed record otherwise any byte
-     * with its MSB set may be considered as a valid event id when the writer
-     * thread crosses this range of buffer again.
-     */
-    clear_buffer_range(idx, record.length);
-    return true;
+    tb = calloc(1, sizeof(*tb)); /* don't use g_malloc, can deadlock when traced */
+    if (!tb) {
+        return NULL;
+    }
+
+    g_mutex_lock(&trace_buffers_lock);
+    tb->next = trace_buffers;
+    trace_buffers = tb;
+    g_mutex_unlock(&trace_buffers_lock);
+
+    g_private_set(&trace_thread_key, tb);
+    trace_thread_buf = tb;
+    return tb;
+}
+
+static void read_from_buffer(TraceThreadBuffer *tb, unsigned int idx,
+                             void *dataptr, size_t size)
+{
+    uint8_t *data_ptr = dataptr;
+    uint32_t x = 0;
+    while (x < size) {
+        data_ptr[x++] = tb->buf[idx++ % TRACE_BUF_LEN];
+    }
+}
+
+static unsigned int write_to_buffer(TraceThreadBuffer *tb, unsigned int idx,
+                                    const void *dataptr, size_t size)
+{
+    const uint8_t *data_ptr = dataptr;
+    uint32_t x = 0;
+    while (x < size) {
+        tb->buf[idx++ % TRACE_BUF_LEN] = data_ptr[x++];
+    }
+    return idx; /* most callers wants to know where to write next */
 }
 
 /**
@@ -154,43 +186,112 @@ static void wait_for_trace_records_available(void)
     g_mutex_unlock(&trace_lock);
 }
 
-static gpointer writeout_thread(gpointer opaque)
+static void write_dropped_record(unsigned int dropped_count)
 {
-    TraceRecord *recordptr;
     union {
         TraceRecord rec;
         uint8_t bytes[sizeof(TraceRecord) + sizeof(uint64_t)];
     } dropped;
-    unsigned int idx = 0;
-    int dropped_count;
+    uint64_t type = TRACE_RECORD_TYPE_EVENT;
     size_t unused __attribute__ ((unused));
+
+    dropped.rec.event = DROPPED_EVENT_ID;
+    dropped.rec.timestamp_ns = get_clock();
+    dropped.rec.length = sizeof(dropped);
+    dropped.rec.pid = trace_pid;
+    dropped.rec.arguments[0] = dropped_count;
+    unused = fwrite(&type, sizeof(type), 1, trace_fp);
+    unused = fwrite(&dropped, sizeof(dropped), 1, trace_fp);
+}
+
+/**
+ * Write out one record straight from a thread buffer and release its space
+ */
+static void write_thread_record(TraceThreadBuffer *tb, uint32_t length)
+{
     uint64_t type = TRACE_RECORD_TYPE_EVENT;
+    unsigned int idx = tb->tail % TRACE_BUF_LEN;
+    size_t first = MIN(length, TRACE_BUF_LEN - idx);
+    size_t unused __attribute__ ((unused));
 
-    for (;;) {
-        wait_for_trace_records_available();
+    unused = fwrite(&type, sizeof(type), 1, trace_fp);
+    unused = fwrite(&tb->buf[idx], first, 1, trace_fp);
+    if (first < length) {
+        unused = fwrite(&tb->buf[0], length - first, 1, trace_fp);
+    }
 
-        if (g_atomic_int_get(&dropped_events)) {
-            dropped.rec.event = DROPPED_EVENT_ID;
-            dropped.rec.timestamp_ns = get_clock();
-            dropped.rec.length = sizeof(TraceRecord) + sizeof(uint64_t);
-            dropped.rec.pid = trace_pid;
-            do {
-                dropped_count = g_atomic_int_get(&dropped_events);
-            } while (!g_atomic_int_compare_and_exchange(&dropped_events,
-                                                        dropped_count, 0));
-            dropped.rec.arguments[0] = dropped_count;
-            unused = fwrite(&type, sizeof(type), 1, trace_fp);
-            unused = fwrite(&dropped.rec, dropped.rec.length, 1, trace_fp);
+    /* finish reading the record before the owner may overwrite it */
+    atomic_store_release(&tb->tail, tb->tail + length);
+}
+
+/**
+ * Drain all thread buffers, merging their records in timestamp order
+ *
+ * Each buffer is already sorted since its owner takes timestamps in
+ * order, so picking the oldest head record among buffers on every step
+ * yields a globally ordered stream for the records published so far.
+ */
+static void writeout_thread_buffers(void)
+{
+    TraceThreadBuffer *tb, **prev;
+
+    g_mutex_lock(&trace_buffers_lock);
+
+    for (tb = trace_buffers; tb; tb = tb->next) {
+        unsigned int dropped_count;
+
+        tb->limit = atomic_load_acquire(&tb->head);
+        dropped_count = atomic_xchg(&tb->dropped, 0);
+        if (dropped_count) {
+            dropped_events_total += dropped_count;
+            write_dropped_record(dropped_count);
+        }
+    }
+
+    for (;;) {
+        TraceThreadBuffer *oldest = NULL;
+        uint64_t oldest_timestamp_ns = 0;
+        uint32_t oldest_length = 0;
+
+        for (tb = trace_buffers; tb; tb = tb->next) {
+            TraceRecord rec;
+
+            if (tb->tail == tb->limit) {
+                continue;
+            }
+            read_from_buffer(tb, tb->tail, &rec, sizeof(rec));
+            if (!oldest || rec.timestamp_ns < oldest_timestamp_ns) {
+                oldest = tb;
+                oldest_timestamp_ns = rec.timestamp_ns;
+                oldest_length = rec.length;
+            }
+        }
+        if (!oldest) {
+            break;
         }
+        write_thread_record(oldest, oldest_length);
+    }
 
-        while (get_trace_record(idx, &recordptr)) {
-            unused = fwrite(&type, sizeof(type), 1, trace_fp);
-            unused = fwrite(recordptr, recordptr->length, 1, trace_fp);
-            writeout_idx += recordptr->length;
-            free(recordptr); /* don't use g_free, can deadlock when traced */
-            idx = writeout_idx % TRACE_BUF_LEN;
+    /* Free buffers whose owner exited once everything has been written */
+    prev = &trace_buffers;
+    while ((tb = *prev) != NULL) {
+        if (atomic_load_acquire(&tb->retired) &&
+            tb->tail == atomic_load_acquire(&tb->head)) {
+            *prev = tb->next;
+            free(tb); /* don't use g_free, can deadlock when traced */
+        } else {
+            prev = &tb->next;
         }
+    }
+
+    g_mutex_unlock(&trace_buffers_lock);
+}
 
+static gpointer writeout_thread(gpointer opaque)
+{
+    for (;;) {
+        wait_for_trace_records_available();
+        writeout_thread_buffers();
         fflush(trace_fp);
     }
     return NULL;
@@ -198,84 +299,71 @@ static gpointer writeout_thread(gpointer opaque)
 
 void trace_record_write_u64(TraceBufferRecord *rec, uint64_t val)
 {
-    rec->rec_off = write_to_buffer(rec->rec_off, &val, sizeof(uint64_t));
+    rec->rec_off = write_to_buffer(rec->tbuf, rec->rec_off,
+                                   &val, sizeof(uint64_t));
 }
 
 void trace_record_write_str(TraceBufferRecord *rec, const char *s, uint32_t slen)
 {
     /* Write string length first */
-    rec->rec_off = write_to_buffer(rec->rec_off, &slen, sizeof(slen));
+    rec->rec_off = write_to_buffer(rec->tbuf, rec->rec_off,
+                                   &slen, sizeof(slen));
     /* Write actual string now */
-    rec->rec_off = write_to_buffer(rec->rec_off, (void*)s, slen);
+    rec->rec_off = write_to_buffer(rec->tbuf, rec->rec_off, s, slen);
 }
 
 int trace_record_start(TraceBufferRecord *rec, uint32_t event, size_t datasize)
 {
-    unsigned int idx, rec_off, old_idx, new_idx;
-    uint32_t rec_len = sizeof(TraceRecord) + datasize;
+    TraceThreadBuffer *tb = trace_thread_buffer_get();
+    uint32_t rec_len = QEMU_ALIGN_UP(sizeof(TraceRecord) + datasize,
+                                     TRACE_RECORD_ALIGN);
     uint64_t event_u64 = event;
     uint64_t timestamp_ns = get_clock();
+    unsigned int head, rec_off;
 
-    do {
-        old_idx = g_atomic_int_get(&trace_idx);
-        smp_rmb();
-        new_idx = old_idx + rec_len;
-
-        if (new_idx - writeout_idx > TRACE_BUF_LEN) {
-            /* Trace Buffer Full, Event dropped ! */
-            g_atomic_int_inc(&dropped_events);
-            return -ENOSPC;
-        }
-    } while (!g_atomic_int_compare_and_exchange(&trace_idx, old_idx, new_idx));
-
-    idx = old_idx % TRACE_BUF_LEN;
-
-    rec_off = idx;
-    rec_off = write_to_buffer(rec_off, &event_u64, sizeof(event_u64));
-    rec_off = write_to_buffer(rec_off, &timestamp_ns, sizeof(timestamp_ns));
-    rec_off = write_to_buffer(rec_off, &rec_len, sizeof(rec_len));
-    rec_off = write_to_buffer(rec_off, &trace_pid, sizeof(trace_pid));
-
-    rec->tbuf_idx = idx;
-    rec->rec_off  = (idx + sizeof(TraceRecord)) % TRACE_BUF_LEN;
-    return 0;
-}
+    if (unlikely(!tb)) {
+        return -ENOMEM;
+    }
 
-static void read_from_buffer(unsigned int idx, void *dataptr, size_t size)
-{
-    uint8_t *data_ptr = dataptr;
-    uint32_t x = 0;
-    while (x < size) {
-        if (idx >= TRACE_BUF_LEN) {
-            idx = idx % TRACE_BUF_LEN;
-        }
-        data_ptr[x++] = trace_buf[idx++];
+    /* A signal handler may trace while this thread is mid-record */
+    if (unlikely(tb->in_record)) {
+        atomic_inc(&tb->dropped);
+        return -EBUSY;
     }
-}
 
-static unsigned int write_to_buffer(unsigned int idx, void *dataptr, size_t size)
-{
-    uint8_t *data_ptr = dataptr;
-    uint32_t x = 0;
-    while (x < size) {
-        if (idx >= TRACE_BUF_LEN) {
-            idx = idx % TRACE_BUF_LEN;
-        }
-        trace_buf[idx++] = data_ptr[x++];
+    head = tb->head;
+    if (head + rec_len - atomic_load_acquire(&tb->tail) > TRACE_BUF_LEN) {
+        /* Trace Buffer Full, Event dropped ! */
+        atomic_inc(&tb->dropped);
+        return -ENOSPC;
     }
-    return idx; /* most callers wants to know where to write next */
+    tb->in_record = true;
+
+    rec_off = head;
+    rec_off = write_to_buffer(tb, rec_off, &event_u64, sizeof(event_u64));
+    rec_off = write_to_buffer(tb, rec_off, &timestamp_ns, sizeof(timestamp_ns));
+    rec_off = write_to_buffer(tb, rec_off, &rec_len, sizeof(rec_len));
+    rec_off = write_to_buffer(tb, rec_off, &trace_pid, sizeof(trace_pid));
+
+    rec->tbuf = tb;
+    rec->tbuf_idx = head;
+    rec->rec_off = rec_off;
+    rec->rec_end = head + rec_len;
+    return 0;
 }
 
 void trace_record_finish(TraceBufferRecord *rec)
 {
-    TraceRecord record;
-    read_from_buffer(rec->tbuf_idx, &record, sizeof(TraceRecord));
-    smp_wmb(); /* write barrier before marking as valid */
-    record.event |= TRACE_RECORD_VALID;
-    write_to_buffer(rec->tbuf_idx, &record, sizeof(TraceRecord));
-
-    if (((unsigned int)g_atomic_int_get(&trace_idx) - writeout_idx)
-        > TRACE_BUF_FLUSH_THRESHOLD) {
+    TraceThreadBuffer *tb = rec->tbuf;
+    static const uint8_t padding[TRACE_RECORD_ALIGN];
+
+    write_to_buffer(tb, rec->rec_off, padding, rec->rec_end - rec->rec_off);
+
+    /* publish the record contents before the new head */
+    atomic_store_release(&tb->head, rec->rec_end);
+    tb->in_record = false;
+
+    if (rec->rec_end - atomic_read(&tb->tail) > TRACE_BUF_FLUSH_THRESHOLD) {
         flush_trace_file(false);
     }
 }
@@ -291,10 +379,16 @@ static int st_write_event_mapping(void)
         uint64_t id = trace_event_get_id(ev);
         const char *name = trace_event_get_name(ev);
         uint32_t len = strlen(name);
+        size_t pad = QEMU_ALIGN_UP(sizeof(type) + sizeof(id) + sizeof(len) +
+                                   len, TRACE_RECORD_ALIGN) -
+                     (sizeof(type) + sizeof(id) + sizeof(len) + len);
+        static const uint8_t padding[TRACE_RECORD_ALIGN];
+
         if (fwrite(&type, sizeof(type), 1, trace_fp) != 1 ||
             fwrite(&id, sizeof(id), 1, trace_fp) != 1 ||
             fwrite(&len, sizeof(len), 1, trace_fp) != 1 ||
-            fwrite(name, len, 1, trace_fp) != 1) {
+            fwrite(name, len, 1, trace_fp) != 1 ||
+            (pad && fwrite(padding, pad, 1, trace_fp) != 1)) {
             return -1;
         }
     }
@@ -368,6 +462,9 @@ void st_print_trace_file_status(void)
 {
     qemu_printf("Trace file \"%s\" %s.\n",
                 trace_file_name, trace_fp ? "on" : "off");
+    g_mutex_lock(&trace_buffers_lock);
+    qemu_printf("Trace records dropped: %" PRIu64 "\n", dropped_events_total);
+    g_mutex_unlock(&trace_buffers_lock);
 }
 
 void st_flush_trace_buffer(void)
@@ -18,8 +18,10 @@ bool st_init(void);
 void st_flush_trace_buffer(void);
 
 typedef struct {
-    unsigned int tbuf_idx;
-    unsigned int rec_off;
+    void *tbuf;             /* calling thread's buffer */
+    unsigned int tbuf_idx;  /* start of the record */
+    unsigned int rec_off;   /* next argument offset */
+    unsigned int rec_end;   /* end of the aligned record */
 } TraceBufferRecord;
 
 /* Note for hackers: Make sure MAX_TRACE_LEN < sizeof(uint32_t) */
@@ -191,6 +191,32 @@ void hbitmap_iter_init(HBitmapIter *hbi, const HBitmap *hb, uint64_t first)
     }
 }
 
+/*
+ * Return the index of the first word in [@pos, @end) of @words that is not
+ * all ones, or @end.  Dense areas are checked eight words at a time; the
+ * reduction has no data dependent branches and is vectorized by compilers.
+ */
+static size_t hb_find_not_full_word(const unsigned long *words,
+                                    size_t pos, size_t end)
+{
+    while (end - pos >= 8) {
+        unsigned long acc = words[pos] & words[pos + 1] &
+                            words[pos + 2] & words[pos + 3] &
+                            words[pos + 4] & words[pos + 5] &
+                            words[pos + 6] & words[pos + 7];
+        if (acc != (unsigned long)-1) {
+            break;
+        }
+        pos += 8;
+    }
+
+    while (pos < end && words[pos] == (unsigned long)-1) {
+        pos++;
+    }
+
+    return pos;
+}
+
 int64_t hbitmap_next_zero(const HBitmap *hb, uint64_t start, uint64_t count)
 {
     size_t pos = (start >> hb->granularity) >> BITS_PER_LEVEL;
@@ -217,10 +243,7 @@ int64_t hbitmap_next_zero(const HBitmap *hb, uint64_t start, uint64_t count)
     assert((start >> hb->granularity) < hb->size);
 
     if (cur == (unsigned long)-1) {
-        do {
-            pos++;
-        } while (pos < sz && last_lev[pos] == (unsigned long)-1);
-
+        pos = hb_find_not_full_word(last_lev, pos + 1, sz);
         if (pos >= sz) {
             return -1;
         }
@@ -242,41 +265,49 @@ int64_t hbitmap_next_zero(const HBitmap *hb, uint64_t start, uint64_t count)
     return res;
 }
 
-bool hbitmap_next_dirty_area(const HBitmap *hb, uint64_t *start,
-                             uint64_t *count)
+int64_t hbitmap_next_dirty(const HBitmap *hb, uint64_t start, uint64_t count)
 {
     HBitmapIter hbi;
-    int64_t firt_dirty_off, area_end;
-    uint32_t granularity = 1UL << hb->granularity;
+    int64_t first_dirty_off;
     uint64_t end;
 
-    if (*start >= hb->orig_size || *count == 0) {
-        return false;
+    if (start >= hb->orig_size || count == 0) {
+        return -1;
     }
 
-    end = *count > hb->orig_size - *start ? hb->orig_size : *start + *count;
+    end = count > hb->orig_size - start ? hb->orig_size : start + count;
+
+    /* The iterator skips clean areas using the upper levels */
+    hbitmap_iter_init(&hbi, hb, start);
+    first_dirty_off = hbitmap_iter_next(&hbi);
+
+    if (first_dirty_off < 0 || first_dirty_off >= end) {
+        return -1;
+    }
+
+    return MAX(start, first_dirty_off);
+}
 
-    hbitmap_iter_init(&hbi, hb, *start);
-    firt_dirty_off = hbitmap_iter_next(&hbi);
+bool hbitmap_next_dirty_area(const HBitmap *hb, uint64_t *start,
+                             uint64_t *count)
+{
+    int64_t first_dirty_off, area_end;
+    uint64_t end;
 
-    if (firt_dirty_off < 0 || firt_dirty_off >= end) {
+    first_dirty_off = hbitmap_next_dirty(hb, *start, *count);
+    if (first_dirty_off < 0) {
         return false;
     }
 
-    if (firt_dirty_off + granularity >= end) {
+    end = *count > hb->orig_size - *start ? hb->orig_size : *start + *count;
+
+    area_end = hbitmap_next_zero(hb, first_dirty_off, end - first_dirty_off);
+    if (area_end < 0) {
         area_end = end;
-    } else {
-        area_end = hbitmap_next_zero(hb, firt_dirty_off + granularity,
-                                     end - firt_dirty_off - granularity);
-        if (area_end < 0) {
-            area_end = end;
-        }
     }
 
-    if (firt_dirty_off > *start) {
-        *start = firt_dirty_off;
-    }
-    *count = area_end - *start;
+    *start = first_dirty_off;
+    *count = area_end - first_dirty_off;
 
     return true;
 }
@@ -0,0 +1,224 @@
+/*
+ * Interval trees
+ *
+ * The tree is an AVL tree keyed on the start of each interval.  Every
+ * node also records the largest "last" in its subtree, which is what
+ * lets searches skip subtrees that end before the query range begins.
+ * Duplicate starts are ordered by node address so that removal can
+ * always find the exact node.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/interval-tree.h"
+
+static inline int node_height(IntervalTreeNode *n)
+{
+    return n ? n->height : 0;
+}
+
+static int node_cmp(const IntervalTreeNode *a, const IntervalTreeNode *b)
+{
+    if (a->start != b->start) {
+        return a->start < b->start ? -1 : 1;
+    }
+    if (a != b) {
+        return (uintptr_t)a < (uintptr_t)b ? -1 : 1;
+    }
+    return 0;
+}
+
+/* Recompute the augmented data of @n from its children */
+static void node_update(IntervalTreeNode *n)
+{
+    uint64_t last = n->last;
+
+    if (n->left) {
+        n->left->parent = n;
+        last = MAX(last, n->left->subtree_last);
+    }
+    if (n->right) {
+        n->right->parent = n;
+        last = MAX(last, n->right->subtree_last);
+    }
+    n->subtree_last = last;
+    n->height = MAX(node_height(n->left), node_height(n->right)) + 1;
+}
+
+static IntervalTreeNode *rotate_right(IntervalTreeNode *n)
+{
+    IntervalTreeNode *l = n->left;
+
+    n->left = l->right;
+    l->right = n;
+    node_update(n);
+    node_update(l);
+    return l;
+}
+
+static IntervalTreeNode *rotate_left(IntervalTreeNode *n)
+{
+    IntervalTreeNode *r = n->right;
+
+    n->right = r->left;
+    r->left = n;
+    node_update(n);
+    node_update(r);
+    return r;
+}
+
+/* Update @n after one of its subtrees changed height by at most one */
+static IntervalTreeNode *rebalance(IntervalTreeNode *n)
+{
+    int balance;
+
+    node_update(n);
+    balance = node_height(n->left) - node_height(n->right);
+    if (balance > 1) {
+        if (node_height(n->left->left) < node_height(n->left->right)) {
+            n->left = rotate_left(n->left);
+        }
+        return rotate_right(n);
+    }
+    if (balance < -1) {
+        if (node_height(n->right->right) < node_height(n->right->left)) {
+            n->right = rotate_right(n->right);
+        }
+        return rotate_left(n);
+    }
+    return n;
+}
+
+static IntervalTreeNode *insert_1(IntervalTreeNode *n, IntervalTreeNode *node)
+{
+    if (!n) {
+        node->left = node->right = NULL;
+        node_update(node);
+        return node;
+    }
+    if (node_cmp(node, n) < 0) {
+        n->left = insert_1(n->left, node);
+    } else {
+        n->right = insert_1(n->right, node);
+    }
+    return rebalance(n);
+}
+
+static IntervalTreeNode *remove_min(IntervalTreeNode *n, IntervalTreeNode **min)
+{
+    if (!n->left) {
+        *min = n;
+        return n->right;
+    }
+    n->left = remove_min(n->left, min);
+    return rebalance(n);
+}
+
+static IntervalTreeNode *remove_1(IntervalTreeNode *n, IntervalTreeNode *node)
+{
+    IntervalTreeNode *min, *right;
+    int c;
+
+    g_assert(n);
+    c = node_cmp(node, n);
+    if (c < 0) {
+        n->left = remove_1(n->left, node);
+    } else if (c > 0) {
+        n->right = remove_1(n->right, node);
+    } else {
+        if (!n->right) {
+            return n->left;
+        }
+        right = remove_min(n->right, &min);
+        min->left = n->left;
+        min->right = right;
+        n = min;
+    }
+    return rebalance(n);
+}
+
+void interval_tree_insert(IntervalTreeNode *node, IntervalTreeRoot *root)
+{
+    root->root = insert_1(root->root, node);
+    root->root->parent = NULL;
+}
+
+void interval_tree_remove(IntervalTreeNode *node, IntervalTreeRoot *root)
+{
+    root->root = remove_1(root->root, node);
+    if (root->root) {
+        root->root->parent = NULL;
+    }
+}
+
+/*
+ * Find the leftmost node in the subtree rooted at @n that overlaps
+ * [@start, @last].  The caller guarantees that n->subtree_last >= start.
+ */
+static IntervalTreeNode *subtree_search(IntervalTreeNode *n,
+                                        uint64_t start, uint64_t last)
+{
+    for (;;) {
+        /*
+         * If anything on the left ends at or after start, the leftmost
+         * overlapping node, if any, is there: everything further right
+         * starts no earlier than it does.
+         */
+        if (n->left && n->left->subtree_last >= start) {
+            n = n->left;
+            continue;
+        }
+        if (n->start > last) {
+            return NULL;
+        }
+        if (n->last >= start) {
+            return n;
+        }
+        n = n->right;
+        if (!n || n->subtree_last < start) {
+            return NULL;
+        }
+    }
+}
+
+IntervalTreeNode *interval_tree_iter_first(IntervalTreeRoot *root,
+                                           uint64_t start, uint64_t last)
+{
+    IntervalTreeNode *n = root->root;
+
+    if (!n || n->subtree_last < start) {
+        return NULL;
+    }
+    return subtree_search(n, start, last);
+}
+
+IntervalTreeNode *interval_tree_iter_next(IntervalTreeNode *node,
+                                          uint64_t start, uint64_t last)
+{
+    IntervalTreeNode *right = node->right, *prev;
+
+    for (;;) {
+        if (right && right->subtree_last >= start) {
+            return subtree_search(right, start, last);
+        }
+
+        /* Go up until we come back from a left child */
+        do {
+            prev = node;
+            node = node->parent;
+            if (!node) {
+                return NULL;
+            }
+            right = node->right;
+        } while (prev == right);
+
+        if (node->start > last) {
+            return NULL;
+        }
+        if (node->last >= start) {
+            return node;
+        }
+    }
+}
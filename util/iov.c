@@ -21,6 +21,7 @@
 #include "qemu/iov.h"
 #include "qemu/sockets.h"
 #include "qemu/cutils.h"
+#include "qemu/bswap.h"
 
 size_t iov_from_buf_full(const struct iovec *iov, unsigned int iov_cnt,
                          size_t offset, const void *buf, size_t bytes)
@@ -353,12 +354,32 @@ void qemu_iovec_concat(QEMUIOVector *dst,
     qemu_iovec_concat_iov(dst, src->iov, src->niov, soffset, sbytes);
 }
 
+/* Words looked at in each large element before it is scanned completely */
+#define IOV_ZERO_SAMPLES 8
+
 /*
- * Check if the contents of the iovecs are all zero
+ * Check if the contents of the iovecs are all zero.  The last word of each
+ * eighth of a large element is checked first, so that most buffers with
+ * data are rejected without reading all of them.
  */
 bool qemu_iovec_is_zero(QEMUIOVector *qiov)
 {
-    int i;
+    int i, j;
+
+    for (i = 0; i < qiov->niov; i++) {
+        const uint8_t *ptr = qiov->iov[i].iov_base;
+        size_t stripe = qiov->iov[i].iov_len / IOV_ZERO_SAMPLES;
+
+        if (stripe < 64) {
+            continue;
+        }
+        for (j = 1; j <= IOV_ZERO_SAMPLES; j++) {
+            if (ldq_he_p(ptr + j * stripe - sizeof(uint64_t))) {
+                return false;
+            }
+        }
+    }
+
     for (i = 0; i < qiov->niov; i++) {
         size_t offs = QEMU_ALIGN_DOWN(qiov->iov[i].iov_len, 4 * sizeof(long));
         uint8_t *ptr = qiov->iov[i].iov_base;
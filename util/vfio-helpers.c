@@ -172,28 +172,64 @@ void qemu_vfio_pci_unmap_bar(QEMUVFIOState *s, int index, void *bar,
     }
 }
 
+static int qemu_vfio_pci_get_irq_info(QEMUVFIOState *s, int irq_type,
+                                      struct vfio_irq_info *irq_info,
+                                      Error **errp)
+{
+    *irq_info = (struct vfio_irq_info) {
+        .argsz = sizeof(*irq_info),
+        .index = irq_type,
+    };
+    if (ioctl(s->device, VFIO_DEVICE_GET_IRQ_INFO, irq_info)) {
+        error_setg_errno(errp, errno, "Failed to get device interrupt info");
+        return -errno;
+    }
+    if (!(irq_info->flags & VFIO_IRQ_INFO_EVENTFD)) {
+        error_setg(errp, "Device interrupt doesn't support eventfd");
+        return -EINVAL;
+    }
+    return 0;
+}
+
 /**
- * Initialize device IRQ with @irq_type and and register an event notifier.
+ * Return the number of vectors the device has for @irq_type, or -errno.
  */
-int qemu_vfio_pci_init_irq(QEMUVFIOState *s, EventNotifier *e,
-                           int irq_type, Error **errp)
+int qemu_vfio_pci_get_irq_count(QEMUVFIOState *s, int irq_type, Error **errp)
 {
+    struct vfio_irq_info irq_info;
     int r;
+
+    r = qemu_vfio_pci_get_irq_info(s, irq_type, &irq_info, errp);
+    if (r) {
+        return r;
+    }
+    return irq_info.count;
+}
+
+/**
+ * Initialize device IRQ with @irq_type and register the @count event
+ * notifiers in @e for its first @count vectors.
+ */
+int qemu_vfio_pci_init_irq(QEMUVFIOState *s, EventNotifier **e, int count,
+                           int irq_type, Error **errp)
+{
+    int i, r;
     struct vfio_irq_set *irq_set;
     size_t irq_set_size;
-    struct vfio_irq_info irq_info = { .argsz = sizeof(irq_info) };
+    struct vfio_irq_info irq_info;
+    int *fds;
 
-    irq_info.index = irq_type;
-    if (ioctl(s->device, VFIO_DEVICE_GET_IRQ_INFO, &irq_info)) {
-        error_setg_errno(errp, errno, "Failed to get device interrupt info");
-        return -errno;
+    r = qemu_vfio_pci_get_irq_info(s, irq_type, &irq_info, errp);
+    if (r) {
+        return r;
     }
-    if (!(irq_info.flags & VFIO_IRQ_INFO_EVENTFD)) {
-        error_setg(errp, "Device interrupt doesn't support eventfd");
+    if (count < 1 || count > irq_info.count) {
+        error_setg(errp, "Device has %u interrupt vectors, %d requested",
+                   irq_info.count, count);
         return -EINVAL;
     }
 
-    irq_set_size = sizeof(*irq_set) + sizeof(int);
+    irq_set_size = sizeof(*irq_set) + count * sizeof(int);
     irq_set = g_malloc0(irq_set_size);
 
     /* Get to a known IRQ state */
@@ -202,10 +238,13 @@ int qemu_vfio_pci_init_irq(QEMUVFIOState *s, EventNotifier *e,
         .flags = VFIO_IRQ_SET_DATA_EVENTFD | VFIO_IRQ_SET_ACTION_TRIGGER,
         .index = irq_info.index,
         .start = 0,
-        .count = 1,
+        .count = count,
     };
 
-    *(int *)&irq_set->data = event_notifier_get_fd(e);
+    fds = (int *)&irq_set->data;
+    for (i = 0; i < count; i++) {
+        fds[i] = event_notifier_get_fd(e[i]);
+    }
     r = ioctl(s->device, VFIO_DEVICE_SET_IRQS, irq_set);
     g_free(irq_set);
     if (r) {